@@ -0,0 +1,251 @@
+#define _GNU_SOURCE
+#include "accessLog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#define ACCESS_LOG_WRITE_BUFFER (256 * 1024) // one write() per drain pass, or per this many bytes
+#define ACCESS_LOG_LINE_MAX ((ACCESS_LOG_PATH_MAX + ACCESS_LOG_METHOD_MAX) * 6 + 256) // every byte escaped as \u00XX
+#define ACCESS_LOG_TAIL_BATCH 64 // records formatted before the tail is handed back to the worker
+#define ACCESS_LOG_IDLE_MS 20    // sleep when every ring was empty, records wait at most this long
+
+_Static_assert((ACCESS_LOG_RING & (ACCESS_LOG_RING - 1)) == 0, "ACCESS_LOG_RING must be a power of two");
+_Static_assert(ACCESS_LOG_PATH_MAX < 256, "pathLen is 8 bits");
+
+static accessLogRing_t* rings;
+static int ringCount;
+static const char* logPath;
+static int logFd = -1;
+static pthread_t logThread;
+static atomic_int stopRequested;
+static atomic_int reopenRequested;
+
+// Second of the last formatted timestamp, gmtime_r() runs once per second
+typedef struct {
+    time_t second;
+    char text[24];
+}timeCache_t;
+
+static int openLog(const char* path) {
+    if (strcmp(path, "-") == 0) {
+        return STDOUT_FILENO;
+    }
+    return open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+}
+
+static int64_t realtimeUs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Quotes, backslashes, control and non-ASCII bytes are escaped, a decoded
+// path may hold any byte and the line has to stay valid JSON
+static size_t escapeJson(char* out, const char* data, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    size_t n = 0;
+    for (size_t i = 0;i < len;i++) {
+        unsigned char c = (unsigned char)data[i];
+        if (c == '"' || c == '\\') {
+            out[n++] = '\\';
+            out[n++] = (char)c;
+        }
+        else if (c < 0x20 || c >= 0x7f) {
+            memcpy(out + n, "\\u00", 4);
+            out[n + 4] = hex[c >> 4];
+            out[n + 5] = hex[c & 0xf];
+            n += 6;
+        }
+        else {
+            out[n++] = (char)c;
+        }
+    }
+    return n;
+}
+
+static size_t formatRecord(char* out, const accessRecord_t* record, int64_t wallOffsetUs, timeCache_t* cache) {
+    int64_t wallUs = record->endUs + wallOffsetUs;
+    time_t second = (time_t)(wallUs / 1000000);
+    if (second != cache->second) {
+        struct tm tm;
+        gmtime_r(&second, &tm);
+        strftime(cache->text, sizeof(cache->text), "%Y-%m-%dT%H:%M:%S", &tm);
+        cache->second = second;
+    }
+    char client[INET_ADDRSTRLEN];
+    if (!inet_ntop(AF_INET, &record->peer.sin_addr, client, sizeof(client))) {
+        strcpy(client, "-");
+    }
+    char method[ACCESS_LOG_METHOD_MAX * 6];
+    size_t methodLen = escapeJson(method, record->method, record->methodLen);
+    char path[ACCESS_LOG_PATH_MAX * 6];
+    size_t pathLen = escapeJson(path, record->path, record->pathLen);
+
+    int len = snprintf(out, ACCESS_LOG_LINE_MAX,
+        "{\"time\":\"%s.%03dZ\",\"client\":\"%s:%u\",\"method\":\"%.*s\",\"path\":\"%.*s\"%s,"
+        "\"status\":%u,\"bytes\":%llu,\"duration_us\":%llu}\n",
+        cache->text, (int)(wallUs / 1000 % 1000), client, ntohs(record->peer.sin_port),
+        (int)methodLen, method, (int)pathLen, path, record->pathCut ? ",\"path_truncated\":true" : "",
+        record->status, (unsigned long long)record->bytes, (unsigned long long)record->durationUs);
+    return len > 0 && len < ACCESS_LOG_LINE_MAX ? (size_t)len : 0;
+}
+
+static void writeAll(const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(logFd, data, len);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // The batch is lost, the next one tries again
+            perror("access log write");
+            return;
+        }
+        data += written;
+        len -= written;
+    }
+}
+
+static void reopenLog(void) {
+    int fd = openLog(logPath);
+    if (fd == -1) {
+        perror("access log reopen");
+        return;
+    }
+    if (fd != logFd) {
+        close(logFd);
+        logFd = fd;
+    }
+}
+
+// Drains the rings round robin, formats into one buffer and writes it once
+// per pass, so a busy server gets few large writes. Sleeps only when
+// every ring was empty.
+static void* accessLogRun(void* arg) {
+    (void)arg;
+    char* out = malloc(ACCESS_LOG_WRITE_BUFFER);
+    if (!out) {
+        perror("access log buffer");
+        return NULL;
+    }
+    timeCache_t cache = { .second = -1 };
+    while (1) {
+        int stopping = atomic_load(&stopRequested);
+        if (atomic_exchange(&reopenRequested, 0)) {
+            reopenLog();
+        }
+        // Records carry monotonic time, converted once per pass
+        int64_t wallOffsetUs = realtimeUs() - monotonicUs();
+        size_t len = 0;
+        uint64_t drained = 0;
+        for (int i = 0;i < ringCount;i++) {
+            accessLogRing_t* ring = &rings[i];
+            uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+            uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+            while (tail != head) {
+                if (ACCESS_LOG_WRITE_BUFFER - len < ACCESS_LOG_LINE_MAX) {
+                    writeAll(out, len);
+                    len = 0;
+                }
+                len += formatRecord(out + len, &ring->records[tail & (ACCESS_LOG_RING - 1)], wallOffsetUs, &cache);
+                tail++;
+                drained++;
+                // The slot is formatted, the worker may reuse it
+                if (tail == head || (tail & (ACCESS_LOG_TAIL_BATCH - 1)) == 0) {
+                    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+                }
+            }
+        }
+        if (len > 0) {
+            writeAll(out, len);
+        }
+        if (drained == 0) {
+            if (stopping) {
+                break;
+            }
+            struct timespec idle = { 0, ACCESS_LOG_IDLE_MS * 1000000L };
+            nanosleep(&idle, NULL);
+        }
+    }
+    free(out);
+    return NULL;
+}
+
+int startAccessLog(const char* path, int workers) {
+    logPath = path;
+    if ((logFd = openLog(path)) == -1) {
+        return -1;
+    }
+    size_t size = (size_t)workers * sizeof(accessLogRing_t);
+    rings = aligned_alloc(_Alignof(accessLogRing_t), size);
+    if (!rings) {
+        return -1;
+    }
+    memset(rings, 0, size);
+    for (int i = 0;i < workers;i++) {
+        if (!(rings[i].records = malloc(ACCESS_LOG_RING * sizeof(accessRecord_t)))) {
+            return -1;
+        }
+    }
+    ringCount = workers;
+
+    // Signals stay with the main thread's sigwait(), the log thread blocks them all
+    sigset_t all;
+    sigset_t previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &previous);
+    int err = pthread_create(&logThread, NULL, accessLogRun, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+accessLogRing_t* accessLogForWorker(int id) {
+    return rings ? &rings[id] : NULL;
+}
+
+accessRecord_t* accessLogReserve(accessLogRing_t* ring, int important, workerMetrics_t* metrics) {
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t used = head - ring->cachedTail;
+    // The tail is only loaded (a cache line owned by the log thread) when the ring looks busy
+    if (used >= ACCESS_LOG_SHED_MARK) {
+        ring->cachedTail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        used = head - ring->cachedTail;
+    }
+    if (used >= ACCESS_LOG_RING) {
+        metrics->accessLogDropped++;
+        return NULL;
+    }
+    if (used >= ACCESS_LOG_SHED_MARK && !important && ring->sampleCount++ % ACCESS_LOG_SAMPLE != 0) {
+        metrics->accessLogSampled++;
+        return NULL;
+    }
+    return &ring->records[head & (ACCESS_LOG_RING - 1)];
+}
+
+void accessLogCommit(accessLogRing_t* ring) {
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+void reopenAccessLog(void) {
+    atomic_store(&reopenRequested, 1);
+}
+
+void stopAccessLog(void) {
+    if (!rings) {
+        return;
+    }
+    atomic_store(&stopRequested, 1);
+    pthread_join(logThread, NULL);
+}
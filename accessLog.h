@@ -0,0 +1,102 @@
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <netinet/in.h>
+#include "metrics.h"
+
+/**
+ * Asynchronous access log. Every worker owns a single producer, single
+ * consumer ring of fixed size records; filling one is a copy and a release
+ * store, the event loop never formats, locks or writes. One background
+ * thread drains all rings, formats JSON lines and writes them in large
+ * batches. A ring that fills up sheds records instead of blocking its worker.
+ */
+
+#define ACCESS_LOG_RING 8192       // records per worker, power of two
+#define ACCESS_LOG_SHED_MARK (ACCESS_LOG_RING * 3 / 4) // above it only 1 in ACCESS_LOG_SAMPLE records is kept
+#define ACCESS_LOG_SAMPLE 16
+#define ACCESS_LOG_METHOD_MAX 8
+#define ACCESS_LOG_PATH_MAX 192    // longer paths are cut, the record says so
+
+/**
+ * Structure holding one access log record
+ * endUs: monotonicUs() once the last response byte was handed to the kernel
+ * durationUs: Request start to endUs
+ * bytes: Response bytes, head and body (file bytes included)
+ * peer: Client address
+ * status: Response status code
+ * methodLen/method: Request method, "-" when the request line was never parsed
+ * pathLen/path: Normalized path, cut to ACCESS_LOG_PATH_MAX
+ * pathCut: path holds only the first ACCESS_LOG_PATH_MAX bytes
+ */
+typedef struct {
+    int64_t endUs;
+    uint64_t durationUs;
+    uint64_t bytes;
+    struct sockaddr_in peer;
+    uint16_t status;
+    uint8_t methodLen;
+    uint8_t pathLen;
+    uint8_t pathCut;
+    char method[ACCESS_LOG_METHOD_MAX];
+    char path[ACCESS_LOG_PATH_MAX];
+}accessRecord_t;
+
+/**
+ * Structure representing the ring of one worker. head is only written by
+ * the worker, tail only by the log thread, each on its own cache line.
+ * head: Records published, the worker stores it with release ordering
+ * cachedTail: Last tail the worker loaded, reloaded only when the ring looks full
+ * sampleCount: Records seen above the shed mark, drives the 1 in ACCESS_LOG_SAMPLE choice
+ * tail: Records consumed, the log thread stores it once a record is formatted
+ * records: ACCESS_LOG_RING slots
+ */
+typedef struct {
+    _Atomic uint64_t head __attribute__((aligned(64)));
+    uint64_t cachedTail;
+    uint64_t sampleCount;
+    _Atomic uint64_t tail __attribute__((aligned(64)));
+    accessRecord_t* records __attribute__((aligned(64)));
+}accessLogRing_t;
+
+/**
+ * Opens the log, allocates one ring per worker and starts the log thread.
+ * Call once before the workers are initialized.
+ * @param path File to append to, "-" writes to stdout
+ * @return 0 on success, -1 on failure (errno set)
+ */
+int startAccessLog(const char* path, int workers);
+
+/**
+ * @return Ring of worker id, NULL when the access log is off
+ */
+accessLogRing_t* accessLogForWorker(int id);
+
+/**
+ * Reserves the next slot of the worker ring. Above ACCESS_LOG_SHED_MARK only
+ * every ACCESS_LOG_SAMPLE-th record and server errors are kept, a full ring
+ * drops the record. Both are counted in metrics.
+ * @param important Record is kept above the shed mark (5xx responses)
+ * @return Slot to fill, publish it with accessLogCommit(), NULL when shed
+ */
+accessRecord_t* accessLogReserve(accessLogRing_t* ring, int important, workerMetrics_t* metrics);
+
+/**
+ * Publishes the slot returned by the last accessLogReserve()
+ */
+void accessLogCommit(accessLogRing_t* ring);
+
+/**
+ * Asks the log thread to reopen the file (log rotation), returns at once
+ */
+void reopenAccessLog(void);
+
+/**
+ * Drains every ring, writes what is left and stops the log thread.
+ * Records published after it returns are never written.
+ */
+void stopAccessLog(void);
+
+#endif
@@ -0,0 +1,755 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include "metrics.h"
+
+// Closed loop load generator: every connection keeps --pipeline requests in
+// flight and sends the next one as soon as a response completes. One epoll
+// loop per thread, latencies go into the server's own log-linear histogram.
+
+#define LOADGEN_EVENTS 256
+#define PIPELINE_MAX 64
+#define RESPONSE_HEAD_MAX 16384 // response header block, also the read buffer size
+
+typedef enum {
+    KIND_SMALL,
+    KIND_LARGE,
+    KIND_API,
+    KIND_ECHO,
+    KIND_COUNT
+}requestKindId_t;
+
+/**
+ * Prebuilt request of one kind in the mix
+ * bytes/len: Whole request, written as is
+ * weight: Share in the mix, 0 when the kind is not used
+ */
+typedef struct {
+    const char* name;
+    char* bytes;
+    size_t len;
+    int weight;
+}requestKind_t;
+
+typedef struct {
+    const char* host;
+    int port;
+    int connections;
+    int pipeline;
+    int keepAlive;
+    int thinkMs;
+    int maxFailedPct;
+    int duration;
+    int threads;
+    const char* mix;
+    size_t echoBytes;
+    const char* smallPath;
+    const char* largePath;
+    const char* out;
+    const char* scenario;
+    const char* label;
+    int serverPid;
+}loadConfig_t;
+
+/**
+ * Structure representing one client connection
+ * sentAt: Send time of the requests in flight, oldest at head
+ * out/outLen/outSent: Request bytes queued but not written yet
+ * in/inLen: Unparsed response bytes
+ * bodyLeft: Body bytes of the current response still to skip, inBody while skipping
+ * wakeAt: With --think, when the next requests go out (0 while requests are in flight)
+ */
+typedef struct {
+    int fd;
+    int connecting;
+    int64_t wakeAt;
+    int64_t sentAt[PIPELINE_MAX];
+    int head;
+    int inflight;
+    char* out;
+    size_t outLen;
+    size_t outSent;
+    size_t outCap;
+    char in[RESPONSE_HEAD_MAX];
+    size_t inLen;
+    size_t bodyLeft;
+    int inBody;
+    int status;
+}loadConnection_t;
+
+/**
+ * Structure holding one loader thread and its results
+ */
+typedef struct {
+    const loadConfig_t* config;
+    const requestKind_t* kinds;
+    int totalWeight;
+    struct sockaddr_in address;
+    int connectionCount;
+    loadConnection_t* connections;
+    int epollFd;
+    uint64_t random;
+    int64_t deadline;
+    pthread_t thread;
+
+    latencyHistogram_t latency;
+    uint64_t maxUs;
+    uint64_t requests;
+    uint64_t errors;  // non 2xx responses
+    uint64_t failed;  // requests lost to a reset connection or a malformed response
+    uint64_t connects;
+    uint64_t bytesIn;
+}loadThread_t;
+
+static void printUsage(const char* program) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  --host A          Server IPv4 address (default 127.0.0.1)\n"
+        "  --port N          Server port (default 8080)\n"
+        "  --connections N   Concurrent connections (default 64)\n"
+        "  --pipeline N      Requests in flight per connection, 1..%d (default 1)\n"
+        "  --no-keepalive    Connection: close, one request per connection\n"
+        "  --think MS        Keep-alive connections stay idle MS between answers and the next requests\n"
+        "  --max-failed PCT  Exit status 1 when more than PCT%% of the requests failed (default 1)\n"
+        "  --duration S      Seconds to run (default 10)\n"
+        "  --threads N       Loader threads (default 2)\n"
+        "  --mix M           Weighted kinds, e.g. small=50,large=10,api=20,echo=20 (default api=1)\n"
+        "  --echo-bytes N    Body size of echo requests (default 1024)\n"
+        "  --small-path P    Path of the small static file (default /index.html)\n"
+        "  --large-path P    Path of the large static file (default /bench-large.bin)\n"
+        "  --server-pid PID  Also report server CPU per request from /proc/PID/stat\n"
+        "  --scenario NAME   Name of the result line (default: the mix)\n"
+        "  --label L         Build or revision the result belongs to (default: none)\n"
+        "  --out FILE        Append the result as one JSON line to FILE\n",
+        program, PIPELINE_MAX);
+}
+
+static int64_t nowUs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static uint64_t nextRandom(loadThread_t* thread) {
+    // xorshift64, plenty for picking request kinds
+    thread->random ^= thread->random << 13;
+    thread->random ^= thread->random >> 7;
+    thread->random ^= thread->random << 17;
+    return thread->random;
+}
+
+static int parseMix(const char* mix, requestKind_t* kinds) {
+    char* copy = strdup(mix);
+    if (!copy) {
+        return -1;
+    }
+    int total = 0;
+    char* save = NULL;
+    for (char* token = strtok_r(copy, ",", &save);token;token = strtok_r(NULL, ",", &save)) {
+        char* equals = strchr(token, '=');
+        int weight = equals ? atoi(equals + 1) : 1;
+        if (equals) {
+            *equals = '\0';
+        }
+        int found = 0;
+        for (int i = 0;i < KIND_COUNT;i++) {
+            if (strcmp(token, kinds[i].name) == 0 && weight > 0) {
+                kinds[i].weight = weight;
+                total += weight;
+                found = 1;
+            }
+        }
+        if (!found) {
+            fprintf(stderr, "Invalid mix entry: %s\n", token);
+            free(copy);
+            return -1;
+        }
+    }
+    free(copy);
+    return total > 0 ? total : -1;
+}
+
+static char* buildRequest(const loadConfig_t* config, const char* method, const char* path, size_t bodyLen, size_t* len) {
+    char head[1024];
+    int headLen = snprintf(head, sizeof(head), "%s %s HTTP/1.1\r\nHost: %s\r\n%s", method, path, config->host,
+        config->keepAlive ? "" : "Connection: close\r\n");
+    if (bodyLen > 0 || strcmp(method, "POST") == 0) {
+        headLen += snprintf(head + headLen, sizeof(head) - headLen, "Content-Length: %zu\r\n", bodyLen);
+    }
+    headLen += snprintf(head + headLen, sizeof(head) - headLen, "\r\n");
+    char* request = malloc(headLen + bodyLen);
+    if (!request) {
+        return NULL;
+    }
+    memcpy(request, head, headLen);
+    memset(request + headLen, 'x', bodyLen);
+    *len = headLen + bodyLen;
+    return request;
+}
+
+static void queueRequest(loadThread_t* thread, loadConnection_t* conn) {
+    uint64_t pick = nextRandom(thread) % (uint64_t)thread->totalWeight;
+    const requestKind_t* kind = thread->kinds;
+    for (int i = 0;i < KIND_COUNT;i++) {
+        if (pick < (uint64_t)thread->kinds[i].weight) {
+            kind = &thread->kinds[i];
+            break;
+        }
+        pick -= thread->kinds[i].weight;
+    }
+    if (conn->outLen + kind->len > conn->outCap) {
+        // Unsent bytes belong to fewer than --pipeline requests, they fit at the front
+        memmove(conn->out, conn->out + conn->outSent, conn->outLen - conn->outSent);
+        conn->outLen -= conn->outSent;
+        conn->outSent = 0;
+    }
+    memcpy(conn->out + conn->outLen, kind->bytes, kind->len);
+    conn->outLen += kind->len;
+    conn->sentAt[(conn->head + conn->inflight) % PIPELINE_MAX] = nowUs();
+    conn->inflight++;
+}
+
+static void openConnection(loadThread_t* thread, loadConnection_t* conn) {
+    conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (conn->fd == -1) {
+        perror("socket");
+        return;
+    }
+    int one = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(conn->fd, (struct sockaddr*)&thread->address, sizeof(thread->address)) == -1 && errno != EINPROGRESS) {
+        perror("connect");
+        close(conn->fd);
+        conn->fd = -1;
+        return;
+    }
+    conn->connecting = 1;
+    conn->wakeAt = 0;
+    conn->head = 0;
+    conn->inflight = 0;
+    conn->outLen = 0;
+    conn->outSent = 0;
+    conn->inLen = 0;
+    conn->inBody = 0;
+    thread->connects++;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = conn;
+    if (epoll_ctl(thread->epollFd, EPOLL_CTL_ADD, conn->fd, &ev) == -1) {
+        perror("epoll_ctl");
+        close(conn->fd);
+        conn->fd = -1;
+        return;
+    }
+    // Requests go out as soon as the connect completes
+    for (int i = 0;i < thread->config->pipeline;i++) {
+        queueRequest(thread, conn);
+    }
+}
+
+// Requests in flight on a broken connection are counted as failed
+static void closeConnection(loadThread_t* thread, loadConnection_t* conn, int reopen) {
+    thread->failed += conn->inflight;
+    close(conn->fd);
+    conn->fd = -1;
+    if (reopen && nowUs() < thread->deadline) {
+        openConnection(thread, conn);
+    }
+}
+
+static int flushRequests(loadConnection_t* conn) {
+    while (conn->outSent < conn->outLen) {
+        ssize_t sent = send(conn->fd, conn->out + conn->outSent, conn->outLen - conn->outSent, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        conn->outSent += sent;
+    }
+    return 0;
+}
+
+static void completeResponse(loadThread_t* thread, loadConnection_t* conn) {
+    int64_t now = nowUs();
+    uint64_t us = (uint64_t)(now - conn->sentAt[conn->head]);
+    histogramRecord(&thread->latency, us);
+    if (us > thread->maxUs) {
+        thread->maxUs = us;
+    }
+    thread->requests++;
+    if (conn->status < 200 || conn->status > 299) {
+        thread->errors++;
+    }
+    conn->head = (conn->head + 1) % PIPELINE_MAX;
+    conn->inflight--;
+    conn->inBody = 0;
+}
+
+// Finds the body length of a response head, -1 when it has none we can skip
+static long parseResponseHead(const char* head, size_t len, int* status) {
+    if (len < 12 || strncmp(head, "HTTP/1.", 7) != 0) {
+        return -1;
+    }
+    *status = atoi(head + 9);
+    const char* end = head + len;
+    for (const char* line = memchr(head, '\n', len);line && line + 1 < end;line = memchr(line + 1, '\n', end - line - 1)) {
+        const char* field = line + 1;
+        if (end - field > 15 && strncasecmp(field, "Content-Length:", 15) == 0) {
+            return strtol(field + 15, NULL, 10);
+        }
+    }
+    // Only chunked /api/stream style responses come without one, not part of any mix
+    return -1;
+}
+
+// Consumes whole responses from conn->in, returns -1 on a malformed one
+static int parseResponses(loadThread_t* thread, loadConnection_t* conn) {
+    size_t offset = 0;
+    while (offset < conn->inLen) {
+        if (conn->inBody) {
+            size_t take = conn->inLen - offset < conn->bodyLeft ? conn->inLen - offset : conn->bodyLeft;
+            conn->bodyLeft -= take;
+            offset += take;
+            if (conn->bodyLeft == 0) {
+                completeResponse(thread, conn);
+            }
+            continue;
+        }
+        char* headEnd = memmem(conn->in + offset, conn->inLen - offset, "\r\n\r\n", 4);
+        if (!headEnd) {
+            break;
+        }
+        size_t headLen = headEnd + 4 - (conn->in + offset);
+        long bodyLen = parseResponseHead(conn->in + offset, headLen, &conn->status);
+        if (bodyLen < 0 || conn->inflight == 0) {
+            return -1;
+        }
+        offset += headLen;
+        conn->bodyLeft = bodyLen;
+        conn->inBody = 1;
+        if (bodyLen == 0) {
+            completeResponse(thread, conn);
+        }
+    }
+    memmove(conn->in, conn->in + offset, conn->inLen - offset);
+    conn->inLen -= offset;
+    return conn->inLen == sizeof(conn->in) ? -1 : 0;
+}
+
+static void handleConnection(loadThread_t* thread, loadConnection_t* conn, uint32_t events) {
+    if (conn->connecting) {
+        int error = 0;
+        socklen_t errorLen = sizeof(error);
+        getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &errorLen);
+        if (error != 0 || (events & (EPOLLERR | EPOLLHUP))) {
+            closeConnection(thread, conn, 1);
+            return;
+        }
+        conn->connecting = 0;
+    }
+    while (1) {
+        ssize_t got = recv(conn->fd, conn->in + conn->inLen, sizeof(conn->in) - conn->inLen, 0);
+        if (got > 0) {
+            thread->bytesIn += got;
+            conn->inLen += got;
+            int answered = conn->inflight;
+            if (parseResponses(thread, conn) == -1) {
+                closeConnection(thread, conn, 1);
+                return;
+            }
+            answered -= conn->inflight;
+            if (!thread->config->keepAlive && conn->inflight == 0) {
+                closeConnection(thread, conn, 1);
+                return;
+            }
+            if (thread->config->thinkMs > 0) {
+                // Idle on the server until wakeThinking() sends the next batch
+                if (conn->inflight == 0) {
+                    conn->wakeAt = nowUs() + (int64_t)thread->config->thinkMs * 1000;
+                }
+                continue;
+            }
+            // Closed loop: every answered request is replaced right away
+            for (int i = 0;i < answered && nowUs() < thread->deadline;i++) {
+                queueRequest(thread, conn);
+            }
+            continue;
+        }
+        if (got == 0) {
+            closeConnection(thread, conn, 1);
+            return;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            closeConnection(thread, conn, 1);
+            return;
+        }
+        break;
+    }
+    if (flushRequests(conn) == -1) {
+        closeConnection(thread, conn, 1);
+    }
+}
+
+// Connections whose --think pause is over send their next --pipeline requests
+static void wakeThinking(loadThread_t* thread) {
+    int64_t now = nowUs();
+    for (int i = 0;i < thread->connectionCount;i++) {
+        loadConnection_t* conn = &thread->connections[i];
+        if (conn->fd == -1 || conn->wakeAt == 0 || conn->wakeAt > now || now >= thread->deadline) {
+            continue;
+        }
+        conn->wakeAt = 0;
+        for (int r = 0;r < thread->config->pipeline;r++) {
+            queueRequest(thread, conn);
+        }
+        if (flushRequests(conn) == -1) {
+            closeConnection(thread, conn, 1);
+        }
+    }
+}
+
+static void* runThread(void* arg) {
+    loadThread_t* thread = arg;
+    for (int i = 0;i < thread->connectionCount;i++) {
+        openConnection(thread, &thread->connections[i]);
+    }
+    struct epoll_event events[LOADGEN_EVENTS];
+    while (1) {
+        int64_t left = (thread->deadline - nowUs()) / 1000;
+        if (left <= 0) {
+            break;
+        }
+        int timeout = thread->config->thinkMs > 0 && thread->config->thinkMs < left ? thread->config->thinkMs : (int)left;
+        int count = epoll_wait(thread->epollFd, events, LOADGEN_EVENTS, timeout);
+        if (count == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0;i < count;i++) {
+            loadConnection_t* conn = events[i].data.ptr;
+            if (conn->fd != -1) {
+                handleConnection(thread, conn, events[i].events);
+            }
+        }
+        if (thread->config->thinkMs > 0) {
+            wakeThinking(thread);
+        }
+    }
+    // Whatever is still in flight at the deadline is neither counted nor failed
+    for (int i = 0;i < thread->connectionCount;i++) {
+        if (thread->connections[i].fd != -1) {
+            close(thread->connections[i].fd);
+        }
+    }
+    return NULL;
+}
+
+// utime + stime of a process in microseconds, -1 when it cannot be read
+static int64_t processCpuUs(int pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+    char line[1024];
+    int64_t result = -1;
+    if (fgets(line, sizeof(line), file)) {
+        // Fields after the command name, which may contain spaces
+        char* rest = strrchr(line, ')');
+        unsigned long long utime, stime;
+        if (rest && sscanf(rest + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) == 2) {
+            result = (int64_t)(utime + stime) * 1000000 / sysconf(_SC_CLK_TCK);
+        }
+    }
+    fclose(file);
+    return result;
+}
+
+static int64_t selfCpuUs(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (int64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 +
+        usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+static long parsePositive(const char* value) {
+    char* end = NULL;
+    long parsed = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || parsed <= 0) {
+        return -1;
+    }
+    return parsed;
+}
+
+static int parseArgs(int argc, char** argv, loadConfig_t* config) {
+    config->host = "127.0.0.1";
+    config->port = 8080;
+    config->connections = 64;
+    config->pipeline = 1;
+    config->keepAlive = 1;
+    config->thinkMs = 0;
+    config->maxFailedPct = 1;
+    config->duration = 10;
+    config->threads = 2;
+    config->mix = "api=1";
+    config->echoBytes = 1024;
+    config->smallPath = "/index.html";
+    config->largePath = "/bench-large.bin";
+    config->out = NULL;
+    config->scenario = NULL;
+    config->label = "";
+    config->serverPid = 0;
+
+    static const struct option longOptions[] = {
+        {"host", required_argument, NULL, 'a'},
+        {"port", required_argument, NULL, 'p'},
+        {"connections", required_argument, NULL, 'c'},
+        {"pipeline", required_argument, NULL, 'd'},
+        {"no-keepalive", no_argument, NULL, 'k'},
+        {"think", required_argument, NULL, 'w'},
+        {"max-failed", required_argument, NULL, 'f'},
+        {"duration", required_argument, NULL, 't'},
+        {"threads", required_argument, NULL, 'T'},
+        {"mix", required_argument, NULL, 'm'},
+        {"echo-bytes", required_argument, NULL, 'e'},
+        {"small-path", required_argument, NULL, 's'},
+        {"large-path", required_argument, NULL, 'l'},
+        {"server-pid", required_argument, NULL, 'P'},
+        {"scenario", required_argument, NULL, 'n'},
+        {"label", required_argument, NULL, 'L'},
+        {"out", required_argument, NULL, 'o'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "c:d:t:h", longOptions, NULL)) != -1) {
+        long value = 0;
+        if (opt == 'p' || opt == 'c' || opt == 'd' || opt == 't' || opt == 'T' || opt == 'P' || opt == 'w' || opt == 'f') {
+            value = parsePositive(optarg);
+            if (value == -1) {
+                fprintf(stderr, "Invalid value: %s\n", optarg);
+                return -1;
+            }
+        }
+        switch (opt) {
+        case 'a': config->host = optarg; break;
+        case 'p': config->port = (int)value; break;
+        case 'c': config->connections = (int)value; break;
+        case 'd': config->pipeline = (int)value; break;
+        case 'k': config->keepAlive = 0; break;
+        case 'w': config->thinkMs = (int)value; break;
+        case 'f': config->maxFailedPct = (int)value; break;
+        case 't': config->duration = (int)value; break;
+        case 'T': config->threads = (int)value; break;
+        case 'm': config->mix = optarg; break;
+        case 'e': config->echoBytes = strtoul(optarg, NULL, 10); break;
+        case 's': config->smallPath = optarg; break;
+        case 'l': config->largePath = optarg; break;
+        case 'P': config->serverPid = (int)value; break;
+        case 'n': config->scenario = optarg; break;
+        case 'L': config->label = optarg; break;
+        case 'o': config->out = optarg; break;
+        default:
+            printUsage(argv[0]);
+            return -1;
+        }
+    }
+    if (config->pipeline > PIPELINE_MAX) {
+        fprintf(stderr, "Pipeline depth is at most %d\n", PIPELINE_MAX);
+        return -1;
+    }
+    if (!config->keepAlive) {
+        // The server closes after each response, nothing can queue behind it
+        config->pipeline = 1;
+    }
+    if (config->threads > config->connections) {
+        config->threads = config->connections;
+    }
+    if (!config->scenario) {
+        config->scenario = config->mix;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    loadConfig_t config;
+    if (parseArgs(argc, argv, &config) == -1) {
+        return EXIT_FAILURE;
+    }
+
+    requestKind_t kinds[KIND_COUNT] = {
+        [KIND_SMALL] = { .name = "small" },
+        [KIND_LARGE] = { .name = "large" },
+        [KIND_API] = { .name = "api" },
+        [KIND_ECHO] = { .name = "echo" }
+    };
+    int totalWeight = parseMix(config.mix, kinds);
+    if (totalWeight == -1) {
+        return EXIT_FAILURE;
+    }
+    kinds[KIND_SMALL].bytes = buildRequest(&config, "GET", config.smallPath, 0, &kinds[KIND_SMALL].len);
+    kinds[KIND_LARGE].bytes = buildRequest(&config, "GET", config.largePath, 0, &kinds[KIND_LARGE].len);
+    kinds[KIND_API].bytes = buildRequest(&config, "GET", "/api/", 0, &kinds[KIND_API].len);
+    kinds[KIND_ECHO].bytes = buildRequest(&config, "POST", "/api/echo", config.echoBytes, &kinds[KIND_ECHO].len);
+    size_t longest = 0;
+    for (int i = 0;i < KIND_COUNT;i++) {
+        if (!kinds[i].bytes) {
+            perror("Malloc failed");
+            return EXIT_FAILURE;
+        }
+        if (kinds[i].len > longest) {
+            longest = kinds[i].len;
+        }
+    }
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(config.port);
+    if (inet_pton(AF_INET, config.host, &address.sin_addr) != 1) {
+        fprintf(stderr, "Invalid IPv4 address: %s\n", config.host);
+        return EXIT_FAILURE;
+    }
+
+    loadThread_t* threads = calloc(config.threads, sizeof(loadThread_t));
+    loadConnection_t* connections = calloc(config.connections, sizeof(loadConnection_t));
+    if (!threads || !connections) {
+        perror("Calloc failed");
+        return EXIT_FAILURE;
+    }
+    int64_t serverCpuStart = config.serverPid ? processCpuUs(config.serverPid) : -1;
+    int64_t selfCpuStart = selfCpuUs();
+    int64_t start = nowUs();
+
+    int assigned = 0;
+    for (int i = 0;i < config.threads;i++) {
+        loadThread_t* thread = &threads[i];
+        thread->config = &config;
+        thread->kinds = kinds;
+        thread->totalWeight = totalWeight;
+        thread->address = address;
+        thread->connectionCount = config.connections / config.threads + (i < config.connections % config.threads);
+        thread->connections = connections + assigned;
+        assigned += thread->connectionCount;
+        thread->random = 0x9e3779b97f4a7c15ULL * (uint64_t)(i + 1);
+        thread->deadline = start + (int64_t)config.duration * 1000000;
+        for (int c = 0;c < thread->connectionCount;c++) {
+            thread->connections[c].fd = -1;
+            thread->connections[c].outCap = longest * config.pipeline;
+            thread->connections[c].out = malloc(thread->connections[c].outCap);
+            if (!thread->connections[c].out) {
+                perror("Malloc failed");
+                return EXIT_FAILURE;
+            }
+        }
+        if ((thread->epollFd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+            perror("epoll_create1");
+            return EXIT_FAILURE;
+        }
+        int err = pthread_create(&thread->thread, NULL, runThread, thread);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            return EXIT_FAILURE;
+        }
+    }
+
+    latencyHistogram_t latency;
+    memset(&latency, 0, sizeof(latency));
+    uint64_t requests = 0, errors = 0, failed = 0, connects = 0, bytesIn = 0, maxUs = 0;
+    for (int i = 0;i < config.threads;i++) {
+        pthread_join(threads[i].thread, NULL);
+        for (int b = 0;b < LATENCY_BUCKETS;b++) {
+            latency.counts[b] += threads[i].latency.counts[b];
+        }
+        latency.count += threads[i].latency.count;
+        latency.sumUs += threads[i].latency.sumUs;
+        requests += threads[i].requests;
+        errors += threads[i].errors;
+        failed += threads[i].failed;
+        connects += threads[i].connects;
+        bytesIn += threads[i].bytesIn;
+        if (threads[i].maxUs > maxUs) {
+            maxUs = threads[i].maxUs;
+        }
+    }
+    double elapsed = (double)(nowUs() - start) / 1e6;
+    double clientCpu = requests ? (double)(selfCpuUs() - selfCpuStart) / requests : 0;
+    double serverCpu = -1;
+    if (serverCpuStart >= 0 && requests) {
+        int64_t serverCpuEnd = processCpuUs(config.serverPid);
+        if (serverCpuEnd >= 0) {
+            serverCpu = (double)(serverCpuEnd - serverCpuStart) / requests;
+        }
+    }
+    double rps = requests / elapsed;
+    double mean = latency.count ? (double)latency.sumUs / latency.count : 0;
+    uint64_t p50 = histogramQuantile(&latency, 0.5);
+    uint64_t p99 = histogramQuantile(&latency, 0.99);
+    uint64_t p999 = histogramQuantile(&latency, 0.999);
+
+    printf("%-24s %10.0f req/s %8.1f MB/s  p50 %6lluus  p99 %6lluus  p999 %6lluus  errors %llu failed %llu",
+        config.scenario, rps, bytesIn / elapsed / 1e6, (unsigned long long)p50, (unsigned long long)p99,
+        (unsigned long long)p999, (unsigned long long)errors, (unsigned long long)failed);
+    if (serverCpu >= 0) {
+        printf("  server cpu %.2fus/req", serverCpu);
+    }
+    printf("\n");
+
+    if (config.out) {
+        FILE* out = fopen(config.out, "a");
+        if (!out) {
+            perror("fopen");
+            return EXIT_FAILURE;
+        }
+        fprintf(out, "{\"label\":\"%s\",\"scenario\":\"%s\",\"mix\":\"%s\",\"connections\":%d,\"pipeline\":%d,\"keepalive\":%s,"
+            "\"think_ms\":%d,\"threads\":%d,\"echo_bytes\":%zu,\"duration_s\":%.3f,\"requests\":%llu,\"errors\":%llu,"
+            "\"failed\":%llu,\"connects\":%llu,\"rps\":%.1f,\"rx_bytes_per_s\":%.0f,"
+            "\"latency_us\":{\"mean\":%.1f,\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu},"
+            "\"client_cpu_us_per_req\":%.3f,\"server_cpu_us_per_req\":",
+            config.label, config.scenario, config.mix, config.connections, config.pipeline, config.keepAlive ? "true" : "false",
+            config.thinkMs, config.threads, config.echoBytes, elapsed, (unsigned long long)requests, (unsigned long long)errors,
+            (unsigned long long)failed, (unsigned long long)connects, rps, bytesIn / elapsed,
+            mean, (unsigned long long)p50, (unsigned long long)p99, (unsigned long long)p999, (unsigned long long)maxUs,
+            clientCpu);
+        if (serverCpu >= 0) {
+            fprintf(out, "%.3f}\n", serverCpu);
+        }
+        else {
+            fprintf(out, "null}\n");
+        }
+        fclose(out);
+    }
+    if (failed * 100 > requests * (uint64_t)config.maxFailedPct) {
+        fprintf(stderr, "%s: %llu failed requests, more than %d%% of %llu\n", config.scenario,
+            (unsigned long long)failed, config.maxFailedPct, (unsigned long long)requests);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
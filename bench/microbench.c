@@ -0,0 +1,496 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "httpParser.h"
+
+// Runs requestAndHeaderParser(), decodeUrl() and normalizePath() in tight
+// loops over a corpus: the requests described by request.txt, raw request
+// files given on the command line and generated worst cases. Linked with
+// -Wl,--wrap=malloc,... so allocations made by the server code are counted.
+
+#define CORPUS_MAX 64
+#define DEFAULT_TARGET_MS 200
+
+/**
+ * One request of the corpus
+ * bytes/len: Raw request, header block terminated by "\r\n\r\n"
+ * headerEnd: Offset handed to the parser, just past the first CRLF of the terminator
+ */
+typedef struct {
+    char name[48];
+    char* bytes;
+    size_t len;
+    size_t headerEnd;
+}corpusEntry_t;
+
+typedef enum {
+    BENCH_PARSE,
+    BENCH_DECODE,
+    BENCH_NORMALIZE
+}benchFunction_t;
+
+static const char* functionNames[] = { "parse", "decodeUrl", "normalizePath" };
+
+// Allocation counters, fed by the --wrap'ed allocator entry points
+static size_t allocations;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* pointer, size_t size);
+
+void* __wrap_malloc(size_t size) {
+    allocations++;
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+    allocations++;
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* pointer, size_t size) {
+    allocations++;
+    return __real_realloc(pointer, size);
+}
+
+static corpusEntry_t corpus[CORPUS_MAX];
+static int corpusCount;
+static volatile size_t sink; // keeps results observable
+
+static int64_t nowNs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Core cycles from perf when the kernel allows it, TSC reference cycles otherwise
+static int cycleFd = -1;
+static const char* cycleSource = "none";
+
+static void openCycleCounter(void) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    cycleFd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (cycleFd != -1) {
+        cycleSource = "perf cpu-cycles";
+        return;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    cycleSource = "tsc";
+#endif
+}
+
+static uint64_t readCycles(void) {
+    if (cycleFd != -1) {
+        uint64_t value = 0;
+        if (read(cycleFd, &value, sizeof(value)) == sizeof(value)) {
+            return value;
+        }
+        return 0;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static corpusEntry_t* addEntry(const char* name, char* bytes, size_t len) {
+    char* terminator = memmem(bytes, len, "\r\n\r\n", 4);
+    if (!terminator || corpusCount == CORPUS_MAX) {
+        fprintf(stderr, "Skipping %s: no header terminator or corpus full\n", name);
+        free(bytes);
+        return NULL;
+    }
+    corpusEntry_t* entry = &corpus[corpusCount++];
+    snprintf(entry->name, sizeof(entry->name), "%s", name);
+    entry->bytes = bytes;
+    entry->len = len;
+    entry->headerEnd = terminator - bytes + 2;
+    return entry;
+}
+
+// Text buffer the generators append to
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+}textBuffer_t;
+
+static void appendText(textBuffer_t* text, const char* data, size_t len) {
+    if (text->len + len > text->cap) {
+        size_t cap = text->cap ? text->cap : 1024;
+        while (cap < text->len + len) {
+            cap *= 2;
+        }
+        char* grown = realloc(text->data, cap);
+        if (!grown) {
+            perror("Realloc failed");
+            exit(EXIT_FAILURE);
+        }
+        text->data = grown;
+        text->cap = cap;
+    }
+    memcpy(text->data + text->len, data, len);
+    text->len += len;
+}
+
+static void appendString(textBuffer_t* text, const char* string) {
+    appendText(text, string, strlen(string));
+}
+
+// request.txt is a curl config: url/request/header/data lines, "next" starts the following request
+static void loadCurlConfig(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        return;
+    }
+    char line[4096];
+    char method[16] = "GET";
+    char target[2048] = "";
+    char data[2048] = "";
+    textBuffer_t headers = { 0 };
+    int index = 0;
+    int done = 0;
+    while (!done) {
+        int more = fgets(line, sizeof(line), file) != NULL;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (!more || strcmp(line, "next") == 0) {
+            if (target[0]) {
+                textBuffer_t request = { 0 };
+                char head[4096];
+                snprintf(head, sizeof(head), "%s %s HTTP/1.1\r\nHost: localhost:8080\r\nUser-Agent: curl/8.9.1\r\nAccept: */*\r\n",
+                    method, target);
+                appendString(&request, head);
+                if (headers.len) {
+                    appendText(&request, headers.data, headers.len);
+                }
+                if (data[0]) {
+                    snprintf(head, sizeof(head), "Content-Length: %zu\r\n", strlen(data));
+                    appendString(&request, head);
+                }
+                appendString(&request, "\r\n");
+                appendString(&request, data);
+                char name[48];
+                snprintf(name, sizeof(name), "request.txt#%d %s", ++index, method);
+                addEntry(name, request.data, request.len);
+            }
+            strcpy(method, "GET");
+            target[0] = '\0';
+            data[0] = '\0';
+            headers.len = 0;
+            done = !more;
+            continue;
+        }
+        // key = "value", a quoted value may hold escaped quotes
+        char* equals = strchr(line, '=');
+        if (line[0] == '#' || !equals) {
+            continue;
+        }
+        char* key = line;
+        char* keyEnd = equals;
+        while (keyEnd > key && keyEnd[-1] == ' ') {
+            keyEnd--;
+        }
+        *keyEnd = '\0';
+        char* value = equals + 1;
+        while (*value == ' ') {
+            value++;
+        }
+        char unquoted[2048];
+        size_t len = 0;
+        int quoted = *value == '"';
+        for (char* c = value + quoted;*c && len + 1 < sizeof(unquoted);c++) {
+            if (quoted && *c == '\\' && c[1]) {
+                c++;
+            }
+            else if (quoted && *c == '"') {
+                break;
+            }
+            unquoted[len++] = *c;
+        }
+        unquoted[len] = '\0';
+        if (strcmp(key, "url") == 0) {
+            // Origin-form target: strip scheme and authority
+            char* slash = strstr(unquoted, "://");
+            slash = slash ? strchr(slash + 3, '/') : strchr(unquoted, '/');
+            snprintf(target, sizeof(target), "%s", slash ? slash : "/");
+        }
+        else if (strcmp(key, "request") == 0) {
+            snprintf(method, sizeof(method), "%.15s", unquoted);
+        }
+        else if (strcmp(key, "header") == 0) {
+            appendString(&headers, unquoted);
+            appendString(&headers, "\r\n");
+        }
+        else if (strcmp(key, "data") == 0) {
+            snprintf(data, sizeof(data), "%s", unquoted);
+            if (strcmp(method, "GET") == 0) {
+                strcpy(method, "POST");
+            }
+        }
+    }
+    free(headers.data);
+    fclose(file);
+}
+
+// A raw request file, bare LF line endings in the header block become CRLF
+static void loadRawRequest(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        perror(path);
+        return;
+    }
+    textBuffer_t request = { 0 };
+    char chunk[4096];
+    size_t got;
+    int previous = 0;
+    int inHeaders = 1;
+    while ((got = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        for (size_t i = 0;i < got;i++) {
+            if (inHeaders && chunk[i] == '\n' && previous != '\r') {
+                appendText(&request, "\r", 1);
+            }
+            appendText(&request, &chunk[i], 1);
+            if (request.len >= 4 && memcmp(request.data + request.len - 4, "\r\n\r\n", 4) == 0) {
+                inHeaders = 0;
+            }
+            previous = chunk[i];
+        }
+    }
+    fclose(file);
+    const char* name = strrchr(path, '/');
+    addEntry(name ? name + 1 : path, request.data, request.len);
+}
+
+static void generateCorpus(void) {
+    textBuffer_t text = { 0 };
+    appendString(&text,
+        "GET /assets/app.js?v=3 HTTP/1.1\r\nHost: example.com\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/126.0 Safari/537.36\r\n"
+        "Accept: */*\r\nAccept-Encoding: gzip, deflate, br, zstd\r\nAccept-Language: en-US,en;q=0.9\r\n"
+        "Cache-Control: no-cache\r\nConnection: keep-alive\r\nReferer: https://example.com/\r\n"
+        "Sec-Fetch-Dest: script\r\nSec-Fetch-Mode: no-cors\r\nSec-Fetch-Site: same-origin\r\n"
+        "Cookie: session=4f1c2a9d8b7e6f5a4c3b2a190817263544536271; theme=dark\r\n"
+        "If-None-Match: \"5f3e-1a2b3c\"\r\n\r\n");
+    addEntry("browser-get", text.data, text.len);
+
+    // Every header slot of httpInfo_t used
+    text = (textBuffer_t){ 0 };
+    appendString(&text, "GET /index.html HTTP/1.1\r\nHost: localhost\r\n");
+    for (int i = 1;i < MAX_HEADERS;i++) {
+        char header[64];
+        snprintf(header, sizeof(header), "X-Custom-Header-%03d: value-%d-abcdefghij\r\n", i, i);
+        appendString(&text, header);
+    }
+    appendString(&text, "\r\n");
+    addEntry("100-headers", text.data, text.len);
+
+    // 6000 byte target, every byte percent-encoded
+    text = (textBuffer_t){ 0 };
+    appendString(&text, "GET /");
+    for (int i = 0;i < 2000;i++) {
+        appendString(&text, i % 16 == 15 ? "%2F" : "%61");
+    }
+    appendString(&text, " HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    addEntry("percent-path", text.data, text.len);
+
+    // 500 segments pushed, 499 popped again
+    text = (textBuffer_t){ 0 };
+    appendString(&text, "GET /");
+    for (int i = 0;i < 500;i++) {
+        appendString(&text, i % 3 == 0 ? "./seg/" : "seg/");
+    }
+    for (int i = 0;i < 499;i++) {
+        appendString(&text, "../");
+    }
+    appendString(&text, "index.html HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    addEntry("dotdot-chain", text.data, text.len);
+}
+
+/**
+ * Result of one benchmark
+ */
+typedef struct {
+    double nsPerOp;
+    double bytesPerCycle;
+    double allocationsPerOp;
+    parserResult_t result;
+}benchResult_t;
+
+// Scratch state of one run, the path views are filled by a parse outside the timed loop
+typedef struct {
+    const corpusEntry_t* entry;
+    httpInfo_t info;
+    char decoded[PATH_BUFFER_CAP * 2];
+    char normalized[PATH_BUFFER_CAP];
+    bufferView_t path;
+    bufferView_t decodedPath;
+}benchState_t;
+
+static parserResult_t runOnce(benchState_t* state, benchFunction_t function) {
+    const corpusEntry_t* entry = state->entry;
+    switch (function) {
+    case BENCH_PARSE:
+        return requestAndHeaderParser(entry->bytes, entry->bytes + entry->headerEnd, &state->info);
+    case BENCH_DECODE: {
+        bufferView_t decoded = { .data = state->decoded, .len = 0 };
+        parserResult_t result = decodeUrl(&state->path, &decoded);
+        sink += decoded.len;
+        return result;
+    }
+    case BENCH_NORMALIZE: {
+        bufferView_t normalized = { .data = state->normalized, .len = PATH_BUFFER_CAP };
+        parserResult_t result = normalizePath(&state->decodedPath, &normalized);
+        sink += normalized.len;
+        return result;
+    }
+    }
+    return OK;
+}
+
+static size_t inputBytes(const benchState_t* state, benchFunction_t function) {
+    switch (function) {
+    case BENCH_PARSE:
+        return state->entry->headerEnd + 2;
+    case BENCH_DECODE:
+        return state->path.len;
+    case BENCH_NORMALIZE:
+        return state->decodedPath.len;
+    }
+    return 0;
+}
+
+static benchResult_t runBench(benchState_t* state, benchFunction_t function, int targetMs) {
+    benchResult_t result;
+    result.result = runOnce(state, function);
+
+    // Double the iterations until one batch takes long enough to time
+    uint64_t iterations = 64;
+    int64_t elapsed;
+    uint64_t cycles;
+    size_t allocationsBefore;
+    while (1) {
+        allocationsBefore = allocations;
+        uint64_t cyclesStart = readCycles();
+        int64_t start = nowNs();
+        for (uint64_t i = 0;i < iterations;i++) {
+            runOnce(state, function);
+        }
+        elapsed = nowNs() - start;
+        cycles = readCycles() - cyclesStart;
+        if (elapsed >= (int64_t)targetMs * 1000000 || iterations >= (1ULL << 40)) {
+            break;
+        }
+        iterations *= 2;
+    }
+    result.nsPerOp = (double)elapsed / iterations;
+    result.bytesPerCycle = cycles ? (double)inputBytes(state, function) * iterations / cycles : 0;
+    result.allocationsPerOp = (double)(allocations - allocationsBefore) / iterations;
+    sink += state->info.headerCnt;
+    return result;
+}
+
+static void printUsage(const char* program) {
+    fprintf(stderr,
+        "Usage: %s [options] [raw-request-file...]\n"
+        "  --curl-config F  curl config describing requests (default request.txt)\n"
+        "  --time MS        Minimum duration of each measurement (default %d)\n"
+        "  --no-generated   Leave out the generated worst cases\n",
+        program, DEFAULT_TARGET_MS);
+}
+
+int main(int argc, char** argv) {
+    const char* curlConfig = "request.txt";
+    int targetMs = DEFAULT_TARGET_MS;
+    int generated = 1;
+    static const struct option longOptions[] = {
+        {"curl-config", required_argument, NULL, 'c'},
+        {"time", required_argument, NULL, 't'},
+        {"no-generated", no_argument, NULL, 'g'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "c:t:h", longOptions, NULL)) != -1) {
+        switch (opt) {
+        case 'c':
+            curlConfig = optarg;
+            break;
+        case 't':
+            targetMs = atoi(optarg);
+            if (targetMs <= 0) {
+                fprintf(stderr, "Invalid time: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'g':
+            generated = 0;
+            break;
+        default:
+            printUsage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (access(curlConfig, R_OK) == 0) {
+        loadCurlConfig(curlConfig);
+    }
+    for (int i = optind;i < argc;i++) {
+        loadRawRequest(argv[i]);
+    }
+    if (generated) {
+        generateCorpus();
+    }
+    if (corpusCount == 0) {
+        fprintf(stderr, "Empty corpus\n");
+        return EXIT_FAILURE;
+    }
+
+    openCycleCounter();
+    printf("cycles: %s\n", cycleSource);
+    printf("%-24s %-14s %8s %10s %12s %10s  %s\n", "case", "function", "bytes", "ns/op", "bytes/cycle", "allocs/op", "result");
+
+    benchState_t* state = malloc(sizeof(benchState_t));
+    if (!state) {
+        perror("Malloc failed");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0;i < corpusCount;i++) {
+        state->entry = &corpus[i];
+        // Path views for the decode and normalize runs, decoded once outside the loop
+        parserResult_t parsed = requestAndHeaderParser(corpus[i].bytes, corpus[i].bytes + corpus[i].headerEnd, &state->info);
+        state->path = state->info.path;
+        state->decodedPath.data = state->decoded;
+        state->decodedPath.len = 0;
+        int pathOk = parsed == OK && decodeUrl(&state->path, &state->decodedPath) == OK;
+
+        for (benchFunction_t function = BENCH_PARSE;function <= BENCH_NORMALIZE;function++) {
+            if (function != BENCH_PARSE && !pathOk) {
+                continue;
+            }
+            benchResult_t result = runBench(state, function, targetMs);
+            printf("%-24s %-14s %8zu %10.1f %12.2f %10.2f  %s\n", corpus[i].name, functionNames[function],
+                inputBytes(state, function), result.nsPerOp, result.bytesPerCycle, result.allocationsPerOp,
+                result.result == OK ? "ok" : "error");
+        }
+    }
+    free(state);
+    return EXIT_SUCCESS;
+}
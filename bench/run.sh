@@ -0,0 +1,54 @@
+#!/bin/sh
+# End-to-end benchmark suite behind "make bench": starts the server, runs each
+# scenario through bench/loadgen and appends one JSON line per scenario to
+# $BENCH_OUT, labelled with the git revision so releases can be compared.
+#   BENCH_DURATION  seconds per scenario (default 10)
+#   BENCH_OUT       result file (default bench/results.jsonl)
+#   BENCH_PORT      port the server listens on (default 8080)
+#   BENCH_SERVER    extra server flags, e.g. "--backend uring --workers 4"
+#   BENCH_THREADS   loadgen threads (default 2)
+set -e
+cd "$(dirname "$0")/.."
+
+DURATION=${BENCH_DURATION:-10}
+OUT=${BENCH_OUT:-bench/results.jsonl}
+PORT=${BENCH_PORT:-8080}
+CAPPED_PORT=$((PORT + 1))
+THREADS=${BENCH_THREADS:-2}
+LABEL=${BENCH_LABEL:-$(git describe --always --dirty 2>/dev/null || echo unknown)}
+LARGE=public/bench-large.bin
+
+# 1mb, well above --small-file-max so it goes out through sendfile()
+head -c 1048576 /dev/zero > "$LARGE"
+./server --port "$PORT" $BENCH_SERVER > /dev/null &
+PID=$!
+# Second server for the admission scenario, far more clients than its cap
+./server --port "$CAPPED_PORT" --max-connections 64 $BENCH_SERVER > /dev/null &
+CAPPED=$!
+trap 'kill $PID $CAPPED 2>/dev/null; rm -f "$LARGE"' EXIT INT TERM
+sleep 1
+kill -0 $PID
+kill -0 $CAPPED
+
+run() {
+    name=$1
+    shift
+    ./bench/loadgen --port "$PORT" --threads "$THREADS" --duration "$DURATION" --server-pid $PID \
+        --label "$LABEL" --scenario "$name" --out "$OUT" "$@"
+}
+
+run api-keepalive --connections 64 --mix api=1
+run api-pipelined --connections 64 --pipeline 16 --mix api=1
+run api-close --connections 32 --no-keepalive --mix api=1
+run static-small --connections 64 --mix small=1
+run static-large --connections 16 --mix large=1
+run echo-4k --connections 64 --mix echo=1 --echo-bytes 4096
+run mixed --connections 64 --pipeline 4 --mix small=50,large=5,api=25,echo=20
+
+# Every accept over the cap closes the oldest idle keep-alive connection. A request the server has
+# read is always answered, only one the client sent while its connection was being closed is lost
+# (a few percent here); turned away clients or requests dropped by the server go far beyond 10%
+run admission-churn --port "$CAPPED_PORT" --server-pid $CAPPED --connections 256 --think 2 --mix api=1 \
+    --max-failed 10
+
+echo "Results appended to $OUT"
@@ -0,0 +1,159 @@
+#include "chunked.h"
+#include <string.h>
+
+void initializeChunkDecoder(chunkDecoder_t* decoder) {
+    decoder->state = CHUNK_SIZE;
+    decoder->remaining = 0;
+    decoder->digits = 0;
+    decoder->skipped = 0;
+}
+
+static int hexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+chunkedResult_t chunkedDecode(chunkDecoder_t* decoder, char* buffer, size_t len, size_t* consumed, size_t* produced) {
+    size_t in = 0;
+    size_t out = 0;
+    chunkedResult_t result = CHUNKED_NEED_MORE;
+
+    while (in < len && decoder->state != CHUNK_DONE) {
+        char c = buffer[in];
+        switch (decoder->state) {
+        case CHUNK_SIZE: {
+            int value = hexValue(c);
+            if (value >= 0) {
+                // 15 digits keep the size far below anything size_t could overflow on
+                if (++decoder->digits > 15) {
+                    result = CHUNKED_ERROR;
+                    goto done;
+                }
+                decoder->remaining = decoder->remaining * 16 + value;
+            }
+            else if (decoder->digits > 0 && (c == ';' || c == ' ' || c == '\t')) {
+                decoder->state = CHUNK_EXTENSION;
+                decoder->skipped = 0;
+            }
+            else if (decoder->digits > 0 && c == '\r') {
+                decoder->state = CHUNK_SIZE_LF;
+            }
+            else {
+                result = CHUNKED_ERROR;
+                goto done;
+            }
+            in++;
+            break;
+        }
+
+        case CHUNK_EXTENSION:
+            if (c == '\r') {
+                decoder->state = CHUNK_SIZE_LF;
+            }
+            else if (++decoder->skipped > CHUNK_EXTENSION_MAX) {
+                result = CHUNKED_ERROR;
+                goto done;
+            }
+            in++;
+            break;
+
+        case CHUNK_SIZE_LF:
+            if (c != '\n') {
+                result = CHUNKED_ERROR;
+                goto done;
+            }
+            in++;
+            decoder->digits = 0;
+            decoder->skipped = 0;
+            decoder->state = decoder->remaining == 0 ? CHUNK_TRAILER_START : CHUNK_DATA;
+            break;
+
+        case CHUNK_DATA: {
+            // Whole run of data in one go, the only state that produces output
+            size_t run = len - in;
+            if (run > decoder->remaining) {
+                run = decoder->remaining;
+            }
+            if (out != in) {
+                memmove(buffer + out, buffer + in, run);
+            }
+            in += run;
+            out += run;
+            decoder->remaining -= run;
+            if (decoder->remaining == 0) {
+                decoder->state = CHUNK_DATA_CR;
+            }
+            break;
+        }
+
+        case CHUNK_DATA_CR:
+            if (c != '\r') {
+                result = CHUNKED_ERROR;
+                goto done;
+            }
+            in++;
+            decoder->state = CHUNK_DATA_LF;
+            break;
+
+        case CHUNK_DATA_LF:
+            if (c != '\n') {
+                result = CHUNKED_ERROR;
+                goto done;
+            }
+            in++;
+            decoder->state = CHUNK_SIZE;
+            break;
+
+        case CHUNK_TRAILER_START:
+            decoder->state = c == '\r' ? CHUNK_FINAL_LF : CHUNK_TRAILER;
+            if (c != '\r' && ++decoder->skipped > CHUNK_TRAILER_MAX) {
+                result = CHUNKED_ERROR;
+                goto done;
+            }
+            in++;
+            break;
+
+        case CHUNK_TRAILER:
+            if (c == '\r') {
+                decoder->state = CHUNK_TRAILER_LF;
+            }
+            else if (++decoder->skipped > CHUNK_TRAILER_MAX) {
+                result = CHUNKED_ERROR;
+                goto done;
+            }
+            in++;
+            break;
+
+        case CHUNK_TRAILER_LF:
+            if (c != '\n') {
+                result = CHUNKED_ERROR;
+                goto done;
+            }
+            in++;
+            decoder->state = CHUNK_TRAILER_START;
+            break;
+
+        case CHUNK_FINAL_LF:
+            if (c != '\n') {
+                result = CHUNKED_ERROR;
+                goto done;
+            }
+            in++;
+            decoder->state = CHUNK_DONE;
+            break;
+
+        case CHUNK_DONE:
+            break;
+        }
+    }
+    if (decoder->state == CHUNK_DONE) {
+        result = CHUNKED_DONE;
+    }
+
+done:
+    *consumed = in;
+    *produced = out;
+    return result;
+}
@@ -0,0 +1,66 @@
+#ifndef CHUNKED_H
+#define CHUNKED_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CHUNK_EXTENSION_MAX 4096 // bytes of chunk extensions per size line
+#define CHUNK_TRAILER_MAX 8192   // bytes of trailer fields after the last chunk
+
+/**
+ * Position of the decoder inside the chunked framing
+ */
+typedef enum {
+    CHUNK_SIZE,         // hex digits of the chunk size
+    CHUNK_EXTENSION,    // ";name=value" after the size, ignored
+    CHUNK_SIZE_LF,
+    CHUNK_DATA,
+    CHUNK_DATA_CR,
+    CHUNK_DATA_LF,
+    CHUNK_TRAILER_START, // start of a trailer line, or the final CRLF
+    CHUNK_TRAILER,       // trailer field, ignored
+    CHUNK_TRAILER_LF,
+    CHUNK_FINAL_LF,
+    CHUNK_DONE
+}chunkState_t;
+
+/**
+ * Resumable Transfer-Encoding: chunked decoder. Works byte by byte, so a
+ * read may end anywhere (inside a size line, a CRLF or chunk data) and the
+ * next call picks up where the previous one stopped.
+ * state: Current position in the framing
+ * remaining: Data bytes left in the current chunk (CHUNK_DATA), size so far in CHUNK_SIZE
+ * digits: Hex digits seen for the current size
+ * skipped: Extension or trailer bytes skipped, bounded by the limits above
+ */
+typedef struct {
+    chunkState_t state;
+    uint64_t remaining;
+    int digits;
+    size_t skipped;
+}chunkDecoder_t;
+
+/**
+ * Result of one chunkedDecode() call
+ */
+typedef enum {
+    CHUNKED_NEED_MORE,
+    CHUNKED_DONE,
+    CHUNKED_ERROR
+}chunkedResult_t;
+
+void initializeChunkDecoder(chunkDecoder_t* decoder);
+
+/**
+ * Decodes buffer in place: chunk data is moved to the front of buffer,
+ * framing is dropped. Input is consumed up to the end of the body, bytes
+ * after it (a pipelined request) are left alone.
+ * @param buffer Raw chunked bytes, overwritten with the decoded data
+ * @param len Number of raw bytes
+ * @param consumed Set to the raw bytes used, len unless the body ended earlier
+ * @param produced Set to the decoded bytes now at the front of buffer
+ * @return CHUNKED_DONE after the last chunk and trailers, CHUNKED_ERROR on bad framing
+ */
+chunkedResult_t chunkedDecode(chunkDecoder_t* decoder, char* buffer, size_t len, size_t* consumed, size_t* produced);
+
+#endif
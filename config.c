@@ -0,0 +1,391 @@
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/resource.h>
+
+static void printUsage(const char* program) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  --port N       Port to listen on (default %d)\n"
+        "  --workers N    Number of worker event loops (default: online CPU count)\n"
+        "  --pin          Pin each worker thread to its own CPU\n"
+        "  --backend B    I/O backend: epoll (default) or uring\n"
+        "  --file-cache N Open files cached per worker, 0 disables (default %d)\n"
+        "  --file-cache-ttl S\n"
+        "                 Seconds before a cached file is re-checked (default %d)\n"
+        "  --small-file-max N\n"
+        "                 Files up to N bytes are sent from a prebuilt response (default %d)\n"
+        "  --response-cache MB\n"
+        "                 Memory for prebuilt responses per worker, 0 disables (default %d)\n"
+        "  --precompressed\n"
+        "                 Serve file.br / file.gz sidecars when the client accepts them\n"
+        "  --precompress  Write missing sidecars for public/ at startup, implies --precompressed\n"
+        "  --max-body N   Largest buffered request body in bytes (default %d)\n"
+        "  --header-timeout S\n"
+        "                 Seconds to receive a complete header block, 0 disables (default %d)\n"
+        "  --body-timeout S\n"
+        "                 Seconds a request body may stall, 0 disables (default %d)\n"
+        "  --write-timeout S\n"
+        "                 Seconds a response may stall, 0 disables (default %d)\n"
+        "  --keepalive-timeout S\n"
+        "                 Seconds an idle keep-alive connection stays open, 0 disables (default %d)\n"
+        "  --backlog N    listen() backlog per worker (default %d)\n"
+        "  --max-connections N\n"
+        "                 Open connections over all workers (default: half the fd limit)\n"
+        "  --io-threads N Threads resolving cold static files off the event loops, 0 disables (default %d)\n"
+        "  --access-log PATH\n"
+        "                 Append JSON access log lines to PATH (\"-\" for stdout), SIGHUP reopens it\n"
+        "  --pack FILE    Serve static files from an asset pack instead of public/\n"
+        "  --build-pack FILE\n"
+        "                 Pack public/ (with its .br/.gz sidecars) into FILE and exit\n"
+        "  --tls-cert FILE\n"
+        "  --tls-key FILE Serve TLS with this PEM certificate chain and key (epoll backend)\n"
+        "  --memory-budget MB\n"
+        "                 Connection buffer memory over all workers, reads wait above it (default: off)\n"
+        "  --proxy PREFIX=HOST:PORT\n"
+        "                 Forward requests under PREFIX to an HTTP upstream, repeatable (epoll backend)\n"
+        "  --upstream-pool N\n"
+        "                 Idle upstream connections kept per worker and route (default %d)\n"
+        "  --upstream-timeout S\n"
+        "                 Seconds an upstream may stall before the request gets 504, 0 disables (default %d)\n"
+        "  --help         Show this message\n",
+        program, DEFAULT_PORT, DEFAULT_FILE_CACHE_ENTRIES, DEFAULT_FILE_CACHE_TTL,
+        DEFAULT_SMALL_FILE_MAX, DEFAULT_RESPONSE_CACHE_MB, DEFAULT_MAX_BODY,
+        DEFAULT_HEADER_TIMEOUT, DEFAULT_BODY_TIMEOUT, DEFAULT_WRITE_TIMEOUT, DEFAULT_KEEPALIVE_TIMEOUT,
+        DEFAULT_BACKLOG, DEFAULT_IO_THREADS, DEFAULT_UPSTREAM_POOL, DEFAULT_UPSTREAM_TIMEOUT);
+}
+
+// Parse a positive integer flag value, returns -1 if invalid
+static long parsePositive(const char* value) {
+    char* end = NULL;
+    long parsed = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || parsed <= 0) {
+        return -1;
+    }
+    return parsed;
+}
+
+// Same as parsePositive() but accepts 0
+static long parseNonNegative(const char* value) {
+    if (strcmp(value, "0") == 0) {
+        return 0;
+    }
+    return parsePositive(value);
+}
+
+// Sockets get half of the fd limit, the rest is left for cached files and splice pipes
+static int defaultMaxConnections(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1 || limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur > 2000000) {
+        return 1000000;
+    }
+    return limit.rlim_cur / 2 > 64 ? (int)(limit.rlim_cur / 2) : 64;
+}
+
+int parseConfig(int argc, char** argv, serverConfig_t* config) {
+    long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+    config->port = DEFAULT_PORT;
+    config->workers = cpuCount > 0 ? (int)cpuCount : 1;
+    config->pinWorkers = 0;
+    config->backend = BACKEND_EPOLL;
+    config->fileCacheEntries = DEFAULT_FILE_CACHE_ENTRIES;
+    config->fileCacheTtl = DEFAULT_FILE_CACHE_TTL;
+    config->smallFileMax = DEFAULT_SMALL_FILE_MAX;
+    config->responseCacheMb = DEFAULT_RESPONSE_CACHE_MB;
+    config->precompressed = 0;
+    config->precompress = 0;
+    config->maxBody = DEFAULT_MAX_BODY;
+    config->headerTimeout = DEFAULT_HEADER_TIMEOUT;
+    config->bodyTimeout = DEFAULT_BODY_TIMEOUT;
+    config->writeTimeout = DEFAULT_WRITE_TIMEOUT;
+    config->keepAliveTimeout = DEFAULT_KEEPALIVE_TIMEOUT;
+    config->backlog = DEFAULT_BACKLOG;
+    config->maxConnections = defaultMaxConnections();
+    config->accessLog = NULL;
+    config->ioThreads = DEFAULT_IO_THREADS;
+    config->pack = NULL;
+    config->buildPack = NULL;
+    config->tlsCert = NULL;
+    config->tlsKey = NULL;
+    config->memoryBudgetMb = 0;
+    config->proxyCount = 0;
+    config->upstreamPool = DEFAULT_UPSTREAM_POOL;
+    config->upstreamTimeout = DEFAULT_UPSTREAM_TIMEOUT;
+
+    static struct option longOptions[] = {
+        {"port", required_argument, NULL, 'p'},
+        {"workers", required_argument, NULL, 'w'},
+        {"pin", no_argument, NULL, 'P'},
+        {"backend", required_argument, NULL, 'b'},
+        {"file-cache", required_argument, NULL, 'c'},
+        {"file-cache-ttl", required_argument, NULL, 't'},
+        {"small-file-max", required_argument, NULL, 's'},
+        {"response-cache", required_argument, NULL, 'r'},
+        {"precompressed", no_argument, NULL, 'z'},
+        {"precompress", no_argument, NULL, 'Z'},
+        {"max-body", required_argument, NULL, 'm'},
+        {"header-timeout", required_argument, NULL, 'H'},
+        {"body-timeout", required_argument, NULL, 'B'},
+        {"write-timeout", required_argument, NULL, 'W'},
+        {"keepalive-timeout", required_argument, NULL, 'K'},
+        {"backlog", required_argument, NULL, 'l'},
+        {"max-connections", required_argument, NULL, 'C'},
+        {"access-log", required_argument, NULL, 'A'},
+        {"io-threads", required_argument, NULL, 'T'},
+        {"pack", required_argument, NULL, 'k'},
+        {"build-pack", required_argument, NULL, 'g'},
+        {"tls-cert", required_argument, NULL, 'e'},
+        {"tls-key", required_argument, NULL, 'y'},
+        {"memory-budget", required_argument, NULL, 'M'},
+        {"proxy", required_argument, NULL, 'x'},
+        {"upstream-pool", required_argument, NULL, 'u'},
+        {"upstream-timeout", required_argument, NULL, 'U'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "p:w:h", longOptions, NULL)) != -1) {
+        long value;
+        switch (opt) {
+        case 'p':
+            value = parsePositive(optarg);
+            if (value == -1 || value > 65535) {
+                fprintf(stderr, "Invalid port: %s\n", optarg);
+                return -1;
+            }
+            config->port = (int)value;
+            break;
+
+        case 'w':
+            value = parsePositive(optarg);
+            if (value == -1 || value > 1024) {
+                fprintf(stderr, "Invalid worker count: %s\n", optarg);
+                return -1;
+            }
+            config->workers = (int)value;
+            break;
+
+        case 'P':
+            config->pinWorkers = 1;
+            break;
+
+        case 'b':
+            if (strcmp(optarg, "epoll") == 0) {
+                config->backend = BACKEND_EPOLL;
+            }
+            else if (strcmp(optarg, "uring") == 0) {
+#ifdef HAVE_IO_URING
+                config->backend = BACKEND_URING;
+#else
+                fprintf(stderr, "io_uring backend not compiled in (build with IO_URING=1)\n");
+                return -1;
+#endif
+            }
+            else {
+                fprintf(stderr, "Unknown backend: %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case 'c':
+            value = parseNonNegative(optarg);
+            if (value == -1 || value > 1000000) {
+                fprintf(stderr, "Invalid file cache size: %s\n", optarg);
+                return -1;
+            }
+            config->fileCacheEntries = (int)value;
+            break;
+
+        case 't':
+            value = parseNonNegative(optarg);
+            if (value == -1 || value > 86400) {
+                fprintf(stderr, "Invalid file cache ttl: %s\n", optarg);
+                return -1;
+            }
+            config->fileCacheTtl = (int)value;
+            break;
+
+        case 's':
+            value = parsePositive(optarg);
+            if (value == -1 || value > 16 * 1024 * 1024) {
+                fprintf(stderr, "Invalid small file size: %s\n", optarg);
+                return -1;
+            }
+            config->smallFileMax = (int)value;
+            break;
+
+        case 'r':
+            value = parseNonNegative(optarg);
+            if (value == -1 || value > 65536) {
+                fprintf(stderr, "Invalid response cache size: %s\n", optarg);
+                return -1;
+            }
+            config->responseCacheMb = (int)value;
+            break;
+
+        case 'z':
+            config->precompressed = 1;
+            break;
+
+        case 'Z':
+#ifdef HAVE_PRECOMPRESS
+            config->precompress = 1;
+            config->precompressed = 1;
+#else
+            fprintf(stderr, "Sidecar generation not compiled in (build with PRECOMPRESS=1)\n");
+            return -1;
+#endif
+            break;
+
+        case 'm':
+            value = parsePositive(optarg);
+            if (value == -1 || value > 1024L * 1024 * 1024) {
+                fprintf(stderr, "Invalid max body size: %s\n", optarg);
+                return -1;
+            }
+            config->maxBody = (int)value;
+            break;
+
+        case 'H':
+        case 'B':
+        case 'W':
+        case 'K':
+            value = parseNonNegative(optarg);
+            if (value == -1 || value > 86400) {
+                fprintf(stderr, "Invalid timeout: %s\n", optarg);
+                return -1;
+            }
+            if (opt == 'H') config->headerTimeout = (int)value;
+            else if (opt == 'B') config->bodyTimeout = (int)value;
+            else if (opt == 'W') config->writeTimeout = (int)value;
+            else config->keepAliveTimeout = (int)value;
+            break;
+
+        case 'l':
+            value = parsePositive(optarg);
+            if (value == -1 || value > 65535) {
+                fprintf(stderr, "Invalid backlog: %s\n", optarg);
+                return -1;
+            }
+            config->backlog = (int)value;
+            break;
+
+        case 'C':
+            value = parsePositive(optarg);
+            if (value == -1 || value > 10000000) {
+                fprintf(stderr, "Invalid max connections: %s\n", optarg);
+                return -1;
+            }
+            config->maxConnections = (int)value;
+            break;
+
+        case 'T':
+            value = parseNonNegative(optarg);
+            if (value == -1 || value > 256) {
+                fprintf(stderr, "Invalid io thread count: %s\n", optarg);
+                return -1;
+            }
+            config->ioThreads = (int)value;
+            break;
+
+        case 'A':
+            if (optarg[0] == '\0') {
+                fprintf(stderr, "Invalid access log path\n");
+                return -1;
+            }
+            config->accessLog = optarg;
+            break;
+
+        case 'k':
+        case 'g':
+            if (optarg[0] == '\0') {
+                fprintf(stderr, "Invalid pack path\n");
+                return -1;
+            }
+            if (opt == 'k') config->pack = optarg;
+            else config->buildPack = optarg;
+            break;
+
+        case 'M':
+            value = parseNonNegative(optarg);
+            if (value == -1 || value > 1048576) {
+                fprintf(stderr, "Invalid memory budget: %s\n", optarg);
+                return -1;
+            }
+            config->memoryBudgetMb = (int)value;
+            break;
+
+        case 'x':
+            // PREFIX=HOST:PORT, checked and resolved by initializeProxy()
+            if (!strchr(optarg, '=') || config->proxyCount == PROXY_ROUTES_MAX) {
+                fprintf(stderr, "Invalid proxy route: %s\n", optarg);
+                return -1;
+            }
+            config->proxy[config->proxyCount++] = optarg;
+            break;
+
+        case 'u':
+            value = parseNonNegative(optarg);
+            if (value == -1 || value > 65536) {
+                fprintf(stderr, "Invalid upstream pool size: %s\n", optarg);
+                return -1;
+            }
+            config->upstreamPool = (int)value;
+            break;
+
+        case 'U':
+            value = parseNonNegative(optarg);
+            if (value == -1 || value > 86400) {
+                fprintf(stderr, "Invalid timeout: %s\n", optarg);
+                return -1;
+            }
+            config->upstreamTimeout = (int)value;
+            break;
+
+        case 'e':
+        case 'y':
+#ifdef HAVE_TLS
+            if (opt == 'e') config->tlsCert = optarg;
+            else config->tlsKey = optarg;
+#else
+            fprintf(stderr, "TLS not compiled in (build with TLS=1)\n");
+            return -1;
+#endif
+            break;
+
+        default:
+            printUsage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (optind < argc) {
+        printUsage(argv[0]);
+        return -1;
+    }
+    if (!config->tlsCert != !config->tlsKey) {
+        fprintf(stderr, "--tls-cert and --tls-key go together\n");
+        return -1;
+    }
+    // A buffered body that can never fit its worker's share would only wait for its 408
+    if (config->memoryBudgetMb > 0 &&
+        (size_t)config->memoryBudgetMb * 1024 * 1024 / config->workers < 2 * (size_t)config->maxBody) {
+        fprintf(stderr, "--memory-budget leaves a worker less than twice --max-body\n");
+        return -1;
+    }
+    // The io_uring loop receives and sends on the socket itself, outside the session
+    if (config->tlsCert && config->backend == BACKEND_URING) {
+        fprintf(stderr, "TLS needs the epoll backend\n");
+        return -1;
+    }
+    // Upstream sockets are driven by the epoll loop, io_uring has no such source
+    if (config->proxyCount > 0 && config->backend == BACKEND_URING) {
+        fprintf(stderr, "--proxy needs the epoll backend\n");
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,98 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#define DEFAULT_PORT 8080
+#define DEFAULT_FILE_CACHE_ENTRIES 1024
+#define DEFAULT_FILE_CACHE_TTL 5 // seconds
+#define DEFAULT_SMALL_FILE_MAX 16384 // bytes
+#define DEFAULT_RESPONSE_CACHE_MB 8
+#define DEFAULT_MAX_BODY (1024 * 1024) // bytes
+#define DEFAULT_HEADER_TIMEOUT 10 // seconds for a whole header block
+#define DEFAULT_BODY_TIMEOUT 30 // seconds without body bytes
+#define DEFAULT_WRITE_TIMEOUT 30 // seconds without send progress
+#define DEFAULT_KEEPALIVE_TIMEOUT 15 // seconds idle between requests
+#define DEFAULT_BACKLOG 511 // per listener, the kernel caps it at net.core.somaxconn
+#define DEFAULT_IO_THREADS 2 // offload threads for cold file lookups, shared by every worker
+#define DEFAULT_UPSTREAM_POOL 32 // idle upstream connections kept per worker and --proxy route
+#define DEFAULT_UPSTREAM_TIMEOUT 30 // seconds to connect, get the response head, or between body bytes
+#define PROXY_ROUTES_MAX 8
+
+/**
+ * Enum for the I/O backend driving the connection state machine
+ */
+typedef enum {
+    BACKEND_EPOLL,
+    BACKEND_URING
+}ioBackend_t;
+
+/**
+ * Structure holding the runtime configuration of the server
+ * port: TCP port every worker listens on
+ * workers: Number of event loop threads (each owns a SO_REUSEPORT listener and an epoll instance)
+ * pinWorkers: Flag to pin worker i to CPU (i % online CPUs)
+ * backend: Readiness based epoll loop or completion based io_uring loop
+ * fileCacheEntries: Open file cache capacity per worker, 0 disables the cache
+ * fileCacheTtl: Seconds a cached file is trusted before it is re-stat'ed
+ * smallFileMax: Files up to this many bytes are served from a prebuilt response
+ * responseCacheMb: Memory cap of prebuilt responses per worker, 0 disables them
+ * precompressed: Serve file.br / file.gz sidecars to clients whose Accept-Encoding allows it
+ * precompress: Generate missing or outdated sidecars for public/ at startup (implies precompressed)
+ * maxBody: Largest request body buffered in memory, bigger ones get 413 (streamed routes are exempt)
+ * headerTimeout: Seconds from the first byte of a request until its headers must be complete (408)
+ * bodyTimeout: Seconds a request body may stall (408)
+ * writeTimeout: Seconds a response may stall before the connection is closed
+ * keepAliveTimeout: Seconds an idle keep-alive connection is kept open
+ * A timeout of 0 disables it.
+ * backlog: listen() backlog of every worker listener
+ * maxConnections: Open connections over all workers (split evenly), the default is half the fd limit
+ * accessLog: Access log file ("-" for stdout), NULL disables the access log
+ * ioThreads: Offload threads opening and stat'ing files the cache cannot answer, 0 keeps that on the event loop
+ * pack: Asset pack served instead of public/, NULL serves the directory
+ * buildPack: Write public/ into this pack file and exit instead of serving
+ * tlsCert/tlsKey: PEM certificate chain and private key, every connection speaks TLS when set
+ * memoryBudgetMb: Connection read/write buffers over all workers (split evenly), 0 disables the budget
+ * proxy/proxyCount: --proxy PREFIX=HOST:PORT routes as given, parsed by initializeProxy()
+ * upstreamPool: Idle keep-alive upstream connections kept per worker and route
+ * upstreamTimeout: Seconds an upstream may take to connect, send its head or its next body bytes (504), 0 disables
+ */
+typedef struct {
+    int port;
+    int workers;
+    int pinWorkers;
+    ioBackend_t backend;
+    int fileCacheEntries;
+    int fileCacheTtl;
+    int smallFileMax;
+    int responseCacheMb;
+    int precompressed;
+    int precompress;
+    int maxBody;
+    int headerTimeout;
+    int bodyTimeout;
+    int writeTimeout;
+    int keepAliveTimeout;
+    int backlog;
+    int maxConnections;
+    const char* accessLog;
+    int ioThreads;
+    const char* pack;
+    const char* buildPack;
+    const char* tlsCert;
+    const char* tlsKey;
+    int memoryBudgetMb;
+    const char* proxy[PROXY_ROUTES_MAX];
+    int proxyCount;
+    int upstreamPool;
+    int upstreamTimeout;
+}serverConfig_t;
+
+/**
+ * Fills config with defaults and then applies command line flags
+ * @param argc Argument count from main()
+ * @param argv Argument vector from main()
+ * @param config Pointer to serverConfig_t structure to populate
+ * @return 0 on success, -1 on invalid arguments (usage is printed)
+ */
+int parseConfig(int argc, char** argv, serverConfig_t* config);
+
+#endif
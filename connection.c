@@ -1,100 +1,546 @@
 #include "connection.h"
+#include "router.h"
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/epoll.h>
 #include <sys/errno.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
 #include "httpParser.h"
 #include <sys/sendfile.h>
 #include "handlers.h"
+#include "worker.h"
+#include "scan.h"
+#include "chunked.h"
+#include "metrics.h"
+#include "offload.h"
+#include "proxy.h"
+#ifdef HAVE_TLS
+#include "tls.h"
+#endif
 
 #define READ_BUFFER_SIZE 4096 // 4kb
 #define MAX_HEADER_SIZE 8192 // 8kb
 #define MIN_RESPONSE_BUFFER 65536
+#define CHUNK_FRAME_HEAD 8 // "%zx\r\n" for a chunk that fits in write_buf
+#define OUTPUT_HEAD_ROOM 1024 // write_buf room a batch keeps for the next head or error response
+#define LOOKUP_READAHEAD (1024 * 1024) // file bytes an offloaded lookup asks the kernel to read ahead
 
-void initializeConnection(connection_t* conn, int fd, int fileRootFd) {
+/**
+ * Cache miss of a static file request, resolved on the offload pool
+ * conn: Waiting connection, NULL once it closed (the entries still go to the cache)
+ * entries: Filled by openFileTarget() on the pool thread
+ * path: Copy of target.path, the request bytes are not touched off the worker
+ */
+typedef struct fileLookupJob {
+    offloadJob_t job;
+    connection_t* conn;
+    fileCache_t* cache;
+    int root_fd;
+    fileTarget_t target;
+    fileCacheEntry_t* entries[FILE_TARGET_LOOKUPS];
+    char path[];
+}fileLookupJob_t;
+
+void initializeConnection(connection_t* conn, int fd, worker_t* worker) {
     conn->fd = fd;
     conn->state = READING_HEADERS;
+    conn->worker = worker;
     conn->header_end = 0;
     conn->parse_offset = 0;
+    conn->scan_offset = 0;
     conn->read_len = 0;
-    conn->read_cap = READ_BUFFER_SIZE;
-    conn->read_buf = malloc(READ_BUFFER_SIZE);
+    conn->read_buf = bufferAcquire(&worker->buffers, READ_BUFFER_SIZE, &conn->read_cap);
     if (!conn->read_buf) {
         perror("Malloc failed");
         conn->state = CLOSING;
-        return;
     }
+    conn->tls = NULL;
+    conn->tls_kernel_send = 0;
+    conn->tls_want_write = 0;
+#ifdef HAVE_TLS
+    if (conn->state != CLOSING && tlsEnabled()) {
+        // Requests are read once the session is up
+        conn->tls = tlsAccept(fd);
+        conn->state = conn->tls ? TLS_HANDSHAKE : CLOSING;
+    }
+#endif
+    // Most requests never need the 64kb write buffer before processing
+    conn->write_buf = NULL;
+    conn->write_cap = 0;
     conn->write_len = 0;
-    conn->write_sent = 0;
-    conn->write_buf = malloc(MIN_RESPONSE_BUFFER);
+    conn->output = NULL;
+    conn->pipelined = 0;
+    conn->read_paused = 0;
+    conn->read_deferred = 0;
+    conn->read_wanted = 0;
+    conn->defer_prev = NULL;
+    conn->defer_next = NULL;
+    conn->read_borrowed = 0;
+    conn->read_retired = NULL;
+    conn->read_retired_count = 0;
+    conn->read_retired_cap = 0;
+    conn->producing = 0;
+    conn->root_fd = worker->root_fd;
+    conn->file_fd = -1;
+    conn->file_entry = NULL;
+    conn->file_offset = 0;
+    conn->file_remaining = 0;
+    conn->shouldClose = 0;
+    conn->served = 0;
+    initializeTimerNode(&conn->timer);
+    conn->timer_phase = TIMER_NONE;
+    conn->idle_prev = NULL;
+    conn->idle_next = NULL;
+    conn->idle_listed = 0;
+    conn->request_start = 0;
+    conn->timing_count = 0;
+    conn->timing_first = 0;
+    conn->timing_done = 0;
+    conn->metrics_state = conn->state;
+    conn->peer_known = 0;
+    conn->output_bytes = 0;
+    conn->logged_bytes = 0;
+    conn->log_records = NULL;
+    conn->lookup = NULL;
+    conn->lookup_done = 0;
+    conn->upstream = NULL;
+    conn->raw_target = NULL;
+    conn->raw_target_len = 0;
+    conn->raw_target_cap = 0;
+    worker->metrics->connections[conn->state]++;
+    worker->connectionCount++;
+    conn->interest = EPOLLIN;
+    conn->uring_inflight = 0;
+    conn->uring_recv_armed = 0;
+    conn->uring_send_busy = 0;
+    conn->uring_closing = 0;
+    conn->uring_recv_cancel = 0;
+    conn->uring_pipe[0] = -1;
+    conn->uring_pipe[1] = -1;
+    conn->uring_pipe_pending = 0;
+    conn->request = NULL;
+    conn->body_expected = 0;
+    conn->body_recieved = 0;
+    conn->body_streamed = 0;
+    conn->body_chunked = 0;
+}
+
+int ensureWriteBuffer(connection_t* conn) {
+    if (conn->write_buf) {
+        return 0;
+    }
+    conn->write_buf = bufferAcquire(&conn->worker->buffers, MIN_RESPONSE_BUFFER, &conn->write_cap);
     if (!conn->write_buf) {
         perror("Malloc failed");
-        conn->state = CLOSING;
-        return;
+        conn->write_cap = 0;
+        return -1;
     }
-    conn->root_fd = fileRootFd;
+    return 0;
+}
+
+// File fds belong to the worker file cache, connections only drop their reference
+static void releaseFile(connection_t* conn) {
+    fileCacheRelease(&conn->worker->fileCache, conn->file_entry);
+    conn->file_entry = NULL;
     conn->file_fd = -1;
+}
+
+static void releaseRawTarget(connection_t* conn) {
+    if (conn->raw_target) {
+        bufferRelease(&conn->worker->buffers, conn->raw_target, conn->raw_target_cap);
+        conn->raw_target = NULL;
+        conn->raw_target_len = 0;
+        conn->raw_target_cap = 0;
+    }
+}
+
+static void releaseRequest(connection_t* conn) {
+    releaseRawTarget(conn);
+    if (conn->request) {
+        poolFree(&conn->worker->requests, conn->request);
+        conn->request = NULL;
+    }
+}
+
+static int ensureOutputQueue(connection_t* conn) {
+    if (conn->output) {
+        return 0;
+    }
+    if (!(conn->output = poolAlloc(&conn->worker->outputs))) {
+        perror("Malloc failed");
+        return -1;
+    }
+    conn->output->count = 0;
+    conn->output->next = 0;
+    conn->output->sent = 0;
+    return 0;
+}
+
+static void releaseSegment(connection_t* conn, outputSegment_t* segment) {
+    free(segment->owned);
+    fileCacheRelease(&conn->worker->fileCache, segment->entry);
+    segment->owned = NULL;
+    segment->entry = NULL;
+}
+
+// Drops whatever was not sent and hands the queue back, write_buf is free again
+static void releaseOutput(connection_t* conn) {
+    outputQueue_t* out = conn->output;
+    if (out) {
+        for (int i = out->next;i < out->count;i++) {
+            releaseSegment(conn, &out->segments[i]);
+        }
+        poolFree(&conn->worker->outputs, out);
+        conn->output = NULL;
+    }
+    // No segment borrows from the outgrown read buffers anymore
+    for (int i = 0;i < conn->read_retired_count;i++) {
+        bufferRelease(&conn->worker->buffers, conn->read_retired[i].buf, conn->read_retired[i].cap);
+    }
+    conn->read_retired_count = 0;
+    conn->read_borrowed = 0;
+    conn->write_len = 0;
+    conn->pipelined = 0;
+}
+
+// Takes over owned and entry, they are dropped right away when the segment cannot be queued
+static int queueSegment(connection_t* conn, const char* data, size_t len, char* owned, fileCacheEntry_t* entry) {
+    if (len > 0 && ensureOutputQueue(conn) == 0 && conn->output->count < OUTPUT_SEGMENTS_MAX) {
+        conn->output->segments[conn->output->count++] = (outputSegment_t){ data, len, owned, entry };
+        conn->output_bytes += len;
+        return 0;
+    }
+    free(owned);
+    fileCacheRelease(&conn->worker->fileCache, entry);
+    return len > 0 ? -1 : 0;
+}
+
+int connectionQueueBytes(connection_t* conn, const char* data, size_t len) {
+    return queueSegment(conn, data, len, NULL, NULL);
+}
+
+int queueWriteBuffer(connection_t* conn, size_t len) {
+    const char* data = conn->write_buf + conn->write_len;
+    conn->write_len += len;
+    outputQueue_t* out = conn->output;
+    if (out && out->count > out->next) {
+        // Heads without a body in between are one contiguous run of write_buf
+        outputSegment_t* last = &out->segments[out->count - 1];
+        if (!last->owned && !last->entry && last->data + last->len == data) {
+            last->len += len;
+            conn->output_bytes += len;
+            return 0;
+        }
+    }
+    return queueSegment(conn, data, len, NULL, NULL);
+}
+
+// Keeps worker->idleHead..idleTail in the order connections became idle
+static void setIdle(connection_t* conn, int idle) {
+    worker_t* worker = conn->worker;
+    if (idle == conn->idle_listed) {
+        return;
+    }
+    if (idle) {
+        conn->idle_prev = worker->idleTail;
+        conn->idle_next = NULL;
+        if (worker->idleTail) worker->idleTail->idle_next = conn;
+        else worker->idleHead = conn;
+        worker->idleTail = conn;
+    }
+    else {
+        if (conn->idle_prev) conn->idle_prev->idle_next = conn->idle_next;
+        else worker->idleHead = conn->idle_next;
+        if (conn->idle_next) conn->idle_next->idle_prev = conn->idle_prev;
+        else worker->idleTail = conn->idle_prev;
+        conn->idle_prev = NULL;
+        conn->idle_next = NULL;
+    }
+    conn->idle_listed = idle;
+}
+
+// Same for worker->deferredHead..deferredTail, in the order reads were deferred
+static void setDeferred(connection_t* conn, int deferred) {
+    worker_t* worker = conn->worker;
+    if (deferred == conn->read_deferred) {
+        return;
+    }
+    if (deferred) {
+        conn->defer_prev = worker->deferredTail;
+        conn->defer_next = NULL;
+        if (worker->deferredTail) worker->deferredTail->defer_next = conn;
+        else worker->deferredHead = conn;
+        worker->deferredTail = conn;
+    }
+    else {
+        if (conn->defer_prev) conn->defer_prev->defer_next = conn->defer_next;
+        else worker->deferredHead = conn->defer_next;
+        if (conn->defer_next) conn->defer_next->defer_prev = conn->defer_prev;
+        else worker->deferredTail = conn->defer_prev;
+        conn->defer_prev = NULL;
+        conn->defer_next = NULL;
+    }
+    conn->read_deferred = deferred;
+}
+
+void closeConnection(connection_t* conn) {
+    worker_t* worker = conn->worker;
+#ifdef HAVE_TLS
+    if (conn->tls) {
+        tlsClose(conn->tls);
+    }
+#endif
+    close(conn->fd);
+    timerCancel(&worker->timers, &conn->timer);
+    setIdle(conn, 0);
+    setDeferred(conn, 0);
+    if (worker->overdraft == conn) {
+        worker->overdraft = NULL;
+    }
+    worker->connectionCount--;
+    if (conn->uring_closing) {
+        worker->closingConnections--;
+    }
+    worker->metrics->connections[conn->metrics_state]--;
+    if (conn->upstream) {
+        // Half relayed, the upstream connection cannot be reused
+        proxyRelease(conn);
+    }
+    releaseFile(conn);
+    releaseOutput(conn);
+    releaseRequest(conn);
+    poolFree(&worker->logRecords, conn->log_records);
+    if (conn->lookup) {
+        // Completes on its own, the connection is not resumed
+        conn->lookup->conn = NULL;
+    }
+    if (conn->uring_pipe[0] != -1) {
+        close(conn->uring_pipe[0]);
+        close(conn->uring_pipe[1]);
+    }
+    free(conn->read_retired);
+    bufferRelease(&worker->buffers, conn->read_buf, conn->read_cap);
+    bufferRelease(&worker->buffers, conn->write_buf, conn->write_cap);
+    poolFree(&worker->connections, conn);
+}
+
+// Per request state, read_buf and the queued output of the batch stay as they are
+static void resetRequestState(connection_t* conn) {
+    conn->state = READING_HEADERS;
+    conn->header_end = 0;
+
+    // Reset file sending state
+    releaseFile(conn);
+    releaseRequest(conn);
+    conn->body_expected = 0;
+    conn->body_recieved = 0;
+    conn->body_streamed = 0;
+    conn->body_chunked = 0;
+    conn->producing = 0;
+    conn->lookup_done = 0;
     conn->file_offset = 0;
     conn->file_remaining = 0;
     conn->shouldClose = 0;
+    conn->request_start = 0;
 }
 
-void closeConnection(connection_t* conn) {
-    close(conn->fd);
-    if (conn->file_fd != -1 && conn->file_fd != conn->root_fd) {
-        close(conn->file_fd);
+// Hands back the read_buf capacity a large body or header block left behind,
+// down to the smallest class that holds the pipelined rest. Only when that
+// frees at least half, so requests of about the same size do not bounce
+// between two classes.
+static void shrinkReadBuffer(connection_t* conn) {
+    size_t target = bufferCapacity(conn->read_len > READ_BUFFER_SIZE ? conn->read_len : READ_BUFFER_SIZE);
+    if (target > conn->read_cap / 2) {
+        return;
+    }
+    char* temp = bufferResize(&conn->worker->buffers, conn->read_buf, conn->read_len, &conn->read_cap, target);
+    if (temp) {
+        // On failure the larger buffer simply stays
+        conn->read_buf = temp;
     }
-    free(conn->read_buf);
-    free(conn->write_buf);
-    free(conn);
 }
 
 void resetConnectionForNextRequest(connection_t* conn) {
+    // Whole batch is sent, nothing borrows from read_buf anymore
+    releaseOutput(conn);
+    // Between requests nothing is formatted, an idle keep-alive connection
+    // holds no write_buf; the next response takes one from the pool again
+    bufferRelease(&conn->worker->buffers, conn->write_buf, conn->write_cap);
+    conn->write_buf = NULL;
+    conn->write_cap = 0;
+
     // Handle pipelined requests: move any unprocessed data to front of buffer
-    // parse_offset now points to the end of the current request
+    // parse_offset now points to the end of the last request of the batch,
+    // so the whole batch costs one memmove
     size_t remaining = conn->read_len - conn->parse_offset;
     if (remaining > 0) {
         // Move remaining data to front of buffer
         memmove(conn->read_buf, conn->read_buf + conn->parse_offset, remaining);
     }
-
-    // Reset state for next request
-    conn->state = READING_HEADERS;
-    conn->header_end = 0;
+    conn->scan_offset = conn->scan_offset > conn->parse_offset ? conn->scan_offset - conn->parse_offset : 0;
     conn->parse_offset = 0;
     conn->read_len = remaining;  // Keep pipelined data
 
-    // Reset write buffer tracking
-    conn->write_len = 0;
-    conn->write_sent = 0;
+    resetRequestState(conn);
+    shrinkReadBuffer(conn);
+    if (conn->worker->overdraft == conn) {
+        // Its request is done, the next deferred read may go over the budget
+        conn->worker->overdraft = NULL;
+    }
+    // Next request starts its own deadline even if the state looks the same
+    conn->served++;
+    conn->timer_phase = TIMER_NONE;
+}
 
-    // Reset file sending state
-    if (conn->file_fd != -1 && conn->file_fd != conn->root_fd) {
-        close(conn->file_fd);
+// Copies read_buf into a new buffer and keeps the old one alive: queued
+// bodies point into it, and with io_uring a send of them may be in flight
+static char* retireReadBuffer(connection_t* conn, size_t newCap) {
+    if (conn->read_retired_count == conn->read_retired_cap) {
+        int cap = conn->read_retired_cap ? conn->read_retired_cap * 2 : 4;
+        retiredBuffer_t* list = realloc(conn->read_retired, (size_t)cap * sizeof(retiredBuffer_t));
+        if (!list) {
+            return NULL;
+        }
+        conn->read_retired = list;
+        conn->read_retired_cap = cap;
     }
-    conn->file_fd = -1;
-    conn->file_offset = 0;
-    conn->file_remaining = 0;
-    conn->shouldClose = 0;
+    size_t cap;
+    char* temp = bufferAcquire(&conn->worker->buffers, newCap, &cap);
+    if (!temp) {
+        return NULL;
+    }
+    memcpy(temp, conn->read_buf, conn->read_len);
+    conn->read_retired[conn->read_retired_count].buf = conn->read_buf;
+    conn->read_retired[conn->read_retired_count].cap = conn->read_cap;
+    conn->read_retired_count++;
+    conn->read_cap = cap;
+    // Bodies queued from now on borrow from the new buffer
+    conn->read_borrowed = 0;
+    return temp;
 }
 
-void handleHeaders(connection_t* conn) {
-    // Check for CRLF to get to header end
-    char* header_end = NULL;
-    for (size_t i = conn->parse_offset; i + 3 < conn->read_len; i++) {
-        if (conn->read_buf[i] == '\r' &&
-            conn->read_buf[i + 1] == '\n' &&
-            conn->read_buf[i + 2] == '\r' &&
-            conn->read_buf[i + 3] == '\n') {
-            header_end = conn->read_buf + i;
-            break;
+// Moves read_buf into a buffer of at least newCap bytes, views of the parsed request follow it
+static int resizeReadBuffer(connection_t* conn, size_t newCap) {
+    char* old = conn->read_buf;
+    char* temp = conn->read_borrowed ?
+        retireReadBuffer(conn, newCap) :
+        bufferResize(&conn->worker->buffers, conn->read_buf, conn->read_len, &conn->read_cap, newCap);
+    if (!temp) {
+        conn->state = CLOSING;
+        return -1;
+    }
+    conn->read_buf = temp;
+    if (conn->request && temp != old) {
+        rebaseHttpInfo(conn->request, old, temp);
+    }
+    return 0;
+}
+
+// Pauses reading until the budget has room for a read_buf of wanted bytes,
+// workerRelieveMemory() resumes the connection. Returns 0 when it fits now.
+static int deferRead(connection_t* conn, size_t wanted) {
+    if (conn->worker->overdraft == conn || !workerOverBudget(conn->worker, bufferCapacity(wanted) - conn->read_cap)) {
+        return 0;
+    }
+    conn->read_paused = 1;
+    conn->read_wanted = wanted;
+    setDeferred(conn, 1);
+    conn->worker->metrics->readDeferrals++;
+    return 1;
+}
+
+// Decodes and normalizes the path in place, returns -1 after queueing the error response
+static int prepareRequestPath(connection_t* conn) {
+    httpInfo_t* request = conn->request;
+
+    // Only origin-form targets, in place normalizing relies on the leading slash
+    // (checked before decoding, "%2F..." is not origin-form either)
+    if (request->path.len == 0 || request->path.data[0] != '/') {
+        handleParseError(BAD_REQUEST_PATH, conn);
+        return -1;
+    }
+    // Proxy routes forward the target as received, it is dropped again for any other route
+    if (conn->worker->proxy) {
+        conn->raw_target = bufferAcquire(&conn->worker->buffers, request->path.len, &conn->raw_target_cap);
+        if (!conn->raw_target) {
+            perror("Malloc failed");
+            conn->raw_target_cap = 0;
+            conn->state = CLOSING;
+            return -1;
         }
+        memcpy(conn->raw_target, request->path.data, request->path.len);
+        conn->raw_target_len = request->path.len;
     }
 
+    // decode url, in place: the raw path in read_buf is not needed afterwards
+    parserResult_t processingRes = OK;
+    request->decodedPath.data = request->path.data;
+    request->decodedPath.len = 0;
+    processingRes = decodeUrl(&request->path, &request->decodedPath);
+    if (processingRes != OK) {
+        handleParseError(processingRes, conn);
+        return -1;
+    }
+
+    // normalize url, in place as well
+    request->normalizedPath.data = request->decodedPath.data;
+    request->normalizedPath.len = request->decodedPath.len < PATH_BUFFER_CAP ? request->decodedPath.len : PATH_BUFFER_CAP;
+    processingRes = normalizePath(&request->decodedPath, &request->normalizedPath);
+    if (processingRes != OK) {
+        handleParseError(processingRes, conn);
+        return -1;
+    }
+    return 0;
+}
+
+// Clients that sent Expect: 100-continue hold the body back until they see this
+// @return -1 when the connection has to close
+static int sendContinue(connection_t* conn) {
+    bufferView_t expect = conn->request->known[HEADER_EXPECT];
+    if (expect.len != 12 || strncasecmp(expect.data, "100-continue", 12) != 0) {
+        return 0;
+    }
+    if (conn->read_len > conn->parse_offset) {
+        // Body is already on its way
+        return 0;
+    }
+    static const char interim[] = "HTTP/1.1 100 Continue\r\n\r\n";
+#ifdef HAVE_TLS
+    if (conn->tls && !conn->tls_kernel_send) {
+        // A record left half written would be finished by the next response's write and
+        // shift its accounting, so a full socket buffer closes instead of dropping it
+        struct iovec iov = { (char*)interim, sizeof(interim) - 1 };
+        return tlsWritev(conn->tls, &iov, 1) == (ssize_t)(sizeof(interim) - 1) ? 0 : -1;
+    }
+#endif
+    // Best effort, if the socket buffer is full the client sends after its own timeout
+    send(conn->fd, interim, sizeof(interim) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+    return 0;
+}
+
+void handleHeaders(connection_t* conn) {
+    if (conn->request_start == 0 && conn->read_len > conn->parse_offset) {
+        // First look at the bytes of this request, latency is measured from here
+        conn->request_start = monotonicUs();
+    }
+    // Check for CRLF to get to header end, only the bytes not scanned by an earlier read
+    size_t scanStart = conn->scan_offset > conn->parse_offset ? conn->scan_offset : conn->parse_offset;
+    const char* header_end = scanHeaderEnd(conn->read_buf + scanStart, conn->read_len - scanStart);
+
     if (!header_end) {
+        // A terminator can still start in the last 3 bytes once more data arrives
+        conn->scan_offset = conn->read_len > scanStart + 3 ? conn->read_len - 3 : scanStart;
+        if (conn->read_len - conn->parse_offset > MAX_HEADER_SIZE) {
+            handleParseError(HEADER_TOO_LARGE, conn);
+        }
+        else if (conn->pipelined > 0) {
+            // Rest of the next request is still on its way, send the batch meanwhile
+            conn->state = WRITING_RESPONSE;
+        }
         // Wait for next EPOLLIN
         return;
     }
@@ -103,7 +549,14 @@ void handleHeaders(connection_t* conn) {
 
     size_t header_size = conn->header_end - conn->parse_offset;
     if (header_size > MAX_HEADER_SIZE) {
-        handleParseError(MAX_HEADER_SIZE, conn);
+        handleParseError(HEADER_TOO_LARGE, conn);
+        return;
+    }
+
+    // Parsed request state only exists while a request is in flight
+    if (!conn->request && !(conn->request = poolAlloc(&conn->worker->requests))) {
+        perror("Malloc failed");
+        conn->state = CLOSING;
         return;
     }
 
@@ -111,7 +564,7 @@ void handleHeaders(connection_t* conn) {
     parserResult_t headerParsingRes = requestAndHeaderParser(
         conn->read_buf + conn->parse_offset,
         conn->read_buf + conn->header_end + 2, // Because of my invarient in parser
-        &conn->request
+        conn->request
     );
 
     if (headerParsingRes != OK) {
@@ -119,80 +572,445 @@ void handleHeaders(connection_t* conn) {
         return;
     }
 
+    if (conn->pipelined > 0 && (conn->request->isChunked ||
+        conn->request->contentLength > conn->read_len - (conn->header_end + 4))) {
+        // Queued responses must not wait behind a body still in flight: flush
+        // them and parse this request again afterwards, before its path is
+        // decoded in place
+        releaseRequest(conn);
+        conn->state = WRITING_RESPONSE;
+        return;
+    }
+
+    // Update parse offset, it now points at the first body byte
+    conn->parse_offset += header_size + 4;
+
+    // Path is resolved before the body arrives, the route decides how the body is taken
+    if (prepareRequestPath(conn) == -1) {
+        return;
+    }
+    routerMatch(conn->worker->router, conn->request);
+    if (!(conn->request->route->flags & ROUTE_PROXY)) {
+        releaseRawTarget(conn);
+    }
+    conn->body_expected = conn->request->contentLength;
+    conn->body_recieved = 0;
+    conn->body_chunked = conn->request->isChunked;
+    if (conn->body_chunked) {
+        initializeChunkDecoder(&conn->body_decoder);
+    }
+    conn->body_streamed = requestBodyStream(conn->request, &conn->body_stream);
+    if (!conn->body_streamed && conn->body_expected > conn->worker->maxBody) {
+        handleParseError(PAYLOAD_TOO_LARGE, conn);
+        return;
+    }
+    // A buffered body of known size gets its buffer now instead of doubling per read.
+    // Over the memory budget it waits for the whole buffer before reading on: bodies
+    // holding part of theirs while all wait for more would never finish.
+    size_t needed = conn->parse_offset + conn->body_expected;
+    if (!conn->body_streamed && needed > conn->read_cap &&
+        !deferRead(conn, needed + READ_BUFFER_SIZE) &&
+        resizeReadBuffer(conn, needed + READ_BUFFER_SIZE) == -1) {
+        return;
+    }
+    if ((conn->body_expected > 0 || conn->body_chunked) && sendContinue(conn) == -1) {
+        conn->state = CLOSING;
+        return;
+    }
+
     // Since everyting is fine we can say header parsing completed
     conn->state = READING_BODY;
-    // Update parse offset
-    conn->parse_offset += header_size + 4;
+}
+
+// Decoded bytes replace the framing in read_buf: a buffered body collects at
+// parse_offset, a streamed one is handed over and dropped like a sized body
+static void handleChunkedBody(connection_t* conn) {
+    size_t start = conn->parse_offset + (conn->body_streamed ? 0 : conn->body_recieved);
+    size_t consumed = 0;
+    size_t produced = 0;
+    chunkedResult_t res = chunkedDecode(&conn->body_decoder, conn->read_buf + start, conn->read_len - start,
+        &consumed, &produced);
+    if (res == CHUNKED_ERROR) {
+        handleParseError(BAD_REQUEST_BODY, conn);
+        return;
+    }
+
+    char* data = conn->read_buf + start;
+    size_t rest = conn->read_len - start - consumed; // bytes after the body, only once it is done
+    if (conn->body_streamed) {
+        if (produced > 0 && conn->body_stream.onChunk(&conn->body_stream, data, produced) == -1) {
+            handleParseError(BAD_REQUEST_BODY, conn);
+            return;
+        }
+        conn->body_stream.received += produced;
+        conn->body_recieved += produced;
+        // Handed over, nothing stays in read_buf
+        produced = 0;
+    }
+    else if (conn->body_recieved + produced > conn->worker->maxBody) {
+        handleParseError(PAYLOAD_TOO_LARGE, conn);
+        return;
+    }
+    else {
+        conn->body_recieved += produced;
+    }
+    memmove(data + produced, data + consumed, rest);
+    conn->read_len = start + produced + rest;
+
+    if (res != CHUNKED_DONE) {
+        // Wait for the rest of the body
+        return;
+    }
+    if (!conn->body_streamed) {
+        // Handlers see a plain body of known length
+        conn->request->contentLength = conn->body_recieved;
+        if (bodyParser(conn->read_buf + conn->parse_offset, conn->request) != OK) {
+            conn->state = CLOSING;
+            return;
+        }
+        conn->parse_offset += conn->body_recieved;
+    }
+    conn->state = PROCESSING;
 }
 
 void handleBody(connection_t* conn) {
-    char* bodyStart = conn->read_buf + conn->parse_offset;
-    parserResult_t bodyParserRes = bodyParser(bodyStart, &conn->request);
-    if (bodyParserRes == OK) {
-        conn->state = PROCESSING;
-        // Update parse_offset to point past the entire request (headers + body)
-        // This is important for HTTP pipelining support
-        conn->parse_offset += conn->request.contentLength;
+    if (conn->body_chunked) {
+        handleChunkedBody(conn);
+        return;
+    }
+    size_t available = conn->read_len - conn->parse_offset;
+    if (conn->body_streamed) {
+        // Hand over what arrived and drop it, bytes after the body move up to parse_offset
+        size_t missing = conn->body_expected - conn->body_recieved;
+        size_t chunk = available < missing ? available : missing;
+        if (chunk > 0) {
+            char* data = conn->read_buf + conn->parse_offset;
+            if (conn->body_stream.onChunk(&conn->body_stream, data, chunk) == -1) {
+                handleParseError(BAD_REQUEST_BODY, conn);
+                return;
+            }
+            conn->body_stream.received += chunk;
+            conn->body_recieved += chunk;
+            memmove(data, data + chunk, available - chunk);
+            conn->read_len -= chunk;
+        }
     }
     else {
-        conn->state = CLOSING;
+        conn->body_recieved = available < conn->body_expected ? available : conn->body_expected;
+    }
+
+    if (conn->body_recieved < conn->body_expected) {
+        // Wait for the rest of the body
         return;
     }
+    if (!conn->body_streamed) {
+        char* bodyStart = conn->read_buf + conn->parse_offset;
+        if (bodyParser(bodyStart, conn->request) != OK) {
+            conn->state = CLOSING;
+            return;
+        }
+        // Update parse_offset to point past the entire request (headers + body)
+        // This is important for HTTP pipelining support
+        conn->parse_offset += conn->body_expected;
+    }
+    conn->state = PROCESSING;
+}
+
+// Pulls produced body pieces into write_buf after write_len until it is
+// nearly full or the producer ends, each piece framed as one chunk.
+// Everything produced is queued as one segment.
+static int appendProducedBody(connection_t* conn) {
+    static const char lastChunk[] = "0\r\n\r\n";
+    size_t frameHead = conn->produce_chunked ? CHUNK_FRAME_HEAD : 0;
+    // Size line, CRLF after the data and the last chunk all have to fit
+    size_t overhead = conn->produce_chunked ? frameHead + 2 + sizeof(lastChunk) - 1 : 0;
+    size_t start = conn->write_len;
+    size_t end = start;
+
+    while (conn->producing && conn->write_cap - end >= overhead + BODY_PRODUCER_MIN_CAP) {
+        char* frame = conn->write_buf + end;
+        size_t cap = conn->write_cap - end - overhead;
+        ssize_t len = conn->producer.produce(&conn->producer, frame + frameHead, cap);
+        if (len < 0) {
+            return -1;
+        }
+        if (len == 0) {
+            conn->producing = 0;
+            if (conn->produce_chunked) {
+                memcpy(frame, lastChunk, sizeof(lastChunk) - 1);
+                end += sizeof(lastChunk) - 1;
+            }
+            break;
+        }
+        if (!conn->produce_chunked) {
+            end += len;
+            continue;
+        }
+        // The size line is only known now, slide the data up behind it
+        char sizeLine[CHUNK_FRAME_HEAD + 1];
+        int sizeLen = snprintf(sizeLine, sizeof(sizeLine), "%zx\r\n", (size_t)len);
+        memmove(frame + sizeLen, frame + frameHead, len);
+        memcpy(frame, sizeLine, sizeLen);
+        memcpy(frame + sizeLen + len, "\r\n", 2);
+        end += sizeLen + len + 2;
+    }
+    return queueWriteBuffer(conn, end - start);
+}
+
+// Head goes into write_buf behind the heads queued before it, the body follows as its own segment
+static int queueResponse(connection_t* conn, response_t* response, int isApi) {
+    if (!isApi) {
+        // From here on the connection holds the file reference
+        conn->file_fd = response->fileDescriptor;
+        conn->file_entry = response->fileEntry;
+        conn->file_remaining = response->fileSize;
+        conn->file_offset = response->fileOffset;
+    }
+    // Static and borrowed bodies are sent in place, only owned ones are freed
+    char* owned = response->bodyOwned ? (char*)response->body : NULL;
+    if (ensureWriteBuffer(conn) == -1) {
+        free(owned);
+        return -1;
+    }
+    size_t room = conn->write_cap - conn->write_len;
+    size_t headLen;
+    createWritableResponse(response, conn->write_buf + conn->write_len, room, &headLen);
+    if (headLen >= room || queueWriteBuffer(conn, headLen) == -1) {
+        free(owned);
+        return -1;
+    }
+    if (response->producer.produce) {
+        // First pieces go out in the same send as the head
+        conn->producer = response->producer;
+        conn->producing = 1;
+        conn->produce_chunked = response->chunked;
+        if (appendProducedBody(conn) == -1) {
+            free(owned);
+            return -1;
+        }
+    }
+    if (!owned && response->body >= conn->read_buf && response->body < conn->read_buf + conn->read_cap) {
+        // Borrowed from the request, read_buf must stay put until the batch is sent
+        conn->read_borrowed = 1;
+    }
+    // Body goes out from its own buffer, sendmsg() joins it with the head
+    return queueSegment(conn, response->body, response->bodyLen, owned, NULL);
+}
+
+// Fresh status line and Date in write_buf, then the prebuilt rest straight from the cache entry
+static int queueCachedResponse(connection_t* conn, response_t* response) {
+    if (ensureWriteBuffer(conn) == -1) {
+        fileCacheRelease(&conn->worker->fileCache, response->fileEntry);
+        return -1;
+    }
+    size_t room = conn->write_cap - conn->write_len;
+    size_t headLen;
+    createWritableResponse(response, conn->write_buf + conn->write_len, room, &headLen);
+    if (headLen >= room || queueWriteBuffer(conn, headLen) == -1) {
+        fileCacheRelease(&conn->worker->fileCache, response->fileEntry);
+        return -1;
+    }
+    // The segment holds the entry reference until the bytes are sent
+    return queueSegment(conn, response->cachedResponse, response->cachedResponseLen, NULL, response->fileEntry);
+}
+
+// The next pipelined request joins the batch only behind a response that
+// is complete in the queue, and while the queue and write_buf have room
+static int canBatchNext(const connection_t* conn) {
+    if (conn->shouldClose || conn->file_remaining > 0 || conn->producing) {
+        return 0;
+    }
+    return conn->pipelined < PIPELINE_DEPTH_MAX &&
+        conn->output->count + 2 <= OUTPUT_SEGMENTS_MAX &&
+        conn->write_cap - conn->write_len >= OUTPUT_HEAD_ROOM &&
+        conn->read_len > conn->parse_offset;
+}
+
+static void runFileLookup(offloadJob_t* job) {
+    fileLookupJob_t* lookup = (fileLookupJob_t*)job;
+    openFileTarget(lookup->root_fd, &lookup->target, LOOKUP_READAHEAD, lookup->entries);
+}
+
+// Back on the worker: the entries join the cache, so the request runs
+// again as a hit, and the connection picks up where it stopped
+static void* completeFileLookup(offloadJob_t* job) {
+    fileLookupJob_t* lookup = (fileLookupJob_t*)job;
+    for (int i = 0;i < FILE_TARGET_LOOKUPS;i++) {
+        if (lookup->entries[i]) {
+            fileCacheInsert(lookup->cache, lookup->entries[i]);
+        }
+    }
+    connection_t* conn = lookup->conn;
+    free(lookup);
+    if (!conn) {
+        return NULL;
+    }
+    conn->lookup = NULL;
+    conn->lookup_done = 1;
+    conn->state = PROCESSING;
+    handleBufferedInput(conn);
+    return conn;
+}
+
+// Static file requests the cache cannot answer without opening or stat'ing
+// go to the offload pool, one cold file must not stall every other client
+static int offloadFileLookup(connection_t* conn) {
+    worker_t* worker = conn->worker;
+    fileTarget_t target;
+    if (!worker->offload || conn->lookup_done ||
+        !fileHandlerTarget(conn->request, &worker->fileCache, &target) ||
+        fileTargetCached(&worker->fileCache, &target)) {
+        return 0;
+    }
+    fileLookupJob_t* lookup = malloc(sizeof(fileLookupJob_t) + target.pathLen);
+    if (!lookup) {
+        // The lookup just blocks the loop instead
+        return 0;
+    }
+    memcpy(lookup->path, target.path, target.pathLen);
+    target.path = lookup->path;
+    lookup->target = target;
+    lookup->conn = conn;
+    lookup->cache = &worker->fileCache;
+    lookup->root_fd = conn->root_fd;
+    lookup->job.run = runFileLookup;
+    lookup->job.complete = completeFileLookup;
+    conn->lookup = lookup;
+    // The request views point into read_buf: stop reading and retire
+    // instead of moving the buffer should bytes still arrive (io_uring)
+    conn->read_paused = 1;
+    conn->read_borrowed = 1;
+    conn->state = AWAITING_IO;
+    worker->metrics->offloadedLookups++;
+    offloadSubmit(worker->offload, &lookup->job);
+    return 1;
 }
 
 void handleRequestProcessing(connection_t* conn) {
-    // decode url
-    parserResult_t processingRes = OK;
-    conn->request.decodedPath.len = 0;
-    conn->request.normalizedPath.len = conn->request.normalizedPathCap;
-    processingRes = decodeUrl(&conn->request.path, &conn->request.decodedPath);
-    if (processingRes != OK) {
-        handleParseError(processingRes, conn);
+    httpInfo_t* request = conn->request;
+    if (request->route->flags & ROUTE_PROXY) {
+        // Answered by the upstream, connectionHandler() relays it
+        proxyForward(conn);
         return;
     }
-
-    // normalize url
-    processingRes = normalizePath(&conn->request.decodedPath, &conn->request.normalizedPath);
-    if (processingRes != OK) {
-        handleParseError(processingRes, conn);
+    if (!conn->body_streamed && !request->isApi && offloadFileLookup(conn)) {
         return;
     }
 
-    // Request processing
-    response_t generatedResponse = requestHandler(&conn->request, conn->root_fd);
+    // Request processing, path was already normalized by handleHeaders()
+    response_t generatedResponse = conn->body_streamed ?
+        finishBodyStream(&conn->body_stream, request) :
+        requestHandler(request, &conn->worker->fileCache);
 
-    createWritableResponse(&generatedResponse, &conn->write_buf, &conn->write_len);
-    if (!conn->request.isApi) {
-        conn->file_fd = generatedResponse.fileDescriptor;
-        conn->file_remaining = generatedResponse.fileSize;
-        conn->file_offset = 0;
+    int firstSegment = conn->output ? conn->output->count : 0;
+    int queued = generatedResponse.cachedResponse ?
+        queueCachedResponse(conn, &generatedResponse) :
+        queueResponse(conn, &generatedResponse, request->isApi);
+    if (queued == -1) {
+        conn->state = CLOSING;
+        return;
     }
     conn->shouldClose = generatedResponse.shouldClose;
+    conn->pipelined++;
+    connectionResponseQueued(conn, generatedResponse.statusCode, firstSegment);
+
+    if (canBatchNext(conn)) {
+        // parse_offset already points at the next request, read_buf is compacted once per batch
+        resetRequestState(conn);
+        return;
+    }
     conn->state = WRITING_RESPONSE;
 }
 
+void handleBufferedInput(connection_t* conn) {
+    // Complete pipelined requests run back to back, their responses leave together
+    do {
+        if (conn->state == READING_HEADERS) {
+            handleHeaders(conn);
+        }
+        if (conn->state == READING_BODY) {
+            handleBody(conn);
+        }
+        if (conn->state == PROCESSING) {
+            handleRequestProcessing(conn);
+        }
+    } while (conn->state == READING_HEADERS && conn->pipelined > 0);
+}
+
+// Runs while the socket is drained: headers are parsed as soon as they are
+// complete, so a streamed body is handed over chunk by chunk instead of
+// piling up in read_buf, and chunked bodies hit --max-body early
+static void consumeWhileReading(connection_t* conn) {
+    if (conn->state == READING_HEADERS) {
+        handleHeaders(conn);
+    }
+    if (conn->state == READING_BODY) {
+        handleBody(conn);
+    }
+}
+
+// Doubles read_buf once it is full, returns -1 when reading must stop.
+// Input piling up behind responses that are not sent yet sets read_paused,
+// so does a request whose larger buffer would go over the memory budget
+// (unless force: bytes already received must be stored somewhere).
+static int growReadBuffer(connection_t* conn, int force) {
+    if (conn->read_len < conn->read_cap) {
+        return 0;
+    }
+    if (conn->state != READING_HEADERS && conn->state != READING_BODY &&
+        conn->read_len - conn->parse_offset >= PIPELINE_READ_MAX) {
+        conn->read_paused = 1;
+    }
+    // Move into the next buffer class, double the size
+    size_t newCap = conn->read_cap * 2;
+
+    if (conn->state == READING_HEADERS && newCap > MAX_HEADER_SIZE) {
+        handleParseError(HEADER_TOO_LARGE, conn);
+        return -1;
+    }
+
+    if (!force && (conn->state == READING_HEADERS || conn->state == READING_BODY) && deferRead(conn, newCap)) {
+        return 0;
+    }
+    return resizeReadBuffer(conn, newCap);
+}
+
+int connectionAppendInput(connection_t* conn, const char* data, size_t len) {
+    while (len > 0) {
+        size_t space = conn->read_cap - conn->read_len;
+        size_t chunk = len < space ? len : space;
+        memcpy(conn->read_buf + conn->read_len, data, chunk);
+        conn->read_len += chunk;
+        data += chunk;
+        len -= chunk;
+        consumeWhileReading(conn);
+        if (growReadBuffer(conn, len > 0) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Plain read(), or the session's record layer for TLS (kTLS receive included)
+static ssize_t receiveInput(connection_t* conn, char* buffer, size_t len) {
+#ifdef HAVE_TLS
+    if (conn->tls) {
+        return tlsRead(conn->tls, buffer, len);
+    }
+#endif
+    return read(conn->fd, buffer, len);
+}
+
 void handleRead(connection_t* conn) {
+    // Edge triggered: keep reading until EAGAIN or we will not be notified again
     while (1) {
         // Read into remaining buffer
-        ssize_t valread = read(conn->fd, conn->read_buf + conn->read_len, conn->read_cap - conn->read_len);
+        ssize_t valread = receiveInput(conn, conn->read_buf + conn->read_len, conn->read_cap - conn->read_len);
         if (valread > 0) {
             conn->read_len += valread;
-            if (conn->read_len == conn->read_cap) {
-                // Reallocate buffer to double the size
-                conn->read_cap *= 2; // Double the capacity
-
-                if (conn->state == READING_HEADERS && conn->read_cap > MAX_HEADER_SIZE) {
-                    handleParseError(MAX_HEADER_SIZE, conn);
-                    break;
-                }
-
-                char* temp = NULL;
-                temp = realloc(conn->read_buf, conn->read_cap);
-                if (!temp) {
-                    conn->state = CLOSING;
-                    break;
-                }
-                conn->read_buf = temp;
+            consumeWhileReading(conn);
+            if (growReadBuffer(conn, 0) == -1 || conn->read_paused) {
+                break;
             }
         }
         else if (valread == 0) {
@@ -202,6 +1020,9 @@ void handleRead(connection_t* conn) {
         else if (errno == EWOULDBLOCK || errno == EAGAIN) {
             break;
         }
+        else if (errno == EINTR) {
+            continue;
+        }
         else {
             conn->state = CLOSING;
             break;
@@ -212,38 +1033,122 @@ void handleRead(connection_t* conn) {
     if (conn->state == CLOSING) {
         return;
     }
-    if (conn->state == READING_HEADERS) {
-        handleHeaders(conn);
+    handleBufferedInput(conn);
+}
+
+// Method, path and status are copied while the request is still around,
+// timing and bytes are filled in once the response is out
+static void stageAccessRecord(connection_t* conn, int index, int statusCode) {
+    worker_t* worker = conn->worker;
+    // A batch is staged from its first response on or not at all
+    if (!conn->log_records && (index > 0 || !(conn->log_records = poolAlloc(&worker->logRecords)))) {
+        worker->metrics->accessLogDropped++;
+        return;
     }
-    if (conn->state == READING_BODY) {
-        handleBody(conn);
+    if (!conn->peer_known) {
+        socklen_t len = sizeof(conn->peer);
+        if (getpeername(conn->fd, (struct sockaddr*)&conn->peer, &len) == -1) {
+            memset(&conn->peer, 0, sizeof(conn->peer));
+        }
+        conn->peer_known = 1;
+    }
+    accessRecord_t* record = &conn->log_records[index];
+    record->peer = conn->peer;
+    record->status = (uint16_t)statusCode;
+    record->bytes = conn->output_bytes - conn->logged_bytes + conn->file_remaining;
+    conn->logged_bytes = conn->output_bytes;
+
+    // Errors raised before the headers were accepted have no request line to trust
+    const httpInfo_t* request = conn->state == READING_HEADERS ? NULL : conn->request;
+    const char* method = request ? request->method.data : "-";
+    size_t methodLen = request ? request->method.len : 1;
+    const char* path = request && request->normalizedPath.len > 0 ? request->normalizedPath.data : "-";
+    size_t pathLen = request && request->normalizedPath.len > 0 ? request->normalizedPath.len : 1;
+    record->methodLen = (uint8_t)(methodLen < ACCESS_LOG_METHOD_MAX ? methodLen : ACCESS_LOG_METHOD_MAX);
+    memcpy(record->method, method, record->methodLen);
+    record->pathCut = pathLen > ACCESS_LOG_PATH_MAX;
+    record->pathLen = (uint8_t)(record->pathCut ? ACCESS_LOG_PATH_MAX : pathLen);
+    memcpy(record->path, path, record->pathLen);
+}
+
+static void publishAccessRecord(connection_t* conn, int index, int64_t now, int last) {
+    worker_t* worker = conn->worker;
+    accessRecord_t* staged = &conn->log_records[index];
+    if (last) {
+        // Produced bodies keep queueing after their head, the rest is theirs too
+        staged->bytes += conn->output_bytes - conn->logged_bytes;
+        conn->logged_bytes = conn->output_bytes;
     }
-    if (conn->state == PROCESSING) {
-        handleRequestProcessing(conn);
+    accessRecord_t* record = accessLogReserve(worker->accessLog, staged->status >= 500, worker->metrics);
+    if (!record) {
+        return;
     }
+    memcpy(record, staged, offsetof(accessRecord_t, path) + staged->pathLen);
+    record->endUs = now;
+    record->durationUs = (uint64_t)(now - conn->timings[index].start);
+    accessLogCommit(worker->accessLog);
 }
 
-void handleSend(connection_t* conn) {
-    while (conn->write_sent < conn->write_len) {
-        ssize_t sent = send(conn->fd, conn->write_buf + conn->write_sent, conn->write_len - conn->write_sent, 0);
-        if (sent < 0) {
-            if (errno == EWOULDBLOCK || errno == EAGAIN) {
-                return;
-            }
-            conn->state = CLOSING;
-            return;
+// Records first byte and total latency of the responses whose bytes are out.
+// The last response of a batch may still have file or produced bytes to go,
+// it is only recorded by finishResponse() (complete).
+static void recordResponseLatency(connection_t* conn, int complete) {
+    workerMetrics_t* metrics = conn->worker->metrics;
+    const outputQueue_t* out = conn->output;
+    int allSent = complete || !connectionOutputPending(conn);
+    int64_t now = 0;
+    while (conn->timing_first < conn->timing_count) {
+        const responseTiming_t* timing = &conn->timings[conn->timing_first];
+        if (!allSent && (out->next < timing->head || (out->next == timing->head && out->sent == 0))) {
+            break;
+        }
+        if (now == 0) {
+            now = monotonicUs();
         }
-        conn->write_sent += sent;
+        histogramRecord(&metrics->firstByte, (uint64_t)(now - timing->start));
+        conn->timing_first++;
     }
-    // Reset for next request
-    conn->write_sent = 0;
-    conn->write_len = 0;
+    int last = complete ? conn->timing_count : conn->timing_count - 1;
+    while (conn->timing_done < last) {
+        const responseTiming_t* timing = &conn->timings[conn->timing_done];
+        if (!allSent && out->next < timing->end) {
+            break;
+        }
+        if (now == 0) {
+            now = monotonicUs();
+        }
+        histogramRecord(&metrics->total, (uint64_t)(now - timing->start));
+        if (conn->log_records) {
+            publishAccessRecord(conn, conn->timing_done, now, complete && conn->timing_done == conn->timing_count - 1);
+        }
+        conn->timing_done++;
+    }
+    if (complete) {
+        poolFree(&conn->worker->logRecords, conn->log_records);
+        conn->log_records = NULL;
+        conn->timing_count = 0;
+        conn->timing_first = 0;
+        conn->timing_done = 0;
+    }
+}
 
-    if (!conn->request.isApi) {
-        conn->state = SENDING_FILE;
+void connectionResponseQueued(connection_t* conn, int statusCode, int firstSegment) {
+    metricsCountResponse(conn->worker->metrics, statusCode);
+    // A request timing out before its first byte has no start to measure from
+    if (conn->request_start == 0 || conn->timing_count == PIPELINE_DEPTH_MAX + 1) {
         return;
     }
+    responseTiming_t* timing = &conn->timings[conn->timing_count++];
+    timing->start = conn->request_start;
+    timing->head = firstSegment;
+    timing->end = conn->output ? conn->output->count : 0;
+    if (conn->worker->accessLog) {
+        stageAccessRecord(conn, conn->timing_count - 1, statusCode);
+    }
+}
 
+void finishResponse(connection_t* conn) {
+    recordResponseLatency(conn, 1);
     // Check if we should close or keep-alive
     if (conn->shouldClose) {
         conn->state = CLOSING;
@@ -252,15 +1157,164 @@ void handleSend(connection_t* conn) {
     }
 }
 
+void finishHeaderSend(connection_t* conn) {
+    recordResponseLatency(conn, 0);
+    // The whole batch is out, write_buf is free again
+    releaseOutput(conn);
+
+    // Produced bodies refill write_buf and stay in WRITING_RESPONSE until the last chunk is out
+    if (conn->producing) {
+        if (appendProducedBody(conn) == -1) {
+            conn->state = CLOSING;
+        }
+        return;
+    }
+
+    // Cached responses and 304s hold a file entry but have no file bytes left
+    if (conn->file_remaining > 0) {
+        conn->state = SENDING_FILE;
+        return;
+    }
+    finishFileSend(conn);
+}
+
+void finishFileSend(connection_t* conn) {
+    releaseFile(conn);
+    finishResponse(conn);
+}
+
+int connectionOutputIov(const connection_t* conn, struct iovec* iov, int max) {
+    const outputQueue_t* out = conn->output;
+    int count = 0;
+    for (int i = out ? out->next : 0;out && i < out->count && count < max;i++) {
+        size_t skip = i == out->next ? out->sent : 0;
+        iov[count].iov_base = (char*)out->segments[i].data + skip;
+        iov[count].iov_len = out->segments[i].len - skip;
+        count++;
+    }
+    return count;
+}
+
+void connectionOutputAdvance(connection_t* conn, size_t sent) {
+    outputQueue_t* out = conn->output;
+    conn->worker->metrics->sendBytes += sent;
+    while (sent > 0 && out->next < out->count) {
+        outputSegment_t* segment = &out->segments[out->next];
+        size_t left = segment->len - out->sent;
+        if (sent < left) {
+            out->sent += sent;
+            break;
+        }
+        // Bodies and cached responses are dropped as soon as they are out
+        sent -= left;
+        releaseSegment(conn, segment);
+        out->next++;
+        out->sent = 0;
+    }
+    recordResponseLatency(conn, 0);
+}
+
+int connectionOutputPending(const connection_t* conn) {
+    return conn->output && conn->output->next < conn->output->count;
+}
+
+int connectionResumeRead(connection_t* conn) {
+    if (!conn->read_paused || conn->read_deferred ||
+        (conn->state != READING_HEADERS && conn->state != READING_BODY)) {
+        return 0;
+    }
+    conn->read_paused = 0;
+    return 1;
+}
+
+size_t connectionDeferredGrowth(const connection_t* conn) {
+    size_t wanted = conn->read_wanted;
+    // Bytes received meanwhile (io_uring) may have grown and filled it
+    // already, a full read_buf still grows: reading into no room looks like EOF
+    if (conn->read_len == conn->read_cap && wanted < conn->read_cap * 2) {
+        wanted = conn->read_cap * 2;
+    }
+    size_t cap = bufferCapacity(wanted);
+    return cap > conn->read_cap ? cap - conn->read_cap : 0;
+}
+
+void connectionResumeDeferred(connection_t* conn) {
+    size_t growth = connectionDeferredGrowth(conn);
+    setDeferred(conn, 0);
+    conn->read_paused = 0;
+    if (growth > 0) {
+        resizeReadBuffer(conn, conn->read_cap + growth);
+    }
+}
+
+int connectionOutputFlags(const connection_t* conn) {
+    return MSG_NOSIGNAL | (conn->file_remaining > 0 ? MSG_MORE : 0);
+}
+
+// With kTLS the kernel encrypts, only userspace TLS needs its own write paths
+static ssize_t sendOutput(connection_t* conn, struct iovec* iov, int count) {
+#ifdef HAVE_TLS
+    if (conn->tls && !conn->tls_kernel_send) {
+        return tlsWritev(conn->tls, iov, count);
+    }
+#endif
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = count };
+    return sendmsg(conn->fd, &msg, connectionOutputFlags(conn));
+}
+
+static ssize_t sendFileBytes(connection_t* conn, off_t* offset, size_t len) {
+#ifdef HAVE_TLS
+    if (conn->tls && !conn->tls_kernel_send) {
+        return tlsSendFile(conn->tls, conn->file_fd, offset, len);
+    }
+#endif
+    return sendfile(conn->fd, conn->file_fd, offset, len);
+}
+
+int connectionFlushOutput(connection_t* conn) {
+    struct iovec iov[OUTPUT_SEGMENTS_MAX];
+    int count;
+    while ((count = connectionOutputIov(conn, iov, OUTPUT_SEGMENTS_MAX)) > 0) {
+        ssize_t sent = sendOutput(conn, iov, count);
+        if (sent < 0) {
+            if (errno == EWOULDBLOCK || errno == EAGAIN) {
+                return 0;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            conn->state = CLOSING;
+            return -1;
+        }
+        connectionOutputAdvance(conn, sent);
+    }
+    releaseOutput(conn);
+    return 1;
+}
+
+void handleSend(connection_t* conn) {
+    if (connectionFlushOutput(conn) == 1) {
+        finishHeaderSend(conn);
+    }
+}
+
 void handleFileSend(connection_t* conn) {
     off_t offset = conn->file_offset;
     size_t remainingFileSize = conn->file_remaining;
     while (remainingFileSize > 0) {
         size_t byteCount = remainingFileSize;
-        ssize_t sent = sendfile(conn->fd, conn->file_fd, &offset, byteCount);
+        ssize_t sent = sendFileBytes(conn, &offset, byteCount);
 
-        if (sent <= 0) {
-            if (errno == EAGAIN || errno == EINTR) {
+        if (sent == 0) {
+            // File shrank under us, no further edge would ever finish it
+            conn->state = CLOSING;
+            return;
+        }
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
                 conn->file_offset = offset;
                 conn->file_remaining = remainingFileSize;
                 return;
@@ -270,17 +1324,34 @@ void handleFileSend(connection_t* conn) {
         }
 
         remainingFileSize -= sent;
+        conn->worker->metrics->sendfileBytes += sent;
     }
-    close(conn->file_fd);
-    conn->file_fd = -1;
+    finishFileSend(conn);
+}
 
-    // Check if we should close or keep-alive
-    if (conn->shouldClose) {
+#ifdef HAVE_TLS
+// Runs the handshake as far as the socket allows, READING_HEADERS once the session is up
+static void handleHandshake(connection_t* conn) {
+    workerMetrics_t* metrics = conn->worker->metrics;
+    tlsResult_t res = tlsHandshake(conn->tls);
+    conn->tls_want_write = res == TLS_WANT_WRITE;
+    if (res == TLS_WANT_READ || res == TLS_WANT_WRITE) {
+        return;
+    }
+    if (res == TLS_FAILED) {
+        metrics->tlsFailed++;
         conn->state = CLOSING;
-    } else {
-        resetConnectionForNextRequest(conn);
+        return;
+    }
+    if (tlsResumed(conn->tls)) metrics->tlsResumed++;
+    else metrics->tlsFull++;
+    // From here on sendmsg() and sendfile() run unchanged, the kernel encrypts without a userspace copy
+    if ((conn->tls_kernel_send = tlsKernelSend(conn->tls))) {
+        metrics->tlsKernelSend++;
     }
+    conn->state = READING_HEADERS;
 }
+#endif
 
 // I will first write about when there is parse error state
 void handleWrite(connection_t* conn) {
@@ -292,34 +1363,130 @@ void handleWrite(connection_t* conn) {
     }
 }
 
+void connectionUpdateTimer(connection_t* conn) {
+    worker_t* worker = conn->worker;
+    if (conn->metrics_state != conn->state) {
+        worker->metrics->connections[conn->metrics_state]--;
+        worker->metrics->connections[conn->state]++;
+        conn->metrics_state = conn->state;
+    }
+    connTimer_t phase = TIMER_NONE;
+    int timeoutMs = 0;
+    switch (conn->state) {
+    case READING_HEADERS:
+        phase = conn->read_len == 0 && conn->served > 0 ? TIMER_IDLE : TIMER_HEADER;
+        timeoutMs = phase == TIMER_IDLE ? worker->keepAliveTimeoutMs : worker->headerTimeoutMs;
+        break;
+    case TLS_HANDSHAKE:
+        // The handshake counts against the first header deadline, a stalled one closes silently
+        phase = TIMER_HEADER;
+        timeoutMs = worker->headerTimeoutMs;
+        break;
+    case READING_BODY:
+        phase = TIMER_BODY;
+        timeoutMs = worker->bodyTimeoutMs;
+        break;
+    case WRITING_RESPONSE:
+    case SENDING_FILE:
+        phase = TIMER_WRITE;
+        timeoutMs = worker->writeTimeoutMs;
+        break;
+    case PROXYING:
+        // A slow client is a send stall like any other, a slow upstream gets its own deadline
+        phase = proxyWaitsForClient(conn) ? TIMER_WRITE : TIMER_UPSTREAM;
+        timeoutMs = phase == TIMER_WRITE ? worker->writeTimeoutMs : worker->proxy->timeoutMs;
+        break;
+    default:
+        break;
+    }
+    setIdle(conn, phase == TIMER_IDLE);
+    if (conn->read_deferred && conn->state != READING_HEADERS && conn->state != READING_BODY) {
+        // Timed out or closing while it waited, nothing is read anymore
+        setDeferred(conn, 0);
+    }
+    if (phase == TIMER_NONE || timeoutMs == 0) {
+        timerCancel(&worker->timers, &conn->timer);
+        conn->timer_phase = phase;
+        return;
+    }
+    // Slowly dripping headers must not extend their deadline
+    if (phase == conn->timer_phase && (phase == TIMER_HEADER || phase == TIMER_IDLE)) {
+        return;
+    }
+    conn->timer_phase = phase;
+    timerSchedule(&worker->timers, &conn->timer, worker->now + timeoutMs);
+}
+
+void connectionTimeout(connection_t* conn) {
+    connTimer_t phase = conn->timer_phase;
+    conn->timer_phase = TIMER_NONE;
+    if ((phase == TIMER_HEADER && conn->read_len > 0) || phase == TIMER_BODY) {
+        // Closes after the 408 like any other parse error
+        handleParseError(REQUEST_TIMEOUT, conn);
+        return;
+    }
+    if (phase == TIMER_UPSTREAM) {
+        proxyTimeout(conn);
+        return;
+    }
+    conn->state = CLOSING;
+}
+
 uint32_t connectionHandler(connection_t* conn, u_int32_t events) {
     uint32_t closingSignal = UINT32_MAX;
     if (events & (EPOLLERR | EPOLLHUP)) {
         return closingSignal;
     }
 
-    if (events & EPOLLIN) {
-        handleRead(conn);
-        if (conn->state == WRITING_RESPONSE || conn->state == SENDING_FILE) {
-            return EPOLLOUT;
+#ifdef HAVE_TLS
+    if (conn->state == TLS_HANDSHAKE) {
+        handleHandshake(conn);
+        if (conn->state == TLS_HANDSHAKE) {
+            return conn->tls_want_write ? EPOLLOUT : EPOLLIN;
         }
         if (conn->state == CLOSING) {
             return closingSignal;
         }
-        return EPOLLIN;
+        // The first request often arrives with the client's Finished, already buffered in the session
+        events |= EPOLLIN;
     }
+#endif
 
-    if (events & EPOLLOUT) {
-        // Reading headers because in request loop I will go back to reading newRequest headers
-        handleWrite(conn);
-        if (conn->state == READING_HEADERS) {
-            return EPOLLIN;
+    if ((events & EPOLLIN) && !conn->read_paused) {
+        handleRead(conn);
+    }
+
+    // Socket is usually writable right after a request is processed, so try
+    // the write now instead of paying an EPOLLOUT round trip through epoll.
+    // After a keep-alive reset, pipelined bytes already sitting in read_buf
+    // are processed here too, because no new edge will report them.
+    // Proxied requests relay from here as well, upstream events arrive with no events set.
+    while (conn->state == WRITING_RESPONSE || conn->state == SENDING_FILE || conn->state == PROXYING) {
+        if (conn->state == PROXYING) {
+            proxyRelay(conn);
+            if (conn->state == PROXYING) {
+                // Upstream socket events drive it on, unless the client has to drain first
+                return proxyWaitsForClient(conn) ? EPOLLOUT : EPOLLIN;
+            }
         }
-        if (conn->state == CLOSING) {
-            return closingSignal;
+        else {
+            handleWrite(conn);
+            if (conn->state == WRITING_RESPONSE || conn->state == SENDING_FILE) {
+                // Kernel send buffer is full, continue on the next EPOLLOUT edge
+                return EPOLLOUT;
+            }
+        }
+        if (conn->state == READING_HEADERS && conn->read_len > 0) {
+            handleBufferedInput(conn);
+        }
+        if (connectionResumeRead(conn)) {
+            // Reading stopped before EAGAIN, no new edge reports what is waiting
+            handleRead(conn);
         }
-        return EPOLLOUT;
     }
 
+    if (conn->state == CLOSING) {
+        return closingSignal;
+    }
     return EPOLLIN;
 }
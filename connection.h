@@ -3,52 +3,330 @@
 
 #include <sys/types.h>
 #include <stdint.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 #include"httpParser.h"
+#include "fileCache.h"
+#include "handlers.h"
+#include "chunked.h"
+#include "timer.h"
+#include "accessLog.h"
+
+#define PIPELINE_DEPTH_MAX 16 // pipelined responses queued before they are flushed together
+#define OUTPUT_SEGMENTS_MAX (PIPELINE_DEPTH_MAX * 2 + 2) // head and body per response, plus an error
+#define PIPELINE_READ_MAX (64 * 1024) // unparsed input held behind unsent responses before reading pauses
+
+struct worker;
+struct ssl_st;
+struct upstreamConn;
 typedef enum {
     READING_HEADERS,
     READING_BODY,
     PROCESSING,
     WRITING_RESPONSE,
     SENDING_FILE,
+    AWAITING_IO, // file lookup runs on the offload pool, reading is paused and read_buf stays put
+    TLS_HANDSHAKE, // accepted on a TLS listener, READING_HEADERS once the session is up
+    PROXYING, // request forwarded to an upstream (proxy.h), reading is paused until its response is relayed
     CLOSING
 }conn_state_t;
 
+/**
+ * Enum for the deadline a connection is waiting on
+ * TIMER_IDLE: keep-alive connection between requests, closed silently
+ * TIMER_HEADER: header block started (or first request), fixed deadline
+ * TIMER_BODY: body stall, pushed back whenever bytes arrive
+ * TIMER_WRITE: send stall, pushed back whenever the response makes progress
+ * TIMER_UPSTREAM: proxied request waiting for its upstream, pushed back on every upstream event
+ */
+typedef enum {
+    TIMER_NONE,
+    TIMER_IDLE,
+    TIMER_HEADER,
+    TIMER_BODY,
+    TIMER_WRITE,
+    TIMER_UPSTREAM
+}connTimer_t;
+
+/**
+ * Read buffer outgrown while queued output borrowed from it
+ */
+typedef struct {
+    char* buf;
+    size_t cap;
+}retiredBuffer_t;
+
+/**
+ * One piece of queued output. Heads point into write_buf, bodies and cached
+ * responses point at their own memory which is dropped once sent, borrowed
+ * bodies (echo) point into read_buf which stays put until the queue is released.
+ */
+typedef struct {
+    const char* data;
+    size_t len;
+    char* owned;             // freed once the segment is sent
+    fileCacheEntry_t* entry; // released once the segment is sent (cached responses)
+}outputSegment_t;
+
+/**
+ * Latency bookkeeping of one queued response
+ * start: monotonicUs() when its request began
+ * head: Output segment its head starts in (or after, when merged into the previous run)
+ * end: Output segments in the queue once it was queued, it is out when next reaches it
+ */
+typedef struct {
+    int64_t start;
+    int head;
+    int end;
+}responseTiming_t;
+
+/**
+ * Responses of one pipelined batch, in order, sent with one sendmsg()
+ */
+typedef struct {
+    outputSegment_t segments[OUTPUT_SEGMENTS_MAX];
+    int count;
+    int next;    // first segment not sent completely
+    size_t sent; // bytes of segments[next] already sent
+    struct iovec iov[OUTPUT_SEGMENTS_MAX]; // io_uring SENDMSG vector, live until the CQE
+}outputQueue_t;
+
 typedef struct connection {
     int fd;
     conn_state_t state;
+    struct worker* worker; // owning worker, its pools back every buffer below
 
-    // persistent read buffer
+    // persistent read buffer, never compacted or freed while queued output may borrow from it
     char* read_buf;
     size_t read_len;
     size_t read_cap;
+    int read_borrowed;   // queued output points into read_buf
+    retiredBuffer_t* read_retired; // outgrown read buffers, released with the output queue
+    int read_retired_count;
+    int read_retired_cap;
 
     size_t parse_offset; // Indicates how much request has been parsed
+    size_t scan_offset; // Header terminator search resumes here, bytes before it hold no "\r\n\r\n"
     size_t header_end; // To keep header end offset
-    size_t body_expected;
-    size_t body_recieved;
+    size_t body_expected; // Content-Length of the current request
+    size_t body_recieved; // body bytes in read_buf (buffered) or consumed (streamed)
+    int body_streamed;    // body goes to body_stream chunk by chunk instead of read_buf
+    bodyStream_t body_stream;
+    int body_chunked;     // Transfer-Encoding: chunked, body_expected is unused
+    chunkDecoder_t body_decoder;
 
-    // persistent write buffer (lazy allocated)
+    // persistent write buffer (lazy allocated on the first response), heads of a batch are packed in it
     char* write_buf;
+    size_t write_cap;
     size_t write_len;
-    size_t write_sent;
+    outputQueue_t* output; // from the worker output pool while responses are queued, NULL when idle
+    int pipelined;         // responses queued in the current batch
+    int read_paused;       // input stopped for backpressure, resumed once a request waits for bytes
+    int read_deferred;     // read_paused because read_buf may not grow over the memory budget
+    size_t read_wanted;    // read_buf size the deferred read waits for
+    struct connection* defer_prev; // worker deferred list links while read_deferred
+    struct connection* defer_next;
+    bodyProducer_t producer; // response body of unknown length, pulled into write_buf
+    int producing;           // producer has more to give (or the last chunk is still due)
+    int produce_chunked;     // frame produced pieces as chunks
 
     // file sending
     int root_fd;   // root directory fd, never overwritten
-    int file_fd;   // per-request opened file fd
+    int file_fd;   // per-request file fd, owned by file_entry
+    fileCacheEntry_t* file_entry; // cache reference held until the file is sent
     off_t file_offset;
     size_t file_remaining;
 
     // connection management
     int shouldClose;  // whether to close after this connection
+    unsigned int served; // responses completed, more than 0 makes an empty read_buf a keep-alive wait
+    timerNode_t timer;   // in worker->timers while a deadline applies
+    connTimer_t timer_phase;
+    struct connection* idle_prev; // worker idle list links while waiting for the next request
+    struct connection* idle_next;
+    int idle_listed;
+    uint32_t interest; // epoll interest currently registered (without EPOLLET)
+
+    // io_uring backend bookkeeping, unused by the epoll loop
+    unsigned int uring_inflight; // submitted operations not yet completed
+    int uring_recv_armed;        // multishot recv is active
+    int uring_send_busy;         // send or splice in flight
+    int uring_closing;           // cancel issued, free once inflight drops to 0
+    int uring_pipe[2];           // splice pipe for file sending, lazily created
+    size_t uring_pipe_pending;   // bytes sitting in the pipe not yet sent
+    int uring_recv_cancel;       // recv cancel issued because reading paused
+    struct msghdr uring_msg;     // IORING_OP_SENDMSG arguments, live until the CQE
+
+    // latency metrics of the responses in the current batch
+    int64_t request_start; // monotonicUs() when the current request was first looked at, 0 before
+    responseTiming_t timings[PIPELINE_DEPTH_MAX + 1]; // plus an error response
+    int timing_count;
+    int timing_first; // timings before it have their first byte recorded
+    int timing_done;  // timings before it are recorded completely
+    conn_state_t metrics_state; // state counted in the worker metrics
+
+    // access log, only touched while worker->accessLog is set
+    struct sockaddr_in peer;   // client address, looked up with the first record
+    int peer_known;
+    uint64_t output_bytes;     // bytes ever queued, file bytes included
+    uint64_t logged_bytes;     // output_bytes already attributed to a record
+    accessRecord_t* log_records; // staged per timing, from worker->logRecords while a batch is out
+
+    // TLS session (NULL for plain connections), see tls.h
+    struct ssl_st* tls;
+    int tls_kernel_send;  // kTLS encrypts socket writes, the plain send paths are used
+    int tls_want_write;   // the handshake waits for the socket to drain
 
-    httpInfo_t request;
+    // offload
+    struct fileLookupJob* lookup; // in flight while AWAITING_IO, the job forgets the connection on close
+    int lookup_done;              // the current request's files were resolved, do not offload again
+
+    // reverse proxy, the upstream connection carrying the current request while PROXYING
+    struct upstreamConn* upstream;
+    char* raw_target;      // request-target as received, the in-place decode overwrites it in read_buf
+    size_t raw_target_len;
+    size_t raw_target_cap; // bufferAcquire() capacity, raw_target is only kept for proxy routes
+
+    httpInfo_t* request; // from the worker request pool while a request is in flight, NULL when idle
 }connection_t;
 
-void initializeConnection(connection_t* conn, int fd, int fileRootFd);
+/**
+ * Sets up a connection taken from worker->connections, read_buf comes from
+ * the worker buffer pool and write_buf stays NULL until a response needs it
+ */
+void initializeConnection(connection_t* conn, int fd, struct worker* worker);
+
+/**
+ * Closes the socket and gives the buffers and the connection back to the worker pools
+ */
 void closeConnection(connection_t* conn);
+
+/**
+ * Acquires the 64kb write buffer from the pool if the connection has none yet
+ * @return 0 on success, -1 when the allocation failed
+ */
+int ensureWriteBuffer(connection_t* conn);
 void resetConnectionForNextRequest(connection_t* conn);
 
 /**
+ * Fills iov with the unsent part of the queued output
+ * @param max Capacity of iov, OUTPUT_SEGMENTS_MAX covers a whole batch
+ * @return Number of iovecs filled, 0 when everything was sent
+ */
+int connectionOutputIov(const connection_t* conn, struct iovec* iov, int max);
+
+/**
+ * Accounts sent bytes against the queue, bodies and cache references of
+ * segments that went out completely are dropped right away
+ */
+void connectionOutputAdvance(connection_t* conn, size_t sent);
+
+/**
+ * @return 1 while queued output is left to send
+ */
+int connectionOutputPending(const connection_t* conn);
+
+/**
+ * Queues len bytes the caller formatted at write_buf + write_len and
+ * advances write_len, runs adjacent to the previous segment are merged
+ * @return 0 on success, -1 when the queue is full
+ */
+int queueWriteBuffer(connection_t* conn, size_t len);
+
+/**
+ * Queues len bytes that stay put until they are sent (proxied body pieces)
+ * @return 0 on success, -1 when the queue is full
+ */
+int connectionQueueBytes(connection_t* conn, const char* data, size_t len);
+
+/**
+ * Sends queued output until the socket is full. Once everything is out
+ * the queue is released and write_buf is free again.
+ * @return 1 when everything was sent, 0 when the socket is full, -1 after an error (CLOSING)
+ */
+int connectionFlushOutput(connection_t* conn);
+
+/**
+ * Counts a response that was just queued in the worker metrics and
+ * starts its latency tracking
+ * @param firstSegment conn->output->count before the head was queued, 0 without a queue
+ */
+void connectionResponseQueued(connection_t* conn, int statusCode, int firstSegment);
+
+/**
+ * Clears read_paused once the connection waits for request bytes again
+ * @return 1 when reading was paused and may resume now
+ */
+int connectionResumeRead(connection_t* conn);
+
+/**
+ * @return Bytes read_buf of a deferred connection grows by once it resumes
+ */
+size_t connectionDeferredGrowth(const connection_t* conn);
+
+/**
+ * Ends a deferral the budget has room for now: read_buf grows (when full)
+ * and read_paused is cleared. The caller drives the connection afterwards
+ * (epoll: as an EPOLLIN event), it is CLOSING when growing failed.
+ */
+void connectionResumeDeferred(connection_t* conn);
+
+/**
+ * Send flags for the head/body: MSG_MORE while file bytes follow, so the
+ * headers and the first sendfile()/splice chunk leave in the same segment
+ */
+int connectionOutputFlags(const connection_t* conn);
+
+/**
+ * Copies received bytes into read_buf, growing it like handleRead() does.
+ * Used by completion based backends that receive into their own buffers.
+ * @return 0 on success, -1 when the connection state was changed to stop reading
+ */
+int connectionAppendInput(connection_t* conn, const char* data, size_t len);
+
+/**
+ * Runs header, body and processing states over the bytes already in read_buf.
+ * Pipelined requests already complete in read_buf are processed in the same
+ * call, up to PIPELINE_DEPTH_MAX responses are queued before they are sent.
+ */
+void handleBufferedInput(connection_t* conn);
+
+/**
+ * Transitions after the queued output has been fully sent: SENDING_FILE for
+ * static files, otherwise keep-alive reset or CLOSING
+ */
+void finishHeaderSend(connection_t* conn);
+
+/**
+ * Closes the per-request file and resets or closes the connection
+ */
+void finishFileSend(connection_t* conn);
+
+/**
+ * Keep-alive reset or CLOSING depending on shouldClose
+ */
+void finishResponse(connection_t* conn);
+
+/**
+ * Re-arms the deadline for the current state, called after every event,
+ * and moves the connection to its state in the worker metrics.
+ * A header block gets one deadline from its start, body reads and sends
+ * are pushed back on every event (no list work, see timerSchedule()).
+ * Keep-alive waits also put the connection on the worker idle list.
+ */
+void connectionUpdateTimer(connection_t* conn);
+
+/**
+ * Deadline passed: a started request gets 408 Request Timeout and the
+ * connection closes after it, idle and stalled connections go CLOSING
+ */
+void connectionTimeout(connection_t* conn);
+
+/**
+ * Drives the state machine for an edge-triggered event. Reads and writes are
+ * drained until EAGAIN, so the caller only has to re-register when the
+ * returned mask differs from conn->interest.
  * @returns -1 for close, EPOLLOUT for write and EPOLLIN for read.
  * It can also return bitwise values
  */
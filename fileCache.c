@@ -0,0 +1,348 @@
+#define _GNU_SOURCE
+#include "fileCache.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <stdio.h>
+
+int64_t monotonicMs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// FNV-1a, paths are short so this is cheaper than anything fancier
+static uint64_t hashPath(const char* path, size_t len) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (size_t i = 0;i < len;i++) {
+        hash ^= (unsigned char)path[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+int initializeFileCache(fileCache_t* cache, int root_fd, size_t capacity, int ttlSeconds) {
+    memset(cache, 0, sizeof(*cache));
+    cache->root_fd = root_fd;
+    cache->capacity = capacity;
+    cache->ttlMs = (int64_t)ttlSeconds * 1000;
+
+    // Power of two buckets, about two per entry
+    cache->bucketCount = 16;
+    while (cache->bucketCount < capacity * 2) {
+        cache->bucketCount *= 2;
+    }
+    cache->buckets = calloc(cache->bucketCount, sizeof(fileCacheEntry_t*));
+    return cache->buckets ? 0 : -1;
+}
+
+static void lruUnlink(fileCache_t* cache, fileCacheEntry_t* entry) {
+    if (entry->lruPrev) entry->lruPrev->lruNext = entry->lruNext;
+    else cache->lruHead = entry->lruNext;
+    if (entry->lruNext) entry->lruNext->lruPrev = entry->lruPrev;
+    else cache->lruTail = entry->lruPrev;
+    entry->lruPrev = NULL;
+    entry->lruNext = NULL;
+}
+
+static void lruPushFront(fileCache_t* cache, fileCacheEntry_t* entry) {
+    entry->lruPrev = NULL;
+    entry->lruNext = cache->lruHead;
+    if (cache->lruHead) cache->lruHead->lruPrev = entry;
+    cache->lruHead = entry;
+    if (!cache->lruTail) cache->lruTail = entry;
+}
+
+static void responseUnlink(fileCache_t* cache, fileCacheEntry_t* entry) {
+    if (entry->responsePrev) entry->responsePrev->responseNext = entry->responseNext;
+    else cache->responseHead = entry->responseNext;
+    if (entry->responseNext) entry->responseNext->responsePrev = entry->responsePrev;
+    else cache->responseTail = entry->responsePrev;
+    entry->responsePrev = NULL;
+    entry->responseNext = NULL;
+}
+
+static void responsePushFront(fileCache_t* cache, fileCacheEntry_t* entry) {
+    entry->responsePrev = NULL;
+    entry->responseNext = cache->responseHead;
+    if (cache->responseHead) cache->responseHead->responsePrev = entry;
+    cache->responseHead = entry;
+    if (!cache->responseTail) cache->responseTail = entry;
+}
+
+static void freeEntry(fileCacheEntry_t* entry) {
+    if (entry->fd != -1) {
+        close(entry->fd);
+    }
+    free(entry->response);
+    free(entry->path);
+    free(entry);
+}
+
+// Takes the entry out of the table, it is freed as soon as nobody sends from it
+static void removeEntry(fileCache_t* cache, fileCacheEntry_t* entry) {
+    fileCacheEntry_t** link = &cache->buckets[entry->hash & (cache->bucketCount - 1)];
+    while (*link && *link != entry) {
+        link = &(*link)->hashNext;
+    }
+    if (*link) {
+        *link = entry->hashNext;
+    }
+    lruUnlink(cache, entry);
+    cache->count--;
+    if (entry->response) {
+        // Buffer lives on with the entry while a connection still sends it
+        responseUnlink(cache, entry);
+        cache->responseBytes -= entry->responseLen;
+    }
+
+    entry->stale = 1;
+    if (entry->refs == 0) {
+        freeEntry(entry);
+    }
+}
+
+static int sameFile(const fileCacheEntry_t* entry, const struct stat* st) {
+    return entry->inode == st->st_ino && entry->device == st->st_dev &&
+        entry->size == st->st_size &&
+        entry->mtime.tv_sec == st->st_mtim.tv_sec &&
+        entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+void fileValidators(const struct stat* st, char etag[FILE_ETAG_MAX], char lastModified[FILE_LAST_MODIFIED_MAX]) {
+    uint64_t mtimeNs = (uint64_t)st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+    snprintf(etag, FILE_ETAG_MAX, "\"%llx-%llx-%llx\"",
+        (unsigned long long)st->st_ino, (unsigned long long)st->st_size, (unsigned long long)mtimeNs);
+    struct tm tm;
+    gmtime_r(&st->st_mtim.tv_sec, &tm);
+    strftime(lastModified, FILE_LAST_MODIFIED_MAX, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+// A missing path yields a negative entry (fd -1) when allowNegative is set.
+// Touches no cache state, offload threads call it through fileCacheOpen().
+static fileCacheEntry_t* openEntry(int root_fd, const char* path, size_t len, uint64_t hash, int allowNegative) {
+    fileCacheEntry_t* entry = calloc(1, sizeof(fileCacheEntry_t));
+    if (!entry) {
+        return NULL;
+    }
+    entry->path = malloc(len + 1);
+    if (!entry->path) {
+        free(entry);
+        errno = ENOMEM;
+        return NULL;
+    }
+    memcpy(entry->path, path, len);
+    entry->path[len] = '\0';
+    entry->pathLen = len;
+    entry->hash = hash;
+
+    if ((entry->fd = openat(root_fd, entry->path, O_RDONLY | O_CLOEXEC)) == -1) {
+        int err = errno;
+        if (allowNegative && err == ENOENT) {
+            entry->validatedAt = monotonicMs();
+            return entry;
+        }
+        free(entry->path);
+        free(entry);
+        errno = err;
+        return NULL;
+    }
+
+    struct stat st;
+    int statFailed = fstat(entry->fd, &st) == -1;
+    if (statFailed || !S_ISREG(st.st_mode)) {
+        int err = statFailed ? errno : EISDIR;
+        freeEntry(entry);
+        errno = err;
+        return NULL;
+    }
+    entry->size = st.st_size;
+    entry->mtime = st.st_mtim;
+    entry->inode = st.st_ino;
+    entry->device = st.st_dev;
+    entry->validatedAt = monotonicMs();
+
+    // Validators change whenever revalidation would replace the entry
+    fileValidators(&st, entry->etag, entry->lastModified);
+    return entry;
+}
+
+static fileCacheEntry_t* findEntry(fileCache_t* cache, const char* path, size_t len, uint64_t hash) {
+    fileCacheEntry_t* entry = cache->buckets[hash & (cache->bucketCount - 1)];
+    while (entry) {
+        if (entry->hash == hash && entry->pathLen == len && memcmp(entry->path, path, len) == 0) {
+            return entry;
+        }
+        entry = entry->hashNext;
+    }
+    return NULL;
+}
+
+static void insertEntry(fileCache_t* cache, fileCacheEntry_t* entry) {
+    if (cache->count >= cache->capacity && cache->lruTail) {
+        cache->evictions++;
+        removeEntry(cache, cache->lruTail);
+    }
+    size_t bucket = entry->hash & (cache->bucketCount - 1);
+    entry->hashNext = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    lruPushFront(cache, entry);
+    cache->count++;
+}
+
+fileCacheEntry_t* fileCacheOpen(int root_fd, const char* path, size_t len) {
+    return openEntry(root_fd, path, len, hashPath(path, len), 1);
+}
+
+const fileCacheEntry_t* fileCachePeek(fileCache_t* cache, const char* path, size_t len) {
+    const fileCacheEntry_t* entry = findEntry(cache, path, len, hashPath(path, len));
+    return entry && monotonicMs() - entry->validatedAt <= cache->ttlMs ? entry : NULL;
+}
+
+void fileCacheInsert(fileCache_t* cache, fileCacheEntry_t* entry) {
+    fileCacheEntry_t* existing = findEntry(cache, entry->path, entry->pathLen, entry->hash);
+    if (existing) {
+        // Revalidated: the table keeps its entry (and its prebuilt response) when the file is unchanged
+        cache->revalidations++;
+        int same = existing->fd == -1 ? entry->fd == -1 :
+            entry->fd != -1 && existing->inode == entry->inode && existing->device == entry->device &&
+            existing->size == entry->size && existing->mtime.tv_sec == entry->mtime.tv_sec &&
+            existing->mtime.tv_nsec == entry->mtime.tv_nsec;
+        if (same) {
+            existing->validatedAt = entry->validatedAt;
+            freeEntry(entry);
+            return;
+        }
+        removeEntry(cache, existing);
+    }
+    else {
+        cache->misses++;
+    }
+    insertEntry(cache, entry);
+}
+
+fileCacheEntry_t* fileCacheAcquire(fileCache_t* cache, const char* path, size_t len) {
+    uint64_t hash = hashPath(path, len);
+
+    if (cache->capacity == 0) {
+        // Caching disabled: private entry, closed on release
+        fileCacheEntry_t* entry = openEntry(cache->root_fd, path, len, hash, 0);
+        if (entry) {
+            entry->stale = 1;
+            entry->refs = 1;
+        }
+        return entry;
+    }
+
+    fileCacheEntry_t* entry = findEntry(cache, path, len, hash);
+    if (entry) {
+        int64_t now = monotonicMs();
+        int valid = now - entry->validatedAt <= cache->ttlMs;
+        if (!valid) {
+            // TTL expired: one fstatat() tells whether the open fd is still the file at path
+            struct stat st;
+            int statRes = fstatat(cache->root_fd, entry->path, &st, 0);
+            cache->revalidations++;
+            valid = entry->fd == -1 ? statRes == -1 && errno == ENOENT : statRes == 0 && sameFile(entry, &st);
+            if (valid) {
+                entry->validatedAt = now;
+            }
+        }
+        if (valid) {
+            cache->hits++;
+            lruUnlink(cache, entry);
+            lruPushFront(cache, entry);
+            if (entry->fd == -1) {
+                errno = ENOENT;
+                return NULL;
+            }
+            entry->refs++;
+            return entry;
+        }
+        removeEntry(cache, entry);
+    }
+
+    cache->misses++;
+    entry = openEntry(cache->root_fd, path, len, hash, 1);
+    if (!entry) {
+        return NULL;
+    }
+
+    insertEntry(cache, entry);
+    if (entry->fd == -1) {
+        errno = ENOENT;
+        return NULL;
+    }
+    entry->refs = 1;
+    return entry;
+}
+
+void fileCacheSetResponseLimits(fileCache_t* cache, size_t smallFileMax, size_t limit) {
+    cache->smallFileMax = smallFileMax;
+    cache->responseLimit = limit;
+}
+
+const char* fileCacheResponse(fileCache_t* cache, fileCacheEntry_t* entry, size_t* len) {
+    if (!entry->response) {
+        return NULL;
+    }
+    if (!entry->stale) {
+        responseUnlink(cache, entry);
+        responsePushFront(cache, entry);
+    }
+    cache->responseHits++;
+    *len = entry->responseLen;
+    return entry->response;
+}
+
+int fileCacheStoreResponse(fileCache_t* cache, fileCacheEntry_t* entry, char* response, size_t len) {
+    if (entry->stale || entry->response || len > cache->responseLimit) {
+        return -1;
+    }
+
+    // Referenced entries may be mid-send from their buffer, skip those
+    fileCacheEntry_t* victim = cache->responseTail;
+    while (victim && cache->responseBytes + len > cache->responseLimit) {
+        fileCacheEntry_t* prev = victim->responsePrev;
+        if (victim->refs == 0) {
+            responseUnlink(cache, victim);
+            cache->responseBytes -= victim->responseLen;
+            cache->responseEvictions++;
+            free(victim->response);
+            victim->response = NULL;
+            victim->responseLen = 0;
+        }
+        victim = prev;
+    }
+    if (cache->responseBytes + len > cache->responseLimit) {
+        return -1;
+    }
+
+    entry->response = response;
+    entry->responseLen = len;
+    cache->responseBytes += len;
+    responsePushFront(cache, entry);
+    return 0;
+}
+
+void fileCacheRelease(fileCache_t* cache, fileCacheEntry_t* entry) {
+    (void)cache;
+    if (!entry) {
+        return;
+    }
+    entry->refs--;
+    if (entry->stale && entry->refs == 0) {
+        freeEntry(entry);
+    }
+}
+
+void destroyFileCache(fileCache_t* cache) {
+    while (cache->lruHead) {
+        removeEntry(cache, cache->lruHead);
+    }
+    free(cache->buckets);
+    cache->buckets = NULL;
+}
@@ -0,0 +1,165 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define FILE_ETAG_MAX 52          // "inode-size-mtime", three 64 bit hex numbers quoted
+#define FILE_LAST_MODIFIED_MAX 32 // IMF-fixdate
+
+/**
+ * Structure representing one open static file
+ * path: Relative path under the document root (key, NUL terminated)
+ * fd: Open O_RDONLY descriptor, shared by every connection sending this file,
+ * -1 for a negative entry (path known to be missing)
+ * size/mtime/inode/device: fstat() result, used to revalidate the entry
+ * contentType: Resolved MIME type (static string)
+ * contentEncoding: "br"/"gzip" for a precompressed sidecar, NULL otherwise
+ * etag: Strong validator "inode-size-mtime" (hex, quoted), built on open
+ * lastModified: mtime as an IMF-fixdate, built on open
+ * validatedAt: Monotonic ms of the last open/revalidation
+ * refs: Connections currently using fd
+ * stale: Entry left the table, fd is closed once refs drops to 0
+ * response: Serialized keep-alive response (status line, headers, body) for
+ * small files, NULL until built. Owned by the entry, freed with it.
+ */
+typedef struct fileCacheEntry {
+    char* path;
+    size_t pathLen;
+    uint64_t hash;
+    int fd;
+    off_t size;
+    struct timespec mtime;
+    ino_t inode;
+    dev_t device;
+    const char* contentType;
+    const char* contentEncoding;
+    char etag[FILE_ETAG_MAX];
+    char lastModified[FILE_LAST_MODIFIED_MAX];
+    int64_t validatedAt;
+    unsigned int refs;
+    int stale;
+    struct fileCacheEntry* hashNext;
+    struct fileCacheEntry* lruPrev;
+    struct fileCacheEntry* lruNext;
+    char* response;
+    size_t responseLen;
+    struct fileCacheEntry* responsePrev;
+    struct fileCacheEntry* responseNext;
+}fileCacheEntry_t;
+
+/**
+ * Structure holding the per-worker open file cache
+ * Bounded hash table with LRU eviction, entries within ttlMs of their last
+ * validation are served without any filesystem syscall.
+ * Entries with a serialized response sit on a second LRU list whose total
+ * size is kept under responseLimit.
+ */
+typedef struct {
+    int root_fd;
+    fileCacheEntry_t** buckets;
+    size_t bucketCount;
+    fileCacheEntry_t* lruHead; // most recently used
+    fileCacheEntry_t* lruTail;
+    size_t count;
+    size_t capacity; // 0 disables caching, every lookup opens a private entry
+    int64_t ttlMs;
+    size_t hits;
+    size_t misses;
+    size_t revalidations;
+    size_t evictions;
+    fileCacheEntry_t* responseHead; // most recently used
+    fileCacheEntry_t* responseTail;
+    size_t responseBytes;
+    size_t responseLimit; // 0 disables response caching
+    size_t smallFileMax;  // largest file whose response is cached
+    int precompressed;    // serve path.br / path.gz sidecars to clients that accept them
+    size_t responseHits;
+    size_t responseEvictions;
+}fileCache_t;
+
+/**
+ * @return 0 on success, -1 when the table cannot be allocated
+ */
+int initializeFileCache(fileCache_t* cache, int root_fd, size_t capacity, int ttlSeconds);
+
+/**
+ * Finds or opens a regular file under the document root
+ * @param path Relative path (no leading '/'), does not need a NUL terminator
+ * @param len Length of path
+ * @return Entry with a reference taken, or NULL with errno set
+ * (ENOENT/ENOTDIR missing, EACCES denied, EISDIR not a regular file).
+ * Missing paths are remembered for the TTL too, so probing for optional
+ * files (precompressed sidecars) costs no syscall on repeat.
+ */
+fileCacheEntry_t* fileCacheAcquire(fileCache_t* cache, const char* path, size_t len);
+
+/**
+ * Opens a file like a cache miss does, without touching any cache: safe on
+ * any thread, the result goes back to the owning worker via fileCacheInsert()
+ * @return Unreferenced entry, a negative one (fd -1) for a missing path,
+ * or NULL with errno set (EACCES, EISDIR, ENOMEM)
+ */
+fileCacheEntry_t* fileCacheOpen(int root_fd, const char* path, size_t len);
+
+/**
+ * Looks path up without opening, stat'ing or taking a reference
+ * @return Entry fileCacheAcquire() would answer from without a syscall
+ * (within its TTL, fd -1 for a known missing path), NULL otherwise
+ */
+const fileCacheEntry_t* fileCachePeek(fileCache_t* cache, const char* path, size_t len);
+
+/**
+ * Adds an entry from fileCacheOpen(). An entry already in the table for the
+ * same unchanged file only gets its validation time refreshed, and the new
+ * entry is freed.
+ */
+void fileCacheInsert(fileCache_t* cache, fileCacheEntry_t* entry);
+
+/**
+ * Configures the small file response cache (disabled after initializeFileCache())
+ * @param smallFileMax Files up to this size get a serialized response
+ * @param limit Total bytes of serialized responses kept by this cache
+ */
+void fileCacheSetResponseLimits(fileCache_t* cache, size_t smallFileMax, size_t limit);
+
+/**
+ * Returns the serialized response of entry and marks it recently used
+ * @param len Set to the response length
+ * @return Response, or NULL when entry has none
+ */
+const char* fileCacheResponse(fileCache_t* cache, fileCacheEntry_t* entry, size_t* len);
+
+/**
+ * Hands a serialized response over to entry. Least recently used responses of
+ * unreferenced entries are dropped to stay under the memory limit.
+ * @return 0 when stored (entry owns response), -1 when it does not fit
+ * or caching is disabled (caller still owns response)
+ */
+int fileCacheStoreResponse(fileCache_t* cache, fileCacheEntry_t* entry, char* response, size_t len);
+
+/**
+ * Drops a reference taken by fileCacheAcquire()
+ */
+void fileCacheRelease(fileCache_t* cache, fileCacheEntry_t* entry);
+
+void destroyFileCache(fileCache_t* cache);
+
+struct stat;
+
+/**
+ * Formats the validators of a file from its fstat() result, the same ones
+ * whether the file is served from the document root or from a pack
+ * @param etag Strong validator "inode-size-mtime" (hex, quoted)
+ * @param lastModified mtime as an IMF-fixdate
+ */
+void fileValidators(const struct stat* st, char etag[FILE_ETAG_MAX], char lastModified[FILE_LAST_MODIFIED_MAX]);
+
+/**
+ * Monotonic clock in milliseconds (coarse, no syscall through the vDSO)
+ */
+int64_t monotonicMs(void);
+
+#endif
@@ -1,268 +1,984 @@
+#define _GNU_SOURCE
 #include "handlers.h"
+#include "router.h"
+#include "metrics.h"
+#include "pack.h"
+#include "proxy.h"
 #include <string.h>
 #include <stdlib.h>
 #include <sys/socket.h>
 #include <unistd.h>
-#include <fcntl.h>
-#include <sys/stat.h>
 #include <sys/sendfile.h>
 #include <stdio.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <strings.h>
 
-#define RESPONSE_BUFFER_SIZE 65536
 
 // Initialize a response structure with default values
-response_t initializeResponse() {
+response_t initializeResponse(void) {
     response_t response = {
         .bodyLen = 0,
         .body = NULL,
+        .bodyOwned = 0,
+        .headerCnt = 0,
         .shouldClose = 0,
         .fileSize = 0,
         .fileDescriptor = -1,
+        .fileEntry = NULL,
+        .cachedResponse = NULL,
+        .cachedResponseLen = 0,
+        .contentEncoding = NULL,
+        .vary = 0,
+        .etag = NULL,
+        .lastModified = NULL,
+        .fileOffset = 0,
+        .rangeTotal = 0,
+        .acceptRanges = 0,
         .contentType = "text/plain"
     };
     return response;
 }
 
-void getFileType(char* relativePath, response_t* response) {
+// Extension to MIME type, compared case-insensitively after a length check
+static const struct {
+    const char* ext;
+    size_t len;
+    const char* type;
+} mimeTypes[] = {
+    {"html", 4, "text/html"},
+    {"htm", 3, "text/html"},
+    {"css", 3, "text/css"},
+    {"js", 2, "application/javascript"},
+    {"mjs", 3, "application/javascript"},
+    {"json", 4, "application/json"},
+    {"txt", 3, "text/plain"},
+    {"xml", 3, "application/xml"},
+    {"svg", 3, "image/svg+xml"},
+    {"png", 3, "image/png"},
+    {"jpg", 3, "image/jpeg"},
+    {"jpeg", 4, "image/jpeg"},
+    {"gif", 3, "image/gif"},
+    {"webp", 4, "image/webp"},
+    {"avif", 4, "image/avif"},
+    {"ico", 3, "image/x-icon"},
+    {"woff", 4, "font/woff"},
+    {"woff2", 5, "font/woff2"},
+    {"wasm", 4, "application/wasm"},
+    {"pdf", 3, "application/pdf"},
+    {"mp4", 3, "video/mp4"},
+    {"webm", 4, "video/webm"}
+};
+
+const char* getFileType(const char* relativePath, size_t len) {
     // Find the last dot in the string
-    char* dot = strrchr(relativePath, '.');
+    const char* dot = memrchr(relativePath, '.', len);
 
     // If no dot is found or it's the last character
-    if (!dot || dot == relativePath + strlen(relativePath) - 1) {
-        response->contentType = "application/octet-stream"; // Default
-        return;
+    if (!dot || dot == relativePath + len - 1) {
+        return "application/octet-stream"; // Default
     }
 
-    char* ext = dot + 1; // Move past the '.'
-
-    // Compare and assign
-    if (strcmp(ext, "html") == 0) response->contentType = "text/html";
-    else if (strcmp(ext, "css") == 0) response->contentType = "text/css";
-    else if (strcmp(ext, "js") == 0)  response->contentType = "application/javascript";
-    else if (strcmp(ext, "png") == 0) response->contentType = "image/png";
-    else response->contentType = "text/plain";
+    const char* ext = dot + 1; // Move past the '.'
+    size_t extLen = relativePath + len - ext;
+    for (size_t i = 0;i < sizeof(mimeTypes) / sizeof(mimeTypes[0]);i++) {
+        if (mimeTypes[i].len == extLen && strncasecmp(ext, mimeTypes[i].ext, extLen) == 0) {
+            return mimeTypes[i].type;
+        }
+    }
+    return "text/plain";
 }
 
 void setInternalServerError(response_t* response) {
+    if (response->bodyOwned) {
+        free((char*)response->body);
+    }
     response->statusCode = 500;
     response->statusText = "Internal Server Error";
+    response->body = NULL;
     response->bodyLen = 0;
+    response->bodyOwned = 0;
+}
+
+// Constant bodies and views into the request are borrowed, the connection never frees them.
+// read_buf is not moved or compacted while the response is queued, see retireReadBuffer().
+static void setBorrowedBody(response_t* response, const char* text, size_t len) {
+    response->body = text;
+    response->bodyLen = len;
+    response->bodyOwned = 0;
 }
 
 void setNotFoundError(response_t* response) {
     response->statusCode = 404;
     response->statusText = "Not Found";
-    response->bodyLen = 15;
-    response->body = malloc(response->bodyLen);
-    if (!response->body) {
+    setBorrowedBody(response, "Route Not Found", 15);
+}
+
+void setForbiddenFileRoute(response_t* response) {
+    response->statusCode = 403;
+    response->statusText = "Forbidden";
+    setBorrowedBody(response, "Forbidden file route", 20);
+}
+
+// Copies data into a body the response owns, for bytes that do not outlive the handler
+static void setCopiedBody(response_t* response, const char* data, size_t len) {
+    char* body = malloc(len > 0 ? len : 1);
+    if (!body) {
         perror("Malloc failed");
         setInternalServerError(response);
         return;
     }
-    memcpy(response->body, "Route Not Found", response->bodyLen);
+    memcpy(body, data, len);
+    response->body = body;
+    response->bodyLen = len;
+    response->bodyOwned = 1;
 }
 
-void setForbiddenFileRoute(response_t* response) {
-    response->statusCode = 403;
-    response->statusText = "Forbidden";
-    response->bodyLen = 20;
-    response->body = malloc(response->bodyLen);
-    if (!response->body) {
+// RFC 9110 tchar, header names are limited to these
+static int isHeaderToken(const char* key) {
+    if (!*key) {
+        return 0;
+    }
+    for (const char* c = key;*c;c++) {
+        if (!((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9') ||
+            strchr("!#$%&'*+-.^_`|~", *c))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int addResponseHeader(response_t* response, const char* key, const char* value) {
+    // A CR or LF in the value would let it inject headers of its own
+    if (response->headerCnt == RESPONSE_HEADERS_MAX || !isHeaderToken(key) || strpbrk(value, "\r\n")) {
+        return -1;
+    }
+    response->headers[response->headerCnt].key = key;
+    response->headers[response->headerCnt].value = value;
+    response->headerCnt++;
+    return 0;
+}
+
+// GET /api/stream: numbered lines of a length the handler does not compute up front
+#define STREAM_LINES 1000
+
+static ssize_t streamLines(bodyProducer_t* producer, char* buffer, size_t cap) {
+    size_t len = 0;
+    // Whole lines only, at most 32 bytes each
+    while (producer->state < STREAM_LINES && cap - len >= 32) {
+        producer->state++;
+        len += snprintf(buffer + len, cap - len, "line %llu\n", (unsigned long long)producer->state);
+    }
+    return len;
+}
+
+// Every API route answers text/plain for now
+static void setTextStatus(response_t* response, int statusCode, char* statusText) {
+    response->contentType = "text/plain";
+    response->statusCode = statusCode;
+    response->statusText = statusText;
+}
+
+// GET /api
+static void apiRoot(response_t* response, httpInfo_t* httpInfo, fileCache_t* fileCache) {
+    (void)httpInfo;
+    (void)fileCache;
+    setTextStatus(response, 200, "OK");
+    setBorrowedBody(response, "Hello", 5);
+}
+
+// POST /api/echo: echoes back the request body, sent straight from read_buf
+static void apiEcho(response_t* response, httpInfo_t* httpInfo, fileCache_t* fileCache) {
+    (void)fileCache;
+    setTextStatus(response, 200, "OK");
+    setBorrowedBody(response, httpInfo->body.data, httpInfo->body.len);
+}
+
+// GET /api/stream: chunked response of unknown length
+static void apiStream(response_t* response, httpInfo_t* httpInfo, fileCache_t* fileCache) {
+    (void)fileCache;
+    response->contentType = "text/plain";
+    response->statusCode = 200;
+    response->statusText = "OK";
+    response->producer.produce = streamLines;
+    response->producer.state = 0;
+    // Generated on every request, nothing worth caching
+    addResponseHeader(response, "Cache-Control", "no-store");
+    // version is "HTTP/1.x"
+    response->chunked = httpInfo->version.data[7] == '1';
+    if (!response->chunked) {
+        response->shouldClose = 1;
+    }
+}
+
+// GET /api/metrics: counters and latency summaries of every worker, Prometheus text format
+static void apiMetrics(response_t* response, httpInfo_t* httpInfo, fileCache_t* fileCache) {
+    (void)httpInfo;
+    (void)fileCache;
+    size_t len;
+    char* text = renderMetrics(&len);
+    if (!text) {
         perror("Malloc failed");
         setInternalServerError(response);
         return;
     }
-    memcpy(response->body, "Forbidden file route", response->bodyLen);
+    setTextStatus(response, 200, "OK");
+    response->contentType = "text/plain; version=0.0.4";
+    response->body = text;
+    response->bodyLen = len;
+    response->bodyOwned = 1;
+    addResponseHeader(response, "Cache-Control", "no-store");
 }
 
-void apiHandler(response_t* response, httpInfo_t* httpInfo, apiRoutes_t route) {
-    // For now stick to text/plain
+static void routeNotFound(response_t* response, httpInfo_t* httpInfo, fileCache_t* fileCache) {
+    (void)httpInfo;
+    (void)fileCache;
     response->contentType = "text/plain";
-    switch (route) {
-    case ROUTE_ROOT:
-        response->statusCode = 200;
-        response->statusText = "OK";
-        response->bodyLen = 5;
-        response->body = malloc(response->bodyLen);
-        if (!response->body) {
-            perror("Malloc failed");
-            setInternalServerError(response);
-            return;
+    setNotFoundError(response);
+}
+
+static void methodNotAllowed(response_t* response, httpInfo_t* httpInfo, fileCache_t* fileCache) {
+    (void)httpInfo;
+    (void)fileCache;
+    setTextStatus(response, 405, "Method Not Allowed");
+    setBorrowedBody(response, "This request method is currently unsupported", 44);
+}
+
+// Head under construction, len keeps counting past cap so the caller sees it did not fit
+typedef struct {
+    char* data;
+    size_t cap;
+    size_t len;
+}headBuilder_t;
+
+static void appendBytes(headBuilder_t* head, const char* bytes, size_t len) {
+    if (head->len + len <= head->cap) {
+        memcpy(head->data + head->len, bytes, len);
+    }
+    head->len += len;
+}
+
+#define appendLiteral(head, literal) appendBytes(head, literal, sizeof(literal) - 1)
+
+static void appendString(headBuilder_t* head, const char* string) {
+    appendBytes(head, string, strlen(string));
+}
+
+static void appendDecimal(headBuilder_t* head, unsigned long long value) {
+    char digits[20];
+    size_t len = 0;
+    do {
+        digits[sizeof(digits) - ++len] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    appendBytes(head, digits + sizeof(digits) - len, len);
+}
+
+#define STATUS_LINE(code, text) { code, text, "HTTP/1.1 " #code " " text "\r\n", sizeof("HTTP/1.1 " #code " " text "\r\n") - 1 }
+
+// Every status the server sends with its standard reason phrase, other phrases are assembled
+static const struct {
+    int code;
+    const char* text;
+    const char* line;
+    size_t len;
+} statusLines[] = {
+    STATUS_LINE(200, "OK"),
+    STATUS_LINE(206, "Partial Content"),
+    STATUS_LINE(304, "Not Modified"),
+    STATUS_LINE(400, "Bad Request"),
+    STATUS_LINE(403, "Forbidden"),
+    STATUS_LINE(404, "Not Found"),
+    STATUS_LINE(405, "Method Not Allowed"),
+    STATUS_LINE(408, "Request Timeout"),
+    STATUS_LINE(413, "Payload Too Large"),
+    STATUS_LINE(416, "Range Not Satisfiable"),
+    STATUS_LINE(431, "Request Header Fields Too Large"),
+    STATUS_LINE(500, "Internal Server Error"),
+    STATUS_LINE(501, "Not Implemented"),
+    STATUS_LINE(505, "HTTP Version Not Supported")
+};
+
+static void appendStatusLine(headBuilder_t* head, const response_t* response) {
+    for (size_t i = 0;i < sizeof(statusLines) / sizeof(statusLines[0]);i++) {
+        if (statusLines[i].code == response->statusCode) {
+            // Handlers pass the same literals, the pointer compare is the usual hit
+            if (statusLines[i].text == response->statusText || strcmp(statusLines[i].text, response->statusText) == 0) {
+                appendBytes(head, statusLines[i].line, statusLines[i].len);
+                return;
+            }
+            break;
         }
-        memcpy(response->body, "Hello", response->bodyLen);
-        break;
-
-    case ROUTE_ECHO:
-        response->statusCode = 200;
-        response->statusText = "OK";
-        response->bodyLen = httpInfo->body.len;
-        response->body = malloc(response->bodyLen);
-        if (!response->body) {
-            perror("Malloc failed");
-            setInternalServerError(response);
-            return;
+    }
+    appendLiteral(head, "HTTP/1.1 ");
+    appendDecimal(head, response->statusCode);
+    appendLiteral(head, " ");
+    appendString(head, response->statusText);
+    appendLiteral(head, "\r\n");
+}
+
+#define DATE_HEADER_LEN 37 // "Date: " + IMF-fixdate (29) + CRLF
+
+// Each worker thread formats the Date at most once per second
+static __thread struct {
+    time_t second;
+    char line[DATE_HEADER_LEN + 1];
+} dateCache;
+
+static void appendDate(headBuilder_t* head) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    if (now.tv_sec != dateCache.second || dateCache.line[0] == '\0') {
+        struct tm tm;
+        gmtime_r(&now.tv_sec, &tm);
+        strftime(dateCache.line, sizeof(dateCache.line), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+        dateCache.second = now.tv_sec;
+    }
+    appendBytes(head, dateCache.line, DATE_HEADER_LEN);
+}
+
+static void appendField(headBuilder_t* head, const char* name, size_t nameLen, const char* value) {
+    appendBytes(head, name, nameLen);
+    appendString(head, value);
+    appendLiteral(head, "\r\n");
+}
+
+#define appendLiteralField(head, name, value) appendField(head, name, sizeof(name) - 1, value)
+
+// Everything after the status line and Date, the part a cached response stores
+static void appendResponseFields(headBuilder_t* head, const response_t* response) {
+    size_t contentLength = response->fileDescriptor != -1 ? response->fileSize : response->bodyLen;
+
+    appendLiteral(head, "Server: " SERVER_NAME "\r\n");
+    // A 304 carries validators only, no representation headers
+    if (response->statusCode != 304) {
+        if (response->producer.produce) {
+            // Length unknown: chunk framing, or for HTTP/1.0 the close delimits the body
+            if (response->chunked) {
+                appendLiteral(head, "Transfer-Encoding: chunked\r\n");
+            }
         }
-        memcpy(response->body, httpInfo->body.data, response->bodyLen);
-        break;
-
-    case ROUTE_UNKNOWN_METHOD:
-        response->statusCode = 405;
-        response->statusText = "Method Not Allowed";
-        response->bodyLen = 44;
-        response->body = malloc(response->bodyLen);
-        if (!response->body) {
-            perror("Malloc failed");
-            setInternalServerError(response);
+        else {
+            appendLiteral(head, "Content-Length: ");
+            appendDecimal(head, contentLength);
+            appendLiteral(head, "\r\n");
+        }
+        appendLiteralField(head, "Content-Type: ", response->contentType);
+        if (response->contentEncoding) {
+            appendLiteralField(head, "Content-Encoding: ", response->contentEncoding);
+        }
+    }
+    if (response->rangeTotal > 0) {
+        appendLiteral(head, "Content-Range: bytes ");
+        if (response->statusCode == 206) {
+            appendDecimal(head, response->fileOffset);
+            appendLiteral(head, "-");
+            appendDecimal(head, response->fileOffset + contentLength - 1);
+        }
+        else {
+            appendLiteral(head, "*");
+        }
+        appendLiteral(head, "/");
+        appendDecimal(head, response->rangeTotal);
+        appendLiteral(head, "\r\n");
+    }
+    if (response->acceptRanges) {
+        appendLiteral(head, "Accept-Ranges: bytes\r\n");
+    }
+    if (response->etag) {
+        appendLiteralField(head, "ETag: ", response->etag);
+        appendLiteralField(head, "Last-Modified: ", response->lastModified);
+    }
+    if (response->vary) {
+        appendLiteral(head, "Vary: Accept-Encoding\r\n");
+    }
+    for (size_t i = 0;i < response->headerCnt;i++) {
+        appendString(head, response->headers[i].key);
+        appendLiteral(head, ": ");
+        appendString(head, response->headers[i].value);
+        appendLiteral(head, "\r\n");
+    }
+    if (response->shouldClose) {
+        appendLiteral(head, "Connection: close\r\n\r\n");
+    }
+    else {
+        appendLiteral(head, "Connection: keep-alive\r\n\r\n");
+    }
+}
+
+size_t generateResponseFields(const response_t* response, char* buffer, size_t cap) {
+    headBuilder_t head = { buffer, cap, 0 };
+    appendResponseFields(&head, response);
+    return head.len;
+}
+
+size_t generateResponseHeaders(response_t* response, char* responseBuffer, size_t responseBufferCap) {
+    headBuilder_t head = { responseBuffer, responseBufferCap, 0 };
+    appendStatusLine(&head, response);
+    appendDate(&head);
+    // The cached bytes already hold the remaining fields
+    if (!response->cachedResponse) {
+        appendResponseFields(&head, response);
+    }
+    return head.len;
+}
+
+// Serializes a keep-alive response for a small file, so later hits are one send().
+// Status line and Date are left out, they are written fresh in front of it per request.
+static void buildCachedResponse(response_t* response, fileCache_t* fileCache, fileCacheEntry_t* entry) {
+    char headers[512];
+    headBuilder_t head = { headers, sizeof(headers), 0 };
+    appendResponseFields(&head, response);
+    size_t headerLen = head.len;
+    if (headerLen > sizeof(headers)) {
+        return;
+    }
+    size_t total = headerLen + entry->size;
+    char* data = malloc(total);
+    if (!data) {
+        return;
+    }
+    memcpy(data, headers, headerLen);
+
+    size_t filled = 0;
+    while (filled < (size_t)entry->size) {
+        ssize_t got = pread(entry->fd, data + headerLen + filled, entry->size - filled, filled);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            // Unreadable or shrank, sendfile() path decides what happens
+            free(data);
             return;
         }
-        memcpy(response->body, "This request method is currently unsupported", response->bodyLen);
-        break;
+        filled += got;
+    }
 
-    default:
-        setNotFoundError(response);
-        break;
+    if (fileCacheStoreResponse(fileCache, entry, data, total) == -1) {
+        free(data);
     }
 }
 
-void fileHandler(response_t* response, httpInfo_t* httpInfo, int root_fd) {
-    int staticFile_fd;
-    struct stat fileStat;
-    // Strip leading '/' from path
-    // And create a short lived relative path buffer for openat()
-    char* relativePath = NULL;
-    relativePath = malloc(httpInfo->normalizedPath.len);
-    if (!relativePath) {
-        perror("Malloc failed");
-        setInternalServerError(response);
+static const struct {
+    int bit;
+    const char* suffix;
+    const char* encoding;
+} sidecars[] = {
+    {ENCODING_BR, ".br", "br"},
+    {ENCODING_GZIP, ".gz", "gzip"}
+};
+
+// Only text assets get .br/.gz sidecars, binary formats are compressed already
+int isCompressibleType(const char* contentType) {
+    return strncmp(contentType, "text/", 5) == 0 || strcmp(contentType, "application/javascript") == 0;
+}
+
+// Resolved once per entry. With sidecars enabled "style.css.gz" is text/css + gzip,
+// whether it is reached through style.css or requested directly.
+static void resolveContentType(fileCache_t* fileCache, fileCacheEntry_t* entry) {
+    entry->contentType = getFileType(entry->path, entry->pathLen);
+    if (!fileCache->precompressed) {
         return;
     }
-    // Copy after striping '/';
-    memcpy(relativePath, httpInfo->normalizedPath.data + 1, httpInfo->normalizedPath.len - 1);
-    // Add null terminator at end
-    relativePath[httpInfo->normalizedPath.len - 1] = '\0';
+    for (size_t i = 0;i < sizeof(sidecars) / sizeof(sidecars[0]);i++) {
+        size_t baseLen = entry->pathLen - 3;
+        if (entry->pathLen > 3 && strcmp(entry->path + baseLen, sidecars[i].suffix) == 0) {
+            const char* baseType = getFileType(entry->path, baseLen);
+            if (isCompressibleType(baseType)) {
+                entry->contentType = baseType;
+                entry->contentEncoding = sidecars[i].encoding;
+            }
+            return;
+        }
+    }
+}
+
+// Looks for path.br / path.gz next to the asset, the client's preference order is ignored (br wins)
+static fileCacheEntry_t* findSidecar(fileCache_t* fileCache, const fileCacheEntry_t* entry, int acceptEncoding) {
+    char path[PATH_BUFFER_CAP + 4];
+    if (entry->pathLen + 4 > sizeof(path)) {
+        return NULL;
+    }
+    memcpy(path, entry->path, entry->pathLen);
+
+    for (size_t i = 0;i < sizeof(sidecars) / sizeof(sidecars[0]);i++) {
+        if (!(acceptEncoding & sidecars[i].bit)) {
+            continue;
+        }
+        memcpy(path + entry->pathLen, sidecars[i].suffix, 4);
+        fileCacheEntry_t* sidecar = fileCacheAcquire(fileCache, path, entry->pathLen + 3);
+        if (sidecar) {
+            if (!sidecar->contentType) {
+                resolveContentType(fileCache, sidecar);
+            }
+            return sidecar;
+        }
+    }
+    return NULL;
+}
+
+// Trims optional whitespace around a header list element
+static bufferView_t trimView(const char* start, const char* end) {
+    while (start < end && (*start == ' ' || *start == '\t')) start++;
+    while (end > start && (end[-1] == ' ' || end[-1] == '\t')) end--;
+    bufferView_t view = { (char*)start, end - start };
+    return view;
+}
+
+// If-None-Match uses the weak comparison: W/"x" matches "x", "*" matches anything
+static int etagListMatches(const bufferView_t* list, const char* etag) {
+    size_t etagLen = strlen(etag);
+    const char* cursor = list->data;
+    const char* end = list->data + list->len;
+    while (cursor < end) {
+        const char* comma = memchr(cursor, ',', end - cursor);
+        const char* elementEnd = comma ? comma : end;
+        bufferView_t element = trimView(cursor, elementEnd);
+        if (element.len >= 2 && strncmp(element.data, "W/", 2) == 0) {
+            element.data += 2;
+            element.len -= 2;
+        }
+        if ((element.len == 1 && element.data[0] == '*') ||
+            (element.len == etagLen && memcmp(element.data, etag, etagLen) == 0)) {
+            return 1;
+        }
+        cursor = elementEnd + 1;
+    }
+    return 0;
+}
+
+// RFC 9110 13.2.2: If-None-Match wins over If-Modified-Since
+static int isNotModified(const httpInfo_t* httpInfo, const char* etag, const char* lastModified, time_t mtime) {
+    if (httpInfo->known[HEADER_IF_NONE_MATCH].len > 0) {
+        return etagListMatches(&httpInfo->known[HEADER_IF_NONE_MATCH], etag);
+    }
+    if (httpInfo->known[HEADER_IF_MODIFIED_SINCE].len == 0) {
+        return 0;
+    }
+    bufferView_t date = httpInfo->known[HEADER_IF_MODIFIED_SINCE];
+    // Browsers echo Last-Modified back verbatim
+    if (date.len == strlen(lastModified) && memcmp(date.data, lastModified, date.len) == 0) {
+        return 1;
+    }
+    char value[64];
+    if (date.len >= sizeof(value)) {
+        return 0;
+    }
+    memcpy(value, date.data, date.len);
+    value[date.len] = '\0';
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    char* parsed = strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (!parsed || *parsed != '\0') {
+        return 0; // invalid dates are ignored
+    }
+    return mtime <= timegm(&tm);
+}
+
+// Parses a single "bytes=first-last" / "bytes=first-" / "bytes=-suffix" range
+// @return 1 satisfiable (start/len set), 0 header ignored (multi-range, syntax), -1 unsatisfiable
+static int parseRange(const bufferView_t* header, off_t size, off_t* start, size_t* len) {
+    bufferView_t value = trimView(header->data, header->data + header->len);
+    if (value.len < 7 || strncasecmp(value.data, "bytes=", 6) != 0 || memchr(value.data, ',', value.len)) {
+        return 0;
+    }
+    const char* cursor = value.data + 6;
+    const char* end = value.data + value.len;
+
+    int hasFirst = 0, hasLast = 0;
+    unsigned long long first = 0, last = 0;
+    for (; cursor < end && *cursor >= '0' && *cursor <= '9'; cursor++, hasFirst = 1) {
+        if (first > (unsigned long long)LLONG_MAX / 10) return 0;
+        first = first * 10 + (*cursor - '0');
+    }
+    if (cursor == end || *cursor != '-') {
+        return 0;
+    }
+    for (cursor++; cursor < end && *cursor >= '0' && *cursor <= '9'; cursor++, hasLast = 1) {
+        if (last > (unsigned long long)LLONG_MAX / 10) return 0;
+        last = last * 10 + (*cursor - '0');
+    }
+    if (cursor != end || (!hasFirst && !hasLast) || (hasFirst && hasLast && last < first)) {
+        return 0;
+    }
+
+    if (!hasFirst) {
+        // Suffix range: the last N bytes
+        if (last == 0 || size == 0) {
+            return -1;
+        }
+        first = last >= (unsigned long long)size ? 0 : (unsigned long long)size - last;
+        last = size - 1;
+    }
+    else {
+        if (first >= (unsigned long long)size) {
+            return -1;
+        }
+        if (!hasLast || last >= (unsigned long long)size) {
+            last = size - 1;
+        }
+    }
+    *start = first;
+    *len = last - first + 1;
+    return 1;
+}
+
+// If-Range holds either the strong ETag or the exact Last-Modified date of the current file
+static int ifRangeMatches(const httpInfo_t* httpInfo, const char* etag, const char* lastModified) {
+    if (httpInfo->known[HEADER_IF_RANGE].len == 0) {
+        return 1;
+    }
+    bufferView_t value = httpInfo->known[HEADER_IF_RANGE];
+    const char* validator = value.len > 0 && value.data[0] == '"' ? etag : lastModified;
+    return value.len == strlen(validator) && memcmp(value.data, validator, value.len) == 0;
+}
+
+void fileHandler(response_t* response, httpInfo_t* httpInfo, fileCache_t* fileCache) {
+    // Strip leading '/' from path, the cache copies the key itself
+    const char* relativePath = httpInfo->normalizedPath.data + 1;
+    size_t relativePathLen = httpInfo->normalizedPath.len - 1;
 
     // Check for empty path
     // if empty serve index file
-    if (strlen(relativePath) == 0) {
-        char* temp = realloc(relativePath, 11);
-        if (temp == NULL) {
-            perror("Realloc failed");
-            free(relativePath);
-            setInternalServerError(response);
-            return;
-        }
-        relativePath = temp;
-        memcpy(relativePath, "index.html", 11);
+    if (relativePathLen == 0) {
+        relativePath = "index.html";
+        relativePathLen = 10;
     }
 
-    if ((staticFile_fd = openat(root_fd, relativePath, O_RDONLY)) == -1) {
-        free(relativePath);
+    fileCacheEntry_t* entry = fileCacheAcquire(fileCache, relativePath, relativePathLen);
+    if (!entry) {
         if (errno == ENOENT || errno == ENOTDIR) {
             setNotFoundError(response);
         }
-        else if (errno == EACCES) {
+        else if (errno == EACCES || errno == EISDIR) {
             setForbiddenFileRoute(response);
         }
         else {
+            perror("File open failed");
             setInternalServerError(response);
         }
         return;
     }
 
-    getFileType(relativePath, response);
-    free(relativePath);
+    // Resolved once per entry, hits reuse it
+    if (!entry->contentType) {
+        resolveContentType(fileCache, entry);
+    }
 
-    if (fstat(staticFile_fd, &fileStat) == -1) {
-        perror("fstat failed");
-        close(staticFile_fd);
-        setInternalServerError(response);
-        return;
+    if (fileCache->precompressed && !entry->contentEncoding && isCompressibleType(entry->contentType)) {
+        response->vary = 1;
+        fileCacheEntry_t* sidecar = httpInfo->acceptEncoding ? findSidecar(fileCache, entry, httpInfo->acceptEncoding) : NULL;
+        if (sidecar) {
+            fileCacheRelease(fileCache, entry);
+            entry = sidecar;
+        }
     }
 
-    // check if the stat is for directory or file
-    if (S_ISREG(fileStat.st_mode) == 0) {
-        close(staticFile_fd);
-        setForbiddenFileRoute(response);
+    response->contentType = entry->contentType;
+    response->contentEncoding = entry->contentEncoding;
+    response->etag = entry->etag;
+    response->lastModified = entry->lastModified;
+    // Validators point into the entry, so the reference is kept even without a body
+    response->fileEntry = entry;
+
+    if (isNotModified(httpInfo, entry->etag, entry->lastModified, entry->mtime.tv_sec)) {
+        response->statusCode = 304;
+        response->statusText = "Not Modified";
         return;
     }
 
+    response->acceptRanges = 1;
+    if (httpInfo->known[HEADER_RANGE].len > 0 && ifRangeMatches(httpInfo, entry->etag, entry->lastModified)) {
+        off_t start;
+        size_t len;
+        int res = parseRange(&httpInfo->known[HEADER_RANGE], entry->size, &start, &len);
+        if (res == -1) {
+            response->statusCode = 416;
+            response->statusText = "Range Not Satisfiable";
+            response->rangeTotal = entry->size;
+            return;
+        }
+        if (res == 1) {
+            // Fed straight into the sendfile()/splice offset of the connection
+            response->statusCode = 206;
+            response->statusText = "Partial Content";
+            response->rangeTotal = entry->size;
+            response->fileOffset = start;
+            response->fileSize = len;
+            response->fileDescriptor = entry->fd;
+            return;
+        }
+    }
+
     response->statusCode = 200;
     response->statusText = "OK";
-    response->fileSize = fileStat.st_size;
-    response->fileDescriptor = staticFile_fd;
+    response->fileSize = entry->size;
+    response->fileDescriptor = entry->fd;
+
+    // Only the keep-alive variant is cached, Connection: close is the rare case
+    if (response->shouldClose || (size_t)entry->size > fileCache->smallFileMax || fileCache->responseLimit == 0) {
+        return;
+    }
+    if (!entry->response) {
+        buildCachedResponse(response, fileCache, entry);
+    }
+    response->cachedResponse = fileCacheResponse(fileCache, entry, &response->cachedResponseLen);
 }
 
-response_t requestHandler(httpInfo_t* httpInfo, int root_fd) {
-    response_t response = initializeResponse();
-    if (httpInfo->isKeepAlive == 0) response.shouldClose = 1;
+// Static files from the --pack mapping: the keep-alive 200 is prebuilt in the
+// pack, every other status borrows its body straight from the mapping
+static void packHandler(response_t* response, httpInfo_t* httpInfo, fileCache_t* fileCache) {
+    (void)fileCache;
+    const char* relativePath = httpInfo->normalizedPath.data + 1;
+    size_t relativePathLen = httpInfo->normalizedPath.len - 1;
+    if (relativePathLen == 0) {
+        relativePath = "index.html";
+        relativePathLen = 10;
+    }
 
-    char* normalizedPathData = httpInfo->normalizedPath.data;
-    size_t normalizedPathLen = httpInfo->normalizedPath.len;
+    packFile_t file;
+    if (!packLookup(relativePath, relativePathLen, &file)) {
+        setNotFoundError(response);
+        return;
+    }
 
-    // isApi flag handles /api routes
-    if (httpInfo->isApi) {
-        // Handle GET requests
-        if (httpInfo->method.len == 3 && strncmp(httpInfo->method.data, "GET", httpInfo->method.len) == 0) {
-            // Route: GET /
-            if (normalizedPathLen == 1 && strncmp(normalizedPathData, "/", normalizedPathLen) == 0) {
-                apiHandler(&response, httpInfo, ROUTE_ROOT);
-            }
-            else {
-                apiHandler(&response, httpInfo, ROUTE_NOT_FOUND);
-            }
+    // Same choice as findSidecar(): br wins over gzip
+    int variant = 0;
+    for (size_t i = 0;i < sizeof(sidecars) / sizeof(sidecars[0]);i++) {
+        if ((httpInfo->acceptEncoding & sidecars[i].bit) && file.variants[1 + i].response) {
+            variant = 1 + i;
+            break;
         }
-        // Handle POST requests
-        else if (httpInfo->method.len == 4 && strncmp(httpInfo->method.data, "POST", httpInfo->method.len) == 0) {
-            // Route: POST /echo - echoes back the request body
-            if (normalizedPathLen == 5 && strncmp(normalizedPathData, "/echo", normalizedPathLen) == 0) {
-                apiHandler(&response, httpInfo, ROUTE_ECHO);
-            }
-            else {
-                apiHandler(&response, httpInfo, ROUTE_NOT_FOUND);
-            }
+    }
+    const packVariant_t* chosen = &file.variants[variant];
+    response->contentType = file.contentType;
+    response->contentEncoding = variant ? sidecars[variant - 1].encoding : NULL;
+    response->vary = file.variants[1].response || file.variants[2].response;
+    response->etag = chosen->etag;
+    response->lastModified = file.lastModified;
+
+    if (isNotModified(httpInfo, chosen->etag, file.lastModified, file.mtime)) {
+        response->statusCode = 304;
+        response->statusText = "Not Modified";
+        return;
+    }
+
+    const char* body = chosen->response + chosen->fieldsLen;
+    response->acceptRanges = 1;
+    if (httpInfo->known[HEADER_RANGE].len > 0 && ifRangeMatches(httpInfo, chosen->etag, file.lastModified)) {
+        off_t start;
+        size_t len;
+        int res = parseRange(&httpInfo->known[HEADER_RANGE], chosen->bodyLen, &start, &len);
+        if (res == -1) {
+            response->statusCode = 416;
+            response->statusText = "Range Not Satisfiable";
+            response->rangeTotal = chosen->bodyLen;
+            return;
         }
-        else {
-            // Unsupported HTTP method
-            apiHandler(&response, httpInfo, ROUTE_UNKNOWN_METHOD);
+        if (res == 1) {
+            response->statusCode = 206;
+            response->statusText = "Partial Content";
+            response->rangeTotal = chosen->bodyLen;
+            response->fileOffset = start;
+            setBorrowedBody(response, body + start, len);
+            return;
         }
     }
-    else {
-        // Handle static files
-        if (httpInfo->method.len == 3 && strncmp(httpInfo->method.data, "GET", httpInfo->method.len) == 0) {
-            fileHandler(&response, httpInfo, root_fd);
+
+    response->statusCode = 200;
+    response->statusText = "OK";
+    if (response->shouldClose) {
+        setBorrowedBody(response, body, chosen->bodyLen);
+        return;
+    }
+    response->cachedResponse = chosen->response;
+    response->cachedResponseLen = chosen->fieldsLen + chosen->bodyLen;
+}
+
+int fileHandlerTarget(const httpInfo_t* httpInfo, const fileCache_t* fileCache, fileTarget_t* target) {
+    if (!httpInfo->route || httpInfo->route->handler != fileHandler) {
+        return 0;
+    }
+    // Same path mapping as fileHandler()
+    target->path = httpInfo->normalizedPath.data + 1;
+    target->pathLen = httpInfo->normalizedPath.len - 1;
+    if (target->pathLen == 0) {
+        target->path = "index.html";
+        target->pathLen = 10;
+    }
+    target->sidecars = 0;
+    if (!fileCache->precompressed || !httpInfo->acceptEncoding ||
+        !isCompressibleType(getFileType(target->path, target->pathLen))) {
+        return 1;
+    }
+    for (size_t i = 0;i < sizeof(sidecars) / sizeof(sidecars[0]);i++) {
+        // A sidecar requested directly has no sidecars of its own
+        if (target->pathLen > 3 && memcmp(target->path + target->pathLen - 3, sidecars[i].suffix, 3) == 0) {
+            target->sidecars = 0;
+            return 1;
         }
-        else {
-            apiHandler(&response, httpInfo, ROUTE_UNKNOWN_METHOD);
+        target->sidecars |= httpInfo->acceptEncoding & sidecars[i].bit;
+    }
+    return 1;
+}
+
+int fileTargetCached(fileCache_t* fileCache, const fileTarget_t* target) {
+    if (fileCache->capacity == 0) {
+        return 1;
+    }
+    const fileCacheEntry_t* entry = fileCachePeek(fileCache, target->path, target->pathLen);
+    if (!entry || entry->fd == -1 || !target->sidecars) {
+        return entry != NULL;
+    }
+    char path[PATH_BUFFER_CAP + 4];
+    if (target->pathLen + 4 > sizeof(path)) {
+        return 1;
+    }
+    memcpy(path, target->path, target->pathLen);
+    for (size_t i = 0;i < sizeof(sidecars) / sizeof(sidecars[0]);i++) {
+        memcpy(path + target->pathLen, sidecars[i].suffix, 4);
+        if ((target->sidecars & sidecars[i].bit) && !fileCachePeek(fileCache, path, target->pathLen + 3)) {
+            return 0;
         }
     }
+    return 1;
+}
+
+// Page cache warm-up, the kernel reads the start while the entry travels back to the worker
+static void readAhead(const fileCacheEntry_t* entry, size_t readahead) {
+    if (!entry || entry->fd == -1) {
+        return;
+    }
+    off_t len = entry->size < (off_t)readahead ? entry->size : (off_t)readahead;
+    if (len > 0) {
+        posix_fadvise(entry->fd, 0, len, POSIX_FADV_WILLNEED);
+    }
+}
 
+void openFileTarget(int root_fd, const fileTarget_t* target, size_t readahead, fileCacheEntry_t** entries) {
+    for (int i = 0;i < FILE_TARGET_LOOKUPS;i++) {
+        entries[i] = NULL;
+    }
+    entries[0] = fileCacheOpen(root_fd, target->path, target->pathLen);
+    readAhead(entries[0], readahead);
+    if (!entries[0] || entries[0]->fd == -1 || !target->sidecars) {
+        return;
+    }
+    char path[PATH_BUFFER_CAP + 4];
+    if (target->pathLen + 4 > sizeof(path)) {
+        return;
+    }
+    memcpy(path, target->path, target->pathLen);
+    for (size_t i = 0;i < sizeof(sidecars) / sizeof(sidecars[0]);i++) {
+        if (!(target->sidecars & sidecars[i].bit)) {
+            continue;
+        }
+        memcpy(path + target->pathLen, sidecars[i].suffix, 4);
+        fileCacheEntry_t* sidecar = fileCacheOpen(root_fd, path, target->pathLen + 3);
+        readAhead(sidecar, readahead);
+        entries[1 + i] = sidecar;
+    }
+}
+
+response_t requestHandler(httpInfo_t* httpInfo, fileCache_t* fileCache) {
+    response_t response = initializeResponse();
+    if (httpInfo->isKeepAlive == 0) response.shouldClose = 1;
+
+    // Route was matched by routerMatch() right after the path was normalized
+    httpInfo->route->handler(&response, httpInfo, fileCache);
     return response;
 }
 
-size_t generateResponseHeaders(response_t* response, char* responseBuffer) {
-    char* connectionString = response->shouldClose ? "close" : "keep-alive";
-    size_t contentLength = response->fileDescriptor != -1 ? response->fileSize : response->bodyLen;
+// POST /api/upload: counts and hashes the body without ever holding it (FNV-1a)
+static int uploadChunk(bodyStream_t* stream, const char* data, size_t len) {
+    uint64_t hash = stream->state;
+    for (size_t i = 0;i < len;i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    stream->state = hash;
+    return 0;
+}
 
-    // Build HTTP response headers
-    size_t headerLen = snprintf(responseBuffer, RESPONSE_BUFFER_SIZE,
-        "HTTP/1.1 %d %s\r\n"
-        "Content-Length: %zu\r\n"
-        "Content-Type: %s\r\n"
-        "Connection: %s\r\n\r\n",
-        response->statusCode, response->statusText, contentLength, response->contentType, connectionString);
+static void uploadComplete(bodyStream_t* stream, httpInfo_t* httpInfo, response_t* response) {
+    (void)httpInfo;
+    char summary[80];
+    int len = snprintf(summary, sizeof(summary), "Received %zu bytes, fnv1a %016llx",
+        stream->received, (unsigned long long)stream->state);
+    setTextStatus(response, 200, "OK");
+    setCopiedBody(response, summary, len);
+}
 
-    return headerLen;
+static void openUpload(bodyStream_t* stream, const httpInfo_t* httpInfo) {
+    (void)httpInfo;
+    stream->onChunk = uploadChunk;
+    stream->onComplete = uploadComplete;
+    stream->state = 1469598103934665603ULL;
 }
 
-void addBody(response_t* response, char* responseBuffer) {
-    memcpy(responseBuffer, response->body, response->bodyLen);
+int requestBodyStream(const httpInfo_t* httpInfo, bodyStream_t* stream) {
+    const route_t* route = httpInfo->route;
+    if (!route->openBodyStream) {
+        return 0;
+    }
+    stream->received = 0;
+    route->openBodyStream(stream, httpInfo);
+    return 1;
 }
 
-void createWritableResponse(response_t* response, char** responseBuffer, size_t* responseBufferLen) {
-    size_t headerLen = generateResponseHeaders(response, *responseBuffer);
-    size_t bodyLen = response->bodyLen;
-    addBody(response , *responseBuffer+headerLen);
-    free(response->body);
-    *responseBufferLen=headerLen+bodyLen;
-}
\ No newline at end of file
+response_t finishBodyStream(bodyStream_t* stream, httpInfo_t* httpInfo) {
+    response_t response = initializeResponse();
+    if (httpInfo->isKeepAlive == 0) response.shouldClose = 1;
+    stream->onComplete(stream, httpInfo, &response);
+    return response;
+}
+
+// Proxy routes are answered by their upstream, this only runs when no
+// connection could carry the request (the io_uring loop never forwards)
+static void badGateway(response_t* response, httpInfo_t* httpInfo, fileCache_t* fileCache) {
+    (void)httpInfo;
+    (void)fileCache;
+    setTextStatus(response, 502, "Bad Gateway");
+    setBorrowedBody(response, "Upstream unavailable", 20);
+}
+
+// PREFIX itself and everything under it, registered first so they win over built-in routes
+static int addProxyRoutes(router_t* router) {
+    for (int i = 0;i < proxyUpstreamCount();i++) {
+        const upstream_t* upstream = proxyUpstream(i);
+        char pattern[UPSTREAM_PREFIX_MAX + 3];
+        snprintf(pattern, sizeof(pattern), "%s/*", upstream->prefix);
+        if (routerAddProxy(router, upstream->prefixLen > 0 ? upstream->prefix : "/", badGateway, i) == -1 ||
+            routerAddProxy(router, pattern, badGateway, i) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int initializeRoutes(router_t* router) {
+    initializeRouter(router, routeNotFound, methodNotAllowed);
+    if (addProxyRoutes(router) == -1) {
+        return -1;
+    }
+    // "/api" used to be stripped by the parser, now it is a prefix rule like any other:
+    // unknown GET/POST routes under it are 404, other methods 405
+    if (routerAdd(router, METHOD_GET, "/api", apiRoot, NULL, ROUTE_API) == -1 ||
+        routerAdd(router, METHOD_GET, "/api/", apiRoot, NULL, ROUTE_API) == -1 ||
+        routerAdd(router, METHOD_GET, "/api/stream", apiStream, NULL, ROUTE_API) == -1 ||
+        routerAdd(router, METHOD_GET, "/api/metrics", apiMetrics, NULL, ROUTE_API) == -1 ||
+        routerAdd(router, METHOD_POST, "/api/echo", apiEcho, NULL, ROUTE_API) == -1 ||
+        routerAdd(router, METHOD_POST, "/api/upload", NULL, openUpload, ROUTE_API) == -1 ||
+        routerAdd(router, METHOD_GET | METHOD_POST, "/api/*", routeNotFound, NULL, ROUTE_API) == -1 ||
+        // Everything else is a static file
+        routerAdd(router, METHOD_GET, "/*", packLoaded() ? packHandler : fileHandler, NULL, 0) == -1) {
+        return -1;
+    }
+    return routerBuild(router);
+}
+
+void createWritableResponse(response_t* response, char* responseBuffer, size_t responseBufferCap, size_t* responseBufferLen) {
+    *responseBufferLen = generateResponseHeaders(response, responseBuffer, responseBufferCap);
+}
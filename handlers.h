@@ -2,37 +2,89 @@
 #define HANDLERS_H
 
 #include "httpParser.h"
+#include "fileCache.h"
 #include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
 
 /**
  * Structure representing HTTP response headers
  * key: Header name
  * value: Header value
+ * Both are borrowed, they only have to live until the head is serialized,
+ * which happens right after the handler returns
  */
 typedef struct{
-    char* key;
-    char* value;
+    const char* key;
+    const char* value;
 }responseHeaders_t;
 
+#define RESPONSE_HEADERS_MAX 8 // custom headers per response
+#define SERVER_NAME "c-http-server/0.5" // Server header value
+
+/**
+ * Producer of a response body whose length is not known up front. The
+ * connection pulls pieces straight into its write buffer and frames each
+ * one as a chunk (Transfer-Encoding: chunked); HTTP/1.0 clients get the
+ * raw bytes and the connection close ends the body.
+ * produce: Writes at most cap bytes into buffer (cap >= BODY_PRODUCER_MIN_CAP),
+ * returns the count, 0 at the end, -1 aborts the connection
+ * state: Private to the handler
+ */
+#define BODY_PRODUCER_MIN_CAP 1024
+
+typedef struct bodyProducer {
+    ssize_t (*produce)(struct bodyProducer* producer, char* buffer, size_t cap);
+    uint64_t state;
+}bodyProducer_t;
+
 /**
  * Structure representing an HTTP response
  * statusCode: HTTP status code (e.g., 200, 404)
  * statusText: Status description (e.g., "OK", "Not Found")
- * headers: Array of response headers
- * body: Response body content
+ * headers/headerCnt: Extra headers added with addResponseHeader(), sent after the built-in ones
+ * body: Response body content, static or borrowed unless bodyOwned. A borrowed
+ * body may point into the request (read_buf), the connection keeps it in place until sent
  * bodyLen: Length of the response body
+ * bodyOwned: body was malloc()ed for this response and is freed once sent
  * shouldClose: Flag indicating if connection should be closed
+ * fileDescriptor: Static file fd (owned by fileEntry), -1 when there is no file
+ * fileEntry: File cache entry holding a reference, released once the file is sent
+ * cachedResponse: Serialized response owned by fileEntry, everything after the
+ * status line and Date header, sent instead of building headers + sendfile() when set
+ * contentEncoding: Content-Encoding of a precompressed sidecar, NULL for identity
+ * vary: Adds Vary: Accept-Encoding (asset has an encoded variant)
+ * etag/lastModified: Validators of a static file (owned by fileEntry), NULL for api responses
+ * fileOffset: First file byte to send (206), fileSize is then the range length
+ * rangeTotal: Full file size for Content-Range on 206/416, 0 when not a range response
+ * acceptRanges: Adds Accept-Ranges: bytes (static file responses)
+ * producer: Body pulled piece by piece when producer.produce is set, body/bodyLen are unused then
+ * chunked: Frame the produced body as chunks (HTTP/1.1 clients)
  */
 typedef struct{
     int statusCode;
     char* statusText;
-    responseHeaders_t* headers;
-    char* body;
+    responseHeaders_t headers[RESPONSE_HEADERS_MAX];
+    size_t headerCnt;
+    const char* body;
     size_t bodyLen;
+    int bodyOwned;
     int shouldClose;
     int fileDescriptor;
     size_t fileSize;
-    char* contentType;
+    fileCacheEntry_t* fileEntry;
+    const char* cachedResponse;
+    size_t cachedResponseLen;
+    const char* contentType;
+    const char* contentEncoding;
+    int vary;
+    const char* etag;
+    const char* lastModified;
+    off_t fileOffset;
+    size_t rangeTotal;
+    int acceptRanges;
+    bodyProducer_t producer;
+    int chunked;
 }response_t;
 
 /**
@@ -47,23 +99,123 @@ typedef enum {
 }requestResponse_t;
 
 /**
- * Enum for api routes
+ * Consumer of a request body that is streamed instead of buffered.
+ * Chunks are handed over as they arrive and dropped from read_buf right
+ * after, so an upload never needs more than one read buffer of memory.
+ * onChunk: Called for every received piece of the body, -1 aborts the request (400)
+ * onComplete: Fills the response once the last body byte was consumed
+ * received: Body bytes consumed so far
+ * state: Private to the handler
+ */
+typedef struct bodyStream {
+    int (*onChunk)(struct bodyStream* stream, const char* data, size_t len);
+    void (*onComplete)(struct bodyStream* stream, httpInfo_t* httpInfo, response_t* response);
+    size_t received;
+    uint64_t state;
+}bodyStream_t;
+
+/**
+ * Picks a streaming consumer for the request body, called once the headers
+ * are parsed and the path is normalized. Streamed bodies are not subject to
+ * the --max-body limit.
+ * @param stream Set up when the route streams its body
+ * @return 1 when the body is streamed into stream, 0 when it is buffered
+ */
+int requestBodyStream(const httpInfo_t* httpInfo, bodyStream_t* stream);
+
+/**
+ * Builds the response of a streamed request after its body is consumed
  */
-typedef enum{
-    ROUTE_ROOT,
-    ROUTE_ECHO,
-    ROUTE_NOT_FOUND,
-    ROUTE_UNKNOWN_METHOD,
-}apiRoutes_t;
+response_t finishBodyStream(bodyStream_t* stream, httpInfo_t* httpInfo);
+
+struct router;
+
+/**
+ * Registers the built-in routes (/api endpoints, static files for the rest)
+ * and builds the route table, shared read only by every worker afterwards
+ * @return 0 on success, -1 on failure
+ */
+int initializeRoutes(struct router* router);
 
 /**
  * Handles incoming HTTP requests and generates appropriate responses
- * @param httpInfo Pointer to parsed HTTP request information
- * @param root_fd File descriptor for static file root folder
+ * @param httpInfo Pointer to parsed HTTP request information, httpInfo->route already matched
+ * @param fileCache Open file cache of the worker, resolves static file paths
  * @return response_t structure containing the HTTP response
  */
-response_t requestHandler(httpInfo_t* httpInfo, int root_fd);
+response_t requestHandler(httpInfo_t* httpInfo, fileCache_t* fileCache);
 
-void createWritableResponse(response_t* response, char** responseBuffer, size_t* responseBufferLen);
+#define FILE_TARGET_LOOKUPS 3 // the file, then its .br and .gz sidecars
+
+/**
+ * Structure naming the files fileHandler() looks up for one request
+ * path/pathLen: Relative path under the document root ("index.html" for "/"), borrowed
+ * sidecars: ENCODING_* bits of the .br/.gz sidecars it probes when the file exists
+ */
+typedef struct {
+    const char* path;
+    size_t pathLen;
+    int sidecars;
+}fileTarget_t;
+
+/**
+ * @return 1 and fills target when the request is served by fileHandler(), 0 otherwise
+ */
+int fileHandlerTarget(const httpInfo_t* httpInfo, const fileCache_t* fileCache, fileTarget_t* target);
+
+/**
+ * @return 1 when fileHandler() can resolve target from the cache without a
+ * filesystem syscall (always 1 with caching disabled, there is nothing to keep)
+ */
+int fileTargetCached(fileCache_t* fileCache, const fileTarget_t* target);
+
+/**
+ * Blocking part of a cache miss for a whole target: opens and stats the file
+ * and its sidecars and starts reading up to readahead bytes of each. Touches
+ * no cache state, offload threads run it; the entries go to fileCacheInsert().
+ * @param entries FILE_TARGET_LOOKUPS slots, NULL where nothing was opened
+ */
+void openFileTarget(int root_fd, const fileTarget_t* target, size_t readahead, fileCacheEntry_t** entries);
+
+/**
+ * @return Response with no status yet, no body and no file, text/plain
+ */
+response_t initializeResponse(void);
+
+/**
+ * Adds a header to the response, key and value are borrowed (see responseHeaders_t)
+ * @return 0 on success, -1 when the response is full or key/value would break the head
+ */
+int addResponseHeader(response_t* response, const char* key, const char* value);
+
+/**
+ * @return MIME type for the extension of relativePath
+ */
+const char* getFileType(const char* relativePath, size_t len);
+
+/**
+ * @return 1 for the text types that get .br/.gz sidecars
+ */
+int isCompressibleType(const char* contentType);
+
+/**
+ * Serializes the header fields after the status line and Date, the part a
+ * cached response stores (prebuilt small file responses, packs)
+ * @return Length, not less than cap when it did not fit
+ */
+size_t generateResponseFields(const response_t* response, char* buffer, size_t cap);
+
+/**
+ * Serializes the status line and headers into responseBuffer, appended with
+ * memcpy() from precomputed status lines and a Date header formatted at most
+ * once per second per thread. For a cachedResponse only the status line and
+ * Date are written, the cached bytes carry the rest.
+ * The body is not copied: the caller sends response->body after the head
+ * (writev) and frees it when bodyOwned.
+ * @param responseBuffer Where the head goes, pipelined heads are packed one after another
+ * @param responseBufferCap Bytes available at responseBuffer
+ * @param responseBufferLen Set to the head length, not less than the cap when it did not fit
+ */
+void createWritableResponse(response_t* response, char* responseBuffer, size_t responseBufferCap, size_t* responseBufferLen);
 
 #endif
\ No newline at end of file
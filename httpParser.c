@@ -2,8 +2,13 @@
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <strings.h>
 #include "httpParser.h"
 #include "connection.h"
+#include "worker.h"
+#include "metrics.h"
+#include "scan.h"
 
 error_entry_t error_table[] = {
     {BAD_REQUEST_LINE,400,"Bad Request"},
@@ -18,7 +23,8 @@ error_entry_t error_table[] = {
     {TOO_MANY_HEADERS,400,"Too Many Headers"},
     {PAYLOAD_TOO_LARGE,413,"Payload Too Large"},
     {REQUEST_TIMEOUT,408,"Request Timeout"},
-    {BAD_REQUEST_PATH,400,"Bad Path For Request"}
+    {BAD_REQUEST_PATH,400,"Bad Path For Request"},
+    {BAD_REQUEST_BODY,400,"Bad Request Body"}
 };
 
 // Handle parser errors
@@ -35,24 +41,37 @@ void handleParseError(parserResult_t res, connection_t* conn) {
         }
     }
 
-    conn->write_buf = malloc(256);
-    if (!conn->write_buf) {
-        perror("Malloc failed");
+    if (ensureWriteBuffer(conn) == -1) {
         conn->state = CLOSING;
         return;
     }
-    conn->write_len = snprintf(conn->write_buf, 256,
-        "HTTP/1.1 %d %s\r\n"
-        "Content-Length: 0\r\n"
-        "Connection: close\r\n\r\n",
-        status, msg);
+    // Appended to the batch, responses to earlier pipelined requests still go out first
+    response_t response = initializeResponse();
+    response.statusCode = status;
+    response.statusText = msg;
+    response.shouldClose = 1;
+    size_t room = conn->write_cap - conn->write_len;
+    size_t len;
+    int firstSegment = conn->output ? conn->output->count : 0;
+    createWritableResponse(&response, conn->write_buf + conn->write_len, room, &len);
+    if (len >= room || queueWriteBuffer(conn, len) == -1) {
+        conn->state = CLOSING;
+        return;
+    }
+    conn->worker->metrics->parseErrors[res]++;
+    connectionResponseQueued(conn, status, firstSegment);
 
-    conn->write_sent = 0;
+    // The response says Connection: close, unparsed bytes must never be retried
+    conn->shouldClose = 1;
     conn->state = WRITING_RESPONSE;
 }
 
 // Custom strstr that respects a maximum length instead of relying on null-terminator
 char* strstr_len(const char* haystack, const char* needle, size_t len) {
+    // Line ends are the hot case, they take the vectorized kernel
+    if (needle[0] == '\r' && needle[1] == '\n' && needle[2] == '\0') {
+        return (char*)scanLineEnd(haystack, len);
+    }
     size_t needle_len = strlen(needle);
     if (needle_len > len) return NULL;
     for (size_t i = 0; i <= len - needle_len; i++) {
@@ -83,177 +102,290 @@ char* strcasestr_len(const char* haystack, size_t haystack_len, const char* need
 httpInfo_t* initializeHttpInfo(httpInfo_t* httpInfo) {
     httpInfo->contentLength = 0;
     httpInfo->isContentLengthSeen = 0;
+    httpInfo->isChunked = 0;
     httpInfo->isKeepAlive = 1;
     httpInfo->headerCnt = 0;
     httpInfo->isApi = 0;
-    httpInfo->decodedPath.data = httpInfo->decodedPathBuf;
+    httpInfo->acceptEncoding = 0;
+    memset(httpInfo->known, 0, sizeof(httpInfo->known));
+    httpInfo->body.data = NULL;
+    httpInfo->body.len = 0;
+    httpInfo->decodedPath.data = NULL;
     httpInfo->decodedPath.len = 0;
-    httpInfo->decodedPathCap = PATH_BUFFER_CAP;
-    httpInfo->normalizedPath.data = httpInfo->normalizedPathBuf;
+    httpInfo->normalizedPath.data = NULL;
     httpInfo->normalizedPath.len = 0;
-    httpInfo->normalizedPathCap = PATH_BUFFER_CAP;
+    httpInfo->route = NULL;
+    httpInfo->paramCnt = 0;
     return httpInfo;
 }
 
-void checkIfApi(httpInfo_t* httpInfo) {
-    size_t pathLength = httpInfo->path.len;
-    char* pathStart = httpInfo->path.data;
-    if (pathLength >= 5 && strncmp(pathStart, "/api/", 5) == 0) {
-        httpInfo->isApi = 1;
-        httpInfo->path.data = pathStart + 4;
-        httpInfo->path.len = pathLength - 4;
+// Only the address is used, oldBase may already be freed
+static void rebaseView(bufferView_t* view, uintptr_t oldBase, char* newBase) {
+    if (view->data) {
+        view->data = newBase + ((uintptr_t)view->data - oldBase);
     }
-    else if (pathLength == 4 && strncmp(pathStart, "/api", 4) == 0) {
-        httpInfo->isApi = 1;
-        httpInfo->path.len = 1;
+}
+
+void rebaseHttpInfo(httpInfo_t* httpInfo, const char* oldBase, char* newBase) {
+    uintptr_t base = (uintptr_t)oldBase;
+    rebaseView(&httpInfo->method, base, newBase);
+    rebaseView(&httpInfo->path, base, newBase);
+    rebaseView(&httpInfo->version, base, newBase);
+    for (size_t i = 0;i < KNOWN_HEADER_COUNT;i++) {
+        rebaseView(&httpInfo->known[i], base, newBase);
     }
+    rebaseView(&httpInfo->body, base, newBase);
+    rebaseView(&httpInfo->decodedPath, base, newBase);
+    rebaseView(&httpInfo->normalizedPath, base, newBase);
 }
 
-parserResult_t requestAndHeaderParser(char* buffer, char* headerEnd, httpInfo_t* uninitializedHttpInfo) {
-    httpInfo_t* httpInfo = initializeHttpInfo(uninitializedHttpInfo);
+void httpHeaderAt(const httpInfo_t* httpInfo, size_t index, bufferView_t* key, bufferView_t* value) {
+    const header_t* header = &httpInfo->headers[index];
+    key->data = httpInfo->method.data + header->keyOffset;
+    key->len = header->keyLen;
+    value->data = httpInfo->method.data + header->valueOffset;
+    value->len = header->valueLen;
+}
 
-    // Find the end of the first line (request line)
-    char* firstLineEnd = strstr(buffer, "\r\n");
-    if (!firstLineEnd) {
-        return BAD_REQUEST_LINE;
+// Parses an Accept-Encoding list like "gzip, deflate;q=0.5, br" into ENCODING_* bits.
+// Only explicitly listed codings count, "*" is ignored.
+int parseAcceptEncoding(const char* value, size_t len) {
+    int mask = 0;
+    const char* end = value + len;
+    while (value < end) {
+        while (value < end && (*value == ' ' || *value == ',')) value++;
+        const char* token = value;
+        while (value < end && *value != ',' && *value != ';' && *value != ' ') value++;
+        size_t tokenLen = value - token;
+
+        // q=0 (or 0.0, 0.000) means explicitly not acceptable
+        int rejected = 0;
+        while (value < end && *value != ',') {
+            if (*value == 'q' && value + 2 < end && value[1] == '=') {
+                const char* q = value + 2;
+                rejected = *q == '0';
+                for (q++; q < end && *q != ',' && *q != ' ' && *q != ';'; q++) {
+                    if (*q != '.' && *q != '0') rejected = 0;
+                }
+            }
+            value++;
+        }
+        if (rejected) {
+            continue;
+        }
+        if (tokenLen == 4 && strncasecmp(token, "gzip", 4) == 0) mask |= ENCODING_GZIP;
+        else if (tokenLen == 2 && strncasecmp(token, "br", 2) == 0) mask |= ENCODING_BR;
+    }
+    return mask;
+}
+
+// RFC 9110 tchar: the bytes allowed in methods and header names
+static const unsigned char tokenChars[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 1, 0, 1, 1, 1, 1, 1, 0, 0, 1, 1, 0, 1, 1, 0,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 0, 1, 0,
+};
+
+typedef struct {
+    const char* name;
+    size_t len;
+    knownHeader_t id;
+}knownHeaderEntry_t;
+
+// Perfect hash over (length, first byte, last byte), case folded with | 0x20.
+// Collision free for the names below, regenerate the slots when adding one.
+#define KNOWN_HEADER_SLOTS 32
+#define knownHeaderHash(name, len) \
+    (((len) * 2 + ((unsigned char)(name)[0] | 0x20) + ((unsigned char)(name)[(len) - 1] | 0x20) * 15) & (KNOWN_HEADER_SLOTS - 1))
+
+static const knownHeaderEntry_t knownHeaders[KNOWN_HEADER_SLOTS] = {
+    [4] = {"If-Range", 8, HEADER_IF_RANGE},
+    [6] = {"Content-Type", 12, HEADER_CONTENT_TYPE},
+    [7] = {"Range", 5, HEADER_RANGE},
+    [8] = {"Accept-Encoding", 15, HEADER_ACCEPT_ENCODING},
+    [9] = {"Connection", 10, HEADER_CONNECTION},
+    [10] = {"Keep-Alive", 10, HEADER_KEEP_ALIVE},
+    [13] = {"Authorization", 13, HEADER_AUTHORIZATION},
+    [14] = {"Upgrade", 7, HEADER_UPGRADE},
+    [21] = {"User-Agent", 10, HEADER_USER_AGENT},
+    [22] = {"If-Modified-Since", 17, HEADER_IF_MODIFIED_SINCE},
+    [23] = {"Content-Length", 14, HEADER_CONTENT_LENGTH},
+    [26] = {"Cookie", 6, HEADER_COOKIE},
+    [27] = {"If-None-Match", 13, HEADER_IF_NONE_MATCH},
+    [28] = {"Host", 4, HEADER_HOST},
+    [29] = {"Expect", 6, HEADER_EXPECT},
+    [31] = {"Transfer-Encoding", 17, HEADER_TRANSFER_ENCODING},
+};
+
+// One hash and at most one strncasecmp per header line
+static knownHeader_t lookupKnownHeader(const char* name, size_t len) {
+    const knownHeaderEntry_t* entry = &knownHeaders[knownHeaderHash(name, len)];
+    if (entry->len == len && strncasecmp(name, entry->name, len) == 0) {
+        return entry->id;
     }
-    size_t firstLineLength = firstLineEnd - buffer;
+    return HEADER_UNKNOWN;
+}
+
+static parserResult_t parseContentLength(const char* value, size_t len, size_t* length) {
+    size_t parsed = 0;
+    for (size_t i = 0;i < len;i++) {
+        if (value[i] < '0' || value[i] > '9' || parsed > (SIZE_MAX - 9) / 10) {
+            return INVALID_CONTENT_LENGTH;
+        }
+        parsed = parsed * 10 + (value[i] - '0');
+    }
+    *length = parsed;
+    return OK;
+}
+
+// Single pass: every byte of the request line and header block is visited once.
+// Names are classified with tokenChars, values end at the vectorized CRLF scan.
+parserResult_t requestAndHeaderParser(char* buffer, char* headerEnd, httpInfo_t* uninitializedHttpInfo) {
+    httpInfo_t* httpInfo = initializeHttpInfo(uninitializedHttpInfo);
+    char* cursor = buffer;
 
     // ---- Parsing Request line ----
 
     // Extract HTTP method (e.g., GET, POST)
-    char* methodEnd = memchr(buffer, ' ', firstLineLength);
-    if (!methodEnd) {
+    while (cursor < headerEnd && tokenChars[(unsigned char)*cursor]) cursor++;
+    if (cursor == buffer || cursor >= headerEnd || *cursor != ' ') {
         return BAD_REQUEST_LINE;
     }
-    size_t methodLength = methodEnd - buffer;
     httpInfo->method.data = buffer;
-    httpInfo->method.len = methodLength;
-
-    // Extract request path/URI
-    firstLineLength -= methodLength;
-    char* pathStart = methodEnd;
-    // Skip leading spaces
-    while (pathStart[0] == ' ') {
-        pathStart++;
-        firstLineLength--;
-    }
-    char* pathEnd = memchr(pathStart, ' ', firstLineLength);
-    if (!pathEnd) {
+    httpInfo->method.len = cursor - buffer;
+
+    // Extract request path/URI, skip repeated spaces
+    while (cursor < headerEnd && *cursor == ' ') cursor++;
+    char* pathStart = cursor;
+    char* pathEnd = memchr(pathStart, ' ', headerEnd - pathStart);
+    if (!pathEnd || pathEnd == pathStart || memchr(pathStart, '\r', pathEnd - pathStart)) {
         return BAD_REQUEST_LINE;
     }
-    size_t pathLength = pathEnd - pathStart;
     httpInfo->path.data = pathStart;
-    httpInfo->path.len = pathLength;
+    httpInfo->path.len = pathEnd - pathStart;
 
     // Extract and validate HTTP version
-    firstLineLength -= pathLength;
-    char* versionStart = pathEnd;
-    while (versionStart[0] == ' ') {
-        versionStart++;
-        firstLineLength--;
+    cursor = pathEnd;
+    while (cursor < headerEnd && *cursor == ' ') cursor++;
+    if (headerEnd - cursor < 10) {
+        return BAD_REQUEST_LINE;
     }
-    size_t versionLength = firstLineEnd - versionStart;
-    httpInfo->version.data = versionStart;
-    httpInfo->version.len = versionLength;
+    httpInfo->version.data = cursor;
+    httpInfo->version.len = 8;
     // Added HTTP/1.0 specially because of apache benchmark compatibility
-    if (strncmp(versionStart, "HTTP/1.1", 8) != 0 &&
-        strncmp(versionStart, "HTTP/1.0", 8) != 0) {
+    if (strncmp(cursor, "HTTP/1.1", 8) != 0 &&
+        strncmp(cursor, "HTTP/1.0", 8) != 0) {
         return INVALID_VERSION;
     }
-
-    // HTTP/1.0 is not reliable for keep alive 
-    if (strncmp(versionStart, "HTTP/1.0", 8) == 0) {
+    // HTTP/1.0 is not reliable for keep alive
+    if (cursor[7] == '0') {
         httpInfo->isKeepAlive = 0;
     }
+    cursor += 8;
+    if (cursor[0] != '\r' || cursor[1] != '\n') {
+        return BAD_REQUEST_LINE;
+    }
+    cursor += 2;
 
     // ---- Parsing Headers ----
-    char* headerStart = firstLineEnd + 2;
-    if (headerStart >= headerEnd) {
+    if (cursor >= headerEnd) {
         return MISSING_REQUIRED_HEADERS;
     }
     size_t headerCnt = 0;
-    // httpInfo->headers = headerArray; Not needed as we allocate array on stack
-
-    // Parse each header line until we hit the empty line
-    while (headerStart < headerEnd) {
-        if (headerCnt >= 100) return TOO_MANY_HEADERS;
-
-        size_t remaining = headerEnd - headerStart;
-        char* lineEnd = strstr_len(headerStart, "\r\n", remaining);
 
-        // If we hit the empty line (\r\n\r\n), we are done
-        if (!lineEnd || lineEnd == headerStart) break;
+    // headerEnd points just past the CRLF of the last header line
+    while (cursor < headerEnd) {
+        if (headerCnt >= MAX_HEADERS) return TOO_MANY_HEADERS;
 
-        // Split header into key and value at colon
-        size_t lineLength = lineEnd - headerStart;
-        char* colon = memchr(headerStart, ':', lineLength);
-
-        if (!colon) {
+        // Header name: token bytes up to the colon, no whitespace allowed before it
+        char* name = cursor;
+        while (cursor < headerEnd && tokenChars[(unsigned char)*cursor]) cursor++;
+        if (cursor == name || cursor >= headerEnd || *cursor != ':') {
             return BAD_HEADER_SYNTAX;
         }
+        size_t keyLen = cursor - name;
 
-        // Extract header key (name)
-        size_t keyLen = colon - headerStart;
-        httpInfo->headers[headerCnt].key.data = headerStart;
-        httpInfo->headers[headerCnt].key.len = keyLen;
-
-        // Extract header value (skip leading whitespace)
-        char* valStart = colon + 1;
-        while (valStart < lineEnd && *valStart == ' ') valStart++;
-        if (valStart == lineEnd) {
+        // Header value: optional whitespace trimmed on both sides
+        cursor++;
+        while (cursor < headerEnd && (*cursor == ' ' || *cursor == '\t')) cursor++;
+        char* lineEnd = (char*)scanLineEnd(cursor, headerEnd - cursor);
+        if (!lineEnd) {
             return BAD_HEADER_SYNTAX;
         }
-
-        size_t valLen = lineEnd - valStart;
-
-        httpInfo->headers[headerCnt].value.data = valStart;
-        httpInfo->headers[headerCnt].value.len = valLen;
-
-        // Handle special headers (Content-Type, Content-Length, Connection)
-        if (keyLen == 12 && strncasecmp(headerStart, "Content-Type", keyLen) == 0) {
-            httpInfo->contentType.data = valStart;
-            httpInfo->contentType.len = lineEnd - valStart;
+        char* valStart = cursor;
+        char* valEnd = lineEnd;
+        while (valEnd > valStart && (valEnd[-1] == ' ' || valEnd[-1] == '\t')) valEnd--;
+        if (valEnd == valStart) {
+            return BAD_HEADER_SYNTAX;
         }
-        else if (keyLen == 14 && strncasecmp(headerStart, "Content-Length", keyLen) == 0) {
-            // Prevent duplicate Content-Length headers
-            if (httpInfo->isContentLengthSeen != 0) {
-                return INVALID_CONTENT_LENGTH;
-            }
-            // Parse Content-Length value
-            size_t length = 0;
-            for (size_t i = 0;i < valLen;i++) {
-                if (valStart[i] >= '0' && valStart[i] <= '9') {
-                    length = length * 10 + (valStart[i] - '0');
+        size_t valLen = valEnd - valStart;
+
+        header_t* header = &httpInfo->headers[headerCnt++];
+        header->keyOffset = name - buffer;
+        header->keyLen = keyLen;
+        header->valueOffset = valStart - buffer;
+        header->valueLen = valLen;
+
+        knownHeader_t id = lookupKnownHeader(name, keyLen);
+        if (id != HEADER_UNKNOWN) {
+            httpInfo->known[id].data = valStart;
+            httpInfo->known[id].len = valLen;
+            switch (id) {
+            case HEADER_CONTENT_LENGTH:
+                // Prevent duplicate Content-Length headers
+                if (httpInfo->isContentLengthSeen != 0) {
+                    return INVALID_CONTENT_LENGTH;
                 }
-                else if (valStart[i] != '\r') {
+                httpInfo->isContentLengthSeen = 1;
+                if (parseContentLength(valStart, valLen, &httpInfo->contentLength) != OK) {
                     return INVALID_CONTENT_LENGTH;
                 }
-                else {
-                    break;
+                break;
+
+            case HEADER_CONNECTION:
+                // Check if connection should be closed
+                if (strcasestr_len(valStart, valLen, "close") != NULL) {
+                    httpInfo->isKeepAlive = 0;
                 }
-            }
-            httpInfo->contentLength = length;
-        }
-        else if (keyLen == 10 && strncasecmp(headerStart, "Connection", keyLen) == 0) {
-            // Check if connection should be closed
-            if (strcasestr_len(valStart, valLen, "close") != NULL) {
-                httpInfo->isKeepAlive = 0;
+                break;
+
+            case HEADER_ACCEPT_ENCODING:
+                httpInfo->acceptEncoding = parseAcceptEncoding(valStart, valLen);
+                break;
+
+            case HEADER_TRANSFER_ENCODING:
+                // Only plain "chunked", a repeated header would stack codings
+                if (httpInfo->isChunked || valLen != 7 || strncasecmp(valStart, "chunked", 7) != 0) {
+                    return UNSUPPORTED_TRANSFER_ENCODING;
+                }
+                httpInfo->isChunked = 1;
+                break;
+
+            default:
+                break;
             }
         }
-        headerCnt++;
 
-        headerStart = lineEnd + 2; // Jump to next line
+        cursor = lineEnd + 2; // Jump to next line
     }
 
     httpInfo->headerCnt = headerCnt;
 
+    // Both framings at once is how requests get smuggled past proxies
+    if (httpInfo->isChunked && httpInfo->isContentLengthSeen) {
+        return INVALID_CONTENT_LENGTH;
+    }
+
     // Validate: GET requests should not have a body
-    if (httpInfo->method.data[0] == 'G' && httpInfo->contentLength != 0) {
+    if (httpInfo->method.data[0] == 'G' && (httpInfo->contentLength != 0 || httpInfo->isChunked)) {
         return BODY_NOT_ALLOWED;
     }
 
-    checkIfApi(httpInfo);
     return OK;
 }
 
@@ -356,7 +488,8 @@ parserResult_t normalizePath(bufferView_t* decodedPath, bufferView_t* normalized
             return BAD_REQUEST_PATH;
         }
 
-        memcpy(out, seg_start, seg_len);
+        // Regions overlap when normalizing in place
+        memmove(out, seg_start, seg_len);
         out += seg_len;
     }
 
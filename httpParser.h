@@ -2,8 +2,13 @@
 #define HTTP_PARSER_H
 
 #include <stddef.h>
+#include <stdint.h>
 
-#define PATH_BUFFER_CAP 8192
+#define PATH_BUFFER_CAP 8192 // longest normalized path accepted
+
+// acceptEncoding bits
+#define ENCODING_GZIP 0x1
+#define ENCODING_BR 0x2
 
 struct connection; 
 typedef struct connection connection_t;
@@ -20,46 +25,100 @@ typedef struct {
 
 /**
  * Structure representing an HTTP header key-value pair
+ * Stored as offsets from the start of the request (httpInfo_t.method.data),
+ * a header block never exceeds MAX_HEADER_SIZE so 16 bits are enough.
+ * Use httpHeaderAt() to get views.
  */
 typedef struct {
-    bufferView_t key;
-    bufferView_t value;
+    uint16_t keyOffset;
+    uint16_t keyLen;
+    uint16_t valueOffset;
+    uint16_t valueLen;
 }header_t;
 
+#define MAX_HEADERS 100
+
+/**
+ * Structure representing a parameter captured by the matched route
+ * name: ":name" of the pattern without the colon, "*" for a prefix rule
+ * value: Matched bytes of normalizedPath
+ */
+typedef struct {
+    bufferView_t name;
+    bufferView_t value;
+}routeParam_t;
+
+#define ROUTE_PARAMS_MAX 8
+
+struct route;
+
+/**
+ * Well known header names, each has an O(1) slot in httpInfo_t.known.
+ * Resolved with a perfect hash while the header line is parsed.
+ */
+typedef enum {
+    HEADER_HOST,
+    HEADER_CONTENT_LENGTH,
+    HEADER_CONTENT_TYPE,
+    HEADER_CONNECTION,
+    HEADER_ACCEPT_ENCODING,
+    HEADER_IF_NONE_MATCH,
+    HEADER_IF_MODIFIED_SINCE,
+    HEADER_RANGE,
+    HEADER_IF_RANGE,
+    HEADER_TRANSFER_ENCODING,
+    HEADER_EXPECT,
+    HEADER_USER_AGENT,
+    HEADER_UPGRADE,
+    HEADER_AUTHORIZATION,
+    HEADER_COOKIE,
+    HEADER_KEEP_ALIVE,
+    KNOWN_HEADER_COUNT,
+    HEADER_UNKNOWN = KNOWN_HEADER_COUNT
+}knownHeader_t;
+
 /**
  * Structure containing parsed HTTP request information
  * method: HTTP method (GET, POST, etc.)
  * path: Request path/URI
  * version: HTTP version (e.g., HTTP/1.1)
  * headerCnt: Number of headers parsed
- * headers: Array of parsed headers
+ * headers: Array of parsed headers (every header, in request order, 8 bytes each)
+ * known: Value of each well known header (indexed by knownHeader_t), len 0 when absent
  * contentLength: Length of request body
- * contentType: Content-Type header value
  * isContentLengthSeen: Flag indicating if Content-Length was present
+ * isChunked: Body uses Transfer-Encoding: chunked, contentLength is set once it is decoded
  * body: Request body data
  * isKeepAlive: Flag for persistent connection (1=keep-alive, 0=close)
- * isApi: To check if the request is api or file request
+ * isApi: Set from the matched route, generated response instead of a static file
+ * acceptEncoding: ENCODING_* bits the client accepts (Accept-Encoding, q=0 excluded)
+ * decodedPath/normalizedPath: Decoded in place over path, so all three views
+ * point into the read buffer and path no longer holds the raw bytes afterwards
+ * route: Route matched by routerMatch() once the path is normalized
+ * paramCnt/params: Parameters captured by the route, values point into normalizedPath
+ *
+ * Connections only hold one (from the worker request pool) while a request
+ * is in flight, idle keep-alive connections carry none.
  */
 typedef struct {
     bufferView_t method;
     bufferView_t path;
     bufferView_t version;
     size_t headerCnt;
-    // header_t* headers; This worked well in blocking phase where we allocated it on heap
-    // For simplicity, I will just use stack for now for each request
-    header_t headers[100];
+    header_t headers[MAX_HEADERS];
+    bufferView_t known[KNOWN_HEADER_COUNT];
     size_t contentLength;
-    bufferView_t contentType;
     int isContentLengthSeen;
+    int isChunked;
     bufferView_t body;
     int isKeepAlive;
     int isApi;
+    int acceptEncoding;
     bufferView_t decodedPath;
     bufferView_t normalizedPath;
-    char decodedPathBuf[PATH_BUFFER_CAP];
-    char normalizedPathBuf[PATH_BUFFER_CAP];
-    size_t decodedPathCap;
-    size_t normalizedPathCap;
+    const struct route* route;
+    size_t paramCnt;
+    routeParam_t params[ROUTE_PARAMS_MAX];
 }httpInfo_t;
 
 /**
@@ -79,7 +138,8 @@ typedef enum {
     TOO_MANY_HEADERS,
     PAYLOAD_TOO_LARGE,
     REQUEST_TIMEOUT,
-    BAD_REQUEST_PATH
+    BAD_REQUEST_PATH,
+    BAD_REQUEST_BODY
 }parserResult_t;
 
 typedef struct {
@@ -105,8 +165,32 @@ parserResult_t requestAndHeaderParser(char* buffer, char* headerEnd, httpInfo_t*
  */
 parserResult_t bodyParser(char* bodyStart, httpInfo_t* httpInfo);
 
+/**
+ * Moves every view of httpInfo from oldBase to newBase after the read
+ * buffer holding the request was reallocated (headers are offsets and
+ * follow method automatically)
+ */
+void rebaseHttpInfo(httpInfo_t* httpInfo, const char* oldBase, char* newBase);
+
+/**
+ * Key and value views of the header at index (< headerCnt)
+ */
+void httpHeaderAt(const httpInfo_t* httpInfo, size_t index, bufferView_t* key, bufferView_t* value);
+
+/**
+ * Percent-decodes requestPath into decodedPath->data, which may be
+ * requestPath->data itself: the output never outgrows the input
+ * @param decodedPath data set by the caller, len is set to the decoded length
+ */
 parserResult_t decodeUrl(bufferView_t* requestPath, bufferView_t* decodedPath);
 
+/**
+ * Resolves "." and ".." segments and repeated slashes.
+ * normalizedPath->data may equal decodedPath->data when the decoded path
+ * starts with '/', segments only ever move towards the front.
+ * @param normalizedPath data set by the caller, len is its capacity on input
+ * and the normalized length on return
+ */
 parserResult_t normalizePath(bufferView_t* decodedPath, bufferView_t* normalizedPath);
 
 void handleParseError(parserResult_t res, connection_t* conn);
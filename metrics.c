@@ -0,0 +1,310 @@
+#define _GNU_SOURCE
+#include "metrics.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
+#include "connection.h"
+#include "httpParser.h"
+
+_Static_assert(CLOSING + 1 == METRICS_CONN_STATES, "METRICS_CONN_STATES out of sync with conn_state_t");
+_Static_assert(BAD_REQUEST_BODY + 1 == METRICS_PARSE_RESULTS, "METRICS_PARSE_RESULTS out of sync with parserResult_t");
+
+static workerMetrics_t* workerMetrics;
+static int workerCount;
+
+static const char* stateNames[METRICS_CONN_STATES] = {
+    [READING_HEADERS] = "reading_headers",
+    [READING_BODY] = "reading_body",
+    [PROCESSING] = "processing",
+    [WRITING_RESPONSE] = "writing_response",
+    [SENDING_FILE] = "sending_file",
+    [AWAITING_IO] = "awaiting_io",
+    [TLS_HANDSHAKE] = "tls_handshake",
+    [PROXYING] = "proxying",
+    [CLOSING] = "closing"
+};
+
+static const char* parseResultNames[METRICS_PARSE_RESULTS] = {
+    [OK] = "ok",
+    [BAD_REQUEST_LINE] = "bad_request_line",
+    [BAD_HEADER_SYNTAX] = "bad_header_syntax",
+    [INVALID_VERSION] = "invalid_version",
+    [INVALID_CONTENT_LENGTH] = "invalid_content_length",
+    [BODY_NOT_ALLOWED] = "body_not_allowed",
+    [MISSING_REQUIRED_HEADERS] = "missing_required_headers",
+    [UNSUPPORTED_TRANSFER_ENCODING] = "unsupported_transfer_encoding",
+    [UNSUPPORTED_METHOD] = "unsupported_method",
+    [HEADER_TOO_LARGE] = "header_too_large",
+    [TOO_MANY_HEADERS] = "too_many_headers",
+    [PAYLOAD_TOO_LARGE] = "payload_too_large",
+    [REQUEST_TIMEOUT] = "request_timeout",
+    [BAD_REQUEST_PATH] = "bad_request_path",
+    [BAD_REQUEST_BODY] = "bad_request_body"
+};
+
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+int initializeMetrics(int workers) {
+    size_t size = (size_t)workers * sizeof(workerMetrics_t);
+    workerMetrics = aligned_alloc(_Alignof(workerMetrics_t), size);
+    if (!workerMetrics) {
+        return -1;
+    }
+    memset(workerMetrics, 0, size);
+    workerCount = workers;
+    return 0;
+}
+
+workerMetrics_t* metricsForWorker(int id) {
+    return &workerMetrics[id];
+}
+
+int64_t monotonicUs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Below 2^(SUB_BITS+1) the value is its own bucket, above it the top
+// SUB_BITS bits after the leading one pick the bucket within its power of two
+static int latencyBucket(uint64_t us) {
+    if (us < 2 * LATENCY_SUB_BUCKETS) {
+        return (int)us;
+    }
+    int exponent = 63 - __builtin_clzll(us);
+    if (exponent > LATENCY_MAX_EXPONENT) {
+        return LATENCY_BUCKETS - 1;
+    }
+    int sub = (int)(us >> (exponent - LATENCY_SUB_BITS)) & (LATENCY_SUB_BUCKETS - 1);
+    return (exponent - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS + sub;
+}
+
+uint64_t latencyBucketUpper(int index) {
+    if (index < 2 * LATENCY_SUB_BUCKETS) {
+        return (uint64_t)index;
+    }
+    int exponent = index / LATENCY_SUB_BUCKETS + LATENCY_SUB_BITS - 1;
+    uint64_t sub = (uint64_t)(index % LATENCY_SUB_BUCKETS);
+    int shift = exponent - LATENCY_SUB_BITS;
+    return ((LATENCY_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+void histogramRecord(latencyHistogram_t* histogram, uint64_t us) {
+    histogram->counts[latencyBucket(us)]++;
+    histogram->count++;
+    histogram->sumUs += us;
+}
+
+uint64_t histogramQuantile(const latencyHistogram_t* histogram, double quantile) {
+    if (histogram->count == 0) {
+        return 0;
+    }
+    // Rank of the sample the quantile falls on, 1 based
+    uint64_t rank = (uint64_t)(quantile * (double)histogram->count + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0;i < LATENCY_BUCKETS;i++) {
+        seen += histogram->counts[i];
+        if (seen >= rank) {
+            return latencyBucketUpper(i);
+        }
+    }
+    return latencyBucketUpper(LATENCY_BUCKETS - 1);
+}
+
+void metricsCountResponse(workerMetrics_t* metrics, int statusCode) {
+    if (statusCode >= METRICS_STATUS_MIN && statusCode <= METRICS_STATUS_MAX) {
+        metrics->responses[statusCode - METRICS_STATUS_MIN]++;
+    }
+}
+
+static void mergeHistogram(latencyHistogram_t* into, const latencyHistogram_t* from) {
+    for (int i = 0;i < LATENCY_BUCKETS;i++) {
+        into->counts[i] += from->counts[i];
+    }
+    into->count += from->count;
+    into->sumUs += from->sumUs;
+}
+
+// Text under construction, failed stays set once an allocation failed
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+    int failed;
+}textBuilder_t;
+
+static void appendText(textBuilder_t* text, const char* format, ...) {
+    while (!text->failed) {
+        va_list args;
+        va_start(args, format);
+        int written = vsnprintf(text->data + text->len, text->cap - text->len, format, args);
+        va_end(args);
+        if (written < 0) {
+            text->failed = 1;
+            return;
+        }
+        if ((size_t)written < text->cap - text->len) {
+            text->len += written;
+            return;
+        }
+        char* grown = realloc(text->data, text->cap * 2);
+        if (!grown) {
+            text->failed = 1;
+            return;
+        }
+        text->data = grown;
+        text->cap *= 2;
+    }
+}
+
+static void appendFamily(textBuilder_t* text, const char* name, const char* type, const char* help) {
+    appendText(text, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void appendSummary(textBuilder_t* text, const char* name, const char* help, const latencyHistogram_t* histogram) {
+    appendFamily(text, name, "summary", help);
+    for (size_t i = 0;i < sizeof(quantiles) / sizeof(quantiles[0]);i++) {
+        appendText(text, "%s{quantile=\"%g\"} %.6f\n", name, quantiles[i],
+            (double)histogramQuantile(histogram, quantiles[i]) / 1e6);
+    }
+    appendText(text, "%s_sum %.6f\n%s_count %llu\n", name, (double)histogram->sumUs / 1e6,
+        name, (unsigned long long)histogram->count);
+}
+
+char* renderMetrics(size_t* len) {
+    // Big enough to hold all histograms, not worth keeping on the stack
+    workerMetrics_t* sum = calloc(1, sizeof(workerMetrics_t));
+    if (!sum) {
+        return NULL;
+    }
+    for (int w = 0;w < workerCount;w++) {
+        const workerMetrics_t* metrics = &workerMetrics[w];
+        sum->accepts += metrics->accepts;
+        sum->wakeups += metrics->wakeups;
+        for (int i = 0;i < METRICS_CONN_STATES;i++) {
+            sum->connections[i] += metrics->connections[i];
+        }
+        for (int i = 0;i <= METRICS_STATUS_MAX - METRICS_STATUS_MIN;i++) {
+            sum->responses[i] += metrics->responses[i];
+        }
+        sum->sendBytes += metrics->sendBytes;
+        sum->sendfileBytes += metrics->sendfileBytes;
+        for (int i = 0;i < METRICS_PARSE_RESULTS;i++) {
+            sum->parseErrors[i] += metrics->parseErrors[i];
+        }
+        sum->offloadedLookups += metrics->offloadedLookups;
+        sum->accessLogDropped += metrics->accessLogDropped;
+        sum->accessLogSampled += metrics->accessLogSampled;
+        sum->tlsFull += metrics->tlsFull;
+        sum->tlsResumed += metrics->tlsResumed;
+        sum->tlsFailed += metrics->tlsFailed;
+        sum->tlsKernelSend += metrics->tlsKernelSend;
+        sum->bufferBytes += metrics->bufferBytes;
+        sum->readDeferrals += metrics->readDeferrals;
+        sum->memoryReclaims += metrics->memoryReclaims;
+        sum->upstreamIdle += metrics->upstreamIdle;
+        sum->upstreamOpened += metrics->upstreamOpened;
+        sum->upstreamReused += metrics->upstreamReused;
+        sum->upstreamErrors += metrics->upstreamErrors;
+        sum->upstreamTimeouts += metrics->upstreamTimeouts;
+        sum->upstreamSplicedBytes += metrics->upstreamSplicedBytes;
+        mergeHistogram(&sum->upstreamLatency, &metrics->upstreamLatency);
+        mergeHistogram(&sum->firstByte, &metrics->firstByte);
+        mergeHistogram(&sum->total, &metrics->total);
+    }
+
+    textBuilder_t text = { .data = malloc(8192), .len = 0, .cap = 8192, .failed = 0 };
+    text.failed = text.data == NULL;
+
+    appendFamily(&text, "http_server_workers", "gauge", "Worker threads.");
+    appendText(&text, "http_server_workers %d\n", workerCount);
+    appendFamily(&text, "http_server_accepted_connections_total", "counter", "Connections accepted.");
+    appendText(&text, "http_server_accepted_connections_total %llu\n", (unsigned long long)sum->accepts);
+    appendFamily(&text, "http_server_event_loop_wakeups_total", "counter",
+        "Event loop waits that returned, epoll_wait() or io_uring_enter().");
+    appendText(&text, "http_server_event_loop_wakeups_total %llu\n", (unsigned long long)sum->wakeups);
+
+    appendFamily(&text, "http_server_connections", "gauge", "Open connections by state.");
+    for (int i = 0;i < METRICS_CONN_STATES;i++) {
+        appendText(&text, "http_server_connections{state=\"%s\"} %lld\n", stateNames[i], (long long)sum->connections[i]);
+    }
+
+    appendFamily(&text, "http_server_responses_total", "counter", "Responses by status code.");
+    for (int i = 0;i <= METRICS_STATUS_MAX - METRICS_STATUS_MIN;i++) {
+        if (sum->responses[i] > 0) {
+            appendText(&text, "http_server_responses_total{code=\"%d\"} %llu\n", i + METRICS_STATUS_MIN,
+                (unsigned long long)sum->responses[i]);
+        }
+    }
+
+    appendFamily(&text, "http_server_sent_bytes_total", "counter", "Bytes sent, sendfile includes io_uring splice.");
+    appendText(&text, "http_server_sent_bytes_total{method=\"send\"} %llu\n", (unsigned long long)sum->sendBytes);
+    appendText(&text, "http_server_sent_bytes_total{method=\"sendfile\"} %llu\n", (unsigned long long)sum->sendfileBytes);
+
+    appendFamily(&text, "http_server_parse_errors_total", "counter", "Rejected requests by parser result.");
+    for (int i = OK + 1;i < METRICS_PARSE_RESULTS;i++) {
+        appendText(&text, "http_server_parse_errors_total{result=\"%s\"} %llu\n", parseResultNames[i],
+            (unsigned long long)sum->parseErrors[i]);
+    }
+
+    appendFamily(&text, "http_server_offloaded_lookups_total", "counter",
+        "Static file lookups resolved on the offload pool instead of the event loop.");
+    appendText(&text, "http_server_offloaded_lookups_total %llu\n", (unsigned long long)sum->offloadedLookups);
+
+    appendFamily(&text, "http_server_access_log_shed_total", "counter",
+        "Access log records not written: ring full, or sampled out above its shed mark.");
+    appendText(&text, "http_server_access_log_shed_total{reason=\"full\"} %llu\n", (unsigned long long)sum->accessLogDropped);
+    appendText(&text, "http_server_access_log_shed_total{reason=\"sampled\"} %llu\n", (unsigned long long)sum->accessLogSampled);
+
+    appendFamily(&text, "http_server_tls_handshakes_total", "counter",
+        "TLS handshakes: full, resumed from a ticket or cached session, or failed.");
+    appendText(&text, "http_server_tls_handshakes_total{result=\"full\"} %llu\n", (unsigned long long)sum->tlsFull);
+    appendText(&text, "http_server_tls_handshakes_total{result=\"resumed\"} %llu\n", (unsigned long long)sum->tlsResumed);
+    appendText(&text, "http_server_tls_handshakes_total{result=\"failed\"} %llu\n", (unsigned long long)sum->tlsFailed);
+    appendFamily(&text, "http_server_tls_kernel_send_total", "counter",
+        "TLS sessions whose sends are encrypted by the kernel (kTLS).");
+    appendText(&text, "http_server_tls_kernel_send_total %llu\n", (unsigned long long)sum->tlsKernelSend);
+    appendFamily(&text, "http_server_buffer_bytes", "gauge",
+        "Read and write buffer bytes held by connections, pooled free buffers excluded.");
+    appendText(&text, "http_server_buffer_bytes %lld\n", (long long)sum->bufferBytes);
+    appendFamily(&text, "http_server_read_deferrals_total", "counter",
+        "Reads stopped until --memory-budget had room for a larger read buffer.");
+    appendText(&text, "http_server_read_deferrals_total %llu\n", (unsigned long long)sum->readDeferrals);
+    appendFamily(&text, "http_server_memory_reclaims_total", "counter",
+        "Idle keep-alive connections closed to free memory for deferred reads.");
+    appendText(&text, "http_server_memory_reclaims_total %llu\n", (unsigned long long)sum->memoryReclaims);
+    appendFamily(&text, "http_server_upstream_idle_connections", "gauge",
+        "Pooled keep-alive connections to --proxy upstreams.");
+    appendText(&text, "http_server_upstream_idle_connections %lld\n", (long long)sum->upstreamIdle);
+    appendFamily(&text, "http_server_upstream_connections_total", "counter",
+        "Upstream connections used for proxied requests: newly opened or reused from the pool.");
+    appendText(&text, "http_server_upstream_connections_total{result=\"opened\"} %llu\n", (unsigned long long)sum->upstreamOpened);
+    appendText(&text, "http_server_upstream_connections_total{result=\"reused\"} %llu\n", (unsigned long long)sum->upstreamReused);
+    appendFamily(&text, "http_server_upstream_failures_total", "counter",
+        "Proxied requests that failed on the upstream or ran past --upstream-timeout.");
+    appendText(&text, "http_server_upstream_failures_total{reason=\"error\"} %llu\n", (unsigned long long)sum->upstreamErrors);
+    appendText(&text, "http_server_upstream_failures_total{reason=\"timeout\"} %llu\n", (unsigned long long)sum->upstreamTimeouts);
+    appendFamily(&text, "http_server_upstream_spliced_bytes_total", "counter",
+        "Proxied response body bytes moved to the client with splice(), never copied to userspace.");
+    appendText(&text, "http_server_upstream_spliced_bytes_total %llu\n", (unsigned long long)sum->upstreamSplicedBytes);
+
+    appendSummary(&text, "http_server_time_to_first_byte_seconds",
+        "Request start to the first response byte handed to the kernel.", &sum->firstByte);
+    appendSummary(&text, "http_server_request_duration_seconds",
+        "Request start to the last response byte handed to the kernel.", &sum->total);
+    appendSummary(&text, "http_server_upstream_response_seconds",
+        "Proxied request forwarded to the upstream response head parsed.", &sum->upstreamLatency);
+
+    free(sum);
+    if (text.failed) {
+        free(text.data);
+        return NULL;
+    }
+    *len = text.len;
+    return text.data;
+}
@@ -0,0 +1,137 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Per-worker counters and latency histograms. Every worker only writes its
+ * own workerMetrics_t with plain increments (no atomics or locks on the
+ * request path); /api/metrics sums all of them on demand. Readers on other
+ * threads may see slightly stale values, like printPoolStats().
+ */
+
+#define METRICS_CONN_STATES 9      // conn_state_t values, checked in metrics.c
+#define METRICS_PARSE_RESULTS 15   // parserResult_t values, checked in metrics.c
+#define METRICS_STATUS_MIN 100
+#define METRICS_STATUS_MAX 599
+
+// Log-linear buckets, HDR style: 2^LATENCY_SUB_BITS buckets per power of two,
+// exact below 16us and within 12.5% above, up to 2^32us (about 71 minutes)
+#define LATENCY_SUB_BITS 3
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_EXPONENT 31
+#define LATENCY_BUCKETS ((LATENCY_MAX_EXPONENT - LATENCY_SUB_BITS + 2) * LATENCY_SUB_BUCKETS)
+
+/**
+ * Latency histogram in microseconds
+ * counts: Samples per bucket, see latencyBucketUpper() for the bounds
+ * count: Samples recorded
+ * sumUs: Sum of all samples
+ */
+typedef struct {
+    uint64_t counts[LATENCY_BUCKETS];
+    uint64_t count;
+    uint64_t sumUs;
+}latencyHistogram_t;
+
+/**
+ * Structure holding the metrics of one worker, cache line aligned so
+ * workers never write to the same line
+ * accepts: Connections accepted
+ * wakeups: Event loop waits that returned (epoll_wait() or io_uring_enter())
+ * connections: Open connections by conn_state_t, as of their last event
+ * responses: Responses queued by status code (index code - METRICS_STATUS_MIN)
+ * sendBytes: Bytes written with send()/sendmsg(), heads and buffered bodies
+ * sendfileBytes: File bytes written with sendfile() or splice
+ * parseErrors: Requests rejected by parserResult_t
+ * offloadedLookups: Static file lookups sent to the offload pool (cache misses and revalidations)
+ * accessLogDropped/accessLogSampled: Access log records shed because the ring was full / above its shed mark
+ * tlsFull/tlsResumed/tlsFailed: TLS handshakes that finished without / with a resumed session, or failed
+ * tlsKernelSend: TLS sessions that went on with kTLS sends
+ * bufferBytes: Connection buffer bytes held (bufferPool_t inUse), refreshed once per event loop iteration
+ * readDeferrals: Reads stopped because read_buf could not grow within --memory-budget
+ * memoryReclaims: Idle keep-alive connections closed to give memory to deferred reads
+ * upstreamIdle: Pooled upstream connections waiting for a request
+ * upstreamOpened/upstreamReused: Upstream connections opened / taken from the pool for a request
+ * upstreamErrors/upstreamTimeouts: Proxied requests that failed on the upstream / ran past --upstream-timeout
+ * upstreamSplicedBytes: Response body bytes moved from upstream to client with splice()
+ * upstreamLatency: Request forwarded to the upstream response head parsed
+ * firstByte: Request start to the first byte of its response handed to the kernel
+ * total: Request start to the last byte of its response handed to the kernel
+ */
+typedef struct {
+    uint64_t accepts;
+    uint64_t wakeups;
+    int64_t connections[METRICS_CONN_STATES];
+    uint64_t responses[METRICS_STATUS_MAX - METRICS_STATUS_MIN + 1];
+    uint64_t sendBytes;
+    uint64_t sendfileBytes;
+    uint64_t parseErrors[METRICS_PARSE_RESULTS];
+    uint64_t offloadedLookups;
+    uint64_t accessLogDropped;
+    uint64_t accessLogSampled;
+    uint64_t tlsFull;
+    uint64_t tlsResumed;
+    uint64_t tlsFailed;
+    uint64_t tlsKernelSend;
+    int64_t bufferBytes;
+    uint64_t readDeferrals;
+    uint64_t memoryReclaims;
+    int64_t upstreamIdle;
+    uint64_t upstreamOpened;
+    uint64_t upstreamReused;
+    uint64_t upstreamErrors;
+    uint64_t upstreamTimeouts;
+    uint64_t upstreamSplicedBytes;
+    latencyHistogram_t upstreamLatency;
+    latencyHistogram_t firstByte;
+    latencyHistogram_t total;
+}__attribute__((aligned(64))) workerMetrics_t;
+
+/**
+ * Allocates the metrics of every worker, call once before the workers start
+ * @return 0 on success, -1 when the allocation failed
+ */
+int initializeMetrics(int workers);
+
+/**
+ * @return Metrics of worker id (0..workers-1)
+ */
+workerMetrics_t* metricsForWorker(int id);
+
+/**
+ * @return Current monotonic time in microseconds
+ */
+int64_t monotonicUs(void);
+
+/**
+ * Adds one sample, values beyond the last bucket land in it
+ */
+void histogramRecord(latencyHistogram_t* histogram, uint64_t us);
+
+/**
+ * @return Largest value that falls into bucket index
+ */
+uint64_t latencyBucketUpper(int index);
+
+/**
+ * @param quantile 0..1
+ * @return Upper bound of the bucket holding the quantile, 0 for an empty histogram
+ */
+uint64_t histogramQuantile(const latencyHistogram_t* histogram, double quantile);
+
+/**
+ * Counts a response by status code, codes outside 100..599 are ignored
+ */
+void metricsCountResponse(workerMetrics_t* metrics, int statusCode);
+
+/**
+ * Sums the metrics of every worker and formats them in the Prometheus text
+ * exposition format (version 0.0.4)
+ * @param len Set to the length of the returned text
+ * @return malloc()ed text the caller frees, NULL when the allocation failed
+ */
+char* renderMetrics(size_t* len);
+
+#endif
@@ -0,0 +1,126 @@
+#include "offload.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+// Jobs waiting for a pool thread, shared by every worker
+static pthread_mutex_t submitLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t submitReady = PTHREAD_COND_INITIALIZER;
+static offloadJob_t* submitHead;
+static offloadJob_t* submitTail;
+static int started;
+
+static void* offloadRun(void* arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&submitLock);
+        while (!submitHead) {
+            pthread_cond_wait(&submitReady, &submitLock);
+        }
+        offloadJob_t* job = submitHead;
+        submitHead = job->next;
+        if (!submitHead) {
+            submitTail = NULL;
+        }
+        pthread_mutex_unlock(&submitLock);
+
+        job->run(job);
+
+        // Only the first finished job of a drain wakes the worker, the rest ride along
+        offloadQueue_t* queue = job->owner;
+        job->next = NULL;
+        pthread_mutex_lock(&queue->lock);
+        int wake = queue->head == NULL;
+        if (queue->tail) queue->tail->next = job;
+        else queue->head = job;
+        queue->tail = job;
+        pthread_mutex_unlock(&queue->lock);
+        if (wake) {
+            uint64_t one = 1;
+            if (write(queue->event_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+                perror("offload eventfd write");
+            }
+        }
+    }
+    return NULL;
+}
+
+int startOffloadPool(int threads) {
+    // Signals stay with the main thread's sigwait(), pool threads block them all
+    sigset_t all;
+    sigset_t previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &previous);
+    for (int i = 0;i < threads;i++) {
+        pthread_t thread;
+        int err = pthread_create(&thread, NULL, offloadRun, NULL);
+        if (err != 0) {
+            pthread_sigmask(SIG_SETMASK, &previous, NULL);
+            errno = err;
+            return -1;
+        }
+        pthread_detach(thread);
+    }
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    started = threads > 0;
+    return 0;
+}
+
+int offloadEnabled(void) {
+    return started;
+}
+
+int initializeOffloadQueue(offloadQueue_t* queue) {
+    queue->head = NULL;
+    queue->tail = NULL;
+    if (pthread_mutex_init(&queue->lock, NULL) != 0) {
+        return -1;
+    }
+    if ((queue->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        pthread_mutex_destroy(&queue->lock);
+        return -1;
+    }
+    return 0;
+}
+
+void offloadSubmit(offloadQueue_t* queue, offloadJob_t* job) {
+    job->owner = queue;
+    job->next = NULL;
+    pthread_mutex_lock(&submitLock);
+    if (submitTail) submitTail->next = job;
+    else submitHead = job;
+    submitTail = job;
+    pthread_cond_signal(&submitReady);
+    pthread_mutex_unlock(&submitLock);
+}
+
+void offloadAcknowledge(offloadQueue_t* queue) {
+    uint64_t count;
+    if (read(queue->event_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        perror("offload eventfd read");
+    }
+}
+
+void offloadDrain(offloadQueue_t* queue, void (*drive)(void* target, void* context), void* context) {
+    // The counter was cleared before the list is taken, a job finishing
+    // after this point finds the list empty and wakes the loop again
+    pthread_mutex_lock(&queue->lock);
+    offloadJob_t* job = queue->head;
+    queue->head = NULL;
+    queue->tail = NULL;
+    pthread_mutex_unlock(&queue->lock);
+
+    while (job) {
+        offloadJob_t* next = job->next;
+        void* target = job->complete(job);
+        if (target) {
+            drive(target, context);
+        }
+        job = next;
+    }
+}
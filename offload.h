@@ -0,0 +1,75 @@
+#ifndef OFFLOAD_H
+#define OFFLOAD_H
+
+#include <pthread.h>
+
+/**
+ * Thread pool for blocking work the event loops must not wait on (opening
+ * and stat'ing cold files). Workers submit jobs to one shared queue, the
+ * pool runs them and hands each back to the completion queue of the worker
+ * that submitted it, whose eventfd wakes its event loop.
+ */
+
+struct offloadQueue;
+
+/**
+ * Structure every job starts with, the submitter embeds it in its own job
+ * run: Blocking part, runs on a pool thread
+ * complete: Runs on the submitting worker once run() returned, owns (frees) the job
+ * and returns what the worker has to drive next (its connection), NULL for nothing
+ * owner: Completion queue the job goes back to
+ */
+typedef struct offloadJob {
+    struct offloadJob* next;
+    void (*run)(struct offloadJob* job);
+    void* (*complete)(struct offloadJob* job);
+    struct offloadQueue* owner;
+}offloadJob_t;
+
+/**
+ * Structure holding the finished jobs of one worker
+ * event_fd: Readable while finished jobs wait, the event loop polls it
+ * lock: Guards head/tail, taken once per finished job and once per drain
+ */
+typedef struct offloadQueue {
+    int event_fd;
+    pthread_mutex_t lock;
+    offloadJob_t* head;
+    offloadJob_t* tail;
+}offloadQueue_t;
+
+/**
+ * Starts the pool threads, call once before the workers run
+ * @return 0 on success, -1 on failure (errno set)
+ */
+int startOffloadPool(int threads);
+
+/**
+ * @return 1 once startOffloadPool() succeeded
+ */
+int offloadEnabled(void);
+
+/**
+ * Creates the eventfd of a worker completion queue
+ * @return 0 on success, -1 on failure
+ */
+int initializeOffloadQueue(offloadQueue_t* queue);
+
+/**
+ * Queues job for the pool, complete() later runs on the worker owning queue
+ */
+void offloadSubmit(offloadQueue_t* queue, offloadJob_t* job);
+
+/**
+ * Clears the eventfd counter, the epoll loop calls it before offloadDrain()
+ * (io_uring reads the counter itself)
+ */
+void offloadAcknowledge(offloadQueue_t* queue);
+
+/**
+ * Completes every finished job on the calling worker
+ * @param drive Called with each non NULL result of complete()
+ */
+void offloadDrain(offloadQueue_t* queue, void (*drive)(void* target, void* context), void* context);
+
+#endif
@@ -0,0 +1,537 @@
+#define _GNU_SOURCE
+#include "pack.h"
+#include "handlers.h"
+#include "fileCache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define PACK_MAGIC "CHSPACK1"
+#define PACK_VERSION 1
+#define PACK_FIELDS_MAX 512 // same bound as a prebuilt small file response
+
+/**
+ * On disk layout, native byte order (built and served on the same machine):
+ * header, entries, index slots, strings, then the responses. Every offset is
+ * from the start of the file, strings are NUL terminated.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t entryCount;
+    uint32_t slotCount;     // power of two, at least twice entryCount
+    uint32_t stringsLen;
+    uint64_t entriesOffset;
+    uint64_t slotsOffset;   // uint32_t each, entry index + 1, 0 for an empty slot
+    uint64_t stringsOffset;
+    uint64_t size;
+}packHeader_t;
+
+typedef struct {
+    uint64_t response;      // 0 when the variant is absent
+    uint64_t bodyLen;
+    uint32_t fieldsLen;
+    uint32_t etag;          // string offset
+}storedVariant_t;
+
+typedef struct {
+    uint64_t hash;
+    int64_t mtime;
+    uint32_t path;          // string offsets
+    uint32_t pathLen;
+    uint32_t contentType;
+    uint32_t lastModified;
+    storedVariant_t variants[PACK_VARIANTS];
+}storedEntry_t;
+
+_Static_assert(sizeof(packHeader_t) % 8 == 0 && sizeof(storedEntry_t) % 8 == 0, "pack records keep 8 byte alignment");
+
+// Mapping of the loaded pack, read only and shared by every worker
+static const char* mapping;
+static const packHeader_t* header;
+static const storedEntry_t* entries;
+static const uint32_t* slots;
+static const char* strings;
+
+// FNV-1a like the file cache, part of the format: the index is built with it
+static uint64_t hashPath(const char* path, size_t len) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (size_t i = 0;i < len;i++) {
+        hash ^= (unsigned char)path[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+int packLoaded(void) {
+    return mapping != NULL;
+}
+
+int packLookup(const char* path, size_t len, packFile_t* file) {
+    uint64_t hash = hashPath(path, len);
+    uint32_t mask = header->slotCount - 1;
+    // Load factor stays under one half, a miss usually ends at the first empty slot
+    for (uint32_t slot = hash & mask;slots[slot] != 0;slot = (slot + 1) & mask) {
+        const storedEntry_t* entry = &entries[slots[slot] - 1];
+        if (entry->hash != hash || entry->pathLen != len || memcmp(strings + entry->path, path, len) != 0) {
+            continue;
+        }
+        file->contentType = strings + entry->contentType;
+        file->lastModified = strings + entry->lastModified;
+        file->mtime = entry->mtime;
+        for (int i = 0;i < PACK_VARIANTS;i++) {
+            const storedVariant_t* stored = &entry->variants[i];
+            packVariant_t* variant = &file->variants[i];
+            variant->response = stored->response ? mapping + stored->response : NULL;
+            variant->fieldsLen = stored->fieldsLen;
+            variant->bodyLen = stored->bodyLen;
+            variant->etag = strings + stored->etag;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+static int validString(uint32_t offset) {
+    return offset < header->stringsLen && memchr(strings + offset, '\0', header->stringsLen - offset) != NULL;
+}
+
+// Everything a lookup dereferences is checked once here, lookups trust the pack
+static int validatePack(size_t size) {
+    if (size < sizeof(packHeader_t)) {
+        return 0;
+    }
+    header = (const packHeader_t*)mapping;
+    if (memcmp(header->magic, PACK_MAGIC, sizeof(header->magic)) != 0 || header->version != PACK_VERSION ||
+        header->size != size) {
+        return 0;
+    }
+    if (header->slotCount == 0 || (header->slotCount & (header->slotCount - 1)) != 0 ||
+        header->slotCount <= header->entryCount ||
+        header->entriesOffset % 8 != 0 || header->slotsOffset % 4 != 0 ||
+        header->entriesOffset > size || (size - header->entriesOffset) / sizeof(storedEntry_t) < header->entryCount ||
+        header->slotsOffset > size || (size - header->slotsOffset) / sizeof(uint32_t) < header->slotCount ||
+        header->stringsOffset > size || size - header->stringsOffset < header->stringsLen) {
+        return 0;
+    }
+    entries = (const storedEntry_t*)(mapping + header->entriesOffset);
+    slots = (const uint32_t*)(mapping + header->slotsOffset);
+    strings = mapping + header->stringsOffset;
+
+    for (uint32_t i = 0;i < header->slotCount;i++) {
+        if (slots[i] > header->entryCount) {
+            return 0;
+        }
+    }
+    for (uint32_t i = 0;i < header->entryCount;i++) {
+        const storedEntry_t* entry = &entries[i];
+        if (entry->path >= header->stringsLen || header->stringsLen - entry->path <= entry->pathLen ||
+            !validString(entry->contentType) || !validString(entry->lastModified) ||
+            !entry->variants[0].response) {
+            return 0;
+        }
+        for (int v = 0;v < PACK_VARIANTS;v++) {
+            const storedVariant_t* variant = &entry->variants[v];
+            if (variant->response &&
+                (variant->response > size || size - variant->response < variant->fieldsLen ||
+                    size - variant->response - variant->fieldsLen < variant->bodyLen ||
+                    !validString(variant->etag))) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+int loadPack(const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    void* mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        return -1;
+    }
+    mapping = mapped;
+    if (!validatePack(st.st_size)) {
+        munmap(mapped, st.st_size);
+        mapping = NULL;
+        errno = EINVAL;
+        return -1;
+    }
+    // Bodies fault in on first use, only the index is read ahead
+    madvise(mapped, header->stringsOffset + header->stringsLen, MADV_WILLNEED);
+    return 0;
+}
+
+// File found under the document root while building
+typedef struct {
+    char* path;
+    size_t pathLen;
+    struct stat st;
+    int variantOf;          // source index of the file this is a sidecar of, -1 for none
+}packSource_t;
+
+typedef struct {
+    packSource_t* items;
+    size_t count;
+    size_t cap;
+}sourceList_t;
+
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+}stringTable_t;
+
+// Variant being written, fields serialized up front so every offset is known before the first write
+typedef struct {
+    int source;             // -1 when absent
+    char* fields;
+    size_t fieldsLen;
+}pendingVariant_t;
+
+static int addString(stringTable_t* table, const char* string, size_t len, uint32_t* offset) {
+    if (table->len + len + 1 > UINT32_MAX) {
+        errno = EFBIG;
+        return -1;
+    }
+    if (table->len + len + 1 > table->cap) {
+        size_t cap = table->cap ? table->cap * 2 : 4096;
+        while (cap < table->len + len + 1) cap *= 2;
+        char* data = realloc(table->data, cap);
+        if (!data) {
+            return -1;
+        }
+        table->data = data;
+        table->cap = cap;
+    }
+    *offset = table->len;
+    memcpy(table->data + table->len, string, len);
+    table->data[table->len + len] = '\0';
+    table->len += len + 1;
+    return 0;
+}
+
+// Same walk as the precompress pass: hidden entries and anything but directories and regular files are skipped
+static int collectSources(int dir_fd, const char* prefix, sourceList_t* list) {
+    int fd = dup(dir_fd);
+    if (fd == -1) {
+        return -1;
+    }
+    DIR* dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        return -1;
+    }
+    // The dup shares the offset a previous walk (--precompress) left at the end
+    rewinddir(dir);
+    struct dirent* ent;
+    int result = 0;
+    while (result == 0 && (ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] == '.') {
+            continue;
+        }
+        struct stat st;
+        if (fstatat(dir_fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+            continue;
+        }
+        char path[PATH_BUFFER_CAP];
+        int pathLen = snprintf(path, sizeof(path), "%s%s", prefix, ent->d_name);
+        if (pathLen < 0 || pathLen + 1 >= (int)sizeof(path)) {
+            // Longer than any path a request can name
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            int sub_fd = openat(dir_fd, ent->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (sub_fd != -1) {
+                path[pathLen] = '/';
+                path[pathLen + 1] = '\0';
+                result = collectSources(sub_fd, path, list);
+                close(sub_fd);
+            }
+            continue;
+        }
+        if (!S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (list->count == list->cap) {
+            size_t cap = list->cap ? list->cap * 2 : 64;
+            packSource_t* items = realloc(list->items, cap * sizeof(packSource_t));
+            if (!items) {
+                result = -1;
+                break;
+            }
+            list->items = items;
+            list->cap = cap;
+        }
+        packSource_t* source = &list->items[list->count];
+        if (!(source->path = strdup(path))) {
+            result = -1;
+            break;
+        }
+        source->pathLen = pathLen;
+        source->st = st;
+        source->variantOf = -1;
+        list->count++;
+    }
+    closedir(dir);
+    return result;
+}
+
+static int compareSources(const void* a, const void* b) {
+    return strcmp(((const packSource_t*)a)->path, ((const packSource_t*)b)->path);
+}
+
+static int findSource(const sourceList_t* list, const char* path) {
+    packSource_t key = { .path = (char*)path };
+    packSource_t* found = bsearch(&key, list->items, list->count, sizeof(packSource_t), compareSources);
+    return found ? (int)(found - list->items) : -1;
+}
+
+// Copies exactly the size seen while collecting, a file changing meanwhile fails the build
+static int copySource(int root_fd, const packSource_t* source, FILE* out) {
+    int fd = openat(root_fd, source->path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    char buffer[65536];
+    off_t left = source->st.st_size;
+    while (left > 0) {
+        ssize_t got = read(fd, buffer, left < (off_t)sizeof(buffer) ? (size_t)left : sizeof(buffer));
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0 || fwrite(buffer, 1, got, out) != (size_t)got) {
+            if (got == 0) errno = EAGAIN;
+            close(fd);
+            return -1;
+        }
+        left -= got;
+    }
+    close(fd);
+    return 0;
+}
+
+static const char* variantSuffixes[PACK_VARIANTS] = { "", ".br", ".gz" };
+static const char* variantEncodings[PACK_VARIANTS] = { NULL, "br", "gzip" };
+
+int buildPack(int root_fd, const char* path) {
+    sourceList_t list = { 0 };
+    stringTable_t table = { 0 };
+    storedEntry_t* stored = NULL;
+    pendingVariant_t* pending = NULL;
+    uint32_t* index = NULL;
+    FILE* out = NULL;
+    char temp[PATH_MAX];
+    size_t count = 0;
+    int result = -1;
+    int saved = 0;
+
+    if (snprintf(temp, sizeof(temp), "%s.tmp", path) >= (int)sizeof(temp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (collectSources(root_fd, "", &list) == -1) {
+        goto done;
+    }
+    qsort(list.items, list.count, sizeof(packSource_t), compareSources);
+
+    // name.br / name.gz of a compressible name travel with it instead of on their own
+    for (size_t i = 0;i < list.count;i++) {
+        packSource_t* source = &list.items[i];
+        for (int v = 1;v < PACK_VARIANTS;v++) {
+            size_t baseLen = source->pathLen - 3;
+            if (source->pathLen <= 3 || strcmp(source->path + baseLen, variantSuffixes[v]) != 0 ||
+                !isCompressibleType(getFileType(source->path, baseLen))) {
+                continue;
+            }
+            char base[PATH_BUFFER_CAP];
+            memcpy(base, source->path, baseLen);
+            base[baseLen] = '\0';
+            source->variantOf = findSource(&list, base);
+        }
+    }
+
+    for (size_t i = 0;i < list.count;i++) {
+        count += list.items[i].variantOf == -1;
+    }
+    if (count >= UINT32_MAX / 2) {
+        errno = EFBIG;
+        goto done;
+    }
+    uint32_t slotCount = 16;
+    while (slotCount < count * 2) {
+        slotCount *= 2;
+    }
+    stored = calloc(count ? count : 1, sizeof(storedEntry_t));
+    pending = calloc((count ? count : 1) * PACK_VARIANTS, sizeof(pendingVariant_t));
+    index = calloc(slotCount, sizeof(uint32_t));
+    if (!stored || !pending || !index) {
+        goto done;
+    }
+
+    size_t e = 0;
+    for (size_t i = 0;i < list.count;i++) {
+        const packSource_t* source = &list.items[i];
+        if (source->variantOf != -1) {
+            continue;
+        }
+        storedEntry_t* entry = &stored[e];
+        pendingVariant_t* variants = &pending[e * PACK_VARIANTS];
+        const char* contentType = getFileType(source->path, source->pathLen);
+        char etag[FILE_ETAG_MAX];
+        char lastModified[FILE_LAST_MODIFIED_MAX];
+        fileValidators(&source->st, etag, lastModified);
+        entry->hash = hashPath(source->path, source->pathLen);
+        entry->mtime = source->st.st_mtim.tv_sec;
+        entry->pathLen = source->pathLen;
+        if (addString(&table, source->path, source->pathLen, &entry->path) == -1 ||
+            addString(&table, contentType, strlen(contentType), &entry->contentType) == -1 ||
+            addString(&table, lastModified, strlen(lastModified), &entry->lastModified) == -1) {
+            goto done;
+        }
+
+        variants[0].source = i;
+        int encoded = 0;
+        for (int v = 1;v < PACK_VARIANTS;v++) {
+            char sidecar[PATH_BUFFER_CAP + 4];
+            snprintf(sidecar, sizeof(sidecar), "%s%s", source->path, variantSuffixes[v]);
+            int found = findSource(&list, sidecar);
+            variants[v].source = found != -1 && list.items[found].variantOf == (int)i ? found : -1;
+            encoded |= variants[v].source != -1;
+        }
+        // Fields of a keep-alive 200, exactly what fileHandler() would build for each variant
+        for (int v = 0;v < PACK_VARIANTS;v++) {
+            if (variants[v].source == -1) {
+                continue;
+            }
+            const packSource_t* variantSource = &list.items[variants[v].source];
+            char variantEtag[FILE_ETAG_MAX];
+            char unused[FILE_LAST_MODIFIED_MAX];
+            fileValidators(&variantSource->st, variantEtag, unused);
+            if (addString(&table, variantEtag, strlen(variantEtag), &entry->variants[v].etag) == -1) {
+                goto done;
+            }
+            response_t response = initializeResponse();
+            response.statusCode = 200;
+            response.statusText = "OK";
+            response.contentType = contentType;
+            response.contentEncoding = variantEncodings[v];
+            response.vary = encoded;
+            response.etag = variantEtag;
+            response.lastModified = lastModified;
+            response.acceptRanges = 1;
+            response.bodyLen = variantSource->st.st_size;
+            char fields[PACK_FIELDS_MAX];
+            size_t fieldsLen = generateResponseFields(&response, fields, sizeof(fields));
+            if (fieldsLen > sizeof(fields) || !(variants[v].fields = malloc(fieldsLen))) {
+                goto done;
+            }
+            memcpy(variants[v].fields, fields, fieldsLen);
+            variants[v].fieldsLen = fieldsLen;
+        }
+
+        uint32_t slot = entry->hash & (slotCount - 1);
+        while (index[slot] != 0) {
+            slot = (slot + 1) & (slotCount - 1);
+        }
+        index[slot] = e + 1;
+        e++;
+    }
+
+    packHeader_t head;
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, PACK_MAGIC, sizeof(head.magic));
+    head.version = PACK_VERSION;
+    head.entryCount = count;
+    head.slotCount = slotCount;
+    head.stringsLen = table.len;
+    head.entriesOffset = sizeof(packHeader_t);
+    head.slotsOffset = head.entriesOffset + count * sizeof(storedEntry_t);
+    head.stringsOffset = head.slotsOffset + (uint64_t)slotCount * sizeof(uint32_t);
+    uint64_t offset = head.stringsOffset + table.len;
+    for (size_t i = 0;i < count;i++) {
+        for (int v = 0;v < PACK_VARIANTS;v++) {
+            pendingVariant_t* variant = &pending[i * PACK_VARIANTS + v];
+            if (variant->source == -1) {
+                continue;
+            }
+            stored[i].variants[v].response = offset;
+            stored[i].variants[v].fieldsLen = variant->fieldsLen;
+            stored[i].variants[v].bodyLen = list.items[variant->source].st.st_size;
+            offset += variant->fieldsLen + stored[i].variants[v].bodyLen;
+        }
+    }
+    head.size = offset;
+
+    // A running server keeps its mapping of the old file, rename never truncates it
+    if (!(out = fopen(temp, "we"))) {
+        goto done;
+    }
+    if (fwrite(&head, sizeof(head), 1, out) != 1 ||
+        fwrite(stored, sizeof(storedEntry_t), count, out) != count ||
+        fwrite(index, sizeof(uint32_t), slotCount, out) != slotCount ||
+        fwrite(table.data, 1, table.len, out) != table.len) {
+        goto done;
+    }
+    for (size_t i = 0;i < count;i++) {
+        for (int v = 0;v < PACK_VARIANTS;v++) {
+            pendingVariant_t* variant = &pending[i * PACK_VARIANTS + v];
+            if (variant->source == -1) {
+                continue;
+            }
+            if (fwrite(variant->fields, 1, variant->fieldsLen, out) != variant->fieldsLen ||
+                copySource(root_fd, &list.items[variant->source], out) == -1) {
+                goto done;
+            }
+        }
+    }
+    FILE* closing = out;
+    out = NULL;
+    if (fclose(closing) != 0 || rename(temp, path) == -1) {
+        goto done;
+    }
+    result = count;
+
+done:
+    saved = errno;
+    if (out) {
+        fclose(out);
+    }
+    if (result == -1) {
+        unlink(temp);
+    }
+    for (size_t i = 0;pending && i < count * PACK_VARIANTS;i++) {
+        free(pending[i].fields);
+    }
+    for (size_t i = 0;i < list.count;i++) {
+        free(list.items[i].path);
+    }
+    free(list.items);
+    free(table.data);
+    free(stored);
+    free(pending);
+    free(index);
+    errno = saved;
+    return result;
+}
@@ -0,0 +1,73 @@
+#ifndef PACK_H
+#define PACK_H
+
+#include <stddef.h>
+#include <time.h>
+
+/**
+ * Static asset pack: the whole document root in one read only file, built
+ * ahead of time with --build-pack and mapped at startup with --pack. Every
+ * file is stored as its serialized keep-alive response (header fields after
+ * the status line and Date, then the body), next to its precompressed
+ * variants, and found through a hashed path index. Serving from it takes
+ * one hash probe and no filesystem syscall, the bytes go out straight from
+ * the mapping.
+ */
+
+#define PACK_VARIANTS 3 // identity, then the .br and .gz sidecars in handlers.c order
+
+/**
+ * Structure describing one stored representation of a file
+ * response: Serialized keep-alive 200, fields then body, NULL when the variant is absent
+ * fieldsLen: Length of the fields, the body starts right after them
+ * bodyLen: Length of the body
+ * etag: Strong validator of this representation
+ */
+typedef struct {
+    const char* response;
+    size_t fieldsLen;
+    size_t bodyLen;
+    const char* etag;
+}packVariant_t;
+
+/**
+ * Structure representing a file found in the pack, every pointer is into the mapping
+ * contentType: MIME type of the identity body
+ * lastModified: Source mtime as an IMF-fixdate
+ * mtime: Source mtime in seconds, for If-Modified-Since
+ * variants: Identity body first, always present
+ */
+typedef struct {
+    const char* contentType;
+    const char* lastModified;
+    time_t mtime;
+    packVariant_t variants[PACK_VARIANTS];
+}packFile_t;
+
+/**
+ * Writes every regular file under the document root (hidden names and
+ * symlinks skipped) into a new pack at path, through a temp file and rename.
+ * name.br / name.gz next to a compressible name become its variants.
+ * @return Number of files packed, -1 on failure (errno set)
+ */
+int buildPack(int root_fd, const char* path);
+
+/**
+ * Maps and validates the pack at path, call once before the routes are built
+ * @return 0 on success, -1 on failure (errno set, EINVAL for a malformed pack)
+ */
+int loadPack(const char* path);
+
+/**
+ * @return 1 once loadPack() succeeded
+ */
+int packLoaded(void);
+
+/**
+ * Finds a file by its path relative to the document root
+ * @param path Relative path (no leading '/'), does not need a NUL terminator
+ * @return 1 and fills file, 0 when the pack has no such file
+ */
+int packLookup(const char* path, size_t len, packFile_t* file);
+
+#endif
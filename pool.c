@@ -0,0 +1,144 @@
+#include "pool.h"
+#include <stdlib.h>
+#include <string.h>
+
+void initializeObjectPool(objectPool_t* pool, size_t objectSize, size_t maxFree) {
+    // Free objects store the list link in their first word
+    pool->objectSize = objectSize < sizeof(void*) ? sizeof(void*) : objectSize;
+    pool->freeList = NULL;
+    pool->freeCount = 0;
+    pool->maxFree = maxFree;
+    memset(&pool->stats, 0, sizeof(pool->stats));
+}
+
+void* poolAlloc(objectPool_t* pool) {
+    void* object = pool->freeList;
+    if (object) {
+        pool->freeList = *(void**)object;
+        pool->freeCount--;
+        pool->stats.hits++;
+        return object;
+    }
+    pool->stats.misses++;
+    return malloc(pool->objectSize);
+}
+
+void poolFree(objectPool_t* pool, void* object) {
+    if (!object) {
+        return;
+    }
+    if (pool->freeCount >= pool->maxFree) {
+        pool->stats.released++;
+        free(object);
+        return;
+    }
+    *(void**)object = pool->freeList;
+    pool->freeList = object;
+    pool->freeCount++;
+    pool->stats.recycled++;
+}
+
+void destroyObjectPool(objectPool_t* pool) {
+    while (pool->freeList) {
+        void* next = *(void**)pool->freeList;
+        free(pool->freeList);
+        pool->freeList = next;
+    }
+    pool->freeCount = 0;
+}
+
+void initializeBufferPool(bufferPool_t* pool, size_t maxBytesPerClass) {
+    size_t size = BUFFER_CLASS_MIN;
+    for (int i = 0;i < BUFFER_CLASS_COUNT;i++, size *= 2) {
+        initializeObjectPool(&pool->classes[i], size, maxBytesPerClass / size);
+    }
+    memset(&pool->oversized, 0, sizeof(pool->oversized));
+    pool->inUse = 0;
+}
+
+// Smallest class that fits size, -1 when size is above the largest class
+static int bufferClass(size_t size) {
+    size_t classSize = BUFFER_CLASS_MIN;
+    for (int i = 0;i < BUFFER_CLASS_COUNT;i++, classSize *= 2) {
+        if (size <= classSize) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+size_t bufferCapacity(size_t size) {
+    int index = bufferClass(size);
+    return index == -1 ? size : (size_t)BUFFER_CLASS_MIN << index;
+}
+
+char* bufferAcquire(bufferPool_t* pool, size_t size, size_t* capacity) {
+    int index = bufferClass(size);
+    char* buffer;
+    if (index == -1) {
+        pool->oversized.misses++;
+        *capacity = size;
+        buffer = malloc(size);
+    }
+    else {
+        *capacity = pool->classes[index].objectSize;
+        buffer = poolAlloc(&pool->classes[index]);
+    }
+    if (buffer) {
+        pool->inUse += *capacity;
+    }
+    return buffer;
+}
+
+void bufferRelease(bufferPool_t* pool, char* buffer, size_t capacity) {
+    if (!buffer) {
+        return;
+    }
+    pool->inUse -= capacity;
+    int index = bufferClass(capacity);
+    if (index == -1 || pool->classes[index].objectSize != capacity) {
+        pool->oversized.released++;
+        free(buffer);
+        return;
+    }
+    poolFree(&pool->classes[index], buffer);
+}
+
+char* bufferResize(bufferPool_t* pool, char* buffer, size_t used, size_t* capacity, size_t newSize) {
+    // Oversized to oversized can stay a plain realloc
+    if (bufferClass(*capacity) == -1 && bufferClass(newSize) == -1) {
+        char* temp = realloc(buffer, newSize);
+        if (temp) {
+            pool->inUse += newSize - *capacity;
+            *capacity = newSize;
+        }
+        return temp;
+    }
+
+    size_t newCapacity;
+    char* temp = bufferAcquire(pool, newSize, &newCapacity);
+    if (!temp) {
+        return NULL;
+    }
+    memcpy(temp, buffer, used < newCapacity ? used : newCapacity);
+    bufferRelease(pool, buffer, *capacity);
+    *capacity = newCapacity;
+    return temp;
+}
+
+void destroyBufferPool(bufferPool_t* pool) {
+    for (int i = 0;i < BUFFER_CLASS_COUNT;i++) {
+        destroyObjectPool(&pool->classes[i]);
+    }
+}
+
+poolStats_t bufferPoolStats(const bufferPool_t* pool) {
+    poolStats_t total = pool->oversized;
+    for (int i = 0;i < BUFFER_CLASS_COUNT;i++) {
+        total.hits += pool->classes[i].stats.hits;
+        total.misses += pool->classes[i].stats.misses;
+        total.recycled += pool->classes[i].stats.recycled;
+        total.released += pool->classes[i].stats.released;
+    }
+    return total;
+}
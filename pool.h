@@ -0,0 +1,92 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+#define BUFFER_CLASS_COUNT 5 // 4kb, 8kb, 16kb, 32kb, 64kb
+#define BUFFER_CLASS_MIN 4096
+#define BUFFER_CLASS_MAX 65536
+
+/**
+ * Structure with allocation counters of a pool
+ * hits: Allocations served from the free list
+ * misses: Allocations that fell back to malloc
+ * recycled: Objects pushed back to the free list
+ * released: Objects freed because the free list was full (or oversized buffers)
+ */
+typedef struct {
+    size_t hits;
+    size_t misses;
+    size_t recycled;
+    size_t released;
+}poolStats_t;
+
+/**
+ * Free list of fixed size objects. Pools are owned by one worker and are
+ * not thread safe on purpose: no locks or atomics on the request path.
+ * objectSize: Size of every object handed out
+ * freeList: Free objects, linked through their first word
+ * freeCount: Number of objects on the free list
+ * maxFree: Free list cap, objects beyond it go back to malloc
+ */
+typedef struct {
+    size_t objectSize;
+    void* freeList;
+    size_t freeCount;
+    size_t maxFree;
+    poolStats_t stats;
+}objectPool_t;
+
+/**
+ * Size-classed buffer pools, power of two classes from 4kb to 64kb.
+ * Requests above 64kb bypass the pool and are counted in oversized.
+ * inUse: Capacity of every buffer handed out and not released yet, free lists excluded
+ */
+typedef struct {
+    objectPool_t classes[BUFFER_CLASS_COUNT];
+    poolStats_t oversized;
+    size_t inUse;
+}bufferPool_t;
+
+void initializeObjectPool(objectPool_t* pool, size_t objectSize, size_t maxFree);
+void* poolAlloc(objectPool_t* pool);
+void poolFree(objectPool_t* pool, void* object);
+void destroyObjectPool(objectPool_t* pool);
+
+/**
+ * Initializes every class, each free list retains at most maxBytesPerClass
+ */
+void initializeBufferPool(bufferPool_t* pool, size_t maxBytesPerClass);
+
+/**
+ * @return Capacity bufferAcquire() hands out for a request of size bytes
+ */
+size_t bufferCapacity(size_t size);
+
+/**
+ * Returns a buffer of at least size bytes
+ * @param capacity Set to the real capacity of the returned buffer
+ * @return Buffer, or NULL when malloc fails
+ */
+char* bufferAcquire(bufferPool_t* pool, size_t size, size_t* capacity);
+
+/**
+ * Gives a buffer back. capacity must be the value bufferAcquire() reported.
+ */
+void bufferRelease(bufferPool_t* pool, char* buffer, size_t capacity);
+
+/**
+ * Moves the first used bytes into a buffer of at least newSize bytes
+ * and releases the old one. On failure the old buffer is left untouched.
+ * @return New buffer, or NULL when allocation fails
+ */
+char* bufferResize(bufferPool_t* pool, char* buffer, size_t used, size_t* capacity, size_t newSize);
+
+void destroyBufferPool(bufferPool_t* pool);
+
+/**
+ * Sums hits/misses/recycled/released of every class (oversized included)
+ */
+poolStats_t bufferPoolStats(const bufferPool_t* pool);
+
+#endif
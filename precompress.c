@@ -0,0 +1,196 @@
+#define _GNU_SOURCE
+#include "precompress.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+#define PRECOMPRESS_MAX_FILE (64 * 1024 * 1024) // bigger assets are skipped
+#define PRECOMPRESS_MIN_FILE 256 // headers would eat the gain
+
+typedef size_t (*compressor_t)(const char* in, size_t inLen, char* out, size_t outCap);
+
+// Single shot gzip (deflate with a gzip wrapper), returns 0 on failure
+static size_t gzipCompress(const char* in, size_t inLen, char* out, size_t outCap) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return 0;
+    }
+    stream.next_in = (Bytef*)in;
+    stream.avail_in = inLen;
+    stream.next_out = (Bytef*)out;
+    stream.avail_out = outCap;
+    int res = deflate(&stream, Z_FINISH);
+    size_t written = stream.total_out;
+    deflateEnd(&stream);
+    return res == Z_STREAM_END ? written : 0;
+}
+
+#ifdef HAVE_BROTLI
+static size_t brotliCompress(const char* in, size_t inLen, char* out, size_t outCap) {
+    size_t written = outCap;
+    if (!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+        inLen, (const uint8_t*)in, &written, (uint8_t*)out)) {
+        return 0;
+    }
+    return written;
+}
+#endif
+
+// Same extension list the sidecar lookup treats as compressible
+static int isCompressibleName(const char* name) {
+    static const char* extensions[] = { ".html", ".css", ".js", ".txt" };
+    size_t len = strlen(name);
+    for (size_t i = 0;i < sizeof(extensions) / sizeof(extensions[0]);i++) {
+        size_t extLen = strlen(extensions[i]);
+        if (len > extLen && strcmp(name + len - extLen, extensions[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int writeAll(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += written;
+        len -= written;
+    }
+    return 0;
+}
+
+// Writes name+suffix through a temp file and rename, so a running server never sees half a sidecar
+static int writeSidecar(int dir_fd, const char* name, const char* suffix, const char* data, size_t len,
+    const struct stat* source, compressor_t compress) {
+    char sidecar[NAME_MAX + 1];
+    char temp[NAME_MAX + 1];
+    if (snprintf(sidecar, sizeof(sidecar), "%s%s", name, suffix) >= (int)sizeof(sidecar) ||
+        snprintf(temp, sizeof(temp), ".%s%s.tmp", name, suffix) >= (int)sizeof(temp)) {
+        return 0;
+    }
+
+    // Up to date sidecar, nothing to do
+    struct stat existing;
+    if (fstatat(dir_fd, sidecar, &existing, 0) == 0 &&
+        (existing.st_mtim.tv_sec > source->st_mtim.tv_sec ||
+            (existing.st_mtim.tv_sec == source->st_mtim.tv_sec && existing.st_mtim.tv_nsec >= source->st_mtim.tv_nsec))) {
+        return 0;
+    }
+
+    // Anything not smaller than the source is not worth serving
+    size_t outCap = len;
+    char* out = malloc(outCap);
+    if (!out) {
+        perror("Malloc failed");
+        return 0;
+    }
+    size_t outLen = compress(data, len, out, outCap);
+    if (outLen == 0 || outLen >= len) {
+        free(out);
+        return 0;
+    }
+
+    int fd = openat(dir_fd, temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        perror("precompress: open");
+        free(out);
+        return 0;
+    }
+    int failed = writeAll(fd, out, outLen) == -1;
+    free(out);
+    if (close(fd) == -1 || failed || renameat(dir_fd, temp, dir_fd, sidecar) == -1) {
+        perror("precompress: write");
+        unlinkat(dir_fd, temp, 0);
+        return 0;
+    }
+    return 1;
+}
+
+static int precompressFile(int dir_fd, const char* name, const struct stat* st) {
+    if (st->st_size < PRECOMPRESS_MIN_FILE || st->st_size > PRECOMPRESS_MAX_FILE) {
+        return 0;
+    }
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return 0;
+    }
+    size_t len = st->st_size;
+    char* data = malloc(len);
+    if (!data) {
+        close(fd);
+        return 0;
+    }
+    size_t filled = 0;
+    while (filled < len) {
+        ssize_t got = read(fd, data + filled, len - filled);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) break;
+        filled += got;
+    }
+    close(fd);
+
+    int written = 0;
+    if (filled == len) {
+        written += writeSidecar(dir_fd, name, ".gz", data, len, st, gzipCompress);
+#ifdef HAVE_BROTLI
+        written += writeSidecar(dir_fd, name, ".br", data, len, st, brotliCompress);
+#endif
+    }
+    free(data);
+    return written;
+}
+
+// Hidden entries (and our own temp files) are skipped
+static int precompressWalk(int dir_fd) {
+    int fd = dup(dir_fd);
+    if (fd == -1) {
+        return -1;
+    }
+    DIR* dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        return -1;
+    }
+
+    int written = 0;
+    struct dirent* ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] == '.') {
+            continue;
+        }
+        struct stat st;
+        if (fstatat(dir_fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            int sub_fd = openat(dir_fd, ent->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (sub_fd != -1) {
+                int res = precompressWalk(sub_fd);
+                written += res > 0 ? res : 0;
+                close(sub_fd);
+            }
+        }
+        else if (S_ISREG(st.st_mode) && isCompressibleName(ent->d_name)) {
+            written += precompressFile(dir_fd, ent->d_name, &st);
+        }
+    }
+    closedir(dir);
+    return written;
+}
+
+int precompressDirectory(int root_fd) {
+    return precompressWalk(root_fd);
+}
@@ -0,0 +1,14 @@
+#ifndef PRECOMPRESS_H
+#define PRECOMPRESS_H
+
+/**
+ * Writes name.gz (and name.br when built with BROTLI=1) next to every
+ * html/css/js/txt file under the document root, recursively.
+ * Sidecars newer than their source are kept, outputs that do not shrink
+ * the file are not written. Runs once at startup, before any worker.
+ * @param root_fd Document root directory fd
+ * @return Number of sidecars written, -1 if the root cannot be walked
+ */
+int precompressDirectory(int root_fd);
+
+#endif
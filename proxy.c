@@ -0,0 +1,919 @@
+#define _GNU_SOURCE
+#include "proxy.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include "connection.h"
+#include "worker.h"
+#include "router.h"
+#include "scan.h"
+#include "metrics.h"
+#include "handlers.h"
+
+static upstream_t upstreams[PROXY_ROUTES_MAX];
+static int upstreamCount;
+
+// Chunked pass-through decodes a copy of every piece to see where the body
+// ends, one worker relays one piece at a time
+static __thread char chunkScratch[UPSTREAM_BUFFER_SIZE];
+
+// "PREFIX=HOST:PORT", resolved once, the prefix keeps no trailing slash
+static int parseRoute(const char* spec, upstream_t* upstream) {
+    const char* separator = strchr(spec, '=');
+    size_t prefixLen = separator - spec;
+    while (prefixLen > 0 && spec[prefixLen - 1] == '/') {
+        prefixLen--;
+    }
+    const char* host = separator + 1;
+    const char* colon = strrchr(host, ':');
+    char* end = NULL;
+    long port = colon ? strtol(colon + 1, &end, 10) : 0;
+    // Patterns are registered as PREFIX and PREFIX/*, no parameters or wildcards of their own
+    if (spec[0] != '/' || prefixLen >= UPSTREAM_PREFIX_MAX || memchr(spec, '*', prefixLen) || memchr(spec, ':', prefixLen) ||
+        !colon || colon == host || (size_t)(colon - host) >= 256 || end == colon + 1 || *end != '\0' || port < 1 || port > 65535) {
+        fprintf(stderr, "Invalid proxy route: %s\n", spec);
+        return -1;
+    }
+    memcpy(upstream->prefix, spec, prefixLen);
+    upstream->prefix[prefixLen] = '\0';
+    upstream->prefixLen = prefixLen;
+
+    char name[256];
+    memcpy(name, host, colon - host);
+    name[colon - host] = '\0';
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* result = NULL;
+    int err = getaddrinfo(name, NULL, &hints, &result);
+    if (err != 0) {
+        fprintf(stderr, "Upstream %s: %s\n", name, gai_strerror(err));
+        return -1;
+    }
+    memcpy(&upstream->address, result->ai_addr, sizeof(upstream->address));
+    upstream->address.sin_port = htons((uint16_t)port);
+    freeaddrinfo(result);
+    upstream->host = host;
+    return 0;
+}
+
+int initializeProxy(const serverConfig_t* config) {
+    for (int i = 0;i < config->proxyCount;i++) {
+        if (parseRoute(config->proxy[i], &upstreams[i]) == -1) {
+            return -1;
+        }
+    }
+    upstreamCount = config->proxyCount;
+    return 0;
+}
+
+int proxyUpstreamCount(void) {
+    return upstreamCount;
+}
+
+const upstream_t* proxyUpstream(int index) {
+    return &upstreams[index];
+}
+
+void initializeProxyPool(proxyPool_t* pool, worker_t* worker, const serverConfig_t* config) {
+    memset(pool, 0, sizeof(*pool));
+    pool->worker = worker;
+    pool->maxIdle = config->upstreamPool;
+    pool->timeoutMs = config->upstreamTimeout * 1000;
+}
+
+// Connections are at least pointer aligned, the low bit tells them apart from client connections
+int proxyIsUpstreamEvent(const void* ptr) {
+    return ((uintptr_t)ptr & 1) != 0;
+}
+
+static void* tagUpstream(upstreamConn_t* uc) {
+    return (void*)((uintptr_t)uc | 1);
+}
+
+static void linkIdle(proxyPool_t* pool, upstreamConn_t* uc) {
+    int index = uc->upstream;
+    uc->prev = NULL;
+    uc->next = pool->idleHead[index];
+    if (pool->idleHead[index]) pool->idleHead[index]->prev = uc;
+    else pool->idleTail[index] = uc;
+    pool->idleHead[index] = uc;
+    pool->idleCount[index]++;
+    pool->worker->metrics->upstreamIdle++;
+}
+
+static void unlinkIdle(proxyPool_t* pool, upstreamConn_t* uc) {
+    int index = uc->upstream;
+    if (uc->prev) uc->prev->next = uc->next;
+    else pool->idleHead[index] = uc->next;
+    if (uc->next) uc->next->prev = uc->prev;
+    else pool->idleTail[index] = uc->prev;
+    uc->prev = NULL;
+    uc->next = NULL;
+    pool->idleCount[index]--;
+    pool->worker->metrics->upstreamIdle--;
+}
+
+// Closing the socket takes it out of the epoll set (fd is -1 after a failed retry), the object goes to the free list
+static void closeUpstream(proxyPool_t* pool, upstreamConn_t* uc) {
+    if (uc->state == UPSTREAM_IDLE) {
+        unlinkIdle(pool, uc);
+    }
+    if (uc->fd != -1) {
+        close(uc->fd);
+    }
+    if (uc->pipe[0] != -1) {
+        close(uc->pipe[0]);
+        close(uc->pipe[1]);
+    }
+    bufferRelease(&pool->worker->buffers, uc->buf, uc->cap);
+    uc->fd = -1;
+    uc->pipe[0] = -1;
+    uc->pipe[1] = -1;
+    uc->piped = 0;
+    uc->buf = NULL;
+    uc->cap = 0;
+    uc->client = NULL;
+    uc->state = UPSTREAM_FREE;
+    uc->next = pool->free;
+    pool->free = uc;
+}
+
+// Non-blocking connect, the request is written once the socket reports writable
+static int connectUpstream(proxyPool_t* pool, upstreamConn_t* uc) {
+    const upstream_t* upstream = &upstreams[uc->upstream];
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket: upstream");
+        return -1;
+    }
+    // Heads and bodies are written whole, nothing to gain from Nagle
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (const struct sockaddr*)&upstream->address, sizeof(upstream->address)) == -1 && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    // Registered once for everything, the connection never has to re-register while pooled or reused
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = tagUpstream(uc);
+    if (epoll_ctl(pool->worker->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("epoll_ctl: upstream");
+        close(fd);
+        return -1;
+    }
+    uc->fd = fd;
+    uc->reused = 0;
+    pool->worker->metrics->upstreamOpened++;
+    return 0;
+}
+
+// Most recently used idle connection first, expired ones are dropped on the way
+static upstreamConn_t* acquireUpstream(proxyPool_t* pool, int index) {
+    worker_t* worker = pool->worker;
+    while (pool->idleTail[index] && worker->now - pool->idleTail[index]->idleSince >= UPSTREAM_IDLE_MAX_MS) {
+        closeUpstream(pool, pool->idleTail[index]);
+    }
+    upstreamConn_t* uc = pool->idleHead[index];
+    if (uc) {
+        unlinkIdle(pool, uc);
+        uc->reused = 1;
+        worker->metrics->upstreamReused++;
+        return uc;
+    }
+    if ((uc = pool->free)) {
+        pool->free = uc->next;
+    }
+    else if (!(uc = malloc(sizeof(upstreamConn_t)))) {
+        perror("Malloc failed");
+        return NULL;
+    }
+    else {
+        // Reused objects keep their flag, they may still be queued from this batch
+        uc->ready = 0;
+    }
+    uc->upstream = index;
+    uc->state = UPSTREAM_FREE;
+    uc->client = NULL;
+    uc->buf = NULL;
+    uc->cap = 0;
+    uc->pipe[0] = -1;
+    uc->pipe[1] = -1;
+    uc->piped = 0;
+    uc->prev = NULL;
+    uc->next = NULL;
+    if (connectUpstream(pool, uc) == -1) {
+        uc->next = pool->free;
+        pool->free = uc;
+        return NULL;
+    }
+    return uc;
+}
+
+// Head under construction, len keeps counting past cap so the caller sees it did not fit
+typedef struct {
+    char* data;
+    size_t cap;
+    size_t len;
+}headBuilder_t;
+
+static void appendBytes(headBuilder_t* head, const char* bytes, size_t len) {
+    if (head->len + len <= head->cap) {
+        memcpy(head->data + head->len, bytes, len);
+    }
+    head->len += len;
+}
+
+#define appendLiteral(head, literal) appendBytes(head, literal, sizeof(literal) - 1)
+
+static void appendField(headBuilder_t* head, const char* key, size_t keyLen, const char* value, size_t valueLen) {
+    appendBytes(head, key, keyLen);
+    appendLiteral(head, ": ");
+    appendBytes(head, value, valueLen);
+    appendLiteral(head, "\r\n");
+}
+
+static int nameIs(const char* key, size_t keyLen, const char* name) {
+    return keyLen == strlen(name) && strncasecmp(key, name, keyLen) == 0;
+}
+
+// Token lists such as Connection or Transfer-Encoding, case-insensitive
+static int hasToken(const char* value, size_t len, const char* token, size_t tokenLen) {
+    size_t i = 0;
+    while (i < len) {
+        while (i < len && (value[i] == ' ' || value[i] == '\t' || value[i] == ',')) {
+            i++;
+        }
+        size_t start = i;
+        while (i < len && value[i] != ',') {
+            i++;
+        }
+        size_t end = i;
+        while (end > start && (value[end - 1] == ' ' || value[end - 1] == '\t')) {
+            end--;
+        }
+        if (end - start == tokenLen && strncasecmp(value + start, token, tokenLen) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Hop-by-hop fields only describe one connection (RFC 9110 7.6.1), both directions rewrite them
+static int isHopByHop(const char* key, size_t keyLen) {
+    return nameIs(key, keyLen, "Connection") || nameIs(key, keyLen, "Keep-Alive") ||
+        nameIs(key, keyLen, "Proxy-Connection") || nameIs(key, keyLen, "TE") ||
+        nameIs(key, keyLen, "Trailer") || nameIs(key, keyLen, "Transfer-Encoding") ||
+        nameIs(key, keyLen, "Upgrade");
+}
+
+// Fields the proxy writes itself, or with the client address appended
+static int isReplacedRequestField(const char* key, size_t keyLen) {
+    return nameIs(key, keyLen, "Content-Length") || nameIs(key, keyLen, "Expect") ||
+        nameIs(key, keyLen, "X-Forwarded-For") || nameIs(key, keyLen, "X-Forwarded-Proto");
+}
+
+static void writeRequestHead(headBuilder_t* head, connection_t* conn, const upstream_t* upstream) {
+    const httpInfo_t* request = conn->request;
+    bufferView_t connection = request->known[HEADER_CONNECTION];
+    appendBytes(head, request->method.data, request->method.len);
+    appendLiteral(head, " ");
+    // Verbatim: the decoded and normalized path is only what the route matched on
+    appendBytes(head, conn->raw_target, conn->raw_target_len);
+    appendLiteral(head, " HTTP/1.1\r\n");
+    if (request->known[HEADER_HOST].len == 0) {
+        appendField(head, "Host", 4, upstream->host, strlen(upstream->host));
+    }
+    bufferView_t forwardedFor = { NULL, 0 };
+    for (size_t i = 0;i < request->headerCnt;i++) {
+        bufferView_t key;
+        bufferView_t value;
+        httpHeaderAt(request, i, &key, &value);
+        if (nameIs(key.data, key.len, "X-Forwarded-For")) {
+            forwardedFor = value;
+        }
+        // Fields the client's Connection header names are hop-by-hop as well
+        if (isHopByHop(key.data, key.len) || isReplacedRequestField(key.data, key.len) ||
+            hasToken(connection.data, connection.len, key.data, key.len)) {
+            continue;
+        }
+        appendField(head, key.data, key.len, value.data, value.len);
+    }
+
+    if (!conn->peer_known) {
+        socklen_t len = sizeof(conn->peer);
+        if (getpeername(conn->fd, (struct sockaddr*)&conn->peer, &len) == -1) {
+            memset(&conn->peer, 0, sizeof(conn->peer));
+        }
+        conn->peer_known = 1;
+    }
+    char peer[INET_ADDRSTRLEN];
+    if (!inet_ntop(AF_INET, &conn->peer.sin_addr, peer, sizeof(peer))) {
+        strcpy(peer, "0.0.0.0");
+    }
+    appendLiteral(head, "X-Forwarded-For: ");
+    if (forwardedFor.len > 0) {
+        appendBytes(head, forwardedFor.data, forwardedFor.len);
+        appendLiteral(head, ", ");
+    }
+    appendBytes(head, peer, strlen(peer));
+    appendLiteral(head, "\r\n");
+    if (conn->tls) appendLiteral(head, "X-Forwarded-Proto: https\r\n");
+    else appendLiteral(head, "X-Forwarded-Proto: http\r\n");
+
+    // A chunked request body was decoded while it was buffered, it leaves with its length
+    if (request->isContentLengthSeen || conn->body_chunked) {
+        char length[32];
+        int len = snprintf(length, sizeof(length), "%zu", request->body.len);
+        appendField(head, "Content-Length", 14, length, len);
+    }
+    appendLiteral(head, "Connection: keep-alive\r\n\r\n");
+}
+
+// Request head into buf, which grows once when a long path or many fields do not fit
+static int buildRequestHead(upstreamConn_t* uc, connection_t* conn) {
+    bufferPool_t* buffers = &conn->worker->buffers;
+    if (!uc->buf && !(uc->buf = bufferAcquire(buffers, UPSTREAM_BUFFER_SIZE, &uc->cap))) {
+        perror("Malloc failed");
+        uc->cap = 0;
+        return -1;
+    }
+    headBuilder_t head = { uc->buf, uc->cap, 0 };
+    writeRequestHead(&head, conn, &upstreams[uc->upstream]);
+    if (head.len > uc->cap) {
+        size_t cap;
+        char* grown = bufferAcquire(buffers, head.len, &cap);
+        if (!grown) {
+            perror("Malloc failed");
+            return -1;
+        }
+        bufferRelease(buffers, uc->buf, uc->cap);
+        uc->buf = grown;
+        uc->cap = cap;
+        head = (headBuilder_t){ uc->buf, uc->cap, 0 };
+        writeRequestHead(&head, conn, &upstreams[uc->upstream]);
+    }
+    uc->len = head.len;
+    uc->sent = 0;
+    uc->body = conn->request->body.data;
+    uc->bodyLen = conn->request->body.len;
+    uc->state = UPSTREAM_SENDING;
+    return 0;
+}
+
+// Answers in place of the upstream, like handleParseError() but the request was read completely
+static void queueGatewayError(connection_t* conn, int status, char* statusText, const char* body) {
+    if (ensureWriteBuffer(conn) == -1) {
+        conn->state = CLOSING;
+        return;
+    }
+    response_t response = initializeResponse();
+    response.statusCode = status;
+    response.statusText = statusText;
+    response.body = body;
+    response.bodyLen = strlen(body);
+    response.shouldClose = !conn->request->isKeepAlive;
+    size_t room = conn->write_cap - conn->write_len;
+    size_t len;
+    int firstSegment = conn->output ? conn->output->count : 0;
+    createWritableResponse(&response, conn->write_buf + conn->write_len, room, &len);
+    if (len >= room || queueWriteBuffer(conn, len) == -1 ||
+        connectionQueueBytes(conn, response.body, response.bodyLen) == -1) {
+        conn->state = CLOSING;
+        return;
+    }
+    connectionResponseQueued(conn, status, firstSegment);
+    conn->shouldClose = response.shouldClose;
+    conn->state = WRITING_RESPONSE;
+}
+
+void proxyForward(connection_t* conn) {
+    proxyPool_t* pool = conn->worker->proxy;
+    upstreamConn_t* uc = acquireUpstream(pool, conn->request->route->upstream);
+    if (!uc || buildRequestHead(uc, conn) == -1) {
+        if (uc) {
+            closeUpstream(pool, uc);
+        }
+        conn->worker->metrics->upstreamErrors++;
+        queueGatewayError(conn, 502, "Bad Gateway", "Upstream unavailable");
+        return;
+    }
+    uc->client = conn;
+    uc->upstreamEof = 0;
+    uc->waitClient = 0;
+    uc->start = monotonicUs();
+    conn->upstream = uc;
+    // The request views and its body stay in read_buf until the response is relayed
+    conn->read_paused = 1;
+    conn->read_borrowed = 1;
+    conn->state = PROXYING;
+}
+
+// Writes what is left of the request head and body
+// @return 1 once everything is out, 0 when the socket is full, -1 on failure
+static int sendRequest(upstreamConn_t* uc) {
+    while (uc->sent < uc->len + uc->bodyLen) {
+        struct iovec iov[2];
+        int count = 0;
+        if (uc->sent < uc->len) {
+            iov[count++] = (struct iovec){ uc->buf + uc->sent, uc->len - uc->sent };
+        }
+        size_t bodySent = uc->sent > uc->len ? uc->sent - uc->len : 0;
+        if (bodySent < uc->bodyLen) {
+            iov[count++] = (struct iovec){ (char*)uc->body + bodySent, uc->bodyLen - bodySent };
+        }
+        // Still connecting reports EAGAIN as well, the connect completion is the next EPOLLOUT edge
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = count };
+        ssize_t sent = sendmsg(uc->fd, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        uc->sent += sent;
+    }
+    // buf holds the response from here on
+    uc->len = 0;
+    uc->state = UPSTREAM_READING_HEAD;
+    return 1;
+}
+
+// Parses the response head at the front of buf and queues the client's version of it.
+// @return 1 when queued, 2 for an interim (1xx) response that was dropped, -1 for a bad head
+static int relayHead(connection_t* conn, upstreamConn_t* uc, size_t headLen) {
+    const char* head = uc->buf;
+    const char* headEnd = head + headLen - 2; // last field ends with its own CRLF
+    const char* lineEnd = scanLineEnd(head, headLen);
+    if (!lineEnd || lineEnd - head < 12 || memcmp(head, "HTTP/1.", 7) != 0 || head[8] != ' ' ||
+        !isdigit((unsigned char)head[9]) || !isdigit((unsigned char)head[10]) || !isdigit((unsigned char)head[11]) ||
+        (lineEnd - head > 12 && head[12] != ' ')) {
+        return -1;
+    }
+    int status = (head[9] - '0') * 100 + (head[10] - '0') * 10 + (head[11] - '0');
+    if (status == 101 || status < 100) {
+        // Protocol switches would need a tunnel
+        return -1;
+    }
+    if (status < 200) {
+        memmove(uc->buf, uc->buf + headLen, uc->len - headLen);
+        uc->len -= headLen;
+        return 2;
+    }
+
+    // First pass: framing and persistence of the upstream connection
+    int lengthSeen = 0;
+    int encodingSeen = 0;
+    int chunked = 0;
+    int keepAlive = head[7] == '1';
+    uint64_t length = 0;
+    const char* connectionValue = NULL;
+    size_t connectionLen = 0;
+    for (const char* line = lineEnd + 2;line < headEnd;) {
+        const char* end = scanLineEnd(line, headEnd + 2 - line);
+        const char* colon = memchr(line, ':', end - line);
+        if (!colon || colon == line) {
+            return -1;
+        }
+        const char* value = colon + 1;
+        while (value < end && (*value == ' ' || *value == '\t')) {
+            value++;
+        }
+        size_t valueLen = end - value;
+        while (valueLen > 0 && (value[valueLen - 1] == ' ' || value[valueLen - 1] == '\t')) {
+            valueLen--;
+        }
+        size_t keyLen = colon - line;
+        if (nameIs(line, keyLen, "Content-Length")) {
+            char* parsedEnd = NULL;
+            unsigned long long parsed = strtoull(value, &parsedEnd, 10);
+            if (valueLen == 0 || !isdigit((unsigned char)value[0]) || parsedEnd != value + valueLen ||
+                (lengthSeen && parsed != length)) {
+                return -1;
+            }
+            length = parsed;
+            lengthSeen = 1;
+        }
+        else if (nameIs(line, keyLen, "Transfer-Encoding")) {
+            encodingSeen = 1;
+            chunked = hasToken(value, valueLen, "chunked", 7);
+        }
+        else if (nameIs(line, keyLen, "Connection")) {
+            connectionValue = value;
+            connectionLen = valueLen;
+            if (hasToken(value, valueLen, "close", 5)) keepAlive = 0;
+            else if (hasToken(value, valueLen, "keep-alive", 10)) keepAlive = 1;
+        }
+        line = end + 2;
+    }
+
+    const httpInfo_t* request = conn->request;
+    int headRequest = request->method.len == 4 && memcmp(request->method.data, "HEAD", 4) == 0;
+    int client10 = request->version.len > 0 && request->version.data[request->version.len - 1] == '0';
+    if (headRequest || status == 204 || status == 304) uc->framing = RELAY_NONE;
+    else if (encodingSeen) uc->framing = chunked ? RELAY_CHUNKED : RELAY_CLOSE;
+    else if (lengthSeen) uc->framing = RELAY_LENGTH;
+    else uc->framing = RELAY_CLOSE;
+    uc->remaining = length;
+    uc->decode = uc->framing == RELAY_CHUNKED && client10;
+    uc->reusable = keepAlive && uc->framing != RELAY_CLOSE;
+    if (uc->framing == RELAY_CHUNKED) {
+        initializeChunkDecoder(&uc->decoder);
+    }
+    // The end of a close delimited or decoded chunked body is the connection close
+    conn->shouldClose = !request->isKeepAlive || uc->framing == RELAY_CLOSE || uc->decode;
+
+    // Second pass: the client head, status line upgraded to HTTP/1.1, own framing and Connection fields
+    if (ensureWriteBuffer(conn) == -1) {
+        return -1;
+    }
+    headBuilder_t out = { conn->write_buf + conn->write_len, conn->write_cap - conn->write_len, 0 };
+    appendLiteral(&out, "HTTP/1.1");
+    appendBytes(&out, head + 8, lineEnd + 2 - (head + 8));
+    for (const char* line = lineEnd + 2;line < headEnd;) {
+        const char* end = scanLineEnd(line, headEnd + 2 - line);
+        const char* colon = memchr(line, ':', end - line);
+        size_t keyLen = colon - line;
+        if (!isHopByHop(line, keyLen) && !(encodingSeen && nameIs(line, keyLen, "Content-Length")) &&
+            !hasToken(connectionValue, connectionLen, line, keyLen)) {
+            appendBytes(&out, line, end + 2 - line);
+        }
+        line = end + 2;
+    }
+    if (uc->framing == RELAY_CHUNKED && !uc->decode) {
+        appendLiteral(&out, "Transfer-Encoding: chunked\r\n");
+    }
+    if (conn->shouldClose) appendLiteral(&out, "Connection: close\r\n\r\n");
+    else appendLiteral(&out, "Connection: keep-alive\r\n\r\n");
+
+    int firstSegment = conn->output ? conn->output->count : 0;
+    if (out.len >= out.cap || queueWriteBuffer(conn, out.len) == -1) {
+        return -1;
+    }
+    connectionResponseQueued(conn, status, firstSegment);
+    histogramRecord(&conn->worker->metrics->upstreamLatency, (uint64_t)(monotonicUs() - uc->start));
+
+    // Body bytes that came with the head are relayed first
+    memmove(uc->buf, uc->buf + headLen, uc->len - headLen);
+    uc->len -= headLen;
+    uc->state = UPSTREAM_RELAYING;
+    return 1;
+}
+
+// Reads until the response head is complete
+// @return 1 once it is queued, 0 when the socket is empty, -1 on failure
+static int readHead(connection_t* conn, upstreamConn_t* uc) {
+    size_t room = uc->cap < UPSTREAM_BUFFER_SIZE ? uc->cap : UPSTREAM_BUFFER_SIZE;
+    while (1) {
+        const char* end = scanHeaderEnd(uc->buf, uc->len);
+        if (end) {
+            int res = relayHead(conn, uc, end + 4 - uc->buf);
+            if (res == 2) {
+                continue;
+            }
+            return res;
+        }
+        if (uc->len >= UPSTREAM_HEAD_MAX) {
+            return -1;
+        }
+        ssize_t received = read(uc->fd, uc->buf + uc->len, room - uc->len);
+        if (received > 0) {
+            uc->len += received;
+            continue;
+        }
+        if (received == 0) {
+            return -1;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+static int bodyDone(const upstreamConn_t* uc) {
+    switch (uc->framing) {
+    case RELAY_LENGTH:
+        return uc->remaining == 0 && uc->piped == 0;
+    case RELAY_CHUNKED:
+        return uc->decoder.state == CHUNK_DONE;
+    case RELAY_CLOSE:
+        return uc->upstreamEof && uc->piped == 0;
+    default:
+        return 1;
+    }
+}
+
+// Queues the len bytes at the front of buf as the next body piece, the
+// caller flushes it before buf is read into again
+// @return 2 to flush and go on, -1 on bad framing from the upstream
+static int relayPiece(connection_t* conn, upstreamConn_t* uc) {
+    size_t len = uc->len;
+    size_t queued = len;
+    uc->len = 0;
+    if (uc->framing == RELAY_NONE) {
+        // Bytes after a body-less response, the connection is out of step
+        uc->reusable = 0;
+        return 2;
+    }
+    if (uc->framing == RELAY_LENGTH) {
+        if (len > uc->remaining) {
+            queued = uc->remaining;
+            uc->reusable = 0;
+        }
+        uc->remaining -= queued;
+    }
+    else if (uc->framing == RELAY_CHUNKED) {
+        size_t consumed = 0;
+        size_t produced = 0;
+        chunkedResult_t res;
+        if (uc->decode) {
+            // HTTP/1.0 clients get the plain bytes, the connection close ends them
+            res = chunkedDecode(&uc->decoder, uc->buf, len, &consumed, &produced);
+            queued = produced;
+        }
+        else {
+            // Passed through as received, the framing is only followed on a copy
+            memcpy(chunkScratch, uc->buf, len);
+            res = chunkedDecode(&uc->decoder, chunkScratch, len, &consumed, &produced);
+            queued = consumed;
+        }
+        if (res == CHUNKED_ERROR) {
+            return -1;
+        }
+        if (res == CHUNKED_DONE && consumed < len) {
+            uc->reusable = 0;
+        }
+    }
+    if (queued > 0 && connectionQueueBytes(conn, uc->buf, queued) == -1) {
+        return -1;
+    }
+    return 2;
+}
+
+// upstream -> pipe -> client without a userspace copy. The pipe is only
+// filled when empty, so EAGAIN on the way in always means the upstream is drained.
+// @return 1 once the body is through, 0 when a socket blocks (waitClient tells which), -1 on failure
+static int spliceBody(connection_t* conn, upstreamConn_t* uc) {
+    if (uc->pipe[0] == -1 && pipe2(uc->pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+        perror("pipe2");
+        uc->pipe[0] = -1;
+        return -1;
+    }
+    while (1) {
+        if (uc->piped == 0) {
+            if (bodyDone(uc)) {
+                return 1;
+            }
+            size_t want = uc->framing == RELAY_LENGTH && uc->remaining < UPSTREAM_SPLICE_MAX ? uc->remaining : UPSTREAM_SPLICE_MAX;
+            ssize_t moved = splice(uc->fd, NULL, uc->pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (moved == 0) {
+                if (uc->framing != RELAY_CLOSE) {
+                    // Closed before Content-Length bytes, the client cannot tell the body is short
+                    return -1;
+                }
+                uc->upstreamEof = 1;
+                return 1;
+            }
+            if (moved < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return 0;
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            uc->piped = moved;
+            if (uc->framing == RELAY_LENGTH) {
+                uc->remaining -= moved;
+            }
+        }
+        ssize_t sent = splice(uc->pipe[0], NULL, conn->fd, NULL, uc->piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                uc->waitClient = 1;
+                return 0;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        uc->piped -= sent;
+        conn->output_bytes += sent;
+        conn->worker->metrics->upstreamSplicedBytes += sent;
+    }
+}
+
+// @return 1 once the body is through, 0 when a socket blocks, 2 after a piece was queued, -1 on failure
+static int relayBody(connection_t* conn, upstreamConn_t* uc) {
+    if (uc->len > 0) {
+        return relayPiece(conn, uc);
+    }
+    if (bodyDone(uc)) {
+        return 1;
+    }
+    // Userspace TLS has to see every byte, kTLS sessions take splice() like plain sockets
+    int userspaceTls = conn->tls && !conn->tls_kernel_send;
+    if ((uc->framing == RELAY_LENGTH || uc->framing == RELAY_CLOSE) && !userspaceTls) {
+        return spliceBody(conn, uc);
+    }
+    size_t room = uc->cap < UPSTREAM_BUFFER_SIZE ? uc->cap : UPSTREAM_BUFFER_SIZE;
+    if (uc->framing == RELAY_LENGTH && uc->remaining < room) {
+        room = uc->remaining;
+    }
+    while (1) {
+        ssize_t received = read(uc->fd, uc->buf, room);
+        if (received > 0) {
+            uc->len = received;
+            return relayPiece(conn, uc);
+        }
+        if (received == 0) {
+            if (uc->framing != RELAY_CLOSE) {
+                return -1;
+            }
+            uc->upstreamEof = 1;
+            return 1;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+// Body is out: the upstream connection goes back to the pool (or closes) and the client moves on
+static void finishRelay(connection_t* conn) {
+    proxyPool_t* pool = conn->worker->proxy;
+    upstreamConn_t* uc = conn->upstream;
+    conn->upstream = NULL;
+    if (uc->reusable && pool->idleCount[uc->upstream] < pool->maxIdle) {
+        // Pooled connections hold no buffer, only their socket and pipe
+        bufferRelease(&conn->worker->buffers, uc->buf, uc->cap);
+        uc->buf = NULL;
+        uc->cap = 0;
+        uc->client = NULL;
+        uc->state = UPSTREAM_IDLE;
+        uc->idleSince = conn->worker->now;
+        linkIdle(pool, uc);
+    }
+    else {
+        closeUpstream(pool, uc);
+    }
+    finishResponse(conn);
+}
+
+// The upstream failed. Before the response head a pooled connection the
+// upstream had closed meanwhile is retried once on a fresh one, anything
+// else gets a 502; after the head the client can only be closed.
+static void failUpstream(connection_t* conn) {
+    proxyPool_t* pool = conn->worker->proxy;
+    upstreamConn_t* uc = conn->upstream;
+    if (uc->reused && (uc->state == UPSTREAM_SENDING || (uc->state == UPSTREAM_READING_HEAD && uc->len == 0))) {
+        // Events still naming the old socket only drive this client once more
+        close(uc->fd);
+        uc->fd = -1;
+        if (connectUpstream(pool, uc) == 0 && buildRequestHead(uc, conn) == 0) {
+            return;
+        }
+    }
+    conn->worker->metrics->upstreamErrors++;
+    int headQueued = uc->state == UPSTREAM_RELAYING;
+    closeUpstream(pool, uc);
+    conn->upstream = NULL;
+    if (headQueued) {
+        conn->state = CLOSING;
+        return;
+    }
+    queueGatewayError(conn, 502, "Bad Gateway", "Upstream unavailable");
+}
+
+void proxyRelay(connection_t* conn) {
+    upstreamConn_t* uc = conn->upstream;
+    uc->waitClient = 0;
+    while (conn->state == PROXYING) {
+        // Whatever is queued goes first: responses pipelined ahead, the head, a copied piece
+        if (conn->output) {
+            int flushed = connectionFlushOutput(conn);
+            if (flushed == -1) {
+                return;
+            }
+            if (flushed == 0) {
+                uc->waitClient = 1;
+                return;
+            }
+        }
+        int res;
+        if (uc->state == UPSTREAM_SENDING) {
+            res = sendRequest(uc);
+        }
+        else if (uc->state == UPSTREAM_READING_HEAD) {
+            res = readHead(conn, uc);
+        }
+        else {
+            res = relayBody(conn, uc);
+            if (res == 1) {
+                finishRelay(conn);
+                return;
+            }
+        }
+        if (res == 0) {
+            return;
+        }
+        if (res == -1) {
+            failUpstream(conn);
+            uc = conn->upstream;
+            if (!uc) {
+                return;
+            }
+        }
+    }
+}
+
+int proxyWaitsForClient(const connection_t* conn) {
+    return conn->upstream && conn->upstream->waitClient;
+}
+
+void proxyTimeout(connection_t* conn) {
+    upstreamConn_t* uc = conn->upstream;
+    conn->worker->metrics->upstreamTimeouts++;
+    if (!uc) {
+        conn->state = CLOSING;
+        return;
+    }
+    int headQueued = uc->state == UPSTREAM_RELAYING;
+    closeUpstream(conn->worker->proxy, uc);
+    conn->upstream = NULL;
+    if (headQueued) {
+        conn->state = CLOSING;
+        return;
+    }
+    queueGatewayError(conn, 504, "Gateway Timeout", "Upstream timed out");
+}
+
+void proxyRelease(connection_t* conn) {
+    closeUpstream(conn->worker->proxy, conn->upstream);
+    conn->upstream = NULL;
+}
+
+void proxyUpstreamEvent(proxyPool_t* pool, void* ptr, uint32_t events) {
+    upstreamConn_t* uc = (upstreamConn_t*)((uintptr_t)ptr & ~(uintptr_t)1);
+    if (uc->state == UPSTREAM_FREE) {
+        // Closed earlier in this batch of events
+        return;
+    }
+    if (uc->state == UPSTREAM_IDLE) {
+        // Send buffer edges are of no interest, and a readable edge may be left over from the last response
+        if (!(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+            return;
+        }
+        char byte;
+        if (recv(uc->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        // Closed by the upstream, or bytes nobody asked for
+        closeUpstream(pool, uc);
+        return;
+    }
+    // The client may close when driven, and its own event can still be later in the batch
+    if (!uc->ready) {
+        uc->ready = 1;
+        uc->readyNext = pool->ready;
+        pool->ready = uc;
+    }
+}
+
+void proxyDrainReady(proxyPool_t* pool, void (*drive)(struct connection* client, void* context), void* context) {
+    upstreamConn_t* uc = pool->ready;
+    pool->ready = NULL;
+    while (uc) {
+        upstreamConn_t* next = uc->readyNext;
+        uc->ready = 0;
+        // Objects are never freed, one released (or handed to another client) since it was queued is told by its state
+        if (uc->client && uc->state != UPSTREAM_FREE && uc->state != UPSTREAM_IDLE) {
+            drive(uc->client, context);
+        }
+        uc = next;
+    }
+}
@@ -0,0 +1,209 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include "config.h"
+#include "chunked.h"
+
+/**
+ * Reverse proxy routes (--proxy PREFIX=HOST:PORT). A request under PREFIX
+ * is forwarded with its request-target as received (the decoded and
+ * normalized path only selects the route) to the upstream once its body is
+ * buffered, over a keep-alive connection from the per-worker pool. The
+ * upstream socket is registered in the worker epoll instance next to the
+ * client sockets, so no extra thread or loop is involved. Response bodies
+ * of known length (or ending with the upstream close) move upstream ->
+ * pipe -> client with splice() and never enter userspace; chunked bodies
+ * are passed through as received (decoded for HTTP/1.0 clients), and
+ * userspace TLS clients get every body piece through their session.
+ * Epoll backend only.
+ */
+
+#define UPSTREAM_BUFFER_SIZE 16384 // request head out, response head and copied body pieces in
+#define UPSTREAM_HEAD_MAX 8192     // response head bytes, larger heads are 502
+#define UPSTREAM_SPLICE_MAX 65536  // bytes moved into the pipe at once, the default pipe capacity
+#define UPSTREAM_IDLE_MAX_MS 60000 // pooled connections older than this are closed instead of reused
+#define UPSTREAM_PREFIX_MAX 256
+
+struct connection;
+struct worker;
+
+/**
+ * One --proxy route, read only once the workers run
+ * prefix/prefixLen: Path prefix without the trailing slash, empty for "/"
+ * address: Upstream IPv4 address and port
+ * host: HOST:PORT as configured, the Host header when the client sent none
+ */
+typedef struct {
+    char prefix[UPSTREAM_PREFIX_MAX];
+    size_t prefixLen;
+    struct sockaddr_in address;
+    const char* host;
+}upstream_t;
+
+/**
+ * Enum for the position of an upstream connection
+ */
+typedef enum {
+    UPSTREAM_FREE,         // on the pool free list, events still naming it are stale
+    UPSTREAM_IDLE,         // pooled keep-alive connection without a client
+    UPSTREAM_SENDING,      // request head and body, connect() may still be in progress
+    UPSTREAM_READING_HEAD, // waiting for the response head
+    UPSTREAM_RELAYING      // response body on its way to the client
+}upstreamState_t;
+
+/**
+ * Enum for how the end of a response body is found
+ */
+typedef enum {
+    RELAY_NONE,    // HEAD, 1xx, 204 and 304: the head is the whole response
+    RELAY_LENGTH,  // Content-Length bytes
+    RELAY_CHUNKED, // chunked framing, tracked on a copy of each piece
+    RELAY_CLOSE    // until the upstream closes, the client connection closes after it
+}relayFraming_t;
+
+/**
+ * Structure representing one connection to an upstream
+ * fd: Upstream socket, registered in the worker epoll instance for good
+ * upstream: Index into the --proxy routes
+ * client: Connection whose request it carries, NULL while pooled or free
+ * buf/cap/len: From the worker buffer pool while a request is in flight:
+ * first the request head, then response bytes not yet relayed
+ * sent: Request head and body bytes written so far
+ * body/bodyLen: Buffered request body, borrowed from the client read_buf
+ * framing/remaining: End of the response body, remaining counts RELAY_LENGTH bytes
+ * decoder: RELAY_CHUNKED framing state
+ * decode: Chunked body is decoded for an HTTP/1.0 client instead of passed through
+ * reusable: Upstream keeps the connection open after this response
+ * reused: Came from the pool, a request it loses before any response byte is retried once
+ * pipe/piped: splice() pipe kept with the connection, bytes sitting in it
+ * upstreamEof: Upstream closed, what is in the pipe is the rest of the body
+ * waitClient: Last relay step stopped on the client socket, not the upstream
+ * start: monotonicUs() when the request was forwarded
+ * idleSince: worker->now when it went back to the pool
+ * prev/next: Idle list of its upstream, or the free list
+ * ready/readyNext: Queued in the ready list of the pool for the current batch
+ */
+typedef struct upstreamConn {
+    int fd;
+    upstreamState_t state;
+    int upstream;
+    struct connection* client;
+    char* buf;
+    size_t cap;
+    size_t len;
+    size_t sent;
+    const char* body;
+    size_t bodyLen;
+    relayFraming_t framing;
+    uint64_t remaining;
+    chunkDecoder_t decoder;
+    int decode;
+    int reusable;
+    int reused;
+    int pipe[2];
+    size_t piped;
+    int upstreamEof;
+    int waitClient;
+    int64_t start;
+    int64_t idleSince;
+    struct upstreamConn* prev;
+    struct upstreamConn* next;
+    int ready;
+    struct upstreamConn* readyNext;
+}upstreamConn_t;
+
+/**
+ * Structure holding the upstream connections of one worker
+ * worker: Owning worker, its epoll instance, buffers and metrics are used
+ * idleHead/idleTail: Pooled connections per upstream, most recently used first
+ * idleCount: Length of each idle list
+ * maxIdle: Connections kept per upstream (--upstream-pool), more are closed when released
+ * timeoutMs: Connect, response head and upstream stall deadline (--upstream-timeout), 0 disables
+ * free: Released connection objects, never freed so stale epoll events stay harmless
+ * ready: Connections with events in the current batch, their clients run after it
+ */
+typedef struct proxyPool {
+    struct worker* worker;
+    upstreamConn_t* idleHead[PROXY_ROUTES_MAX];
+    upstreamConn_t* idleTail[PROXY_ROUTES_MAX];
+    int idleCount[PROXY_ROUTES_MAX];
+    int maxIdle;
+    int timeoutMs;
+    upstreamConn_t* free;
+    upstreamConn_t* ready;
+}proxyPool_t;
+
+/**
+ * Parses the --proxy routes and resolves their upstream hosts, call once
+ * before initializeRoutes()
+ * @return 0 on success, -1 on a malformed route or unknown host (printed)
+ */
+int initializeProxy(const serverConfig_t* config);
+
+/**
+ * @return Number of --proxy routes, 0 when proxying is off
+ */
+int proxyUpstreamCount(void);
+
+/**
+ * @return Route of upstream index (< proxyUpstreamCount())
+ */
+const upstream_t* proxyUpstream(int index);
+
+/**
+ * Sets up the pool of a worker
+ */
+void initializeProxyPool(proxyPool_t* pool, struct worker* worker, const serverConfig_t* config);
+
+/**
+ * @return 1 when an epoll data pointer names an upstream connection (tagged in the low bit)
+ */
+int proxyIsUpstreamEvent(const void* ptr);
+
+/**
+ * Handles an epoll event of an upstream socket. A pooled connection that
+ * became readable (the upstream closed it) is closed here, one carrying a
+ * request is queued for proxyDrainReady()
+ */
+void proxyUpstreamEvent(proxyPool_t* pool, void* ptr, uint32_t events);
+
+/**
+ * Drives (connectionHandler() with no events) the clients of the connections
+ * queued in this batch, called once the batch is done since they may close
+ */
+void proxyDrainReady(proxyPool_t* pool, void (*drive)(struct connection* client, void* context), void* context);
+
+/**
+ * Forwards the parsed request of conn (body buffered) to the upstream of
+ * its ROUTE_PROXY route: PROXYING with reading paused, or WRITING_RESPONSE
+ * with a 502 queued when no connection could be opened
+ */
+void proxyForward(struct connection* conn);
+
+/**
+ * Moves the forwarded request and its response as far as both sockets
+ * allow. Leaves PROXYING for finishResponse() once the body is relayed,
+ * WRITING_RESPONSE with a 502 when the upstream failed before its head, or
+ * CLOSING when it failed after the head went out.
+ */
+void proxyRelay(struct connection* conn);
+
+/**
+ * @return 1 while the relay waits for the client socket to drain, 0 while it waits for the upstream
+ */
+int proxyWaitsForClient(const struct connection* conn);
+
+/**
+ * Upstream deadline passed: 504 before the response head, CLOSING after it
+ */
+void proxyTimeout(struct connection* conn);
+
+/**
+ * Client connection closes mid-request, its upstream connection is closed too
+ */
+void proxyRelease(struct connection* conn);
+
+#endif
@@ -0,0 +1,513 @@
+#include "router.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ROUTE_SEED_TRIES 65536 // displacements tried per bucket before the hash is given up on
+
+static routeNode_t* newNode(const char* label, size_t len) {
+    routeNode_t* node = calloc(1, sizeof(routeNode_t));
+    if (!node) {
+        return NULL;
+    }
+    node->label = malloc(len + 1);
+    if (!node->label) {
+        free(node);
+        return NULL;
+    }
+    memcpy(node->label, label, len);
+    node->label[len] = '\0';
+    node->labelLen = len;
+    return node;
+}
+
+static void freeRoutes(route_t* route) {
+    while (route) {
+        route_t* next = route->next;
+        free(route);
+        route = next;
+    }
+}
+
+static void freeNode(routeNode_t* node) {
+    for (size_t i = 0;i < node->childCount;i++) {
+        freeNode(node->children[i]);
+        free(node->children[i]);
+    }
+    if (node->param) {
+        freeNode(node->param);
+        free(node->param);
+    }
+    free(node->children);
+    free(node->label);
+    freeRoutes(node->routes);
+    freeRoutes(node->prefix);
+}
+
+// Static labels of siblings start with distinct bytes, one compare per child
+static routeNode_t* findChild(const routeNode_t* node, char first) {
+    for (size_t i = 0;i < node->childCount;i++) {
+        if (node->children[i]->label[0] == first) {
+            return node->children[i];
+        }
+    }
+    return NULL;
+}
+
+static int addChild(routeNode_t* node, routeNode_t* child) {
+    routeNode_t** children = realloc(node->children, (node->childCount + 1) * sizeof(routeNode_t*));
+    if (!children) {
+        return -1;
+    }
+    children[node->childCount++] = child;
+    node->children = children;
+    return 0;
+}
+
+// Cuts child's label after at bytes, the first part becomes a new node in its place
+static routeNode_t* splitNode(routeNode_t* parent, routeNode_t* child, size_t at) {
+    routeNode_t* middle = newNode(child->label, at);
+    if (!middle) {
+        return NULL;
+    }
+    if (addChild(middle, child) == -1) {
+        freeNode(middle);
+        free(middle);
+        return NULL;
+    }
+    memmove(child->label, child->label + at, child->labelLen - at + 1);
+    child->labelLen -= at;
+    for (size_t i = 0;i < parent->childCount;i++) {
+        if (parent->children[i] == child) {
+            parent->children[i] = middle;
+        }
+    }
+    return middle;
+}
+
+static routeNode_t* insertStatic(routeNode_t* node, const char* run, size_t len) {
+    while (len > 0) {
+        routeNode_t* child = findChild(node, run[0]);
+        if (!child) {
+            if (!(child = newNode(run, len)) || addChild(node, child) == -1) {
+                free(child ? child->label : NULL);
+                free(child);
+                return NULL;
+            }
+            return child;
+        }
+        size_t common = 0;
+        while (common < len && common < child->labelLen && child->label[common] == run[common]) {
+            common++;
+        }
+        if (common < child->labelLen && !(child = splitNode(node, child, common))) {
+            return NULL;
+        }
+        node = child;
+        run += common;
+        len -= common;
+    }
+    return node;
+}
+
+static routeNode_t* insertParam(routeNode_t* node, const char* name, size_t len) {
+    if (node->param) {
+        // One parameter per position, "/:id" and "/:name" would be ambiguous
+        if (node->param->labelLen != len || memcmp(node->param->label, name, len) != 0) {
+            return NULL;
+        }
+        return node->param;
+    }
+    return node->param = newNode(name, len);
+}
+
+void initializeRouter(router_t* router, routeHandler_t notFound, routeHandler_t methodNotAllowed) {
+    memset(router, 0, sizeof(*router));
+    router->notFound.methods = METHOD_ANY;
+    router->notFound.handler = notFound;
+    router->notFound.flags = ROUTE_API;
+    router->methodNotAllowed.methods = METHOD_ANY;
+    router->methodNotAllowed.handler = methodNotAllowed;
+    router->methodNotAllowed.flags = ROUTE_API;
+}
+
+static route_t* insertRoute(router_t* router, unsigned int methods, const char* pattern,
+    routeHandler_t handler, routeBodyStream_t openBodyStream, int flags) {
+    size_t len = strlen(pattern);
+    if (len == 0 || pattern[0] != '/' || len > PATH_BUFFER_CAP || (!handler && !openBodyStream)) {
+        fprintf(stderr, "Route %s: invalid pattern\n", pattern);
+        return NULL;
+    }
+
+    routeNode_t* node = &router->root;
+    int prefix = 0;
+    int params = 0;
+    size_t i = 0;
+    while (i < len && node) {
+        if (pattern[i] == '*') {
+            // Prefix rule, only as the last byte
+            if (i != len - 1) {
+                node = NULL;
+                break;
+            }
+            prefix = 1;
+            break;
+        }
+        if (pattern[i] == ':') {
+            size_t start = ++i;
+            while (i < len && pattern[i] != '/' && pattern[i] != ':' && pattern[i] != '*') {
+                i++;
+            }
+            // Parameters are whole segments: "/:name" followed by "/" or the end
+            if (pattern[start - 2] != '/' || i == start || (i < len && pattern[i] != '/')) {
+                node = NULL;
+                break;
+            }
+            params++;
+            node = insertParam(node, pattern + start, i - start);
+            continue;
+        }
+        size_t start = i;
+        while (i < len && pattern[i] != ':' && pattern[i] != '*') {
+            i++;
+        }
+        node = insertStatic(node, pattern + start, i - start);
+    }
+    if (!node || params + prefix > ROUTE_PARAMS_MAX) {
+        fprintf(stderr, "Route %s: malformed or conflicting pattern\n", pattern);
+        return NULL;
+    }
+
+    route_t* route = calloc(1, sizeof(route_t));
+    if (!route) {
+        perror("Calloc failed");
+        return NULL;
+    }
+    route->methods = methods;
+    route->handler = handler;
+    route->openBodyStream = openBodyStream;
+    route->flags = flags;
+    // Appended, routes registered first win on overlapping methods
+    route_t** tail = prefix ? &node->prefix : &node->routes;
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+    *tail = route;
+    return route;
+}
+
+int routerAdd(router_t* router, unsigned int methods, const char* pattern,
+    routeHandler_t handler, routeBodyStream_t openBodyStream, int flags) {
+    return insertRoute(router, methods, pattern, handler, openBodyStream, flags) ? 0 : -1;
+}
+
+int routerAddProxy(router_t* router, const char* pattern, routeHandler_t handler, int upstream) {
+    // Bodies are buffered before they are forwarded, no stream
+    route_t* route = insertRoute(router, METHOD_ANY, pattern, handler, NULL, ROUTE_API | ROUTE_PROXY);
+    if (!route) {
+        return -1;
+    }
+    route->upstream = upstream;
+    return 0;
+}
+
+// FNV-1a over the path, bucket from the high half and slot from a remix of the whole value
+static uint64_t hashPath(const char* path, size_t len) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (size_t i = 0;i < len;i++) {
+        hash ^= (unsigned char)path[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static size_t slotIndex(uint64_t hash, uint32_t seed, size_t slotMask) {
+    uint64_t x = hash + seed * 0x9e3779b97f4a7c15ULL;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return (size_t)x & slotMask;
+}
+
+typedef struct {
+    char* path;
+    size_t len;
+    const route_t* routes;
+    uint64_t hash;
+    size_t bucket;
+}staticPath_t;
+
+typedef struct {
+    staticPath_t* paths;
+    size_t count;
+    size_t cap;
+    char buffer[PATH_BUFFER_CAP];
+}staticPaths_t;
+
+// Every node reached through static edges only that has routes is a static path
+static int collectStatic(const routeNode_t* node, staticPaths_t* out, size_t depth) {
+    if (depth + node->labelLen > PATH_BUFFER_CAP) {
+        return 0;
+    }
+    if (node->labelLen > 0) {
+        memcpy(out->buffer + depth, node->label, node->labelLen);
+        depth += node->labelLen;
+    }
+    if (node->routes) {
+        if (out->count == out->cap) {
+            size_t cap = out->cap ? out->cap * 2 : 16;
+            staticPath_t* paths = realloc(out->paths, cap * sizeof(staticPath_t));
+            if (!paths) {
+                return -1;
+            }
+            out->paths = paths;
+            out->cap = cap;
+        }
+        staticPath_t* entry = &out->paths[out->count];
+        if (!(entry->path = malloc(depth + 1))) {
+            return -1;
+        }
+        memcpy(entry->path, out->buffer, depth);
+        entry->path[depth] = '\0';
+        entry->len = depth;
+        entry->routes = node->routes;
+        entry->hash = hashPath(entry->path, depth);
+        out->count++;
+    }
+    for (size_t i = 0;i < node->childCount;i++) {
+        if (collectStatic(node->children[i], out, depth) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static size_t powerOfTwo(size_t n) {
+    size_t size = 1;
+    while (size < n) {
+        size <<= 1;
+    }
+    return size;
+}
+
+// Hash and displace: buckets are placed largest first, each one tries seeds
+// until all of its paths land on free slots
+static int placeBuckets(router_t* router, staticPath_t* paths, size_t count) {
+    size_t bucketCount = router->seedMask + 1;
+    size_t* sizes = calloc(bucketCount, sizeof(size_t));
+    size_t* members = malloc(count * sizeof(size_t));
+    if (!sizes || !members) {
+        free(sizes);
+        free(members);
+        return -1;
+    }
+    for (size_t i = 0;i < count;i++) {
+        paths[i].bucket = (size_t)(paths[i].hash >> 32) & router->seedMask;
+        sizes[paths[i].bucket]++;
+    }
+
+    int placed = 1;
+    for (size_t size = count;size > 0 && placed;size--) {
+        for (size_t b = 0;b < bucketCount && placed;b++) {
+            if (sizes[b] != size) {
+                continue;
+            }
+            size_t memberCount = 0;
+            for (size_t i = 0;i < count;i++) {
+                if (paths[i].bucket == b) {
+                    members[memberCount++] = i;
+                }
+            }
+            placed = 0;
+            for (uint32_t seed = 0;seed < ROUTE_SEED_TRIES && !placed;seed++) {
+                size_t m = 0;
+                for (;m < memberCount;m++) {
+                    routeSlot_t* slot = &router->slots[slotIndex(paths[members[m]].hash, seed, router->slotMask)];
+                    if (slot->path) {
+                        break;
+                    }
+                    // Claimed for now, taken back below if a later member collides
+                    slot->path = paths[members[m]].path;
+                }
+                if (m == memberCount) {
+                    router->seeds[b] = seed;
+                    placed = 1;
+                }
+                while (m-- > 0 && !placed) {
+                    router->slots[slotIndex(paths[members[m]].hash, seed, router->slotMask)].path = NULL;
+                }
+            }
+            for (size_t m = 0;m < memberCount && placed;m++) {
+                routeSlot_t* slot = &router->slots[slotIndex(paths[members[m]].hash, router->seeds[b], router->slotMask)];
+                slot->len = paths[members[m]].len;
+                slot->routes = paths[members[m]].routes;
+                paths[members[m]].path = NULL; // the slot owns it now
+            }
+        }
+    }
+    free(sizes);
+    free(members);
+    return placed ? 0 : -1;
+}
+
+int routerBuild(router_t* router) {
+    staticPaths_t* collected = calloc(1, sizeof(staticPaths_t));
+    if (!collected) {
+        perror("Calloc failed");
+        return -1;
+    }
+    int res = collectStatic(&router->root, collected, 0);
+    if (res == 0 && collected->count > 0) {
+        // Load of at most one half, one bucket per path in the worst case
+        router->slotMask = powerOfTwo(collected->count * 2) - 1;
+        router->seedMask = powerOfTwo(collected->count) - 1;
+        router->slots = calloc(router->slotMask + 1, sizeof(routeSlot_t));
+        router->seeds = calloc(router->seedMask + 1, sizeof(uint32_t));
+        if (!router->slots || !router->seeds) {
+            res = -1;
+        }
+        else if (placeBuckets(router, collected->paths, collected->count) == -1) {
+            // Out of seeds or memory: the trie alone still answers every path
+            for (size_t i = 0;i <= router->slotMask;i++) {
+                free(router->slots[i].path);
+            }
+            free(router->slots);
+            free(router->seeds);
+            router->slots = NULL;
+            router->seeds = NULL;
+        }
+    }
+    for (size_t i = 0;i < collected->count;i++) {
+        free(collected->paths[i].path);
+    }
+    free(collected->paths);
+    free(collected);
+    if (res == -1) {
+        perror("Route table");
+    }
+    return res;
+}
+
+static unsigned int methodBit(const bufferView_t* method) {
+    const char* m = method->data;
+    switch (method->len) {
+    case 3:
+        if (memcmp(m, "GET", 3) == 0) return METHOD_GET;
+        if (memcmp(m, "PUT", 3) == 0) return METHOD_PUT;
+        break;
+    case 4:
+        if (memcmp(m, "POST", 4) == 0) return METHOD_POST;
+        if (memcmp(m, "HEAD", 4) == 0) return METHOD_HEAD;
+        break;
+    case 5:
+        if (memcmp(m, "PATCH", 5) == 0) return METHOD_PATCH;
+        break;
+    case 6:
+        if (memcmp(m, "DELETE", 6) == 0) return METHOD_DELETE;
+        break;
+    case 7:
+        if (memcmp(m, "OPTIONS", 7) == 0) return METHOD_OPTIONS;
+        break;
+    }
+    return METHOD_OTHER;
+}
+
+static void pushParam(httpInfo_t* httpInfo, const char* name, size_t nameLen, char* value, size_t valueLen) {
+    routeParam_t* param = &httpInfo->params[httpInfo->paramCnt++];
+    param->name.data = (char*)name;
+    param->name.len = nameLen;
+    param->value.data = value;
+    param->value.len = valueLen;
+}
+
+// node's own edge is already consumed, path is what is left of the request path.
+// Depth is bounded by the pattern with the most edges, so is the parameter count.
+static const route_t* matchNode(const routeNode_t* node, char* path, size_t len, httpInfo_t* httpInfo) {
+    if (len == 0 && node->routes) {
+        return node->routes;
+    }
+    if (len > 0) {
+        const routeNode_t* child = findChild(node, path[0]);
+        if (child && child->labelLen <= len && memcmp(child->label, path, child->labelLen) == 0) {
+            const route_t* routes = matchNode(child, path + child->labelLen, len - child->labelLen, httpInfo);
+            if (routes) {
+                return routes;
+            }
+        }
+        if (node->param && path[0] != '/') {
+            size_t segment = 1;
+            while (segment < len && path[segment] != '/') {
+                segment++;
+            }
+            size_t mark = httpInfo->paramCnt;
+            pushParam(httpInfo, node->param->label, node->param->labelLen, path, segment);
+            const route_t* routes = matchNode(node->param, path + segment, len - segment, httpInfo);
+            if (routes) {
+                return routes;
+            }
+            httpInfo->paramCnt = mark;
+        }
+    }
+    if (node->prefix) {
+        pushParam(httpInfo, "*", 1, path, len);
+        return node->prefix;
+    }
+    return NULL;
+}
+
+void routerMatch(const router_t* router, httpInfo_t* httpInfo) {
+    char* path = httpInfo->normalizedPath.data;
+    size_t len = httpInfo->normalizedPath.len;
+    const route_t* routes = NULL;
+    httpInfo->paramCnt = 0;
+
+    if (router->slots) {
+        uint64_t hash = hashPath(path, len);
+        uint32_t seed = router->seeds[(size_t)(hash >> 32) & router->seedMask];
+        const routeSlot_t* slot = &router->slots[slotIndex(hash, seed, router->slotMask)];
+        if (slot->path && slot->len == len && memcmp(slot->path, path, len) == 0) {
+            routes = slot->routes;
+        }
+    }
+    if (!routes) {
+        routes = matchNode(&router->root, path, len, httpInfo);
+    }
+
+    const route_t* route = routes;
+    unsigned int method = methodBit(&httpInfo->method);
+    while (route && !(route->methods & method)) {
+        route = route->next;
+    }
+    if (!route) {
+        route = routes ? &router->methodNotAllowed : &router->notFound;
+        httpInfo->paramCnt = 0;
+    }
+    httpInfo->route = route;
+    httpInfo->isApi = (route->flags & ROUTE_API) != 0;
+}
+
+bufferView_t routeParam(const httpInfo_t* httpInfo, const char* name) {
+    size_t len = strlen(name);
+    for (size_t i = 0;i < httpInfo->paramCnt;i++) {
+        const routeParam_t* param = &httpInfo->params[i];
+        if (param->name.len == len && memcmp(param->name.data, name, len) == 0) {
+            return param->value;
+        }
+    }
+    bufferView_t none = { .data = NULL, .len = 0 };
+    return none;
+}
+
+void destroyRouter(router_t* router) {
+    freeNode(&router->root);
+    if (router->slots) {
+        for (size_t i = 0;i <= router->slotMask;i++) {
+            free(router->slots[i].path);
+        }
+    }
+    free(router->slots);
+    free(router->seeds);
+    memset(&router->root, 0, sizeof(router->root));
+    router->slots = NULL;
+    router->seeds = NULL;
+}
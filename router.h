@@ -0,0 +1,160 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "httpParser.h"
+#include "handlers.h"
+#include "fileCache.h"
+
+/**
+ * Route table shared read only by every worker, filled once at startup.
+ * Patterns are stored in a radix trie: static runs of bytes are compressed
+ * into one edge, ":name" matches one non-empty segment and a trailing "*"
+ * matches the rest of the path (prefix rule). Static children win over a
+ * parameter, a parameter over a prefix rule, with backtracking.
+ * routerBuild() then puts every fully static path into a perfect hash, so
+ * the usual dispatch is one pass over the path plus one memcmp(). Nothing
+ * is allocated while matching.
+ */
+
+// Method bits a route answers to
+#define METHOD_GET 0x01
+#define METHOD_HEAD 0x02
+#define METHOD_POST 0x04
+#define METHOD_PUT 0x08
+#define METHOD_DELETE 0x10
+#define METHOD_PATCH 0x20
+#define METHOD_OPTIONS 0x40
+#define METHOD_OTHER 0x80 // any method not listed above
+#define METHOD_ANY 0xff
+
+// Route flags
+#define ROUTE_API 0x1 // generated response, never a static file (httpInfo_t.isApi)
+#define ROUTE_PROXY 0x2 // forwarded to route_t.upstream, see proxy.h
+
+/**
+ * Fills the response of a matched request
+ * @param fileCache Open file cache of the worker handling the request
+ */
+typedef void (*routeHandler_t)(response_t* response, httpInfo_t* httpInfo, fileCache_t* fileCache);
+
+/**
+ * Sets up the consumer of a streamed request body, see requestBodyStream()
+ */
+typedef void (*routeBodyStream_t)(bodyStream_t* stream, const httpInfo_t* httpInfo);
+
+/**
+ * Structure representing one registered route
+ * methods: METHOD_* bits
+ * handler: Builds the response, may be NULL when the body stream completes it
+ * openBodyStream: Streams the request body instead of buffering it, NULL to buffer
+ * flags: ROUTE_* bits
+ * upstream: Index of the proxy.h upstream a ROUTE_PROXY route forwards to
+ * next: Other routes registered on the same pattern
+ */
+typedef struct route {
+    unsigned int methods;
+    routeHandler_t handler;
+    routeBodyStream_t openBodyStream;
+    int flags;
+    int upstream;
+    struct route* next;
+}route_t;
+
+/**
+ * Radix trie node, the edge leading here is label (static) or a parameter
+ * label/labelLen: Static bytes of the edge, the parameter name for param nodes
+ * children: Static children, their labels start with distinct bytes
+ * param: Child matching one segment, at most one per node
+ * routes: Routes whose pattern ends here
+ * prefix: Routes whose pattern ends here with "*"
+ */
+typedef struct routeNode {
+    char* label;
+    size_t labelLen;
+    struct routeNode** children;
+    size_t childCount;
+    struct routeNode* param;
+    route_t* routes;
+    route_t* prefix;
+}routeNode_t;
+
+/**
+ * Perfect hash slot of a static path
+ */
+typedef struct {
+    char* path;
+    size_t len;
+    const route_t* routes;
+}routeSlot_t;
+
+/**
+ * Structure holding the route table
+ * root: Trie root, its label is empty
+ * slots/slotMask: Perfect hash of the static paths, NULL until routerBuild()
+ * seeds/seedMask: Displacement per first level bucket
+ * notFound/methodNotAllowed: Answer requests no route matches, path or method wise
+ */
+typedef struct router {
+    routeNode_t root;
+    routeSlot_t* slots;
+    size_t slotMask;
+    uint32_t* seeds;
+    size_t seedMask;
+    route_t notFound;
+    route_t methodNotAllowed;
+}router_t;
+
+/**
+ * @param notFound Handler of requests no pattern matches
+ * @param methodNotAllowed Handler of requests whose pattern has no route for the method
+ */
+void initializeRouter(router_t* router, routeHandler_t notFound, routeHandler_t methodNotAllowed);
+
+/**
+ * Registers a route, call before routerBuild()
+ * @param methods METHOD_* bits, may overlap other routes of the same pattern only
+ * if the first one registered is meant to win
+ * @param pattern Absolute path: "/api/echo", "/users/:id/posts", or a prefix rule
+ * ending in "*" such as "/static/" followed by "*"
+ * @param openBodyStream NULL to buffer the request body
+ * @param flags ROUTE_* bits
+ * @return 0 on success, -1 for a malformed or conflicting pattern or an allocation failure
+ */
+int routerAdd(router_t* router, unsigned int methods, const char* pattern,
+    routeHandler_t handler, routeBodyStream_t openBodyStream, int flags);
+
+/**
+ * Registers a ROUTE_PROXY route for every method, call before routerBuild()
+ * @param handler Answers the request when it cannot be forwarded
+ * @param upstream Index of the upstream (proxy.h)
+ * @return 0 on success, -1 like routerAdd()
+ */
+int routerAddProxy(router_t* router, const char* pattern, routeHandler_t handler, int upstream);
+
+/**
+ * Builds the perfect hash over the static paths, call once after the last routerAdd()
+ * @return 0 on success, -1 when the allocation failed
+ */
+int routerBuild(router_t* router);
+
+/**
+ * Resolves httpInfo->normalizedPath and method to a route. Never fails:
+ * sets httpInfo->route to the matched route or one of the router fallbacks,
+ * along with the parameters and isApi.
+ */
+void routerMatch(const router_t* router, httpInfo_t* httpInfo);
+
+/**
+ * @param name Parameter name without the ':', "*" for the rest matched by a prefix rule
+ * @return Value of the parameter, len 0 when the route has no such parameter
+ */
+bufferView_t routeParam(const httpInfo_t* httpInfo, const char* name);
+
+/**
+ * Frees every node and route, the router is empty afterwards
+ */
+void destroyRouter(router_t* router);
+
+#endif
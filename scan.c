@@ -0,0 +1,92 @@
+#include "scan.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// pairs is 1 for "\r\n" and 2 for "\r\n\r\n"
+static const char* scanScalar(const char* buffer, size_t len, size_t pairs) {
+    size_t patternLen = pairs * 2;
+    for (size_t i = 0; i + patternLen <= len; i++) {
+        if (buffer[i] == '\r' && buffer[i + 1] == '\n' &&
+            (pairs == 1 || (buffer[i + 2] == '\r' && buffer[i + 3] == '\n'))) {
+            return buffer + i;
+        }
+    }
+    return NULL;
+}
+
+#if defined(__x86_64__)
+
+// One unaligned load per pattern byte, shifted by its position: a lane is
+// set only where the whole pattern starts, so no candidate re-check is needed
+static const char* scanSse2(const char* buffer, size_t len, size_t pairs) {
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    size_t patternLen = pairs * 2;
+    size_t i = 0;
+    for (; i + 16 + patternLen - 1 <= len; i += 16) {
+        const __m128i* p = (const __m128i*)(buffer + i);
+        __m128i match = _mm_and_si128(
+            _mm_cmpeq_epi8(_mm_loadu_si128(p), cr),
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(buffer + i + 1)), lf));
+        if (pairs == 2) {
+            match = _mm_and_si128(match, _mm_and_si128(
+                _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(buffer + i + 2)), cr),
+                _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(buffer + i + 3)), lf)));
+        }
+        unsigned int mask = _mm_movemask_epi8(match);
+        if (mask) {
+            return buffer + i + __builtin_ctz(mask);
+        }
+    }
+    return scanScalar(buffer + i, len - i, pairs);
+}
+
+__attribute__((target("avx2")))
+static const char* scanAvx2(const char* buffer, size_t len, size_t pairs) {
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    size_t patternLen = pairs * 2;
+    size_t i = 0;
+    for (; i + 32 + patternLen - 1 <= len; i += 32) {
+        __m256i match = _mm256_and_si256(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(buffer + i)), cr),
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(buffer + i + 1)), lf));
+        if (pairs == 2) {
+            match = _mm256_and_si256(match, _mm256_and_si256(
+                _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(buffer + i + 2)), cr),
+                _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(buffer + i + 3)), lf)));
+        }
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(match);
+        if (mask) {
+            return buffer + i + __builtin_ctz(mask);
+        }
+    }
+    // Less than one 32 byte step left, SSE2 takes the rest
+    return scanSse2(buffer + i, len - i, pairs);
+}
+
+static const char* scan(const char* buffer, size_t len, size_t pairs) {
+    // Reads a CPU feature word the runtime filled at startup, no cpuid per call
+    if (__builtin_cpu_supports("avx2")) {
+        return scanAvx2(buffer, len, pairs);
+    }
+    return scanSse2(buffer, len, pairs);
+}
+
+#else
+
+static const char* scan(const char* buffer, size_t len, size_t pairs) {
+    return scanScalar(buffer, len, pairs);
+}
+
+#endif
+
+const char* scanHeaderEnd(const char* buffer, size_t len) {
+    return scan(buffer, len, 2);
+}
+
+const char* scanLineEnd(const char* buffer, size_t len) {
+    return scan(buffer, len, 1);
+}
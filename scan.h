@@ -0,0 +1,26 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+
+/**
+ * Vectorized CRLF search used by the request parser.
+ * x86-64 uses AVX2 (32 bytes per step) when the CPU has it and SSE2
+ * (16 bytes) otherwise; other targets get the scalar loop.
+ */
+
+/**
+ * Finds the first "\r\n\r\n" in buffer
+ * @param buffer Bytes to scan, need not be NUL terminated
+ * @param len Number of bytes to scan
+ * @return Pointer to the first '\r' of the terminator, or NULL
+ */
+const char* scanHeaderEnd(const char* buffer, size_t len);
+
+/**
+ * Finds the first "\r\n" in buffer
+ * @return Pointer to the '\r', or NULL
+ */
+const char* scanLineEnd(const char* buffer, size_t len);
+
+#endif
@@ -1,143 +1,177 @@
 #define _POSIX_C_SOURCE 200809L
-#include <netinet/in.h>
-#include <sys/socket.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <signal.h>
-#include <sys/epoll.h>
-#include <errno.h>
-#include <sys/time.h>
 #include <fcntl.h>
-#include "httpParser.h"
-#include "handlers.h"
-#include "connection.h"
-
-#define PORT 8080
-#define BUFFER_SIZE 4096
-#define MAX_REQUEST_LIMIT 16384 // This is what max request can be
-
-int main() {
-    int server_fd, new_socket, docroot_fd;
-    struct sockaddr_in address;
-    socklen_t addrlen = sizeof(address);
-    int opt = 1;
-    // struct timeval timeout;
-    // timeout.tv_sec = 10;
-    // timeout.tv_usec = 0;
+#include <pthread.h>
+#include "config.h"
+#include "worker.h"
+#include "router.h"
+#include "metrics.h"
+#include "accessLog.h"
+#include "offload.h"
+#include "pack.h"
+#include "proxy.h"
+#ifdef HAVE_TLS
+#include "tls.h"
+#endif
+#ifdef HAVE_PRECOMPRESS
+#include "precompress.h"
+#endif
+
+int main(int argc, char** argv) {
+    int docroot_fd = -1;
+    serverConfig_t config;
+
+    if (parseConfig(argc, argv, &config) == -1) {
+        exit(EXIT_FAILURE);
+    }
 
+    // A peer resetting mid-response must fail the send, not kill every worker
+    signal(SIGPIPE, SIG_IGN);
+
+    // A pack replaces the document root, public/ is never touched
+    if (config.pack && !config.buildPack) {
+        if (loadPack(config.pack) == -1) {
+            perror("Pack load failed");
+            exit(EXIT_FAILURE);
+        }
+    }
     // Open file descriptor to server_file_root folder
-    if ((docroot_fd = open("public", O_RDONLY | O_DIRECTORY)) == -1) {
+    else if ((docroot_fd = open("public", O_RDONLY | O_DIRECTORY)) == -1) {
         perror("open failed");
         exit(EXIT_FAILURE);
     }
 
-    // Creating socket file descriptor
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        fprintf(stderr, "Socket creation failed\n");
+#ifdef HAVE_PRECOMPRESS
+    if (config.precompress && docroot_fd != -1) {
+        int written = precompressDirectory(docroot_fd);
+        if (written == -1) {
+            perror("precompress");
+        }
+        else {
+            printf("Precompressed %d sidecar(s)\n", written);
+        }
+    }
+#endif
+
+    // Build step only, the sidecars written above go into the pack
+    if (config.buildPack) {
+        int packed = buildPack(docroot_fd, config.buildPack);
+        if (packed == -1) {
+            perror("Pack build failed");
+            exit(EXIT_FAILURE);
+        }
+        printf("Packed %d file(s) into %s\n", packed, config.buildPack);
+        close(docroot_fd);
+        return EXIT_SUCCESS;
+    }
+
+    // Upstreams resolved before the route table, which registers their prefixes
+    if (config.proxyCount > 0 && initializeProxy(&config) == -1) {
+        fprintf(stderr, "Proxy setup failed\n");
         exit(EXIT_FAILURE);
     }
-    // Set server_fd to be non-blocking
-    int flags = fcntl(server_fd, F_GETFL, 0);
-    fcntl(server_fd, F_SETFL, flags | O_NONBLOCK);
 
-    // Configure socket to allow port reuse
-    if ((setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) < 0) {
-        fprintf(stderr, "Socket address setup failed\n");
+    // Built once, every worker matches against it without locking
+    router_t router;
+    if (initializeRoutes(&router) == -1) {
+        fprintf(stderr, "Route table setup failed\n");
         exit(EXIT_FAILURE);
     }
-    // Set up address structure for binding
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(PORT);
 
-    // Forcefully binding socket to port 8080
-    if (bind(server_fd, (struct sockaddr*)&address, addrlen) < 0) {
-        fprintf(stderr, "Socket bind error\n");
+    // Every worker writes its own slot, /api/metrics sums them
+    if (initializeMetrics(config.workers) == -1) {
+        perror("Metrics allocation failed");
         exit(EXIT_FAILURE);
     }
 
-    // Listen to the socket
-    if ((listen(server_fd, 50)) < 0) {
-        fprintf(stderr, "Error while listening\n");
+    // Rings exist before the workers look up theirs
+    if (config.accessLog && startAccessLog(config.accessLog, config.workers) == -1) {
+        perror("Access log");
         exit(EXIT_FAILURE);
     }
 
-    int epoll_fd = epoll_create(1);
+#ifdef HAVE_TLS
+    // One context for every worker, so tickets and cached sessions resume on any of them
+    if (config.tlsCert && initializeTls(config.tlsCert, config.tlsKey) == -1) {
+        fprintf(stderr, "TLS setup failed\n");
+        exit(EXIT_FAILURE);
+    }
+#endif
 
-    struct epoll_event ev, events[100];
-    ev.events = EPOLLIN;
-    ev.data.fd = server_fd;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) == -1) {
-        perror("epoll_ctl: server_fd");
+    // Shared by every worker, each gets its own completion eventfd
+    if (config.ioThreads > 0 && startOffloadPool(config.ioThreads) == -1) {
+        perror("Offload pool");
         exit(EXIT_FAILURE);
     }
 
-    while (1) {
-        int socketEvents = epoll_wait(epoll_fd, events, 100, -1);
-        if (socketEvents == -1) {
-            perror("epoll_wait");
-            break;
+    worker_t* workers = calloc(config.workers, sizeof(worker_t));
+    if (!workers) {
+        perror("Calloc failed");
+        exit(EXIT_FAILURE);
+    }
+
+    long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpuCount < 1) cpuCount = 1;
+
+    // Every worker gets its own SO_REUSEPORT listener before any thread starts,
+    // so a bind failure aborts startup instead of leaving a half-running server
+    for (int i = 0;i < config.workers;i++) {
+        int cpu = config.pinWorkers ? (int)(i % cpuCount) : -1;
+        if (initializeWorker(&workers[i], i, &config, docroot_fd, &router, cpu) == -1) {
+            fprintf(stderr, "Worker %d setup failed\n", i);
+            exit(EXIT_FAILURE);
         }
+    }
+
+    // Workers inherit this mask, the main thread alone receives these signals
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    if (config.accessLog) {
+        sigaddset(&signals, SIGHUP);
+    }
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
 
-        for (int i = 0;i < socketEvents;i++) {
-            if (events[i].data.fd == server_fd) {
-                // Accept new connection
-                while ((new_socket = accept(server_fd, (struct sockaddr*)&address, &addrlen)) != -1) {
-                    // Set the client socket as non-blocking
-                    int flags = fcntl(new_socket, F_GETFL, 0);
-                    fcntl(new_socket, F_SETFL, flags | O_NONBLOCK);
-
-                    // Add the new socket to epoll
-                    connection_t* conn = malloc(sizeof(connection_t));
-                    initializeConnection(conn, new_socket, docroot_fd);
-
-                    if (conn->state != READING_HEADERS) {
-                        exit(EXIT_FAILURE);
-                    }
-
-                    struct epoll_event conn_ev;
-                    conn_ev.events = EPOLLIN;
-                    conn_ev.data.ptr = conn;
-
-                    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, new_socket, &conn_ev) == -1) {
-                        perror("epoll_ctl: new_socket");
-                        close(new_socket);
-                        free(conn);
-                    }
-
-                }
-                if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                    perror("accept");
-                }
-            }
-            else {
-                connection_t* conn = events[i].data.ptr;
-                u_int32_t epoll_events = events[i].events;
-                uint32_t mask = connectionHandler(conn, epoll_events);
-
-                if (mask == UINT32_MAX) {
-                    if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL) == -1) {
-                        perror("epoll_ctl: del epollin");
-                        return EXIT_FAILURE;
-                    }
-                    closeConnection(conn);
-                }
-                else {
-                    struct epoll_event temp_ev;
-                    temp_ev.data.ptr = conn;
-                    temp_ev.events = mask;
-                    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &temp_ev) == -1) {
-                        perror("epoll_ctl: mod epollin");
-                        connectionHandler(conn, EPOLLERR); // This is my invariant
-                    }
-                }
-            }
+    for (int i = 0;i < config.workers;i++) {
+        int err = pthread_create(&workers[i].thread, NULL, workerRun, &workers[i]);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            exit(EXIT_FAILURE);
         }
     }
 
+    printf("Listening on port %d with %d worker(s)%s\n", config.port, config.workers, config.tlsCert ? " (TLS)" : "");
+    fflush(stdout);
+
+    // SIGUSR1 dumps pool stats, SIGHUP reopens the access log, SIGINT/SIGTERM stop the server.
+    // A worker hitting a fatal error exits the whole process itself.
+    while (1) {
+        int sig;
+        if (sigwait(&signals, &sig) != 0) {
+            continue;
+        }
+        if (sig == SIGUSR1) {
+            printPoolStats(workers, config.workers);
+            continue;
+        }
+        if (sig == SIGHUP) {
+            reopenAccessLog();
+            continue;
+        }
+        break;
+    }
+
+    // Whatever the workers logged so far still reaches the file
+    stopAccessLog();
+
+    if (docroot_fd != -1) {
+        close(docroot_fd);
+    }
     return EXIT_SUCCESS;
 }
-
-// fix uint32 using -1
\ No newline at end of file
@@ -0,0 +1,46 @@
+#!/bin/sh
+# Range check behind "make test": both backends must send the whole range of a
+# file served through splice/sendfile, page aligned or not. An unaligned start
+# makes the first io_uring splice in come back short.
+#   TEST_PORT      port of the server (default 8190)
+cd "$(dirname "$0")/.."
+
+PORT=${TEST_PORT:-8190}
+FILE=public/range-test.bin
+
+# Larger than --small-file-max, so it takes the SENDING_FILE path
+head -c 5000000 /dev/urandom > "$FILE"
+SERVER=
+trap 'kill $SERVER 2>/dev/null; rm -f "$FILE" /tmp/range-test.$$' EXIT INT TERM
+
+failures=0
+check() {
+    # check RANGE FIRST LAST: the body must hold bytes FIRST..LAST of the file
+    curl -s -r "$1" -o /tmp/range-test.$$ "http://127.0.0.1:$PORT/range-test.bin"
+    if tail -c +$(($2 + 1)) "$FILE" | head -c $(($3 - $2 + 1)) | cmp -s - /tmp/range-test.$$; then
+        echo "ok   $BACKEND $1"
+    else
+        echo "FAIL $BACKEND $1: got $(wc -c < /tmp/range-test.$$) bytes, expected $(($3 - $2 + 1))"
+        failures=$((failures + 1))
+    fi
+}
+
+for BACKEND in epoll uring; do
+    ./server --port "$PORT" --workers 1 --backend "$BACKEND" > /dev/null 2>&1 &
+    SERVER=$!
+    sleep 1
+    if ! kill -0 $SERVER 2>/dev/null; then
+        # Built with IO_URING=0, or the kernel has no io_uring
+        echo "skip $BACKEND: server did not start"
+        continue
+    fi
+    check 100-199999 100 199999
+    check 4096-199999 4096 199999
+    check 65537-4999999 65537 4999999
+    check 1- 1 4999999
+    kill $SERVER
+    wait $SERVER 2>/dev/null
+done
+
+[ $failures -eq 0 ] && echo "range: all passed"
+exit $failures
@@ -0,0 +1,125 @@
+#include "timer.h"
+
+#define TIMER_MASK (TIMER_SLOTS - 1)
+
+void initializeTimerWheel(timerWheel_t* wheel, int64_t nowMs) {
+    for (int level = 0;level < TIMER_LEVELS;level++) {
+        for (int i = 0;i < TIMER_SLOTS;i++) {
+            wheel->slots[level][i].next = &wheel->slots[level][i];
+            wheel->slots[level][i].prev = &wheel->slots[level][i];
+        }
+    }
+    wheel->tick = nowMs / TIMER_TICK_MS;
+    wheel->count = 0;
+}
+
+void initializeTimerNode(timerNode_t* node) {
+    node->next = NULL;
+    node->prev = NULL;
+    node->expires = 0;
+}
+
+static void linkNode(timerWheel_t* wheel, timerNode_t* head, timerNode_t* node) {
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+    wheel->count++;
+}
+
+static void unlinkNode(timerWheel_t* wheel, timerNode_t* node) {
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->next = NULL;
+    node->prev = NULL;
+    wheel->count--;
+}
+
+// Rounds the deadline up to a tick, so a node never fires early
+static void insertNode(timerWheel_t* wheel, timerNode_t* node) {
+    int64_t tick = (node->expires + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    if (tick <= wheel->tick) {
+        tick = wheel->tick + 1;
+    }
+    int64_t delta = tick - wheel->tick;
+    if (delta < TIMER_SLOTS) {
+        linkNode(wheel, &wheel->slots[0][tick & TIMER_MASK], node);
+        return;
+    }
+    // Beyond level 1 the node waits in the farthest slot and is re-inserted from there
+    if (delta >= (int64_t)TIMER_SLOTS * TIMER_SLOTS) {
+        tick = wheel->tick + (int64_t)TIMER_SLOTS * TIMER_SLOTS - 1;
+    }
+    linkNode(wheel, &wheel->slots[1][(tick / TIMER_SLOTS) & TIMER_MASK], node);
+}
+
+void timerSchedule(timerWheel_t* wheel, timerNode_t* node, int64_t expiresMs) {
+    if (node->next) {
+        if (expiresMs >= node->expires) {
+            node->expires = expiresMs;
+            return;
+        }
+        unlinkNode(wheel, node);
+    }
+    node->expires = expiresMs;
+    insertNode(wheel, node);
+}
+
+void timerCancel(timerWheel_t* wheel, timerNode_t* node) {
+    if (node->next) {
+        unlinkNode(wheel, node);
+    }
+}
+
+// Moves one level 1 slot down, its nodes are due within the next turn of level 0
+static void cascade(timerWheel_t* wheel) {
+    timerNode_t* head = &wheel->slots[1][(wheel->tick / TIMER_SLOTS) & TIMER_MASK];
+    while (head->next != head) {
+        timerNode_t* node = head->next;
+        unlinkNode(wheel, node);
+        insertNode(wheel, node);
+    }
+}
+
+int timerAdvance(timerWheel_t* wheel, int64_t nowMs, timerExpire_t expire, void* context) {
+    int64_t target = nowMs / TIMER_TICK_MS;
+    int expired = 0;
+    while (wheel->tick < target) {
+        if (wheel->count == 0) {
+            // Nothing to walk through, jump straight to now
+            wheel->tick = target;
+            break;
+        }
+        wheel->tick++;
+        if ((wheel->tick & TIMER_MASK) == 0) {
+            cascade(wheel);
+        }
+        timerNode_t* head = &wheel->slots[0][wheel->tick & TIMER_MASK];
+        while (head->next != head) {
+            timerNode_t* node = head->next;
+            unlinkNode(wheel, node);
+            if (node->expires > nowMs) {
+                // Deadline was pushed back after the node was inserted
+                insertNode(wheel, node);
+                continue;
+            }
+            expire(node, context);
+            expired++;
+        }
+    }
+    return expired;
+}
+
+int timerNextTimeout(const timerWheel_t* wheel, int64_t nowMs) {
+    if (wheel->count == 0) {
+        return -1;
+    }
+    // First non empty level 0 slot, the next cascade at the latest
+    int64_t next = wheel->tick + 1;
+    int64_t cascadeTick = (wheel->tick | TIMER_MASK) + 1;
+    while (next < cascadeTick && wheel->slots[0][next & TIMER_MASK].next == &wheel->slots[0][next & TIMER_MASK]) {
+        next++;
+    }
+    int64_t wait = next * TIMER_TICK_MS - nowMs;
+    return wait < 0 ? 0 : (int)wait;
+}
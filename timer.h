@@ -0,0 +1,82 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Hierarchical timer wheel owned by one worker event loop.
+ * Level 0 has TIMER_SLOTS slots of TIMER_TICK_MS each (25.6s), level 1
+ * TIMER_SLOTS slots of a whole level 0 turn (about 109 minutes) and is
+ * cascaded into level 0 one slot per turn. Longer deadlines are clamped
+ * and re-inserted when their slot comes up.
+ * Not thread safe on purpose, like every other per-worker structure.
+ */
+
+#define TIMER_TICK_MS 100
+#define TIMER_SLOTS 256 // per level, power of 2
+#define TIMER_LEVELS 2
+
+/**
+ * Intrusive timer node, embedded in the object it times out
+ * next/prev: Slot list links, next is NULL while the node is not scheduled
+ * expires: Deadline in monotonic ms, may be later than the slot it sits in
+ */
+typedef struct timerNode {
+    struct timerNode* next;
+    struct timerNode* prev;
+    int64_t expires;
+}timerNode_t;
+
+/**
+ * Structure holding the wheel
+ * slots: Sentinel heads of the circular slot lists
+ * tick: Last tick processed by timerAdvance()
+ * count: Scheduled nodes
+ */
+typedef struct {
+    timerNode_t slots[TIMER_LEVELS][TIMER_SLOTS];
+    int64_t tick;
+    size_t count;
+}timerWheel_t;
+
+/**
+ * Callback for an expired node, the node is already unscheduled and may be
+ * scheduled again or freed by the callback
+ */
+typedef void (*timerExpire_t)(timerNode_t* node, void* context);
+
+/**
+ * @param nowMs Current monotonic time in ms
+ */
+void initializeTimerWheel(timerWheel_t* wheel, int64_t nowMs);
+
+/**
+ * Marks a node as not scheduled, call once before its first use
+ */
+void initializeTimerNode(timerNode_t* node);
+
+/**
+ * Schedules node to expire at expiresMs. Moving the deadline of a scheduled
+ * node later only stores it, the node is re-inserted lazily when its old
+ * slot comes up, so pushing a deadline back on every event costs no list work.
+ */
+void timerSchedule(timerWheel_t* wheel, timerNode_t* node, int64_t expiresMs);
+
+/**
+ * Unschedules node, no-op when it is not scheduled
+ */
+void timerCancel(timerWheel_t* wheel, timerNode_t* node);
+
+/**
+ * Processes every tick up to nowMs and calls expire for nodes whose deadline passed
+ * @return Number of expired nodes
+ */
+int timerAdvance(timerWheel_t* wheel, int64_t nowMs, timerExpire_t expire, void* context);
+
+/**
+ * @return Milliseconds until the next slot that needs processing, -1 when nothing is scheduled
+ */
+int timerNextTimeout(const timerWheel_t* wheel, int64_t nowMs);
+
+#endif
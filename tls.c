@@ -0,0 +1,194 @@
+#define _GNU_SOURCE
+#include "tls.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#define TLS_RECORD_MAX 16384       // largest TLS plaintext record
+#define TLS_SESSION_CACHE 20480    // TLS 1.2 sessions kept for resumption, shared by every worker
+#define TLS_SESSION_LIFETIME 3600  // seconds a session or ticket can be resumed
+
+static SSL_CTX* context;
+
+// Gather buffer of small output pieces and pread() target without kTLS, one record each
+static __thread char recordBuffer[TLS_RECORD_MAX];
+
+// Only HTTP/1.1 is spoken, a client offering ALPN without it gets no ALPN answer
+static int selectAlpn(SSL* tls, const unsigned char** out, unsigned char* outLen,
+    const unsigned char* in, unsigned int inLen, void* arg) {
+    (void)tls;
+    (void)arg;
+    static const unsigned char http11[] = "\x08http/1.1";
+    unsigned char* selected;
+    if (SSL_select_next_proto(&selected, outLen, http11, sizeof(http11) - 1, in, inLen) != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+int initializeTls(const char* certFile, const char* keyFile) {
+    SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx) {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    // kTLS is only used when the kernel has the tls module and the cipher is supported there
+    // A peer closing without close_notify reads as a plain close, the HTTP framing tells about truncation
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE |
+        SSL_OP_IGNORE_UNEXPECTED_EOF);
+    // Unsent output is offered again from the queue, not from the same pointer;
+    // idle keep-alive sessions give their record buffers back
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+        SSL_MODE_RELEASE_BUFFERS);
+    if (SSL_CTX_use_certificate_chain_file(ctx, certFile) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, keyFile, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        return -1;
+    }
+
+    // Resumption: stateless TLS 1.3 tickets (keys live in the context, no
+    // lookup per handshake) and the internal session cache for TLS 1.2 clients
+    static const unsigned char sessionContext[] = "c-http-server";
+    SSL_CTX_set_session_id_context(ctx, sessionContext, sizeof(sessionContext) - 1);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, TLS_SESSION_CACHE);
+    SSL_CTX_set_timeout(ctx, TLS_SESSION_LIFETIME);
+    SSL_CTX_set_num_tickets(ctx, 1);
+    SSL_CTX_set_alpn_select_cb(ctx, selectAlpn, NULL);
+    context = ctx;
+    return 0;
+}
+
+int tlsEnabled(void) {
+    return context != NULL;
+}
+
+SSL* tlsAccept(int fd) {
+    SSL* tls = SSL_new(context);
+    if (!tls) {
+        ERR_clear_error();
+        return NULL;
+    }
+    if (SSL_set_fd(tls, fd) != 1) {
+        ERR_clear_error();
+        SSL_free(tls);
+        return NULL;
+    }
+    SSL_set_accept_state(tls);
+    return tls;
+}
+
+// SSL_get_error() looks at the thread error queue, it is cleared before every call
+static int lastError(SSL* tls, int res) {
+    int err = SSL_get_error(tls, res);
+    if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+        ERR_clear_error();
+    }
+    return err;
+}
+
+tlsResult_t tlsHandshake(SSL* tls) {
+    ERR_clear_error();
+    int res = SSL_do_handshake(tls);
+    if (res == 1) {
+        return TLS_DONE;
+    }
+    switch (lastError(tls, res)) {
+    case SSL_ERROR_WANT_READ:
+        return TLS_WANT_READ;
+    case SSL_ERROR_WANT_WRITE:
+        return TLS_WANT_WRITE;
+    default:
+        return TLS_FAILED;
+    }
+}
+
+int tlsResumed(SSL* tls) {
+    return SSL_session_reused(tls);
+}
+
+int tlsKernelSend(SSL* tls) {
+    return BIO_get_ktls_send(SSL_get_wbio(tls)) ? 1 : 0;
+}
+
+ssize_t tlsRead(SSL* tls, char* buffer, size_t len) {
+    ERR_clear_error();
+    size_t got;
+    int res = SSL_read_ex(tls, buffer, len, &got);
+    if (res == 1) {
+        return got;
+    }
+    switch (lastError(tls, res)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0; // close_notify, or EOF without it
+    case SSL_ERROR_SYSCALL:
+        if (errno == 0) errno = EIO;
+        return -1;
+    default:
+        errno = EPROTO;
+        return -1;
+    }
+}
+
+static ssize_t writeRecord(SSL* tls, const char* data, size_t len) {
+    ERR_clear_error();
+    size_t written;
+    int res = SSL_write_ex(tls, data, len, &written);
+    if (res == 1) {
+        return written;
+    }
+    int err = lastError(tls, res);
+    errno = err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE ? EAGAIN : EPIPE;
+    return -1;
+}
+
+ssize_t tlsWritev(SSL* tls, const struct iovec* iov, int count) {
+    if (count == 1 || iov[0].iov_len >= TLS_RECORD_MAX) {
+        // Large bodies are written in place, OpenSSL cuts them into records
+        return writeRecord(tls, iov[0].iov_base, iov[0].iov_len);
+    }
+    // Heads and small bodies of a batch share records instead of one record each
+    size_t len = 0;
+    for (int i = 0;i < count && len < sizeof(recordBuffer);i++) {
+        size_t chunk = iov[i].iov_len < sizeof(recordBuffer) - len ? iov[i].iov_len : sizeof(recordBuffer) - len;
+        memcpy(recordBuffer + len, iov[i].iov_base, chunk);
+        len += chunk;
+    }
+    return writeRecord(tls, recordBuffer, len);
+}
+
+ssize_t tlsSendFile(SSL* tls, int file_fd, off_t* offset, size_t len) {
+    size_t chunk = len < sizeof(recordBuffer) ? len : sizeof(recordBuffer);
+    ssize_t got;
+    while ((got = pread(file_fd, recordBuffer, chunk, *offset)) == -1 && errno == EINTR) {
+    }
+    if (got <= 0) {
+        return got;
+    }
+    ssize_t written = writeRecord(tls, recordBuffer, got);
+    if (written > 0) {
+        *offset += written;
+    }
+    return written;
+}
+
+void tlsClose(SSL* tls) {
+    if (SSL_is_init_finished(tls)) {
+        // One non-blocking attempt, the socket is closed right after either way
+        ERR_clear_error();
+        SSL_shutdown(tls);
+        ERR_clear_error();
+    }
+    SSL_free(tls);
+}
@@ -0,0 +1,87 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * TLS termination (OpenSSL, built with TLS=1). One server context is shared
+ * by every worker, each connection gets its own session. After the
+ * handshake OpenSSL hands the send keys to the kernel (kTLS) when the
+ * kernel supports it; from then on send(), sendmsg() and sendfile() on the
+ * socket are encrypted in the kernel and the plain output paths run as
+ * they are. Without kTLS the connection writes through tlsWritev()/tlsSendFile().
+ * Sessions resume from TLS 1.3 tickets or the TLS 1.2 session cache.
+ */
+
+struct ssl_st;
+
+/**
+ * Enum for the outcome of a handshake step
+ */
+typedef enum {
+    TLS_DONE,
+    TLS_WANT_READ,
+    TLS_WANT_WRITE,
+    TLS_FAILED
+}tlsResult_t;
+
+/**
+ * Loads the certificate chain and key and sets up the shared context.
+ * Call once before the workers are initialized.
+ * @return 0 on success, -1 on failure (OpenSSL errors printed)
+ */
+int initializeTls(const char* certFile, const char* keyFile);
+
+/**
+ * @return 1 once initializeTls() succeeded, every accepted socket speaks TLS then
+ */
+int tlsEnabled(void);
+
+/**
+ * @return New server session on the accepted socket fd, NULL on failure
+ */
+struct ssl_st* tlsAccept(int fd);
+
+/**
+ * Runs the handshake as far as the socket allows
+ */
+tlsResult_t tlsHandshake(struct ssl_st* tls);
+
+/**
+ * @return 1 when the finished handshake resumed a session
+ */
+int tlsResumed(struct ssl_st* tls);
+
+/**
+ * @return 1 when the kernel encrypts what is written to the socket (kTLS send)
+ */
+int tlsKernelSend(struct ssl_st* tls);
+
+/**
+ * read() through the session
+ * @return Bytes read, 0 once the peer closed, -1 with errno set (EAGAIN to wait for the socket)
+ */
+ssize_t tlsRead(struct ssl_st* tls, char* buffer, size_t len);
+
+/**
+ * sendmsg() through the session without kTLS. Small pieces are gathered into
+ * one record. After EAGAIN the next call must offer the same bytes again
+ * (the unsent queue does, it is only advanced by what was written).
+ * @return Bytes written, -1 with errno set (EAGAIN to wait for the socket)
+ */
+ssize_t tlsWritev(struct ssl_st* tls, const struct iovec* iov, int count);
+
+/**
+ * sendfile() through the session without kTLS, one record read with pread()
+ * @param offset Advanced by the bytes written
+ * @return Bytes written, 0 when the file ended early, -1 with errno set
+ */
+ssize_t tlsSendFile(struct ssl_st* tls, int file_fd, off_t* offset, size_t len);
+
+/**
+ * Sends close_notify when the handshake finished (best effort) and frees the session
+ */
+void tlsClose(struct ssl_st* tls);
+
+#endif
@@ -0,0 +1,718 @@
+#define _GNU_SOURCE
+#include "uring.h"
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include "connection.h"
+
+#define URING_ENTRIES 1024
+#define URING_CQ_ENTRIES 8192
+#define URING_BUF_COUNT 1024 // provided recv buffers, must be a power of 2
+#define URING_BUF_SIZE 4096
+#define URING_BUF_GROUP 0
+#define SPLICE_CHUNK 65536 // default pipe capacity
+
+/**
+ * Enum for the operation tag kept in the low bits of user_data,
+ * connection_t comes from the malloc backed pool so its low 4 bits are always zero
+ */
+typedef enum {
+    OP_ACCEPT = 1,
+    OP_RECV,
+    OP_SEND,
+    OP_SPLICE_IN,
+    OP_SPLICE_OUT,
+    OP_CANCEL,
+    OP_ACCEPT_CANCEL,
+    OP_OFFLOAD
+}uringOp_t;
+
+#define OP_MASK 15ULL
+
+/**
+ * Structure holding the mapped rings of one worker
+ * sq_local_tail: SQEs prepared locally, published to the kernel on submit
+ * buf_ring/buf_base: Provided buffer ring and the memory it hands out to multishot recv
+ * accept_armed: Accept is active (or its cancel has not completed yet)
+ * accept_multishot: The armed accept is multishot and no cancel was sent for it
+ * offload_count: Offload eventfd counter, target of the pending IORING_OP_READ
+ */
+typedef struct {
+    int ring_fd;
+    worker_t* worker;
+
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail;
+    struct io_uring_sqe* sqes;
+
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+
+    void* ring_ptr;
+    size_t ring_len;
+    size_t sqes_len;
+
+    struct io_uring_buf_ring* buf_ring;
+    size_t buf_ring_len;
+    char* buf_base;
+    unsigned short buf_tail;
+    int accept_armed;
+    int accept_multishot;
+    uint64_t offload_count;
+}uring_t;
+
+static uint64_t tagOp(connection_t* conn, uringOp_t op) {
+    return (uint64_t)(uintptr_t)conn | op;
+}
+
+static int setupRing(uring_t* ring) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL |
+        IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER;
+    params.cq_entries = URING_CQ_ENTRIES;
+
+    ring->ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring->ring_fd < 0 && errno == EINVAL) {
+        // Older kernel without the task-run hints, retry with the basics
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = URING_CQ_ENTRIES;
+        ring->ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    }
+    if (ring->ring_fd < 0) {
+        perror("io_uring_setup");
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+        fprintf(stderr, "io_uring: kernel lacks IORING_FEAT_SINGLE_MMAP or IORING_FEAT_EXT_ARG\n");
+        return -1;
+    }
+
+    // SQ and CQ rings share one mapping
+    size_t sqLen = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqLen = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_len = sqLen > cqLen ? sqLen : cqLen;
+    ring->ring_ptr = mmap(NULL, ring->ring_len, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+    if (ring->ring_ptr == MAP_FAILED) {
+        perror("mmap: io_uring rings");
+        ring->ring_ptr = NULL;
+        return -1;
+    }
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        perror("mmap: io_uring sqes");
+        ring->sqes = NULL;
+        return -1;
+    }
+
+    char* base = ring->ring_ptr;
+    ring->sq_head = (unsigned*)(base + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(base + params.sq_off.tail);
+    ring->sq_mask = *(unsigned*)(base + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+    // Identity mapping, SQE slot i is always array entry i
+    unsigned* array = (unsigned*)(base + params.sq_off.array);
+    for (unsigned i = 0;i < params.sq_entries;i++) {
+        array[i] = i;
+    }
+
+    ring->cq_head = (unsigned*)(base + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(base + params.cq_off.tail);
+    ring->cq_mask = *(unsigned*)(base + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(base + params.cq_off.cqes);
+    return 0;
+}
+
+// Hands every prepared SQE to the kernel, optionally waiting for completions
+// timeoutMs bounds the wait for completions, -1 waits without a limit
+static int submitRing(uring_t* ring, unsigned waitNr, int timeoutMs) {
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    unsigned flags = waitNr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    void* argp = NULL;
+    size_t argSize = 0;
+    if (waitNr > 0 && timeoutMs >= 0) {
+        ts.tv_sec = timeoutMs / 1000;
+        ts.tv_nsec = (long long)(timeoutMs % 1000) * 1000000;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (uintptr_t)&ts;
+        argp = &arg;
+        argSize = sizeof(arg);
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+
+    while (1) {
+        unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        unsigned toSubmit = ring->sq_local_tail - head;
+        int ret = syscall(__NR_io_uring_enter, ring->ring_fd, toSubmit, waitNr, flags, argp, argSize);
+        if (ret >= 0) {
+            return ret;
+        }
+        if (errno == EINTR || errno == ETIME) {
+            // A timed out wait still submitted, the deadline is handled by the caller
+            return 0;
+        }
+        if (errno == EAGAIN || errno == EBUSY) {
+            // Completion side is backed up, reap first and submit on the next round
+            return 0;
+        }
+        perror("io_uring_enter");
+        return -1;
+    }
+}
+
+// Makes sure count SQEs can be prepared back to back
+static int reserveSqes(uring_t* ring, unsigned count) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local_tail - head + count <= ring->sq_entries) {
+        return 0;
+    }
+    if (submitRing(ring, 0, -1) < 0) {
+        return -1;
+    }
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    return ring->sq_local_tail - head + count <= ring->sq_entries ? 0 : -1;
+}
+
+static struct io_uring_sqe* getSqe(uring_t* ring) {
+    if (reserveSqes(ring, 1) == -1) {
+        return NULL;
+    }
+    struct io_uring_sqe* sqe = &ring->sqes[ring->sq_local_tail & ring->sq_mask];
+    ring->sq_local_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static void provideBuffer(uring_t* ring, unsigned short bid) {
+    struct io_uring_buf* buf = &ring->buf_ring->bufs[ring->buf_tail & (URING_BUF_COUNT - 1)];
+    buf->addr = (uintptr_t)(ring->buf_base + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    ring->buf_tail++;
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+static int setupBufferRing(uring_t* ring) {
+    ring->buf_ring_len = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    ring->buf_ring = mmap(NULL, ring->buf_ring_len, PROT_READ | PROT_WRITE,
+        MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (ring->buf_ring == MAP_FAILED) {
+        perror("mmap: buffer ring");
+        ring->buf_ring = NULL;
+        return -1;
+    }
+    ring->buf_base = malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+    if (!ring->buf_base) {
+        perror("Malloc failed");
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)ring->buf_ring;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BUF_GROUP;
+    if (syscall(__NR_io_uring_register, ring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        perror("io_uring_register: PBUF_RING");
+        return -1;
+    }
+
+    ring->buf_tail = 0;
+    for (unsigned i = 0;i < URING_BUF_COUNT;i++) {
+        provideBuffer(ring, i);
+    }
+    return 0;
+}
+
+static void teardownRing(uring_t* ring) {
+    if (ring->buf_ring) munmap(ring->buf_ring, ring->buf_ring_len);
+    free(ring->buf_base);
+    if (ring->sqes) munmap(ring->sqes, ring->sqes_len);
+    if (ring->ring_ptr) munmap(ring->ring_ptr, ring->ring_len);
+    if (ring->ring_fd >= 0) close(ring->ring_fd);
+}
+
+static void armAccept(uring_t* ring) {
+    struct io_uring_sqe* sqe = getSqe(ring);
+    if (!sqe) {
+        fprintf(stderr, "worker %d: cannot arm accept\n", ring->worker->id);
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = ring->worker->listen_fd;
+    // At the cap one client at a time, a multishot accept would drain the backlog only to turn it away
+    worker_t* worker = ring->worker;
+    ring->accept_multishot = worker->connectionCount - worker->closingConnections < worker->maxConnections;
+    if (ring->accept_multishot) {
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    }
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = OP_ACCEPT;
+    ring->accept_armed = 1;
+}
+
+// Finished offload jobs complete this read of the eventfd, onOffload() arms the next one
+static void armOffload(uring_t* ring) {
+    struct io_uring_sqe* sqe = getSqe(ring);
+    if (!sqe) {
+        fprintf(stderr, "worker %d: cannot arm offload read\n", ring->worker->id);
+        return;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = ring->worker->offload->event_fd;
+    sqe->addr = (uintptr_t)&ring->offload_count;
+    sqe->len = sizeof(ring->offload_count);
+    sqe->user_data = OP_OFFLOAD;
+}
+
+// Ends the armed accept, onAccept() arms the next one (single shot while at the cap) unless paused
+static void cancelAccept(uring_t* ring) {
+    struct io_uring_sqe* sqe = getSqe(ring);
+    if (!sqe) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = OP_ACCEPT;
+    sqe->user_data = OP_ACCEPT_CANCEL;
+    ring->accept_multishot = 0;
+}
+
+static void pauseAccept(uring_t* ring) {
+    workerPauseAccept(ring->worker);
+    cancelAccept(ring);
+}
+
+static void armRecv(uring_t* ring, connection_t* conn) {
+    struct io_uring_sqe* sqe = getSqe(ring);
+    if (!sqe) {
+        conn->state = CLOSING;
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = tagOp(conn, OP_RECV);
+    conn->uring_inflight++;
+    conn->uring_recv_armed = 1;
+}
+
+static void submitSend(uring_t* ring, connection_t* conn) {
+    struct io_uring_sqe* sqe = getSqe(ring);
+    if (!sqe) {
+        conn->state = CLOSING;
+        return;
+    }
+    // Every queued head and body in one SENDMSG, the msghdr lives in conn until the CQE
+    memset(&conn->uring_msg, 0, sizeof(conn->uring_msg));
+    conn->uring_msg.msg_iov = conn->output->iov;
+    conn->uring_msg.msg_iovlen = connectionOutputIov(conn, conn->output->iov, OUTPUT_SEGMENTS_MAX);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = conn->fd;
+    sqe->addr = (uintptr_t)&conn->uring_msg;
+    sqe->len = 1;
+    sqe->msg_flags = connectionOutputFlags(conn);
+    sqe->user_data = tagOp(conn, OP_SEND);
+    conn->uring_inflight++;
+    conn->uring_send_busy = 1;
+}
+
+// file -> pipe, then pipe -> socket once the splice in has reported how much it moved:
+// a short splice in (unaligned range start) would break a linked pair and cancel the splice out
+static void submitSplice(uring_t* ring, connection_t* conn) {
+    if (conn->uring_pipe[0] == -1 && pipe2(conn->uring_pipe, O_CLOEXEC) == -1) {
+        perror("pipe2");
+        conn->state = CLOSING;
+        return;
+    }
+    struct io_uring_sqe* sqe = getSqe(ring);
+    if (!sqe) {
+        conn->state = CLOSING;
+        return;
+    }
+
+    if (conn->uring_pipe_pending == 0) {
+        sqe->opcode = IORING_OP_SPLICE;
+        sqe->splice_fd_in = conn->file_fd;
+        sqe->splice_off_in = conn->file_offset;
+        sqe->fd = conn->uring_pipe[1];
+        sqe->off = (uint64_t)-1;
+        sqe->len = conn->file_remaining < SPLICE_CHUNK ? conn->file_remaining : SPLICE_CHUNK;
+        sqe->splice_flags = SPLICE_F_MOVE;
+        sqe->user_data = tagOp(conn, OP_SPLICE_IN);
+        conn->uring_inflight++;
+        conn->uring_send_busy = 1;
+        return;
+    }
+
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->splice_fd_in = conn->uring_pipe[0];
+    sqe->splice_off_in = (uint64_t)-1;
+    sqe->fd = conn->fd;
+    sqe->off = (uint64_t)-1;
+    sqe->len = conn->uring_pipe_pending;
+    sqe->splice_flags = SPLICE_F_MOVE;
+    if (conn->file_remaining > 0) {
+        sqe->splice_flags |= SPLICE_F_MORE;
+    }
+    sqe->user_data = tagOp(conn, OP_SPLICE_OUT);
+    conn->uring_inflight++;
+    conn->uring_send_busy = 1;
+}
+
+// Ends the multishot recv while read_paused, drive arms a new one once reading resumes
+static void pauseRecv(uring_t* ring, connection_t* conn) {
+    struct io_uring_sqe* sqe = getSqe(ring);
+    if (!sqe) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = tagOp(conn, OP_RECV);
+    sqe->user_data = tagOp(conn, OP_CANCEL);
+    conn->uring_inflight++;
+    conn->uring_recv_cancel = 1;
+}
+
+// Cancels everything still pending on the socket, memory is released once inflight is 0
+static void startClose(uring_t* ring, connection_t* conn) {
+    conn->uring_closing = 1;
+    // Counted as gone for admission from here, closeConnection() takes it back off
+    conn->worker->closingConnections++;
+    // CLOSING has no deadline, this also takes it off the idle list
+    connectionUpdateTimer(conn);
+    if (conn->uring_inflight == 0) {
+        return;
+    }
+    struct io_uring_sqe* sqe = getSqe(ring);
+    if (!sqe) {
+        shutdown(conn->fd, SHUT_RDWR);
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = conn->fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = tagOp(conn, OP_CANCEL);
+    conn->uring_inflight++;
+}
+
+// Moves the state machine forward until it has to wait for a completion
+static void driveConnection(uring_t* ring, connection_t* conn) {
+    while (!conn->uring_closing) {
+        if (conn->state == CLOSING) {
+            startClose(ring, conn);
+            break;
+        }
+        if (conn->uring_send_busy) {
+            connectionUpdateTimer(conn);
+            return;
+        }
+
+        if (conn->state == WRITING_RESPONSE) {
+            if (connectionOutputPending(conn)) {
+                submitSend(ring, conn);
+                continue;
+            }
+            finishHeaderSend(conn);
+        }
+        else if (conn->state == SENDING_FILE) {
+            if (conn->file_remaining > 0 || conn->uring_pipe_pending > 0) {
+                submitSplice(ring, conn);
+                continue;
+            }
+            finishFileSend(conn);
+        }
+        else {
+            connectionResumeRead(conn);
+            if (!conn->uring_recv_armed && !conn->read_paused) {
+                armRecv(ring, conn);
+                continue;
+            }
+            connectionUpdateTimer(conn);
+            return;
+        }
+
+        // Response finished, pipelined bytes may already hold the next request
+        if (conn->state == READING_HEADERS && conn->read_len > 0) {
+            handleBufferedInput(conn);
+        }
+    }
+
+    if (conn->uring_inflight == 0) {
+        closeConnection(conn);
+    }
+}
+
+static void expireConnection(timerNode_t* node, void* context) {
+    connection_t* conn = (connection_t*)((char*)node - offsetof(connection_t, timer));
+    connectionTimeout(conn);
+    driveConnection(context, conn);
+}
+
+static void closeIdleConnection(connection_t* conn, void* context) {
+    conn->state = CLOSING;
+    driveConnection(context, conn);
+}
+
+// Reading again after its deferral, drive arms a new recv
+static void resumeDeferredRead(connection_t* conn, void* context) {
+    driveConnection(context, conn);
+}
+
+static void onAccept(uring_t* ring, struct io_uring_cqe* cqe) {
+    worker_t* worker = ring->worker;
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        // Multishot accept terminated (error, overflow or paused), arm a new one unless paused
+        ring->accept_armed = 0;
+        if (!worker->acceptPaused) {
+            armAccept(ring);
+        }
+    }
+    int res = cqe->res;
+    if (res < 0) {
+        if (res == -EMFILE || res == -ENFILE || res == -ENOMEM || res == -ENOBUFS) {
+            if (!workerAdmit(worker, 1, closeIdleConnection, ring) && !worker->acceptPaused) {
+                pauseAccept(ring);
+            }
+        }
+        else if (res != -EAGAIN && res != -EINTR && res != -ECANCELED) {
+            fprintf(stderr, "accept: %s\n", strerror(-res));
+        }
+        return;
+    }
+    if (!workerAdmit(worker, 0, closeIdleConnection, ring)) {
+        // Multishot accept already took this one, over the cap it is turned away
+        close(res);
+        if (!worker->acceptPaused) {
+            pauseAccept(ring);
+        }
+        return;
+    }
+
+    connection_t* conn = poolAlloc(&worker->connections);
+    if (!conn) {
+        perror("Malloc failed");
+        close(res);
+        return;
+    }
+    // A failed buffer allocation leaves the connection CLOSING, drive frees it
+    initializeConnection(conn, res, worker);
+    worker->metrics->accepts++;
+    driveConnection(ring, conn);
+    if (worker->connectionCount - worker->closingConnections >= worker->maxConnections && !worker->acceptPaused) {
+        if (!worker->idleHead) {
+            // Stop before the kernel takes one more, later clients wait in the backlog
+            pauseAccept(ring);
+        }
+        else if (ring->accept_multishot) {
+            cancelAccept(ring);
+        }
+    }
+}
+
+static void onRecv(uring_t* ring, connection_t* conn, struct io_uring_cqe* cqe) {
+    int res = cqe->res;
+    int appended = 0;
+    int paused = conn->uring_recv_cancel;
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        conn->uring_recv_armed = 0;
+        conn->uring_recv_cancel = 0;
+        conn->uring_inflight--;
+    }
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (res > 0 && !conn->uring_closing && conn->state != CLOSING) {
+            appended = connectionAppendInput(conn, ring->buf_base + (size_t)bid * URING_BUF_SIZE, res) == 0;
+        }
+        provideBuffer(ring, bid);
+    }
+    if (conn->uring_closing) {
+        return;
+    }
+
+    if (res == 0) {
+        conn->state = CLOSING;
+    }
+    else if (res < 0) {
+        // Out of provided buffers or paused just ends the multishot, re-armed when reading again
+        if (res != -ENOBUFS && res != -EINTR && !(res == -ECANCELED && paused)) {
+            conn->state = CLOSING;
+        }
+    }
+    else if (appended && (conn->state == READING_HEADERS || conn->state == READING_BODY ||
+        conn->state == PROCESSING)) {
+        // PROCESSING: a streamed body already completed while it was appended
+        handleBufferedInput(conn);
+    }
+    if (conn->read_paused && conn->uring_recv_armed && !conn->uring_recv_cancel && conn->state != CLOSING) {
+        // Pipelined input piles up behind unsent responses, stop receiving until they are out
+        pauseRecv(ring, conn);
+    }
+}
+
+static void resumeConnection(void* target, void* context) {
+    driveConnection(context, target);
+}
+
+// Connections only close once nothing is in flight, so no later CQE names a resumed one
+static void onOffload(uring_t* ring) {
+    offloadDrain(ring->worker->offload, resumeConnection, ring);
+    armOffload(ring);
+}
+
+static void onSend(connection_t* conn, struct io_uring_cqe* cqe) {
+    conn->uring_inflight--;
+    conn->uring_send_busy = 0;
+    if (conn->uring_closing) {
+        return;
+    }
+    if (cqe->res < 0) {
+        if (cqe->res != -EINTR && cqe->res != -EAGAIN) {
+            conn->state = CLOSING;
+        }
+        return;
+    }
+    connectionOutputAdvance(conn, cqe->res);
+}
+
+static void onSpliceIn(connection_t* conn, struct io_uring_cqe* cqe) {
+    conn->uring_inflight--;
+    conn->uring_send_busy = 0;
+    if (conn->uring_closing) {
+        return;
+    }
+    if (cqe->res <= 0) {
+        // 0 means the file shrank
+        conn->state = CLOSING;
+        return;
+    }
+    conn->file_offset += cqe->res;
+    conn->file_remaining -= cqe->res;
+    conn->uring_pipe_pending += cqe->res;
+}
+
+static void onSpliceOut(connection_t* conn, struct io_uring_cqe* cqe) {
+    conn->uring_inflight--;
+    conn->uring_send_busy = 0;
+    if (conn->uring_closing) {
+        return;
+    }
+    if (cqe->res <= 0) {
+        conn->state = CLOSING;
+        return;
+    }
+    conn->uring_pipe_pending -= cqe->res;
+    conn->worker->metrics->sendfileBytes += cqe->res;
+}
+
+static void handleCompletion(uring_t* ring, struct io_uring_cqe* cqe) {
+    uint64_t data = cqe->user_data;
+    uringOp_t op = data & OP_MASK;
+    connection_t* conn = (connection_t*)(uintptr_t)(data & ~OP_MASK);
+
+    switch (op) {
+    case OP_ACCEPT:
+        onAccept(ring, cqe);
+        return;
+    case OP_RECV:
+        onRecv(ring, conn, cqe);
+        break;
+    case OP_SEND:
+        onSend(conn, cqe);
+        break;
+    case OP_SPLICE_IN:
+        onSpliceIn(conn, cqe);
+        break;
+    case OP_SPLICE_OUT:
+        onSpliceOut(conn, cqe);
+        break;
+    case OP_CANCEL:
+        conn->uring_inflight--;
+        break;
+    case OP_ACCEPT_CANCEL:
+        return;
+    case OP_OFFLOAD:
+        onOffload(ring);
+        return;
+    default:
+        return;
+    }
+    driveConnection(ring, conn);
+}
+
+void* uringRun(worker_t* worker) {
+    uring_t ring;
+    memset(&ring, 0, sizeof(ring));
+    ring.ring_fd = -1;
+    ring.worker = worker;
+
+    // io_uring surfaces EAGAIN on O_NONBLOCK files instead of waiting for readiness
+    int flags = fcntl(worker->listen_fd, F_GETFL, 0);
+    fcntl(worker->listen_fd, F_SETFL, flags & ~O_NONBLOCK);
+    if (worker->offload) {
+        flags = fcntl(worker->offload->event_fd, F_GETFL, 0);
+        fcntl(worker->offload->event_fd, F_SETFL, flags & ~O_NONBLOCK);
+    }
+
+    if (setupRing(&ring) == -1 || setupBufferRing(&ring) == -1) {
+        fprintf(stderr, "worker %d: io_uring setup failed\n", worker->id);
+        teardownRing(&ring);
+        return NULL;
+    }
+    armAccept(&ring);
+    if (worker->offload) {
+        armOffload(&ring);
+    }
+
+    while (1) {
+        // One kernel crossing submits the whole batch and waits for completions
+        // or the next connection deadline
+        if (submitRing(&ring, 1, timerNextTimeout(&worker->timers, worker->now)) < 0) {
+            break;
+        }
+        worker->now = monotonicMs();
+        worker->metrics->wakeups++;
+
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            handleCompletion(&ring, &ring.cqes[head & ring.cq_mask]);
+            head++;
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+        timerAdvance(&worker->timers, worker->now, expireConnection, &ring);
+        workerRelieveMemory(worker, closeIdleConnection, resumeDeferredRead, &ring);
+        if (workerShouldResumeAccept(worker)) {
+            worker->acceptPaused = 0;
+            if (!ring.accept_armed) {
+                armAccept(&ring);
+            }
+        }
+    }
+
+    teardownRing(&ring);
+    return NULL;
+}
@@ -0,0 +1,17 @@
+#ifndef URING_H
+#define URING_H
+
+#include "worker.h"
+
+/**
+ * Runs the io_uring event loop of a worker forever.
+ * Uses multishot accept, multishot recv into a provided buffer ring,
+ * IORING_OP_SEND for write_buf and linked file->pipe->socket splices
+ * for static files. Submissions are batched into one io_uring_enter()
+ * per loop iteration, which also waits for the next completion.
+ * @param worker Worker whose listener is already created
+ * @return NULL when the ring cannot be set up or fails
+ */
+void* uringRun(worker_t* worker);
+
+#endif
@@ -0,0 +1,518 @@
+#define _GNU_SOURCE
+#include "worker.h"
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <errno.h>
+#include "connection.h"
+#ifdef HAVE_IO_URING
+#include "uring.h"
+#endif
+
+#define CONNECTION_POOL_MAX_FREE 256
+#define REQUEST_POOL_MAX_FREE 64 // only requests in flight hold one
+#define OUTPUT_POOL_MAX_FREE 64 // only connections with unsent responses hold one
+#define LOG_RECORD_POOL_MAX_FREE 64 // same, when the access log is on
+#define BUFFER_POOL_CLASS_BYTES (4 * 1024 * 1024) // retained per size class
+
+int createListener(int port, int backlog) {
+    int server_fd;
+    struct sockaddr_in address;
+    int opt = 1;
+
+    // Creating socket file descriptor
+    // Non-blocking from the start, no fcntl() round trips
+    if ((server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    // Configure socket to allow port reuse
+    if ((setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) < 0) {
+        perror("setsockopt: SO_REUSEADDR");
+        close(server_fd);
+        return -1;
+    }
+    // Every worker binds its own socket, kernel balances accepts between them
+    if ((setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) < 0) {
+        perror("setsockopt: SO_REUSEPORT");
+        close(server_fd);
+        return -1;
+    }
+    // Set up address structure for binding
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+
+    if (bind(server_fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        perror("bind");
+        close(server_fd);
+        return -1;
+    }
+
+    if ((listen(server_fd, backlog)) < 0) {
+        perror("listen");
+        close(server_fd);
+        return -1;
+    }
+    return server_fd;
+}
+
+int initializeWorker(worker_t* worker, int id, const serverConfig_t* config, int root_fd, const router_t* router, int cpu) {
+    worker->id = id;
+    worker->root_fd = root_fd;
+    worker->router = router;
+    worker->cpu = cpu;
+    worker->backend = config->backend;
+    worker->epoll_fd = -1;
+    initializeObjectPool(&worker->connections, sizeof(connection_t), CONNECTION_POOL_MAX_FREE);
+    initializeObjectPool(&worker->requests, sizeof(httpInfo_t), REQUEST_POOL_MAX_FREE);
+    initializeObjectPool(&worker->outputs, sizeof(outputQueue_t), OUTPUT_POOL_MAX_FREE);
+    initializeObjectPool(&worker->logRecords, sizeof(accessRecord_t) * (PIPELINE_DEPTH_MAX + 1), LOG_RECORD_POOL_MAX_FREE);
+    initializeBufferPool(&worker->buffers, BUFFER_POOL_CLASS_BYTES);
+    if (initializeFileCache(&worker->fileCache, root_fd, config->fileCacheEntries, config->fileCacheTtl) == -1) {
+        perror("File cache");
+        return -1;
+    }
+    fileCacheSetResponseLimits(&worker->fileCache, config->smallFileMax, (size_t)config->responseCacheMb * 1024 * 1024);
+    worker->fileCache.precompressed = config->precompressed;
+    worker->maxBody = config->maxBody;
+    worker->now = monotonicMs();
+    initializeTimerWheel(&worker->timers, worker->now);
+    worker->headerTimeoutMs = config->headerTimeout * 1000;
+    worker->bodyTimeoutMs = config->bodyTimeout * 1000;
+    worker->writeTimeoutMs = config->writeTimeout * 1000;
+    worker->keepAliveTimeoutMs = config->keepAliveTimeout * 1000;
+
+    // Cap split evenly, rounded up so every worker admits at least one
+    worker->maxConnections = (config->maxConnections + config->workers - 1) / config->workers;
+    worker->connectionCount = 0;
+    worker->closingConnections = 0;
+    worker->acceptPaused = 0;
+    worker->pendingCount = 0;
+    worker->fdReclaims = 0;
+    worker->idleHead = NULL;
+    worker->idleTail = NULL;
+    worker->metrics = metricsForWorker(id);
+    worker->accessLog = accessLogForWorker(id);
+    worker->bufferBudget = (size_t)config->memoryBudgetMb * 1024 * 1024 / config->workers;
+    worker->deferredHead = NULL;
+    worker->deferredTail = NULL;
+    worker->overdraft = NULL;
+    worker->proxy = NULL;
+    if (proxyUpstreamCount() > 0) {
+        if (!(worker->proxy = malloc(sizeof(proxyPool_t)))) {
+            perror("Malloc failed");
+            return -1;
+        }
+        initializeProxyPool(worker->proxy, worker, config);
+    }
+    worker->offload = NULL;
+    if (offloadEnabled()) {
+        worker->offload = malloc(sizeof(offloadQueue_t));
+        if (!worker->offload || initializeOffloadQueue(worker->offload) == -1) {
+            perror("Offload queue");
+            free(worker->offload);
+            return -1;
+        }
+    }
+
+    if ((worker->listen_fd = createListener(config->port, config->backlog)) == -1) {
+        return -1;
+    }
+    if (worker->backend == BACKEND_URING) {
+        return 0;
+    }
+
+    if ((worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        perror("epoll_create1");
+        close(worker->listen_fd);
+        return -1;
+    }
+
+    // Listener is the only source registered with a NULL pointer
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->listen_fd, &ev) == -1) {
+        perror("epoll_ctl: listen_fd");
+        close(worker->epoll_fd);
+        close(worker->listen_fd);
+        return -1;
+    }
+    // Finished offload jobs are reported with the queue itself as the pointer
+    if (worker->offload) {
+        ev.events = EPOLLIN;
+        ev.data.ptr = worker->offload;
+        if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->offload->event_fd, &ev) == -1) {
+            perror("epoll_ctl: offload eventfd");
+            close(worker->epoll_fd);
+            close(worker->listen_fd);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Pin calling thread to the worker's cpu, failure is not fatal
+static void pinWorker(worker_t* worker) {
+    if (worker->cpu < 0) {
+        return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(worker->cpu, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0) {
+        fprintf(stderr, "worker %d: pinning to cpu %d failed: %s\n", worker->id, worker->cpu, strerror(err));
+    }
+}
+
+static void closeIdleConnection(connection_t* conn, void* context) {
+    worker_t* worker = context;
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    closeConnection(conn);
+}
+
+static void setListenerRegistered(worker_t* worker, int registered) {
+    // Listener is the only source registered with a NULL pointer
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(worker->epoll_fd, registered ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, worker->listen_fd, &ev) == -1) {
+        perror("epoll_ctl: listen_fd");
+    }
+}
+
+// Registers an accepted socket, a connection that failed to set up is closed again
+static void addConnection(worker_t* worker, int fd) {
+    connection_t* conn = poolAlloc(&worker->connections);
+    if (!conn) {
+        perror("Malloc failed");
+        close(fd);
+        return;
+    }
+    initializeConnection(conn, fd, worker);
+    worker->metrics->accepts++;
+
+    if (conn->state == CLOSING) {
+        closeConnection(conn);
+        return;
+    }
+
+    struct epoll_event conn_ev;
+    conn_ev.events = conn->interest | EPOLLET;
+    conn_ev.data.ptr = conn;
+
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, fd, &conn_ev) == -1) {
+        perror("epoll_ctl: new_socket");
+        closeConnection(conn);
+        return;
+    }
+    connectionUpdateTimer(conn);
+}
+
+// At least n idle keep-alive connections to give way, walks n of them at most
+static int idleAtLeast(const worker_t* worker, int n) {
+    const connection_t* conn = worker->idleHead;
+    for (;conn && n > 0;conn = conn->idle_next) {
+        n--;
+    }
+    return n == 0;
+}
+
+// Runs inside the epoll batch, so nothing is closed here: a later event of the
+// same batch may still name an idle connection, and its memory would be reused
+// right away. Sockets over the cap wait in pendingFds for admitPending().
+static void acceptConnections(worker_t* worker) {
+    // Level triggered listener: whatever the budget leaves is reported again next iteration
+    for (int budget = ACCEPT_BUDGET;budget > 0;budget--) {
+        int overCap = worker->connectionCount + worker->pendingCount >= worker->maxConnections;
+        if (overCap && !idleAtLeast(worker, worker->pendingCount + worker->fdReclaims + 1)) {
+            workerPauseAccept(worker);
+            setListenerRegistered(worker, 0);
+            return;
+        }
+        int new_socket = accept4(worker->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (new_socket == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno == EMFILE || errno == ENFILE || errno == ENOMEM || errno == ENOBUFS) {
+                // Retried next iteration once an idle connection gave its fd back, otherwise the listener pauses
+                if (idleAtLeast(worker, worker->pendingCount + worker->fdReclaims + 1)) {
+                    worker->fdReclaims++;
+                }
+                else {
+                    workerPauseAccept(worker);
+                    setListenerRegistered(worker, 0);
+                }
+                return;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept4");
+            }
+            return;
+        }
+        if (overCap) {
+            worker->pendingFds[worker->pendingCount++] = new_socket;
+            continue;
+        }
+        addConnection(worker, new_socket);
+    }
+}
+
+// After the epoll batch: the idle connections acceptConnections() counted on close
+// now, each pending socket takes the place of one
+static void admitPending(worker_t* worker) {
+    for (;worker->fdReclaims > 0 && worker->idleHead;worker->fdReclaims--) {
+        closeIdleConnection(worker->idleHead, worker);
+    }
+    worker->fdReclaims = 0;
+    for (int i = 0;i < worker->pendingCount;i++) {
+        if (worker->connectionCount >= worker->maxConnections) {
+            if (!worker->idleHead) {
+                // The idle ones became busy during the batch, the client is turned away
+                close(worker->pendingFds[i]);
+                continue;
+            }
+            closeIdleConnection(worker->idleHead, worker);
+        }
+        addConnection(worker, worker->pendingFds[i]);
+    }
+    worker->pendingCount = 0;
+    if (worker->connectionCount >= worker->maxConnections && !worker->idleHead && !worker->acceptPaused) {
+        workerPauseAccept(worker);
+        setListenerRegistered(worker, 0);
+    }
+}
+
+int workerAdmit(worker_t* worker, int outOfResources, void (*closeIdle)(connection_t* conn, void* context), void* context) {
+    // A connection whose close is still in flight is as good as gone, its fd and memory follow
+    size_t open = worker->connectionCount - worker->closingConnections;
+    if (!outOfResources && open < worker->maxConnections) {
+        return 1;
+    }
+    if (!worker->idleHead || (outOfResources && worker->closingConnections > 0)) {
+        // Out of fds while closes are pending: those give fds back, no further victim is needed
+        return 0;
+    }
+    // Oldest idle keep-alive connection gives way to a client with a request to make
+    closeIdle(worker->idleHead, context);
+    return 1;
+}
+
+void workerPauseAccept(worker_t* worker) {
+    // Resume once a tenth of the cap is free again, or any connection closed when out of fds below it
+    size_t lowWater = worker->maxConnections - worker->maxConnections / 10;
+    if (lowWater >= worker->connectionCount) {
+        lowWater = worker->connectionCount > 0 ? worker->connectionCount - 1 : 0;
+    }
+    worker->resumeConnections = lowWater;
+    worker->acceptPaused = 1;
+}
+
+int workerShouldResumeAccept(const worker_t* worker) {
+    return worker->acceptPaused &&
+        (worker->connectionCount <= worker->resumeConnections ||
+        (worker->idleHead != NULL && worker->closingConnections == 0));
+}
+
+int workerOverBudget(const worker_t* worker, size_t extra) {
+    return worker->bufferBudget > 0 && worker->buffers.inUse + extra > worker->bufferBudget;
+}
+
+// Closing idle keep-alive connections only helps when, together, they free enough
+static int idleCovers(const worker_t* worker, size_t shortfall) {
+    size_t held = 0;
+    for (const connection_t* conn = worker->idleHead;conn && held < shortfall;conn = conn->idle_next) {
+        held += conn->read_cap + conn->write_cap;
+    }
+    return held >= shortfall;
+}
+
+void workerRelieveMemory(worker_t* worker, void (*closeIdle)(connection_t* conn, void* context),
+    void (*resume)(connection_t* conn, void* context), void* context) {
+    worker->metrics->bufferBytes = (int64_t)worker->buffers.inUse;
+    // io_uring connections give their buffers back once their cancels complete,
+    // those are counted as free already so no more idle ones are closed for them
+    size_t closing = 0;
+    while (worker->deferredHead) {
+        connection_t* conn = worker->deferredHead;
+        size_t growth = connectionDeferredGrowth(conn);
+        if (!workerOverBudget(worker, growth)) {
+            connectionResumeDeferred(conn);
+            resume(conn, context);
+            continue;
+        }
+        size_t needed = worker->buffers.inUse + growth;
+        if (needed <= worker->bufferBudget + closing) {
+            return;
+        }
+        if (idleCovers(worker, needed - worker->bufferBudget - closing)) {
+            // Idle keep-alive connections only hold their shrunk read_buf, the oldest give way first
+            connection_t* idle = worker->idleHead;
+            size_t held = idle->read_cap + idle->write_cap;
+            size_t before = worker->buffers.inUse;
+            closeIdle(idle, context);
+            worker->metrics->memoryReclaims++;
+            if (worker->buffers.inUse == before) {
+                closing += held;
+            }
+            continue;
+        }
+        if (closing > 0 || worker->overdraft) {
+            return;
+        }
+        // The budget is held by requests that wait just like this one (bytes io_uring
+        // received before the recv was cancelled still grow read_buf), or by ones
+        // still running: without an overdraft the waiting ones could all run into their 408
+        worker->overdraft = conn;
+        connectionResumeDeferred(conn);
+        resume(conn, context);
+        return;
+    }
+}
+
+// Runs the state machine for one event and applies the outcome: close, or
+// re-register when the interest changed, and re-arm the deadline
+static void dispatchConnection(worker_t* worker, connection_t* conn, uint32_t events) {
+    uint32_t mask = connectionHandler(conn, events);
+
+    if (mask == UINT32_MAX) {
+        if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL) == -1) {
+            perror("epoll_ctl: del epollin");
+            exit(EXIT_FAILURE);
+        }
+        closeConnection(conn);
+        return;
+    }
+    if (mask != conn->interest) {
+        // Only a real read <-> write transition costs an epoll_ctl
+        struct epoll_event temp_ev;
+        temp_ev.data.ptr = conn;
+        temp_ev.events = mask | EPOLLET;
+        if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, conn->fd, &temp_ev) == -1) {
+            perror("epoll_ctl: mod epollin");
+            connectionHandler(conn, EPOLLERR); // This is my invariant
+        }
+        else {
+            conn->interest = mask;
+        }
+    }
+    connectionUpdateTimer(conn);
+}
+
+// Reading again after its deferral, whatever arrived meanwhile sent no new edge
+static void resumeDeferredRead(connection_t* conn, void* context) {
+    dispatchConnection(context, conn, EPOLLIN);
+}
+
+// A connection whose file lookup finished continues with its response
+static void resumeConnection(void* target, void* context) {
+    dispatchConnection(context, target, 0);
+}
+
+static void driveProxied(connection_t* client, void* context) {
+    dispatchConnection(context, client, 0);
+}
+
+// Deadline passed, the 408 (if any) goes out like any other response
+static void expireConnection(timerNode_t* node, void* context) {
+    connection_t* conn = (connection_t*)((char*)node - offsetof(connection_t, timer));
+    connectionTimeout(conn);
+    dispatchConnection(context, conn, 0);
+}
+
+void* workerRun(void* arg) {
+    worker_t* worker = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    pinWorker(worker);
+
+#ifdef HAVE_IO_URING
+    if (worker->backend == BACKEND_URING) {
+        uringRun(worker);
+        exit(EXIT_FAILURE);
+    }
+#endif
+
+    while (1) {
+        // Sleeps until the next connection deadline at most
+        int timeout = timerNextTimeout(&worker->timers, worker->now);
+        int socketEvents = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, timeout);
+        worker->now = monotonicMs();
+        if (socketEvents == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+        worker->metrics->wakeups++;
+
+        // Resumed connections may close, so they run after the events that may still name them
+        int offloadReady = 0;
+        for (int i = 0;i < socketEvents;i++) {
+            if (events[i].data.ptr == NULL) {
+                acceptConnections(worker);
+            }
+            else if (events[i].data.ptr == worker->offload) {
+                offloadReady = 1;
+            }
+            else if (proxyIsUpstreamEvent(events[i].data.ptr)) {
+                // Upstream sockets are tagged, the client they carry a request for runs after the batch
+                proxyUpstreamEvent(worker->proxy, events[i].data.ptr, events[i].events);
+            }
+            else {
+                dispatchConnection(worker, events[i].data.ptr, events[i].events);
+            }
+        }
+        if (worker->proxy) {
+            proxyDrainReady(worker->proxy, driveProxied, worker);
+        }
+        admitPending(worker);
+        if (offloadReady) {
+            offloadAcknowledge(worker->offload);
+            offloadDrain(worker->offload, resumeConnection, worker);
+        }
+        timerAdvance(&worker->timers, worker->now, expireConnection, worker);
+        workerRelieveMemory(worker, closeIdleConnection, resumeDeferredRead, worker);
+        if (workerShouldResumeAccept(worker)) {
+            worker->acceptPaused = 0;
+            setListenerRegistered(worker, 1);
+        }
+    }
+
+    exit(EXIT_FAILURE);
+}
+
+static void printStatsLine(int id, const char* name, poolStats_t stats) {
+    fprintf(stderr, "worker %d %-11s hits=%zu misses=%zu recycled=%zu released=%zu\n",
+        id, name, stats.hits, stats.misses, stats.recycled, stats.released);
+}
+
+void printPoolStats(const worker_t* workers, int count) {
+    for (int i = 0;i < count;i++) {
+        printStatsLine(workers[i].id, "connections", workers[i].connections.stats);
+        printStatsLine(workers[i].id, "requests", workers[i].requests.stats);
+        printStatsLine(workers[i].id, "outputs", workers[i].outputs.stats);
+        if (workers[i].accessLog) {
+            printStatsLine(workers[i].id, "logRecords", workers[i].logRecords.stats);
+        }
+        printStatsLine(workers[i].id, "buffers", bufferPoolStats(&workers[i].buffers));
+        const fileCache_t* cache = &workers[i].fileCache;
+        fprintf(stderr, "worker %d %-11s hits=%zu misses=%zu revalidations=%zu evictions=%zu open=%zu\n",
+            workers[i].id, "files", cache->hits, cache->misses, cache->revalidations, cache->evictions, cache->count);
+        fprintf(stderr, "worker %d %-11s hits=%zu evictions=%zu bytes=%zu\n",
+            workers[i].id, "responses", cache->responseHits, cache->responseEvictions, cache->responseBytes);
+    }
+}
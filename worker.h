@@ -0,0 +1,170 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <pthread.h>
+#include "config.h"
+#include "pool.h"
+#include "fileCache.h"
+#include "timer.h"
+#include "router.h"
+#include "metrics.h"
+#include "accessLog.h"
+#include "offload.h"
+#include "proxy.h"
+
+#define MAX_EVENTS 100
+#define ACCEPT_BUDGET 64 // accepts per event loop iteration, the rest waits behind connected clients
+
+struct connection;
+
+/**
+ * Structure representing one event loop thread
+ * Every worker owns its listener, epoll instance and connections,
+ * so nothing on the request path is shared between workers
+ * id: Worker index (0..workers-1)
+ * listen_fd: SO_REUSEPORT listening socket owned by this worker
+ * backend: I/O backend this worker runs
+ * epoll_fd: Epoll instance of this worker (-1 for the io_uring backend)
+ * root_fd: Document root directory fd (shared, read only)
+ * cpu: CPU this worker is pinned to, -1 when not pinned
+ * thread: Thread running workerRun()
+ * connections: Free list of connection_t objects recycled on close
+ * requests: Free list of httpInfo_t, one is held per request in flight
+ * outputs: Free list of outputQueue_t, one is held while a batch of responses is sent
+ * buffers: Size-classed read/write buffer pools
+ * fileCache: Open static files shared by the connections of this worker
+ * router: Route table built at startup, shared read only by every worker
+ * maxBody: Largest request body buffered for a handler (--max-body)
+ * timers: Connection deadlines, drives the event loop wait timeout
+ * now: Monotonic ms, refreshed once per event loop iteration
+ * headerTimeoutMs/bodyTimeoutMs/writeTimeoutMs/keepAliveTimeoutMs: Deadlines from the config, 0 disables
+ * connectionCount: Open connections of this worker
+ * maxConnections: Admission cap, its share of --max-connections
+ * resumeConnections: Low-water mark, a paused listener resumes at or below it
+ * closingConnections: io_uring connections whose close waits for its cancels, still in connectionCount
+ * acceptPaused: Listener is not accepting (cap reached or out of fds)
+ * pendingFds/pendingCount: Sockets accepted over the cap during an epoll batch, admitted once
+ * idle connections made room after it
+ * fdReclaims: Idle connections to close after the epoll batch because accept ran out of fds
+ * idleHead/idleTail: Keep-alive connections waiting for a request, oldest first,
+ * closed to make room when the worker is under pressure
+ * metrics: Counters and latency histograms only this worker writes (/api/metrics)
+ * accessLog: Ring this worker produces access log records into, NULL when the log is off
+ * logRecords: Free list of staged records, one batch is held while its responses are sent
+ * offload: Completion queue of the file lookups this worker offloaded, NULL without an offload pool
+ * bufferBudget: Its share of --memory-budget for connection buffers (buffers.inUse), 0 disables
+ * deferredHead/deferredTail: Connections whose read_buf could not grow within the budget, oldest first
+ * overdraft: Deferred read let through over the budget because nothing was left to reclaim, one at a time
+ * proxy: Upstream connections of the --proxy routes, NULL without any
+ */
+typedef struct worker {
+    int id;
+    int listen_fd;
+    ioBackend_t backend;
+    int epoll_fd;
+    int root_fd;
+    int cpu;
+    pthread_t thread;
+    objectPool_t connections;
+    objectPool_t requests;
+    objectPool_t outputs;
+    bufferPool_t buffers;
+    fileCache_t fileCache;
+    const router_t* router;
+    size_t maxBody;
+    timerWheel_t timers;
+    int64_t now;
+    int headerTimeoutMs;
+    int bodyTimeoutMs;
+    int writeTimeoutMs;
+    int keepAliveTimeoutMs;
+    size_t connectionCount;
+    size_t maxConnections;
+    size_t resumeConnections;
+    size_t closingConnections;
+    int acceptPaused;
+    int pendingFds[ACCEPT_BUDGET];
+    int pendingCount;
+    int fdReclaims;
+    struct connection* idleHead;
+    struct connection* idleTail;
+    workerMetrics_t* metrics;
+    accessLogRing_t* accessLog;
+    objectPool_t logRecords;
+    offloadQueue_t* offload;
+    size_t bufferBudget;
+    struct connection* deferredHead;
+    struct connection* deferredTail;
+    struct connection* overdraft;
+    proxyPool_t* proxy;
+}worker_t;
+
+/**
+ * Creates a non-blocking listening socket bound with SO_REUSEPORT
+ * so that every worker can own a separate accept queue on the same port
+ * @param port Port to bind on all interfaces
+ * @param backlog listen() backlog
+ * @return Listening socket fd, or -1 on failure
+ */
+int createListener(int port, int backlog);
+
+/**
+ * Admission check of the io_uring backend, where closing a connection
+ * never frees it under a pending completion. Under pressure (cap reached,
+ * or the last accept ran out of fds or memory) the oldest idle keep-alive
+ * connection is closed through closeIdle to make room; connections whose
+ * close is still in flight count as gone, so a burst of accepts does not
+ * pick a victim each. The epoll backend admits after its event batch instead.
+ * @param outOfResources The last accept failed with EMFILE/ENFILE/ENOMEM/ENOBUFS
+ * @return 1 when a connection may be accepted, 0 when the listener has to pause
+ */
+int workerAdmit(worker_t* worker, int outOfResources, void (*closeIdle)(struct connection* conn, void* context), void* context);
+
+/**
+ * Marks the listener paused and sets the low-water mark it resumes at
+ */
+void workerPauseAccept(worker_t* worker);
+
+/**
+ * @return 1 when a paused listener should accept again: below the low-water
+ * mark, or idle keep-alive connections can be reclaimed
+ */
+int workerShouldResumeAccept(const worker_t* worker);
+
+/**
+ * @return 1 when the connection buffers of the worker hold extra more bytes than its budget allows
+ */
+int workerOverBudget(const worker_t* worker, size_t extra);
+
+/**
+ * Runs once per event loop iteration, refreshes the bufferBytes gauge.
+ * Deferred reads resume through resume, oldest first, while the budget has
+ * room for them; for the first one that does not fit, idle keep-alive
+ * connections are closed through closeIdle, oldest first. With none left it
+ * becomes the overdraft and goes ahead anyway once the previous one finished.
+ */
+void workerRelieveMemory(worker_t* worker, void (*closeIdle)(struct connection* conn, void* context),
+    void (*resume)(struct connection* conn, void* context), void* context);
+
+/**
+ * Sets up a worker: listener, and for the epoll backend the epoll instance
+ * with the listener (and the offload eventfd) registered, upstream sockets join it later. initializeMetrics(), and startAccessLog()
+ * and startOffloadPool() when enabled, must have run. io_uring rings are created by the worker thread.
+ * @return 0 on success, -1 on failure
+ */
+int initializeWorker(worker_t* worker, int id, const serverConfig_t* config, int root_fd, const router_t* router, int cpu);
+
+/**
+ * Thread entry point, runs the event loop of a worker forever.
+ * A fatal event loop error exits the process.
+ * @param arg Pointer to worker_t
+ */
+void* workerRun(void* arg);
+
+/**
+ * Prints pool and file cache counters of every worker to stderr.
+ * Counters are read without synchronization, values are approximate.
+ */
+void printPoolStats(const worker_t* workers, int count);
+
+#endif